@@ -0,0 +1,84 @@
+#include "buf_pool.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+const int min_class_shift = 6;                      // 64B
+const int max_class_shift = 22;                     // 4MB, 覆盖最大包长
+const int class_count = max_class_shift - min_class_shift + 1;
+const size_t max_cached_bytes_per_class = 1 << 20;  // 每级最多缓存的字节数, 至少缓存1个
+
+// 缓冲前面的头, 记录所属级别, 保持8字节对齐
+struct BufHead {
+    int32_t class_idx;
+    int32_t reserved;
+};
+
+struct PoolClass {
+    std::mutex mutex;
+    std::vector<char*> free_list;
+};
+
+struct Pool {
+    PoolClass classes[class_count];
+};
+
+// 不析构, 避免静态对象析构顺序导致退出时归还到已析构的池
+Pool& GetPool()
+{
+    static Pool* pool = new Pool();
+    return *pool;
+}
+
+int ClassIdx(int size)
+{
+    int idx = 0;
+    while (idx < class_count && (1 << (idx + min_class_shift)) < size) ++idx;
+    return idx < class_count ? idx : -1;
+}
+
+}  // namespace
+
+char* BufPool::Alloc(int size)
+{
+    if (size < 0) return nullptr;
+    const int idx = ClassIdx(size);
+    char* raw = nullptr;
+    if (idx >= 0) {
+        PoolClass& pool_class = GetPool().classes[idx];
+        std::lock_guard<std::mutex> lock(pool_class.mutex);
+        if (!pool_class.free_list.empty()) {
+            raw = pool_class.free_list.back();
+            pool_class.free_list.pop_back();
+        }
+    }
+    if (raw == nullptr) {
+        const size_t capacity = idx >= 0 ? ((size_t)1 << (idx + min_class_shift)) : (size_t)size;
+        raw = (char*)malloc(sizeof(BufHead) + capacity);
+        if (raw == nullptr) return nullptr;
+        ((BufHead*)raw)->class_idx = idx;
+    }
+    return raw + sizeof(BufHead);
+}
+
+void BufPool::Free(char* buf)
+{
+    if (buf == nullptr) return;
+    char* raw = buf - sizeof(BufHead);
+    const int idx = ((BufHead*)raw)->class_idx;
+    if (idx >= 0) {
+        PoolClass& pool_class = GetPool().classes[idx];
+        const size_t capacity = (size_t)1 << (idx + min_class_shift);
+        std::lock_guard<std::mutex> lock(pool_class.mutex);
+        if (pool_class.free_list.empty() ||
+            (pool_class.free_list.size() + 1) * capacity <= max_cached_bytes_per_class) {
+            pool_class.free_list.push_back(raw);
+            return;
+        }
+    }
+    free(raw);
+}
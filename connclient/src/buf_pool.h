@@ -0,0 +1,10 @@
+#pragma once
+
+// 按2的幂分级缓存的缓冲池, 线程安全, 可以在一个线程分配另一个线程归还
+// 64B到4MB之间分级缓存, 更大的请求直接走malloc/free
+class BufPool
+{
+public:
+    static char* Alloc(int size);
+    static void Free(char* buf);
+};
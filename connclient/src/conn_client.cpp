@@ -4,6 +4,7 @@
 #include "common_def.h"
 
 #ifndef OS_WIN32
+#include <poll.h>
 #include <sys/select.h>
 
 #include "unistd.h"
@@ -11,25 +12,60 @@
 #include <WinSock2.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <deque>
 #include <functional>
+#include <mutex>
 #include <thread>
 
+#include "buf_pool.h"
 #include "concurrentqueue.h"
 #include "conn_protocol.h"
+#include "kcp_fec.h"
 #include "kcp_session.h"
+#include "lz4_block.h"
+#include "mtu_prober.h"
+#include "path_monitor.h"
 #include "socket_api.h"
 #include "stream.h"
 #include "sys_api.h"
 #include "time_api.h"
 #include "time_expire.h"
 
+#ifndef CONNCLIENT_HEADLESS
+#include <dmsdk/dlib/buffer.h>
+#include <dmsdk/dlib/hash.h>
+#include <dmsdk/dlib/log.h>
+#endif
+
 
 const int recv_one_time_size = 1024 * 16;
 const int cs_conn_head_size = sizeof(CsConnHead);
 const int cs_udp_conn_head_size = sizeof(CsUdpConnHead);
 const int max_udp_pkg_len = 2048;
+const int inline_max_net_steps = 256;  // 内联模式一次Update最多收包的轮数
+const int send_stack_vecs = 8;  // 聚合发送的片段数不超过此值时不用堆上的数组
+const int output_buffer_pool_max = 16;  // 每个连接留着复用的output dmBuffer个数
 const int max_pkg_size = 3 * 1024 * 1024;
+// UDP接收缓冲连同KcpDgram头正好落在BufPool的2KB一级
+const int udp_dgram_capacity = max_udp_pkg_len - (int)sizeof(KcpDgram);
+// KCP输出前预留的包头空间, UDP/TCP包头都原地写在KCP数据前面
+// 启用FEC时UDP包头后面还有FecHead
+const int kcp_udp_head_size = cs_udp_conn_head_size + (int)sizeof(FecHead);
+const int kcp_headroom =
+    cs_conn_head_size > kcp_udp_head_size ? cs_conn_head_size : kcp_udp_head_size;
+// 能FEC编码的KCP datagram最大长度, 校验分片比数据分片多2字节长度
+const int fec_max_kcp_len = max_udp_pkg_len - kcp_udp_head_size - 2 - udp_crc_size;
+const int fec_group_timeout_ms = 10;  // 组不满时最多等这么久就补发校验分片
+const int dup_trace_max = 64;         // 对外保留的自适应冗余采样记录条数
+// 客户端支持的KCP扩展
+const uint32_t client_kcp_features = KCP_FEATURE_SACK | KCP_FEATURE_CHANNELS |
+                                     KCP_FEATURE_UNRELIABLE_SEQ | KCP_FEATURE_FEC |
+                                     KCP_FEATURE_BATCH | KCP_FEATURE_COMPACT;
+const int coalesce_default_max_len = 128;
 
 #define LOG_DEBUG(p)                                                                              \
     if (debug_log_mode_) {                                                                        \
@@ -62,6 +98,16 @@ enum ConnState {
     CS_LOGIC_CONNECTED,
 };
 
+// 网络线程投递给Update()的事件, msg.data非空时为收到的消息, 直接交给output回调后释放
+struct OutEvent {
+    std::function<void()> fun;
+    KcpRecvMsg msg;
+    // 入队时的会话序号. 控制事件要等序号比它小的消息都交付后才执行, 消息要等到同序号的生命周期事件执行后才交付
+    uint32_t epoch = {0};
+    // 是否开启新的会话序号(断开, 重连, 连接成功)
+    bool barrier = {false};
+};
+
 class ConnClientPrivate
 {
 public:
@@ -70,12 +116,15 @@ public:
 
 public:
     void StartNetThreadLoop();
-    void Update();
+    int Update(int budget_us, int max_events);
+    void SetInlineMode(bool enable);
 
     int Connect(const char* ip, uint32_t port, int timeout_ms);
     int ConnectBlock(const char* ip, uint32_t port, int timeout_ms);
     void Close();
-    int SendMsg(const char* msg_buf, int msg_len);
+    int SendMsg(const char* msg_buf, int msg_len, int channel, int flags);
+    int SendMsgV(const ConnMsgVec* vec, int count, int channel, int flags);
+    int SendUnreliable(const char* msg_buf, int msg_len, int stream);
     int CreateConnect(int ai_socktype, int ai_family, int ai_protocol);
     bool IsConnected() const { return conn_state_ == CS_LOGIC_CONNECTED; }
     void SetConnState(int state);
@@ -87,14 +136,58 @@ public:
     void SetLogInfoCB(LuaCallback cb);
     void SetLogErrorCB(LuaCallback cb);
     void SetOutputCB(LuaCallback cb);
+    void SetOutputBuffer(bool enable);
     void SetDisconnectCB(LuaCallback cb);
     void SetConnectSuccessCB(LuaCallback cb);
     void SetRelinkSuccessCB(LuaCallback cb);
     void SetRelinkCB(LuaCallback cb);
+    void SetTransportSwitchCB(LuaCallback cb);
     void SetMagicNum(int magic) { magic_ = magic; }
     void AddRelinkInterval(int msec);
     void ClearRelinkInterval();
     void EnableKcpLog() { enable_kcp_log_ = true; }
+    void SetKcpAckDelay(int max_delay_ms, int ack_every)
+    {
+        kcp_ack_delay_ms_ = max_delay_ms;
+        kcp_ack_every_ = ack_every;
+    }
+    void SetCompressThreshold(int threshold) { compress_threshold_ = threshold; }
+    void SetKcpChannel(int channel, int priority, int weight);
+    void GetCompressStats(ConnCompressStats* stats) const;
+    void GetUnreliableStats(ConnUnreliableStats* stats) const;
+    void SetFec(int data_shards, int parity_shards)
+    {
+        fec_data_shards_ = data_shards;
+        fec_parity_shards_ = parity_shards;
+    }
+    void GetFecStats(ConnFecStats* stats) const;
+    void SetCongestionControl(int cc) { congestion_ = cc; }
+    void SetDupSendAdaptive(int max_count, int max_wait_ms, int loss_on, int loss_off)
+    {
+        dup_adaptive_count_ = max_count;
+        dup_adaptive_wait_ms_ = max_wait_ms;
+        dup_adaptive_loss_on_ = loss_on;
+        dup_adaptive_loss_off_ = loss_off;
+    }
+    int GetDupSendTrace(ConnDupTrace* trace, int max) const;
+    void SetTransportAdaptive(int probe_ms, int margin)
+    {
+        path_probe_ms_ = probe_ms;
+        path_margin_ = margin;
+    }
+    void GetPathStats(ConnPathStats* stats) const;
+    void SetMultipathBudget(int bytes_per_sec) { multipath_budget_ = bytes_per_sec; }
+    void GetMultipathStats(ConnMultipathStats* stats) const;
+    void SetMtuProbe(int max_mtu) { mtu_probe_max_ = max_mtu; }
+    void GetMtuStats(ConnMtuStats* stats) const;
+    void SetCoalesce(int delay_ms, int max_len)
+    {
+        coalesce_delay_ms_ = delay_ms;
+        coalesce_max_len_ = max_len > 0 ? max_len : coalesce_default_max_len;
+    }
+    void GetCoalesceStats(ConnCoalesceStats* stats) const;
+    void SetUdpChecksum(bool enable) { udp_checksum_ = enable; }
+    void GetChecksumStats(ConnChecksumStats* stats) const;
     void SwitchNetwork();
 
     static void StaticKcpLogFun(const char* log, struct IKCPCB* kcp, void* user);
@@ -103,12 +196,37 @@ public:
 private:
     int InnerConnect(const std::string& ip, uint32_t port, int timeout_ms);
     int SendTCPBuf(uint8_t cmd, const char* msg_buf = nullptr, int msg_len = 0);
-    int SendKCPBuf(const char* msg_buf, int msg_len);
+    int SendKCPBuf(const char* msg_buf, int msg_len, int channel, bool critical);
+    int SendKCPBufV(const IKCPVEC* vec, int nvec, int msg_len, int channel, bool critical);
+    int SendUnreliableBuf(const char* msg_buf, int msg_len, int stream);
     int SendUDPBuf(uint8_t cmd, const char* msg_buf = nullptr, int msg_len = 0);
+    int SendTCPFrame(char* pkg_buf, int total_len);
+    int SendKCPFrame(char* data, int len, bool critical = false);
+    int SendKCPUdp(char* data, int len, bool fec);
+    int SendKCPTcp(char* data, int len);
+    void SendKCPCopy(char* data, int len, bool over_udp);
+    bool TakeMultipathBudget(int len);
+    int SendFecParity();
+    void CheckFecGroup(int64_t now_ms);
+    int InputFec(const char* msg_buf, int msg_len, int64_t cur_time, KcpDgram* dgram,
+                 bool compact);
+    int SendKCPCompressed(KcpSession* session, const IKCPVEC* vec, int nvec, int msg_len,
+                          int64_t now_ms, bool critical);
+    int CoalesceMsg(int channel, const IKCPVEC* vec, int nvec, int msg_len, int64_t now_ms);
+    int FlushCoalesce(int channel, int64_t now_ms);
+    void CheckCoalesce(int64_t now_ms, bool all);
+    int NetWaitMs(int64_t now_ms) const;
+    bool OutputBatch(KcpRecvMsg* msg);
+    int OutputKCP(char* data, int len, bool critical);
+    void BeginKcpPack();
+    void EndKcpPack();
+    void FlushKcpPack();
+    bool DecompressMsg(KcpRecvMsg* msg);
     void InnerClose(int reason);
 
 private:
     void NetThreadLoop();
+    bool NetStep(int timeout_ms);
     void NotifyWorker();
     bool IsErrorable(int fd);
     bool IsReadable(int fd);
@@ -116,14 +234,33 @@ private:
     void OnTcpRead(int64_t cur_time);
     void OnTcpWrite();
     void OnUdpRead(int64_t cur_time);
+    void OnUdpPkg(KcpDgram* dgram, int pkg_len, int64_t cur_time);
     void ReadStream(int64_t cur_time);
     void SendTcpPing(int64_t now_ms, bool immediate);
-    void SendUdpPing(int64_t now_ms);
+    void SendUdpPing(int64_t now_ms, bool immediate);
+    void CheckPath(int64_t now_ms);
+    void CheckMtu(int64_t now_ms);
+    void SendMtuProbe(uint16_t id, int mtu);
+    void ApplyMtu();
+    bool KcpOverUdp() const { return enable_udp_ && !kcp_over_tcp_; }
     void AddSocketToSelect(int fd, bool is_read, bool is_write);
     int HandleUDPRoutePing(int64_t cur_time, char* pkg);
-    int UdpWrite(const char* pkg_buf, int len);
-    int InputToKcp(const char* msg_buf, int msg_len, int64_t cur_time);
+    int UdpWrite(char* pkg_buf, int len, bool crc = true);
+    bool CheckUdpCrc(const char* pkg_buf, int* pkg_len);
+    void OnUdpError();
+    int InputToKcp(const char* msg_buf, int msg_len, int64_t cur_time,
+                   KcpDgram* dgram = nullptr, bool compact = false);
+    int UdpHeadLen() const;
+    void PutUdpHead(char* pkg_buf, uint8_t cmd) const;
+    int TcpHeadLen(int msg_len) const;
+    void PutTcpHead(char* pkg_buf, uint8_t cmd, int msg_len) const;
     void CreateKCP(const ControlKCPInfo* kcp_info);
+    int CreateKcpChannel(int channel);
+    KcpSession* GetKcpChannel(int channel);
+    void ApplyChannelWeight(int channel);
+    int RecvKcpMsgs(int channel);
+    void NegotiateKCPFeature(const ControlKCPFeature* server_feature);
+    void PublishDupTrace();
     static int KCPOutput(const char* data, int len, ikcpcb* kcp, void* user);
     void CheckTimeout(int64_t now_ms);
     void CheckRelink(int64_t now_ms);
@@ -133,8 +270,20 @@ public:
 
 private:
     volatile bool running_ = {false};
+    // 内联模式: 不起网络线程, Update()里完成网络线程的一轮, 发送直接进KCP. Connect前设置
+    bool inline_mode_ = {false};
     moodycamel::ConcurrentQueue<std::function<void()>> in_queue_;
-    moodycamel::ConcurrentQueue<std::function<void()>> out_queue_;
+    // 交给主线程的事件分两条: ctrl_queue_为连接生命周期等控制事件, 不受Update预算限制;
+    // out_queue_为收到的消息和日志. 两条队列按epoch排序, 控制事件不会越过更早会话的消息
+    moodycamel::ConcurrentQueue<OutEvent> ctrl_queue_;
+    moodycamel::ConcurrentQueue<OutEvent> out_queue_;
+    // 网络线程当前的会话序号
+    uint32_t out_epoch_ = {0};
+    // 以下只在主线程访问: 已取出待执行的控制事件, 已取出还没交付的一个消息, 已执行的最新生命周期序号
+    std::deque<OutEvent> ctrl_pending_;
+    OutEvent out_held_;
+    bool out_held_valid_ = {false};
+    uint32_t ctrl_epoch_ = {0};
     std::thread thread_;
     int thread_priority_ = {0};
 
@@ -146,10 +295,16 @@ private:
 #ifndef OS_WIN32
     int pipe_sock_[2] = {-1, -1};
 #endif
+#ifndef OS_WIN32
+    // 非Windows用poll, 避免select在fd超过FD_SETSIZE(压测大量连接)时越界
+    struct pollfd pfds_[3];
+    int npfds_ = {0};
+#else
     int maxfd_ = {0};
     fd_set rset_;
     fd_set wset_;
     fd_set eset_;
+#endif
 
     int conn_state_ = {CS_INIT};
     int64_t conn_state_ts_ = {0};
@@ -164,9 +319,107 @@ private:
     TimeExpire udp_ping_expire_ = {2000};
     int64_t ping_seq_ = {0};
 
-    KcpSession kcp_session_;
+    KcpSession kcp_sessions_[kcp_max_channels];  // 下标为可靠通道号, 0为默认通道
+    ControlKCPInfo kcp_info_;                     // 服务器下发的KCP参数, 创建其他通道时使用
+    bool kcp_sack_ = {false};
+    bool kcp_channels_ = {false};                 // 已协商KCP_FEATURE_CHANNELS
+    int channel_priority_[kcp_max_channels];      // 越小越优先, 决定flush和交给上层的顺序
+    int channel_weight_[kcp_max_channels];        // 占协商发送窗口的百分比
+    int channel_order_[kcp_max_channels];         // 按优先级排好的通道号
+    // 多通道时各通道的小块输出先拼进同一个datagram, 包头同样原地写在前面
+    char kcp_pack_buf_[kcp_headroom + max_udp_pkg_len + udp_crc_size];
+    int kcp_pack_len_ = {0};
+    bool kcp_packing_ = {false};
+    bool kcp_pack_critical_ = {false};  // 已攒的输出里有关键datagram
+    char udp_send_buf_[max_udp_pkg_len + udp_crc_size];
     bool enable_udp_ = {false};
     bool enable_kcp_log_ = {false};
+    int kcp_ack_delay_ms_ = {0};
+    int kcp_ack_every_ = {0};
+    int compress_threshold_ = {0};
+    bool kcp_compress_ = {false};  // 已协商KCP_FEATURE_COMPRESS
+    bool kcp_unreliable_seq_ = {false};  // 已协商KCP_FEATURE_UNRELIABLE_SEQ
+    uint16_t unreliable_send_seq_[unreliable_max_streams];
+    uint16_t unreliable_recv_seq_[unreliable_max_streams];
+    uint32_t unreliable_recv_valid_ = {0};  // 按bit记录各stream是否收到过
+    int fec_data_shards_ = {0};
+    int fec_parity_shards_ = {0};
+    bool kcp_fec_ = {false};  // 已协商KCP_FEATURE_FEC
+    FecEncoder fec_encoder_;  // 协商了且设置了SetFec时启用
+    FecDecoder fec_decoder_;
+    int congestion_ = {CONN_CC_SERVER};
+    int dup_adaptive_count_ = {0};
+    int dup_adaptive_wait_ms_ = {0};
+    int dup_adaptive_loss_on_ = {0};
+    int dup_adaptive_loss_off_ = {0};
+    uint32_t dup_trace_seen_ = {0};  // 已发布的默认通道采样记录累计条数
+    // 默认通道采样记录快照, 网络线程有新记录时更新, 其他线程读
+    mutable std::mutex dup_trace_mutex_;
+    std::vector<ConnDupTrace> dup_trace_;
+    int path_probe_ms_ = {0};
+    int path_margin_ = {0};
+    bool kcp_path_switch_ = {false};  // 已协商KCP_FEATURE_PATH_SWITCH
+    bool kcp_over_tcp_ = {false};     // 启用了UDP但KCP数据已切到TCP
+    PathMonitor path_monitor_;        // 协商了且设置了SetTransportAdaptive时启用
+    // 路径评估结果快照, 网络线程每次评估后更新, 其他线程读
+    mutable std::mutex path_stats_mutex_;
+    ConnPathStats path_stats_ = {};
+    int multipath_budget_ = {0};
+    bool kcp_multipath_ = {false};     // 协商了KCP_FEATURE_PATH_SWITCH且设置了SetMultipathBudget
+    int64_t multipath_tokens_ = {0};   // 令牌桶, 单位为字节*1000, 避免按ms补充时取整丢失
+    int64_t multipath_refill_ms_ = {0};
+    int mtu_probe_max_ = {0};
+    bool kcp_mtu_probe_ = {false};  // 已协商KCP_FEATURE_MTU_PROBE且设置了SetMtuProbe
+    MtuProber mtu_prober_;
+    int kcp_mtu_ = {0};               // 已应用到各通道的mtu
+    uint32_t mtu_lost_seen_ = {0};    // 各通道已处理到的超时丢包累计数之和
+    int coalesce_delay_ms_ = {0};
+    int coalesce_max_len_ = {coalesce_default_max_len};
+    bool kcp_batch_ = {false};  // 已协商KCP_FEATURE_BATCH
+    bool kcp_compact_ = {false};     // 已协商KCP_FEATURE_COMPACT, 上行用紧凑格式
+    int64_t compact_legacy_until_ms_ = {0};  // 服务器确认切换后, 这之前还接受原格式的下行UDP
+    bool tcp_compact_in_ = {false};  // 服务器已确认切换, TCP下行按紧凑格式解析
+    bool udp_checksum_ = {false};
+    bool udp_crc_ = {false};     // 已协商KCP_FEATURE_CRC32C, 上行UDP带校验和
+    bool udp_crc_in_ = {false};  // 服务器已确认, 下行UDP校验不过的丢弃
+    // 各通道攒着的批量消息, 控制byte已经写在开头
+    struct Coalesce {
+        std::string buf;
+        int count = {0};
+        int64_t deadline_ms = {0};
+    };
+    Coalesce coalesce_[kcp_max_channels];
+    std::atomic<bool> coalesce_dirty_ = {false};  // 上次Update以来调用过SendMsg
+
+    // 压缩统计, 网络线程写, 其他线程读
+    std::atomic<uint64_t> send_zip_msgs_ = {0};
+    std::atomic<uint64_t> send_raw_bytes_ = {0};
+    std::atomic<uint64_t> send_zip_bytes_ = {0};
+    std::atomic<uint64_t> recv_zip_msgs_ = {0};
+    std::atomic<uint64_t> recv_zip_bytes_ = {0};
+    std::atomic<uint64_t> recv_raw_bytes_ = {0};
+    // 不可靠消息统计, 同上
+    std::atomic<uint64_t> unreliable_send_msgs_ = {0};
+    std::atomic<uint64_t> unreliable_recv_msgs_ = {0};
+    std::atomic<uint64_t> unreliable_stale_drops_ = {0};
+    // FEC统计, 同上
+    std::atomic<uint64_t> fec_send_data_ = {0};
+    std::atomic<uint64_t> fec_send_parity_ = {0};
+    std::atomic<uint64_t> fec_recovered_ = {0};
+    // 多路径冗余统计, 同上
+    std::atomic<uint64_t> multipath_copy_pkgs_ = {0};
+    std::atomic<uint64_t> multipath_copy_bytes_ = {0};
+    std::atomic<uint64_t> multipath_budget_drops_ = {0};
+    // MTU探测统计, 同上
+    std::atomic<int> mtu_cur_ = {0};
+    std::atomic<uint32_t> mtu_probes_ = {0};
+    std::atomic<uint32_t> mtu_black_holes_ = {0};
+    // 合并发送统计, 同上
+    std::atomic<uint64_t> coalesce_msgs_ = {0};
+    std::atomic<uint64_t> coalesce_batches_ = {0};
+    // UDP校验统计, 同上
+    std::atomic<uint64_t> udp_crc_verified_ = {0};
+    std::atomic<uint64_t> udp_crc_drops_ = {0};
 
     bool is_first_connect_ = {true};
     std::vector<int> relink_interval_ms_vec_;
@@ -178,20 +431,46 @@ private:
     void LogInfo(const char* text);
     void LogError(const char* text);
     void Output(const char* data, int len, int64_t cur_time);
+    void OutputUnreliableSeq(const char* data, int len, int64_t cur_time);
+    void OutputMsg(KcpRecvMsg* msg);
+    void PostEvent(std::function<void()>&& fun)
+    {
+        out_queue_.enqueue(OutEvent{std::move(fun), {}, out_epoch_});
+    }
+    // 生命周期事件(barrier)之后的消息属于新的会话序号, 不会被提前到它前面交付
+    void PostCtrlEvent(std::function<void()>&& fun, bool barrier)
+    {
+        if (barrier) out_epoch_++;
+        ctrl_queue_.enqueue(OutEvent{std::move(fun), {}, out_epoch_, barrier});
+    }
+    bool PollOutEvent();
     void Disconnect();
     void ConnectSuccess();
     void ReConnectSuccess();
     void CallLuaCallback(void* user, LuaCallback callback, const char* data, int data_len,
-                         const char* text, int text_len);
+                         int channel, int value);
+    void CallLuaOutputBuffer(void* user, LuaCallback callback, const char* data, int data_len,
+                             int channel);
+#ifndef CONNCLIENT_HEADLESS
+    dmBuffer::HBuffer AcquireOutputBuffer(uint32_t size);
+    void RecycleOutputBuffer(dmBuffer::HBuffer buffer);
+    void ReleaseOutputBuffers();
+#endif
 
     LuaCallback log_debug_cb_ = {nullptr};
     LuaCallback log_info_cb_ = {nullptr};
     LuaCallback log_error_cb_ = {nullptr};
     LuaCallback output_cb_ = {nullptr};
+    bool output_buffer_ = {false};  // 只在主线程读写
+#ifndef CONNCLIENT_HEADLESS
+    // 回调用完的dmBuffer, 下次同样长度的消息直接复用, 越靠后越新. 只在主线程读写
+    std::vector<dmBuffer::HBuffer> output_buffer_pool_;
+#endif
     LuaCallback disconnect_cb_ = {nullptr};
     LuaCallback connect_success_cb_ = {nullptr};
     LuaCallback reconnect_success_cb_ = {nullptr};
     LuaCallback relink_cb_ = {nullptr};
+    LuaCallback transport_switch_cb_ = {nullptr};
 };
 
 ConnClientPrivate::ConnClientPrivate()
@@ -203,6 +482,14 @@ ConnClientPrivate::ConnClientPrivate()
 #endif
     thread_priority_ = SysAPI::GetPriority();
     SetConnState(CS_INIT);
+    memset(&kcp_info_, 0, sizeof(kcp_info_));
+    memset(unreliable_send_seq_, 0, sizeof(unreliable_send_seq_));
+    memset(unreliable_recv_seq_, 0, sizeof(unreliable_recv_seq_));
+    for (int i = 0; i < kcp_max_channels; ++i) {
+        channel_priority_[i] = i;
+        channel_weight_[i] = 100;
+        channel_order_[i] = i;
+    }
 
     SocketAPI::init_sock_env();
 }
@@ -213,6 +500,15 @@ ConnClientPrivate::~ConnClientPrivate()
     NotifyWorker();
     if (thread_.joinable()) thread_.join();
     InnerClose(-1);
+    // 没有交给Update()的消息在这里释放
+    OutEvent event;
+    while (out_queue_.try_dequeue(event)) {
+        KcpSession::FreeMsg(&event.msg);
+    }
+    if (out_held_valid_) KcpSession::FreeMsg(&out_held_.msg);
+#ifndef CONNCLIENT_HEADLESS
+    ReleaseOutputBuffers();
+#endif
 #ifndef OS_WIN32
     if (pipe_sock_[0] != -1) SocketAPI::closesocket_ex(pipe_sock_[0]);
     if (pipe_sock_[1] != -1) SocketAPI::closesocket_ex(pipe_sock_[1]);
@@ -225,12 +521,51 @@ ConnClientPrivate::~ConnClientPrivate()
 
 void ConnClientPrivate::StartNetThreadLoop()
 {
-    if (!thread_.joinable()) {
+    if (inline_mode_) {
+        if (!running_) {
+            running_ = true;
+            relink_count_ = 0;
+        }
+    } else if (!thread_.joinable()) {
         LOG_DEBUG("thread_.joinable=" << thread_.joinable());
         thread_ = std::thread(&ConnClientPrivate::NetThreadLoop, this);
     }
 }
 
+#ifndef OS_WIN32
+static short PollEvents(const struct pollfd* pfds, int npfds, int fd)
+{
+    for (int i = 0; i < npfds; ++i) {
+        if (pfds[i].fd == fd) return pfds[i].revents;
+    }
+    return 0;
+}
+
+bool ConnClientPrivate::IsErrorable(int fd)
+{
+    return (fd != -1 && (PollEvents(pfds_, npfds_, fd) & (POLLERR | POLLHUP | POLLNVAL)) != 0);
+}
+
+bool ConnClientPrivate::IsReadable(int fd)
+{
+    return (fd != -1 && (PollEvents(pfds_, npfds_, fd) & POLLIN) != 0);
+}
+
+bool ConnClientPrivate::IsWritable(int fd)
+{
+    return (fd != -1 && (PollEvents(pfds_, npfds_, fd) & POLLOUT) != 0);
+}
+
+void ConnClientPrivate::AddSocketToSelect(int fd, bool is_read, bool is_write)
+{
+    if (fd != INVALID_SOCKET && npfds_ < (int)(sizeof(pfds_) / sizeof(pfds_[0]))) {
+        struct pollfd& pfd = pfds_[npfds_++];
+        pfd.fd = fd;
+        pfd.events = (is_read ? POLLIN : 0) | (is_write ? POLLOUT : 0);
+        pfd.revents = 0;
+    }
+}
+#else
 bool ConnClientPrivate::IsErrorable(int fd)
 {
     return (fd != -1 && FD_ISSET(fd, &eset_));
@@ -246,7 +581,6 @@ bool ConnClientPrivate::IsWritable(int fd)
     return (fd != -1 && FD_ISSET(fd, &wset_));
 }
 
-
 void ConnClientPrivate::AddSocketToSelect(int fd, bool is_read, bool is_write)
 {
     if (fd != INVALID_SOCKET) {
@@ -255,91 +589,198 @@ void ConnClientPrivate::AddSocketToSelect(int fd, bool is_read, bool is_write)
         if (fd > maxfd_) maxfd_ = fd;
     }
 }
+#endif
 
 void ConnClientPrivate::NetThreadLoop()
 {
     SysAPI::SetPriority(thread_priority_);
     running_ = true;
     relink_count_ = 0;
-    const int timeout_ms = 10;
     while (running_) {
-        struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
-
-        maxfd_ = 0;
-        FD_ZERO(&rset_);
-        FD_ZERO(&wset_);
-        FD_ZERO(&eset_);
+        NetStep(NetWaitMs(TimeAPI::GetTimeMs()));
+    }
+}
 
-        AddSocketToSelect(tcp_sock_, true, tcp_writable_);
-        AddSocketToSelect(udp_sock_, true, false);
+// 网络线程的一轮: 等socket最多timeout_ms并处理读写, 执行主线程交过来的操作, 驱动KCP和各项定时检查.
+// 有socket可读写时返回true
+bool ConnClientPrivate::NetStep(int timeout_ms)
+{
+    bool ready = false;
 #ifndef OS_WIN32
-        const int pipe_read_sock = pipe_sock_[0];
-        AddSocketToSelect(pipe_read_sock, true, false);
-#endif
+    npfds_ = 0;
+    AddSocketToSelect(tcp_sock_, true, tcp_writable_);
+    AddSocketToSelect(udp_sock_, true, false);
+    const int pipe_read_sock = pipe_sock_[0];
+    AddSocketToSelect(pipe_read_sock, true, false);
+
+    if (npfds_ > 0) {
+        const int retval = poll(pfds_, npfds_, timeout_ms);
+#else
+    struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+
+    maxfd_ = 0;
+    FD_ZERO(&rset_);
+    FD_ZERO(&wset_);
+    FD_ZERO(&eset_);
 
-        if (maxfd_ > 0) {
-            const int retval = select(maxfd_ + 1, &rset_, &wset_, &eset_, &tv);
-            if (retval > 0) {
-                const int64_t cur_time = TimeAPI::GetTimeMs();
-                if (IsReadable(tcp_sock_) || IsErrorable(tcp_sock_)) {
-                    OnTcpRead(cur_time);
-                } else if (IsWritable(tcp_sock_)) {
-                    LOG_DEBUG("Writable tcp_sock_=" << tcp_sock_);
-                    tcp_writable_ = false;
-                    if (conn_state_ == CS_CONNECTING) {
-                        SetConnState(CS_CONNECTED);
-                        if (!SocketAPI::set_tcp_no_delay(tcp_sock_)) {
-                            const int err = SocketAPI::get_last_error();
-                            LOG_ERROR("SetTcpNoDelay failed errno[" << err << "] errstr["
-                                                                    << strerror(err) << "]");
-                        }
-                        LOG_INFO("tcp_sock connect Ok");
-                    } else {
-                        OnTcpWrite();
+    AddSocketToSelect(tcp_sock_, true, tcp_writable_);
+    AddSocketToSelect(udp_sock_, true, false);
+
+    if (maxfd_ > 0) {
+        const int retval = select(maxfd_ + 1, &rset_, &wset_, &eset_, &tv);
+#endif
+        if (retval > 0) {
+            ready = true;
+            const int64_t cur_time = TimeAPI::GetTimeMs();
+            if (IsReadable(tcp_sock_) || IsErrorable(tcp_sock_)) {
+                OnTcpRead(cur_time);
+            } else if (IsWritable(tcp_sock_)) {
+                LOG_DEBUG("Writable tcp_sock_=" << tcp_sock_);
+                tcp_writable_ = false;
+                if (conn_state_ == CS_CONNECTING) {
+                    SetConnState(CS_CONNECTED);
+                    if (!SocketAPI::set_tcp_no_delay(tcp_sock_)) {
+                        const int err = SocketAPI::get_last_error();
+                        LOG_ERROR("SetTcpNoDelay failed errno[" << err << "] errstr["
+                                                                << strerror(err) << "]");
                     }
+                    LOG_INFO("tcp_sock connect Ok");
+                } else {
+                    OnTcpWrite();
                 }
-                if (IsReadable(udp_sock_) || IsErrorable(udp_sock_)) {
-                    OnUdpRead(cur_time);
-                }
+            }
+            if (IsReadable(udp_sock_) || IsErrorable(udp_sock_)) {
+                OnUdpRead(cur_time);
+            }
 
 #ifndef OS_WIN32
-                if (char c[8]; IsReadable(pipe_read_sock)) {
-                    read(pipe_sock_[0], &c, 8);
-                    LOG_DEBUG("Readable pipe");
-                }
+            if (char c[8]; IsReadable(pipe_read_sock)) {
+                read(pipe_sock_[0], &c, 8);
+                LOG_DEBUG("Readable pipe");
+            }
 #endif
-            } else if (retval == -1 && errno != EINTR) {
-                LOG_ERROR("panic select: " << strerror(errno));
+        } else if (retval == -1 && errno != EINTR) {
+            LOG_ERROR("panic select: " << strerror(errno));
+        }
+    } else if (timeout_ms > 0) {
+        TimeAPI::SleepMs(timeout_ms);
+    }
+
+    std::function<void()> fun;
+    while (in_queue_.try_dequeue(fun)) {
+        fun();
+    }
+    const int64_t now_ms = TimeAPI::GetTimeMs();
+    CheckCoalesce(now_ms, false);
+    BeginKcpPack();
+    for (int i = 0; i < kcp_max_channels; ++i) {
+        kcp_sessions_[channel_order_[i]].Tick((uint32_t)now_ms);
+    }
+    EndKcpPack();
+    PublishDupTrace();
+    CheckFecGroup(now_ms);
+    SendTcpPing(now_ms, false);
+    SendUdpPing(now_ms, false);
+    CheckPath(now_ms);
+    CheckMtu(now_ms);
+    CheckTimeout(now_ms);
+    CheckRelink(now_ms);
+    return ready;
+}
+
+bool ConnClientPrivate::PollOutEvent()
+{
+    if (!out_held_valid_) out_held_valid_ = out_queue_.try_dequeue(out_held_);
+    return out_held_valid_;
+}
+
+int ConnClientPrivate::Update(int budget_us, int max_events)
+{
+    if (inline_mode_) {
+        // 不等待地收包并驱动KCP, 收到的消息下面就交给回调. 每轮每个socket只读一次, 读到没有数据为止
+        if (running_) {
+            for (int i = 0; i < inline_max_net_steps && NetStep(0) && running_; ++i) {
             }
         } else {
-            TimeAPI::SleepMs(timeout_ms);
+            std::function<void()> fun;
+            while (in_queue_.try_dequeue(fun)) {
+                fun();
+            }
         }
-
-        std::function<void()> fun;
-        while (in_queue_.try_dequeue(fun)) {
-            fun();
+    } else if (coalesce_dirty_.exchange(false, std::memory_order_relaxed)) {
+        // 帧末把这一帧攒着的小消息发出去
+        in_queue_.enqueue([this]() { CheckCoalesce(TimeAPI::GetTimeMs(), true); });
+        NotifyWorker();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    int handled = 0;
+    for (;;) {
+        // 控制事件不受预算限制, 但要等比它早的会话的消息都交付了才执行
+        OutEvent event;
+        while (ctrl_queue_.try_dequeue(event)) {
+            ctrl_pending_.push_back(std::move(event));
         }
-        const int64_t now_ms = TimeAPI::GetTimeMs();
-        kcp_session_.Tick((uint32_t)now_ms);
-        SendTcpPing(now_ms, false);
-        SendUdpPing(now_ms);
-        CheckTimeout(now_ms);
-        CheckRelink(now_ms);
+        if (!ctrl_pending_.empty()) {
+            OutEvent& ctrl = ctrl_pending_.front();
+            if (!PollOutEvent() || out_held_.epoch >= ctrl.epoch) {
+                if (ctrl.barrier) ctrl_epoch_ = ctrl.epoch;
+                event = std::move(ctrl);
+                ctrl_pending_.pop_front();
+                if (event.fun) event.fun();
+                continue;
+            }
+        }
+        if ((max_events > 0 && handled >= max_events) ||
+            (handled > 0 && budget_us > 0 &&
+             std::chrono::steady_clock::now() - start >= std::chrono::microseconds(budget_us))) {
+            break;
+        }
+        if (!PollOutEvent()) break;
+        // 新会话的消息先等它的生命周期事件, 那个事件已经在ctrl_queue_里了
+        if (out_held_.epoch > ctrl_epoch_) {
+            if (ctrl_pending_.empty() && ctrl_queue_.size_approx() == 0) break;
+            continue;
+        }
+        event = std::move(out_held_);
+        out_held_valid_ = false;
+        if (event.msg.data != nullptr) {
+            if (output_cb_ != nullptr) {
+                if (output_buffer_) {
+                    CallLuaOutputBuffer(user_data_, output_cb_, event.msg.data, event.msg.len,
+                                        event.msg.channel);
+                } else {
+                    CallLuaCallback(user_data_, output_cb_, event.msg.data, event.msg.len,
+                                    event.msg.channel, -1);
+                }
+            }
+            KcpSession::FreeMsg(&event.msg);
+        } else if (event.fun) {
+            event.fun();
+        }
+        handled++;
     }
+    // 回调里发的消息已直接进了KCP, 攒着的小消息也在这一帧发出去
+    if (inline_mode_ && coalesce_dirty_.exchange(false, std::memory_order_relaxed)) {
+        CheckCoalesce(TimeAPI::GetTimeMs(), true);
+    }
+    return handled;
 }
 
-void ConnClientPrivate::Update()
+void ConnClientPrivate::SetInlineMode(bool enable)
 {
-    std::function<void()> fun;
-    while (out_queue_.try_dequeue(fun)) {
-        fun();
-    }
+    if (thread_.joinable() || running_) return;
+    inline_mode_ = enable;
 }
 
 int ConnClientPrivate::Connect(const char* ip, uint32_t port, int timeout_ms)
 {
     LOG_DEBUG("Connect[" << ip << ":" << port << "] " << std::this_thread::get_id());
     ASSERT(std::this_thread::get_id() != thread_.get_id());
+    if (inline_mode_) {
+        StartNetThreadLoop();
+        InnerConnect(ip, port, timeout_ms);
+        return 0;
+    }
     std::string ip_str(ip);
     in_queue_.enqueue([this, ip_str = std::move(ip_str), port, timeout_ms]() {
         InnerConnect(ip_str, port, timeout_ms);
@@ -418,17 +859,11 @@ int ConnClientPrivate::CreateConnect(int ai_socktype, int ai_family, int ai_prot
 
 int ConnClientPrivate::ConnectBlock(const char* ip, uint32_t port, int timeout_ms)
 {
-    ASSERT(std::this_thread::get_id() != thread_.get_id());
-    std::string ip_str(ip);
-    in_queue_.enqueue([this, ip_str = std::move(ip_str), port, timeout_ms]() {
-        InnerConnect(ip_str, port, timeout_ms);
-    });
-    StartNetThreadLoop();
-    NotifyWorker();
+    Connect(ip, port, timeout_ms);
 
     int loop_count = timeout_ms / 10;
     while (loop_count-- > 0) {
-        Update();
+        Update(0, 0);
         if (conn_state_ == CS_LOGIC_CONNECTED) return 0;
         TimeAPI::SleepMs(10);
     }
@@ -438,6 +873,10 @@ int ConnClientPrivate::ConnectBlock(const char* ip, uint32_t port, int timeout_m
 void ConnClientPrivate::Close()
 {
     ASSERT(std::this_thread::get_id() != thread_.get_id());
+    if (inline_mode_) {
+        InnerClose(-1);
+        return;
+    }
     in_queue_.enqueue([this]() { InnerClose(-1); });
 }
 void ConnClientPrivate::InnerClose(int reason)
@@ -447,8 +886,15 @@ void ConnClientPrivate::InnerClose(int reason)
     }
     if (reason < CLIENT_CONNECT_ERROR) {
         LOG_DEBUG("Release Kcp");
-        kcp_session_.Flush();
-        kcp_session_.Release();
+        BeginKcpPack();
+        for (int i = 0; i < kcp_max_channels; ++i) {
+            kcp_sessions_[channel_order_[i]].Flush();
+        }
+        EndKcpPack();
+        for (auto& session : kcp_sessions_) {
+            session.Release();
+        }
+        kcp_channels_ = false;
         running_ = false;
     }
     if (tcp_sock_ != -1) {
@@ -462,29 +908,149 @@ void ConnClientPrivate::InnerClose(int reason)
     SetConnState(CS_INIT);
     write_stream_.Reset();
     read_stream_.Reset();
+    // 重连后沿用KCP但回到原格式, 服务器不会再下发CONTROL_KCP_INFO重新协商
+    if (kcp_compact_) {
+        for (int i = 0; i < kcp_max_channels; ++i) {
+            if (!kcp_sessions_[i].IsNull()) kcp_sessions_[i].SetCompact(false, i);
+        }
+    }
+    kcp_compact_ = false;
+    tcp_compact_in_ = false;
+    udp_crc_ = false;
+    udp_crc_in_ = false;
 
     if (reason >= 0 && disconnect_cb_ != nullptr) {
         if (disconnect_cb_) {
-            out_queue_.enqueue([this, reason]() {
-                CallLuaCallback(user_data_, disconnect_cb_, nullptr, 0, nullptr, reason + 1);
-            });
+            PostCtrlEvent([this, reason]() {
+                CallLuaCallback(user_data_, disconnect_cb_, nullptr, 0, 0, reason);
+            }, true);
+        }
+    }
+}
+
+int ConnClientPrivate::SendMsg(const char* msg_buf, int msg_len, int channel, int flags)
+{
+    if (conn_state_ < CS_LOGIC_CONNECTED) return -1;
+    if (channel < 0 || channel >= kcp_max_channels) return -1;
+    const bool critical = (flags & CONN_SEND_CRITICAL) != 0;
+    if (coalesce_delay_ms_ > 0) coalesce_dirty_.store(true, std::memory_order_relaxed);
+    if (inline_mode_) return SendKCPBuf(msg_buf, msg_len, channel, critical);
+    std::string str(msg_buf, msg_len);
+    in_queue_.enqueue([this, str = std::move(str), channel, critical]() {
+        SendKCPBuf(str.c_str(), (int)str.size(), channel, critical);
+    });
+    return 0;
+}
+
+int ConnClientPrivate::SendMsgV(const ConnMsgVec* vec, int count, int channel, int flags)
+{
+    if (conn_state_ < CS_LOGIC_CONNECTED) return -1;
+    if (channel < 0 || channel >= kcp_max_channels) return -1;
+    if (count < 0 || (count > 0 && vec == nullptr)) return -1;
+    size_t total_len = 0;
+    for (int i = 0; i < count; ++i) {
+        if (vec[i].len < 0) return -1;
+        total_len += vec[i].len;
+    }
+    if (total_len > (size_t)max_pkg_size) return -1;
+    const bool critical = (flags & CONN_SEND_CRITICAL) != 0;
+    if (coalesce_delay_ms_ > 0) coalesce_dirty_.store(true, std::memory_order_relaxed);
+    if (inline_mode_) {
+        // 没有线程交接, 片段直接交给KCP按segment拷贝
+        IKCPVEC stack_vec[send_stack_vecs];
+        std::vector<IKCPVEC> heap_vec;
+        IKCPVEC* kcp_vec = stack_vec;
+        if (count > send_stack_vecs) {
+            heap_vec.resize(count);
+            kcp_vec = heap_vec.data();
         }
+        for (int i = 0; i < count; ++i) {
+            kcp_vec[i].base = vec[i].buf;
+            kcp_vec[i].len = vec[i].len;
+        }
+        return SendKCPBufV(kcp_vec, count, (int)total_len, channel, critical);
+    }
+    // 交给网络线程前本来就要拷贝一次, 片段直接聚合进这份拷贝
+    std::string str;
+    str.reserve(total_len);
+    for (int i = 0; i < count; ++i) {
+        if (vec[i].len > 0) str.append(vec[i].buf, vec[i].len);
     }
+    in_queue_.enqueue([this, str = std::move(str), channel, critical]() {
+        SendKCPBuf(str.c_str(), (int)str.size(), channel, critical);
+    });
+    return 0;
 }
 
-int ConnClientPrivate::SendMsg(const char* msg_buf, int msg_len)
+int ConnClientPrivate::SendUnreliable(const char* msg_buf, int msg_len, int stream)
 {
     if (conn_state_ < CS_LOGIC_CONNECTED) return -1;
+    if (stream < 0 || stream >= unreliable_max_streams) return -1;
+    if (msg_len <= 0 ||
+        msg_len > max_udp_pkg_len - cs_udp_conn_head_size - (int)sizeof(UnreliableMsgHead)) {
+        return -1;
+    }
+    if (inline_mode_) return SendUnreliableBuf(msg_buf, msg_len, stream) < 0 ? -1 : 0;
     std::string str(msg_buf, msg_len);
-    in_queue_.enqueue([this, str = std::move(str)]() { SendKCPBuf(str.c_str(), (int)str.size()); });
+    in_queue_.enqueue([this, str = std::move(str), stream]() {
+        SendUnreliableBuf(str.c_str(), (int)str.size(), stream);
+    });
+    NotifyWorker();
     return 0;
 }
 
-int ConnClientPrivate::SendKCPBuf(const char* msg_buf, int msg_len)
+// 消息在udp_send_buf_里拼好UnreliableMsgHead, 有UDP时包头原地补在前面, 否则走TCP
+int ConnClientPrivate::SendUnreliableBuf(const char* msg_buf, int msg_len, int stream)
+{
+    if (conn_state_ < CS_LOGIC_CONNECTED) return -1;
+    const uint8_t cmd = kcp_unreliable_seq_ ? CONTROL_UNRELIABLE_SEQ_MSG : CONTROL_UNRELIABLE_MSG;
+    const int head_len = kcp_unreliable_seq_ ? (int)sizeof(UnreliableMsgHead) : 0;
+    char* body = udp_send_buf_ + cs_udp_conn_head_size;
+    if (head_len > 0) {
+        auto* head = (UnreliableMsgHead*)body;
+        head->stream = (uint8_t)stream;
+        head->seq = unreliable_send_seq_[stream]++;
+    }
+    memcpy(body + head_len, msg_buf, msg_len);
+    unreliable_send_msgs_.fetch_add(1, std::memory_order_relaxed);
+    if (!KcpOverUdp() || udp_sock_ == INVALID_SOCKET) {
+        return SendTCPBuf(cmd, body, head_len + msg_len);
+    }
+    const int udp_head_len = UdpHeadLen();
+    PutUdpHead(body - udp_head_len, cmd);
+    return UdpWrite(body - udp_head_len, udp_head_len + head_len + msg_len);
+}
+
+int ConnClientPrivate::SendKCPBuf(const char* msg_buf, int msg_len, int channel, bool critical)
+{
+    const IKCPVEC vec = {msg_buf, msg_len};
+    return SendKCPBufV(&vec, 1, msg_len, channel, critical);
+}
+
+// vec的片段按顺序组成一条消息, msg_len为总长
+int ConnClientPrivate::SendKCPBufV(const IKCPVEC* vec, int nvec, int msg_len, int channel,
+                                   bool critical)
 {
     if (msg_len <= 0) return 0;
     if (conn_state_ < CS_LOGIC_CONNECTED) return -1;
-    const int ret = kcp_session_.Send(msg_buf, msg_len, TimeAPI::GetTimeMs());
+    KcpSession* session = GetKcpChannel(channel);
+    const int index = (int)(session - kcp_sessions_);
+    const int64_t now_ms = TimeAPI::GetTimeMs();
+    BeginKcpPack();
+    int ret = 0;
+    if (kcp_batch_ && coalesce_delay_ms_ > 0 && !critical && msg_len <= coalesce_max_len_) {
+        ret = CoalesceMsg(index, vec, nvec, msg_len, now_ms);
+    } else {
+        // 先发本通道攒着的小消息, 保持通道内顺序
+        ret = FlushCoalesce(index, now_ms);
+        if (ret != 0) {
+        } else if (kcp_compress_ || kcp_batch_) {
+            ret = SendKCPCompressed(session, vec, nvec, msg_len, now_ms, critical);
+        } else {
+            ret = session->SendV(vec, nvec, now_ms, critical);
+        }
+    }
+    EndKcpPack();
     if (ret != 0) {
         LOG_ERROR("kcp_session_.Send ret[" << ret << "]");
         return -1;
@@ -492,22 +1058,259 @@ int ConnClientPrivate::SendKCPBuf(const char* msg_buf, int msg_len)
     return 0;
 }
 
+// 协商了压缩或批量后上行消息带控制byte, 协商了压缩时达到阈值且压缩后更小的消息压缩发送
+int ConnClientPrivate::SendKCPCompressed(KcpSession* session, const IKCPVEC* vec, int nvec,
+                                         int msg_len, int64_t now_ms, bool critical)
+{
+    const char cmd = CONTROL_RELIABLE_MSG;
+    if (kcp_compress_ && compress_threshold_ > 0 && msg_len >= compress_threshold_) {
+        const int head_len = 1 + (int)sizeof(CompressedMsgHead);
+        const int buf_len = head_len + Lz4Block::Bound(msg_len);
+        char* buf = BufPool::Alloc(buf_len);
+        // 多个片段先拼到一起再压缩
+        char* joined = nullptr;
+        const char* msg_buf = vec[0].base;
+        if (buf != nullptr && nvec > 1) {
+            joined = BufPool::Alloc(msg_len);
+            if (joined == nullptr) {
+                BufPool::Free(buf);
+                buf = nullptr;
+            } else {
+                int off = 0;
+                for (int i = 0; i < nvec; ++i) {
+                    if (vec[i].len > 0) memcpy(joined + off, vec[i].base, vec[i].len);
+                    off += vec[i].len;
+                }
+                msg_buf = joined;
+            }
+        }
+        if (buf != nullptr) {
+            const int zip_len =
+                Lz4Block::Compress(msg_buf, msg_len, buf + head_len, buf_len - head_len);
+            if (zip_len > 0 && head_len + zip_len < 1 + msg_len) {
+                buf[0] = (char)(cmd | CONTROL_FLAG_COMPRESSED);
+                ((CompressedMsgHead*)(buf + 1))->raw_len = (uint32_t)msg_len;
+                const IKCPVEC zip_vec = {buf, head_len + zip_len};
+                const int ret = session->SendV(&zip_vec, 1, now_ms, critical);
+                BufPool::Free(buf);
+                if (joined != nullptr) BufPool::Free(joined);
+                if (ret == 0) {
+                    send_zip_msgs_.fetch_add(1, std::memory_order_relaxed);
+                    send_raw_bytes_.fetch_add(msg_len, std::memory_order_relaxed);
+                    send_zip_bytes_.fetch_add(head_len + zip_len, std::memory_order_relaxed);
+                }
+                return ret;
+            }
+            BufPool::Free(buf);
+            if (joined != nullptr) BufPool::Free(joined);
+        }
+    }
+    // 控制byte作为第一个片段
+    IKCPVEC stack_vec[send_stack_vecs + 1];
+    std::vector<IKCPVEC> heap_vec;
+    IKCPVEC* all = stack_vec;
+    if (nvec > send_stack_vecs) {
+        heap_vec.resize(nvec + 1);
+        all = heap_vec.data();
+    }
+    all[0] = {&cmd, 1};
+    for (int i = 0; i < nvec; ++i) all[i + 1] = vec[i];
+    return session->SendV(all, nvec + 1, now_ms, critical);
+}
+
+// 攒进本通道的批量消息, 放不下时先把已攒的发出去; 剩下的空间放不下同样大小的下一条时立即发
+int ConnClientPrivate::CoalesceMsg(int channel, const IKCPVEC* vec, int nvec, int msg_len,
+                                   int64_t now_ms)
+{
+    Coalesce& co = coalesce_[channel];
+    const int mss = (int)kcp_sessions_[channel].Mss();
+    char len_buf[batch_len_max_bytes];
+    const int entry_len = BatchPutLen(len_buf, (uint32_t)msg_len) + msg_len;
+    if (co.count > 0 && (int)co.buf.size() + entry_len > mss) {
+        const int ret = FlushCoalesce(channel, now_ms);
+        if (ret != 0) return ret;
+    }
+    if (co.count == 0) {
+        co.buf.assign(1, (char)((int)CONTROL_RELIABLE_MSG | (int)CONTROL_FLAG_BATCH));
+        co.deadline_ms = now_ms + coalesce_delay_ms_;
+    }
+    co.buf.append(len_buf, entry_len - msg_len);
+    for (int i = 0; i < nvec; ++i) {
+        if (vec[i].len > 0) co.buf.append(vec[i].base, vec[i].len);
+    }
+    co.count++;
+    if ((int)co.buf.size() + entry_len > mss) return FlushCoalesce(channel, now_ms);
+    return 0;
+}
+
+// 只有一条时按普通消息发, 省掉长度
+int ConnClientPrivate::FlushCoalesce(int channel, int64_t now_ms)
+{
+    Coalesce& co = coalesce_[channel];
+    if (co.count == 0) return 0;
+    KcpSession& session = kcp_sessions_[channel];
+    int ret = 0;
+    if (co.count == 1) {
+        uint32_t len = 0;
+        const int n = BatchGetLen(co.buf.data() + 1, (int)co.buf.size() - 1, &len);
+        co.buf[n] = (char)CONTROL_RELIABLE_MSG;
+        ret = session.Send(co.buf.data() + n, (int)co.buf.size() - n, now_ms);
+    } else {
+        ret = session.Send(co.buf.data(), (int)co.buf.size(), now_ms);
+        coalesce_msgs_.fetch_add(co.count, std::memory_order_relaxed);
+        coalesce_batches_.fetch_add(1, std::memory_order_relaxed);
+    }
+    co.buf.clear();
+    co.count = 0;
+    return ret;
+}
+
+// 发出到期的批量消息, all为帧末全部发出
+void ConnClientPrivate::CheckCoalesce(int64_t now_ms, bool all)
+{
+    if (!kcp_batch_ || conn_state_ < CS_LOGIC_CONNECTED) return;
+    BeginKcpPack();
+    for (int i = 0; i < kcp_max_channels; ++i) {
+        const Coalesce& co = coalesce_[i];
+        if (co.count > 0 && (all || now_ms >= co.deadline_ms)) FlushCoalesce(i, now_ms);
+    }
+    EndKcpPack();
+}
+
+// 网络线程poll的等待时间, 有攒着的消息时不晚于最早的期限醒来
+int ConnClientPrivate::NetWaitMs(int64_t now_ms) const
+{
+    int64_t wait_ms = 10;
+    for (const auto& co : coalesce_) {
+        if (co.count > 0) wait_ms = std::min(wait_ms, std::max<int64_t>(co.deadline_ms - now_ms, 0));
+    }
+    return (int)wait_ms;
+}
+
+// 拆开批量消息逐条交给上层. 小消息不拷贝, 各自引用原消息里的一段, 原消息在最后一条释放后释放.
+// 格式错误时一条也不交付, 返回false
+bool ConnClientPrivate::OutputBatch(KcpRecvMsg* msg)
+{
+    // 先校验格式并数出非空的小消息
+    int count = 0;
+    const char* p = msg->data + 1;
+    int left = msg->len - 1;
+    while (left > 0) {
+        uint32_t len = 0;
+        const int n = BatchGetLen(p, left, &len);
+        if (n < 0 || len > (uint32_t)(left - n)) {
+            KcpSession::FreeMsg(msg);
+            return false;
+        }
+        if (len > 0) count++;
+        p += n + len;
+        left -= n + (int)len;
+    }
+    if (count == 0 || output_cb_ == nullptr) {
+        KcpSession::FreeMsg(msg);
+        return true;
+    }
+
+    const int channel = msg->channel;
+    const char* batch = msg->data + 1;
+    const int batch_len = msg->len - 1;
+    KcpSharedMsg* shared = count > 1 ? KcpSession::ShareMsg(msg, count) : nullptr;
+    p = batch;
+    left = batch_len;
+    while (left > 0) {
+        uint32_t len = 0;
+        const int n = BatchGetLen(p, left, &len);
+        p += n;
+        left -= n;
+        if (len > 0) {
+            KcpRecvMsg one;
+            if (shared != nullptr) {
+                one.shared = shared;
+            } else {
+                // 只有一条时直接用原消息
+                one = *msg;
+                *msg = KcpRecvMsg();
+            }
+            one.data = p;
+            one.len = (int)len;
+            one.channel = channel;
+            OutputMsg(&one);
+        }
+        p += len;
+        left -= (int)len;
+    }
+    return true;
+}
+
+// 把压缩消息解压到池化缓冲, 替换msg, 数据损坏返回false
+bool ConnClientPrivate::DecompressMsg(KcpRecvMsg* msg)
+{
+    const int zip_len = msg->len - 1 - (int)sizeof(CompressedMsgHead);
+    if (zip_len <= 0) return false;
+    const uint32_t raw_len = ((const CompressedMsgHead*)(msg->data + 1))->raw_len;
+    if (raw_len > (uint32_t)max_pkg_size) return false;
+    KcpRecvMsg raw;
+    raw.buf = BufPool::Alloc((int)raw_len);
+    if (raw.buf == nullptr) return false;
+    if (Lz4Block::Decompress(msg->data + 1 + sizeof(CompressedMsgHead), zip_len, raw.buf,
+                             (int)raw_len) < 0) {
+        KcpSession::FreeMsg(&raw);
+        return false;
+    }
+    recv_zip_msgs_.fetch_add(1, std::memory_order_relaxed);
+    recv_zip_bytes_.fetch_add(msg->len, std::memory_order_relaxed);
+    recv_raw_bytes_.fetch_add(raw_len, std::memory_order_relaxed);
+    KcpSession::FreeMsg(msg);
+    raw.data = raw.buf;
+    raw.len = (int)raw_len;
+    *msg = raw;
+    return true;
+}
+
+void ConnClientPrivate::GetCompressStats(ConnCompressStats* stats) const
+{
+    stats->send_msgs = send_zip_msgs_.load(std::memory_order_relaxed);
+    stats->send_raw_bytes = send_raw_bytes_.load(std::memory_order_relaxed);
+    stats->send_zip_bytes = send_zip_bytes_.load(std::memory_order_relaxed);
+    stats->recv_msgs = recv_zip_msgs_.load(std::memory_order_relaxed);
+    stats->recv_zip_bytes = recv_zip_bytes_.load(std::memory_order_relaxed);
+    stats->recv_raw_bytes = recv_raw_bytes_.load(std::memory_order_relaxed);
+}
+
+void ConnClientPrivate::GetUnreliableStats(ConnUnreliableStats* stats) const
+{
+    stats->send_msgs = unreliable_send_msgs_.load(std::memory_order_relaxed);
+    stats->recv_msgs = unreliable_recv_msgs_.load(std::memory_order_relaxed);
+    stats->stale_drops = unreliable_stale_drops_.load(std::memory_order_relaxed);
+}
+
+void ConnClientPrivate::GetFecStats(ConnFecStats* stats) const
+{
+    stats->send_data_shards = fec_send_data_.load(std::memory_order_relaxed);
+    stats->send_parity_shards = fec_send_parity_.load(std::memory_order_relaxed);
+    stats->recv_recovered = fec_recovered_.load(std::memory_order_relaxed);
+}
+
+void ConnClientPrivate::GetMultipathStats(ConnMultipathStats* stats) const
+{
+    stats->copy_pkgs = multipath_copy_pkgs_.load(std::memory_order_relaxed);
+    stats->copy_bytes = multipath_copy_bytes_.load(std::memory_order_relaxed);
+    stats->budget_drops = multipath_budget_drops_.load(std::memory_order_relaxed);
+}
+
 int ConnClientPrivate::SendTCPBuf(uint8_t cmd, const char* msg_buf, int msg_len)
 {
     if (msg_len < 0) return -1;
-    const int total_len = cs_conn_head_size + msg_len;
+    const int head_len = TcpHeadLen(msg_len);
+    const int total_len = head_len + msg_len;
     if (write_stream_.EnsureWritable(total_len) != 0) {
         LOG_ERROR("flow[" << flow_ << "] EnsureWritable failed total_len=" << total_len);
         InnerClose(CLIENT_CONNECT_ERROR);
         return -1;
     }
-    auto* head = (CsConnHead*)write_stream_.End();
-    head->sec_pkg_len = htonl(total_len);
-    head->flow = flow_;
-    head->magic = magic_;
-    head->cmd = cmd;
+    PutTcpHead(write_stream_.End(), cmd, msg_len);
     if (msg_buf != nullptr && msg_len > 0) {
-        memcpy(write_stream_.End() + cs_conn_head_size, msg_buf, msg_len);
+        memcpy(write_stream_.End() + head_len, msg_buf, msg_len);
     }
     write_stream_.AddSize(total_len);
     OnTcpWrite();
@@ -522,40 +1325,90 @@ int ConnClientPrivate::SendUDPBuf(uint8_t cmd, const char* msg_buf, int msg_len)
         LOG_ERROR("SendUDPBuf msg_len[" << msg_len << "] illegal");
         return -1;
     }
-    const int len = cs_udp_conn_head_size + msg_len;
-    static char pkg_buf[max_udp_pkg_len];
-    auto* head = (CsUdpConnHead*)pkg_buf;
-    head->flow = flow_;
-    head->magic = magic_;
-    head->cmd = cmd;
+    const int head_len = UdpHeadLen();
+    char* pkg_buf = udp_send_buf_;
+    PutUdpHead(pkg_buf, cmd);
     if (msg_buf != nullptr && msg_len > 0) {
-        memcpy((char*)pkg_buf + cs_udp_conn_head_size, msg_buf, msg_len);
+        memcpy(pkg_buf + head_len, msg_buf, msg_len);
+    }
+    return UdpWrite(pkg_buf, head_len + msg_len);
+}
+
+// 包头长度随格式变化, 紧凑格式不比原格式长, 原地写在数据前面的调用方按原格式预留空间
+int ConnClientPrivate::UdpHeadLen() const
+{
+    if (!kcp_compact_) return cs_udp_conn_head_size;
+    char buf[varint_max_bytes];
+    return 1 + VarintPut(buf, (uint32_t)flow_);
+}
+
+void ConnClientPrivate::PutUdpHead(char* pkg_buf, uint8_t cmd) const
+{
+    if (!kcp_compact_) {
+        auto* head = (CsUdpConnHead*)pkg_buf;
+        head->flow = flow_;
+        head->magic = magic_;
+        head->cmd = cmd;
+        return;
     }
-    return UdpWrite(pkg_buf, len);
+    pkg_buf[0] = (char)CompactMagicCmd(magic_, cmd);
+    VarintPut(pkg_buf + 1, (uint32_t)flow_);
 }
 
-int ConnClientPrivate::UdpWrite(const char* pkg_buf, int len)
+int ConnClientPrivate::TcpHeadLen(int msg_len) const
 {
+    if (!kcp_compact_) return cs_conn_head_size;
+    char buf[varint_max_bytes];
+    return 1 + VarintPut(buf, (uint32_t)msg_len);
+}
+
+void ConnClientPrivate::PutTcpHead(char* pkg_buf, uint8_t cmd, int msg_len) const
+{
+    if (!kcp_compact_) {
+        auto* head = (CsConnHead*)pkg_buf;
+        head->sec_pkg_len = htonl(cs_conn_head_size + msg_len);
+        head->flow = flow_;
+        head->magic = magic_;
+        head->cmd = cmd;
+        return;
+    }
+    pkg_buf[0] = (char)CompactMagicCmd(magic_, cmd);
+    VarintPut(pkg_buf + 1, (uint32_t)msg_len);
+}
+
+// 协商了校验和时原地追加在末尾, pkg_buf后面要有udp_crc_size字节可写. KCP输出buffer是mtu的3倍,
+// 打包和udp_send_buf_都多留了这么多
+int ConnClientPrivate::UdpWrite(char* pkg_buf, int len, bool crc)
+{
+    if (crc && udp_crc_) len = UdpCrcAppend(pkg_buf, len);
     const int send_len = SocketAPI::send_ex(udp_sock_, pkg_buf, len, 0);
     if (send_len <= 0) {
         const int err = SocketAPI::get_last_error();
         if (err != EWOULDBLOCK && err != EINTR) {
             LOG_ERROR("udp send errno[" << err << "] errstr[" << strerror(err) << "] send_len["
                                         << send_len << "] pkg_len[" << len << "]");
-            InnerClose(CLIENT_CONNECT_ERROR);
+            OnUdpError();
             return -1;
         }
     }
     if (send_len != len) {
         LOG_ERROR("udp send busy, disconnect! send_len = " << send_len << ", pkg_len = " << len);
-        InnerClose(CLIENT_CONNECT_ERROR);
+        OnUdpError();
         return -1;
     }
     return send_len;
 }
 
+// 能切到TCP时UDP出错不断开连接, ping没有回应, 由路径评估切走
+void ConnClientPrivate::OnUdpError()
+{
+    if (kcp_path_switch_ && path_monitor_.Enabled()) return;
+    InnerClose(CLIENT_CONNECT_ERROR);
+}
+
 void ConnClientPrivate::NotifyWorker()
 {
+    if (inline_mode_) return;
 #ifndef OS_WIN32
     const int wfd = pipe_sock_[1];
     if (wfd > 0) {
@@ -564,36 +1417,127 @@ void ConnClientPrivate::NotifyWorker()
 #endif
 }
 
+// 回调参数为脚本实例, 连接, 之后依次是: data不为nullptr时的字符串(消息或日志), channel大于0时的
+// 通道号(非默认通道的消息), value不小于0时的数值(断开原因, 重连次数, 传输方式)
 void ConnClientPrivate::CallLuaCallback(void* user, LuaCallback callback, const char* data,
-                                        int data_len, const char* text, int text_len)
+                                        int data_len, int channel, int value)
 {
-    if (!dmScript::IsCallbackValid(callback)) return;
+#ifdef CONNCLIENT_HEADLESS
+    if (callback == nullptr || !callback->fun) return;
+    callback->fun(user, data, data_len, channel, value);
+#else
+    lua_State* L = SetupConnCallback(callback, user);
+    if (L == nullptr) return;
 
-    lua_State* L = dmScript::GetCallbackLuaContext(callback);
-    DM_LUA_STACK_CHECK(L, 0)
+    int nargs = 2;
+    if (data != nullptr) {
+        lua_pushlstring(L, data, data_len);
+        nargs++;
+    }
+    if (channel > 0) {
+        lua_pushnumber(L, channel);
+        nargs++;
+    }
+    if (value >= 0) {
+        lua_pushnumber(L, value);
+        nargs++;
+    }
 
-    if (!dmScript::SetupCallback(callback)) {
-        dmLogError("Failed to setup callback");
+    dmScript::PCall(L, nargs, 0);
+    TeardownConnCallback(L);
+#endif
+}
+
+// 消息交给回调时换成dmBuffer, 参数与CallLuaCallback的output一致.
+// dmBuffer只能由dmBuffer::Create分配, 不能引用KCP收包的内存, 这里仍要复制一次(与lua_pushlstring
+// 相同), 省掉的是Lua字符串的哈希和驻留, 脚本可以直接把buffer交给其他接受buffer的API.
+// buffer归C所有, 回调返回后收回复用, 省掉每条消息的Create/Destroy; 脚本要留着就自己复制一份
+void ConnClientPrivate::CallLuaOutputBuffer(void* user, LuaCallback callback, const char* data,
+                                            int data_len, int channel)
+{
+#ifdef CONNCLIENT_HEADLESS
+    CallLuaCallback(user, callback, data, data_len, channel, -1);
+#else
+    // dmBuffer不能是0个元素, 空消息照旧
+    if (data_len <= 0) {
+        CallLuaCallback(user, callback, data, data_len, channel, -1);
+        return;
+    }
+    if (callback == nullptr) return;
+
+    dmBuffer::HBuffer buffer = AcquireOutputBuffer((uint32_t)data_len);
+    if (buffer == 0) return;
+    void* bytes = nullptr;
+    uint32_t size = 0;
+    dmBuffer::GetBytes(buffer, &bytes, &size);
+    memcpy(bytes, data, data_len);
+
+    lua_State* L = SetupConnCallback(callback, user);
+    if (L == nullptr) {
+        RecycleOutputBuffer(buffer);
         return;
     }
 
-    lua_pushlightuserdata(L, user);
-    int nargs = 1;
-    if (data != nullptr && data_len > 0) {
-        lua_pushlstring(L, data, data_len);
-        nargs++;
-    } else if (text != nullptr && text_len > 0) {
-        lua_pushlstring(L, text, text_len);
-        nargs++;
-    } else if (text_len > 0) {
-        lua_pushnumber(L, text_len - 1);
+    dmScript::LuaHBuffer lua_buffer(buffer, dmScript::OWNER_C);
+    dmScript::PushBuffer(L, lua_buffer);
+    int nargs = 3;
+    if (channel > 0) {
+        lua_pushnumber(L, channel);
         nargs++;
     }
 
-    dmScript::PCall(L, nargs + 1, 0);
-    dmScript::TeardownCallback(callback);
+    dmScript::PCall(L, nargs, 0);
+    TeardownConnCallback(L);
+    RecycleOutputBuffer(buffer);
+#endif
+}
+
+#ifndef CONNCLIENT_HEADLESS
+// 取一个正好size字节的dmBuffer, 长度是脚本可见的, 只能复用同样长度的
+dmBuffer::HBuffer ConnClientPrivate::AcquireOutputBuffer(uint32_t size)
+{
+    for (size_t i = output_buffer_pool_.size(); i-- > 0;) {
+        dmBuffer::HBuffer buffer = output_buffer_pool_[i];
+        void* bytes = nullptr;
+        uint32_t buffer_size = 0;
+        dmBuffer::GetBytes(buffer, &bytes, &buffer_size);
+        if (buffer_size == size) {
+            output_buffer_pool_.erase(output_buffer_pool_.begin() + i);
+            return buffer;
+        }
+    }
+    static const dmhash_t stream_name = dmHashString64("data");
+    dmBuffer::StreamDeclaration decl = {};
+    decl.m_Name = stream_name;
+    decl.m_Type = dmBuffer::VALUE_TYPE_UINT8;
+    decl.m_Count = 1;
+    dmBuffer::HBuffer buffer = 0;
+    if (dmBuffer::Create(size, &decl, 1, &buffer) != dmBuffer::RESULT_OK) {
+        dmLogError("Failed to create output buffer, len=%u", size);
+        return 0;
+    }
+    return buffer;
+}
+
+// 放回池子, 满了丢掉最久没用的
+void ConnClientPrivate::RecycleOutputBuffer(dmBuffer::HBuffer buffer)
+{
+    if ((int)output_buffer_pool_.size() >= output_buffer_pool_max) {
+        dmBuffer::Destroy(output_buffer_pool_.front());
+        output_buffer_pool_.erase(output_buffer_pool_.begin());
+    }
+    output_buffer_pool_.push_back(buffer);
 }
 
+void ConnClientPrivate::ReleaseOutputBuffers()
+{
+    for (dmBuffer::HBuffer buffer : output_buffer_pool_) {
+        dmBuffer::Destroy(buffer);
+    }
+    output_buffer_pool_.clear();
+}
+#endif
+
 void ConnClientPrivate::ConnectSuccess()
 {
     SetConnState(CS_LOGIC_CONNECTED);
@@ -601,11 +1545,11 @@ void ConnClientPrivate::ConnectSuccess()
     tcp_ping_expire_.Reset(now_ms);
     SendTcpPing(now_ms, true);
     if (connect_success_cb_ != nullptr) {
-        out_queue_.enqueue([this]() {
+        PostCtrlEvent([this]() {
             if (connect_success_cb_ != nullptr) {
-                CallLuaCallback(user_data_, connect_success_cb_, nullptr, 0, nullptr, 0);
+                CallLuaCallback(user_data_, connect_success_cb_, nullptr, 0, 0, -1);
             }
-        });
+        }, true);
     }
 }
 
@@ -616,11 +1560,11 @@ void ConnClientPrivate::ReConnectSuccess()
     tcp_ping_expire_.Reset(now_ms);
     SendTcpPing(now_ms, true);
     if (reconnect_success_cb_ != nullptr) {
-        out_queue_.enqueue([this]() {
+        PostCtrlEvent([this]() {
             if (reconnect_success_cb_ != nullptr) {
-                CallLuaCallback(user_data_, reconnect_success_cb_, nullptr, 0, nullptr, 0);
+                CallLuaCallback(user_data_, reconnect_success_cb_, nullptr, 0, 0, -1);
             }
-        });
+        }, true);
     }
 }
 
@@ -628,14 +1572,44 @@ void ConnClientPrivate::ReConnectSuccess()
 void ConnClientPrivate::Output(const char* data, int len, int64_t cur_time)
 {
     if (output_cb_ != nullptr) {
-        std::string data_str(data, len);
-        out_queue_.enqueue([this, data_str = std::move(data_str)]() {
-            if (output_cb_ != nullptr) {
-                CallLuaCallback(user_data_, output_cb_, data_str.c_str(), data_str.size(), nullptr,
-                                0);
-            }
-        });
+        KcpRecvMsg msg;
+        msg.buf = BufPool::Alloc(len);
+        if (msg.buf == nullptr) return;
+        memcpy(msg.buf, data, len);
+        msg.data = msg.buf;
+        msg.len = len;
+        OutputMsg(&msg);
+    }
+}
+
+// 每个stream只把比已收到的更新的消息交给上层
+void ConnClientPrivate::OutputUnreliableSeq(const char* data, int len, int64_t cur_time)
+{
+    if (len <= (int)sizeof(UnreliableMsgHead)) return;
+    const auto* head = (const UnreliableMsgHead*)data;
+    if (head->stream >= unreliable_max_streams) return;
+    const uint32_t bit = 1u << head->stream;
+    const uint16_t seq = head->seq;
+    if ((unreliable_recv_valid_ & bit) != 0 &&
+        !UnreliableSeqNewer(seq, unreliable_recv_seq_[head->stream])) {
+        unreliable_stale_drops_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    unreliable_recv_valid_ |= bit;
+    unreliable_recv_seq_[head->stream] = seq;
+    unreliable_recv_msgs_.fetch_add(1, std::memory_order_relaxed);
+    Output(data + sizeof(UnreliableMsgHead), len - (int)sizeof(UnreliableMsgHead), cur_time);
+}
+
+// 接管msg, 在Update()中回调后释放
+void ConnClientPrivate::OutputMsg(KcpRecvMsg* msg)
+{
+    if (output_cb_ == nullptr) {
+        KcpSession::FreeMsg(msg);
+        return;
     }
+    out_queue_.enqueue(OutEvent{nullptr, *msg, out_epoch_});
+    *msg = KcpRecvMsg();
 }
 
 void ConnClientPrivate::OnTcpRead(int64_t cur_time)
@@ -658,38 +1632,93 @@ void ConnClientPrivate::OnUdpRead(int64_t cur_time)
 {
     if (udp_sock_ == INVALID_SOCKET) return;
 
-    static char pkg_buf[max_udp_pkg_len];
+    // 收到的KCP数据直接留在datagram缓冲里, 由segment引用到被取走
+    KcpDgram* dgram = KcpDgram::New(udp_dgram_capacity);
+    if (dgram == nullptr) return;
+    char* pkg_buf = dgram->Data();
     struct sockaddr server_addr;
     uint32_t server_addr_len = sizeof(server_addr);
-    int pkg_len = SocketAPI::recvfrom_ex(udp_sock_, pkg_buf, max_udp_pkg_len, 0, &server_addr,
+    int pkg_len = SocketAPI::recvfrom_ex(udp_sock_, pkg_buf, dgram->Capacity(), 0, &server_addr,
                                          &server_addr_len);
-    if (pkg_len >= cs_udp_conn_head_size) {
-        auto* head = (CsUdpConnHead*)pkg_buf;
-        const int flow = head->flow;
+    if (pkg_len <= 0 || CheckUdpCrc(pkg_buf, &pkg_len)) OnUdpPkg(dgram, pkg_len, cur_time);
+    dgram->Release();
+}
+
+// 校验得上的去掉末尾校验和; 服务器确认前校验不上的按不带校验和处理(切换前发出的包),
+// flow 0的ping不带校验和. 出错的datagram在这里丢掉, 不会让KCP解析出错断开连接
+bool ConnClientPrivate::CheckUdpCrc(const char* pkg_buf, int* pkg_len)
+{
+    if (!udp_crc_) return true;
+    const int body_len = UdpCrcStrip(pkg_buf, *pkg_len);
+    if (body_len >= 0) {
+        udp_crc_verified_.fetch_add(1, std::memory_order_relaxed);
+        *pkg_len = body_len;
+        return true;
+    }
+    if (!udp_crc_in_) return true;
+    if (*pkg_len == sizeof(int) + sizeof(int64_t) && ((const CsUdpConnHead*)pkg_buf)->flow == 0) {
+        return true;
+    }
+    udp_crc_drops_.fetch_add(1, std::memory_order_relaxed);
+    LOG_DEBUG("flow[" << flow_ << "] udp checksum mismatch, len = " << *pkg_len);
+    return false;
+}
+
+void ConnClientPrivate::OnUdpPkg(KcpDgram* dgram, int pkg_len, int64_t cur_time)
+{
+    char* pkg_buf = dgram->Data();
+    if (pkg_len >= 1) {
+        const int flow = pkg_len >= cs_udp_conn_head_size ? ((CsUdpConnHead*)pkg_buf)->flow : -1;
+        // ping回的是本端发出的时间; magic低3位为0时紧凑格式的可靠消息也可能以4个0开头, 再核对时间
         if (pkg_len == sizeof(int) + sizeof(int64_t) && flow == 0) {
-            HandleUDPRoutePing(cur_time, pkg_buf);
-        } else {
-            if (flow != flow_) {
-                LOG_ERROR("proto flow[" << flow << "] != flow[" << flow_ << "]");
+            int64_t ack_time_ms = 0;
+            memcpy(&ack_time_ms, pkg_buf + sizeof(int), sizeof(ack_time_ms));
+            if (!kcp_compact_ || (ack_time_ms <= cur_time && cur_time - ack_time_ms < 60000)) {
+                HandleUDPRoutePing(cur_time, pkg_buf);
                 return;
             }
-            char* msg_buf = (char*)pkg_buf + cs_udp_conn_head_size;
-            const int msg_len = pkg_len - cs_udp_conn_head_size;
-
-            if (head->cmd == CONTROL_UNRELIABLE_MSG) {
-                Output(msg_buf, msg_len, cur_time);
-            } else if (head->cmd == CONTROL_RELIABLE_MSG) {
-                InputToKcp(msg_buf, msg_len, cur_time);
-            } else if (head->cmd == CONTROL_DISCONNECT) {
-                InnerClose(CONTROL_SERVER_CLOSE);
-            }
+        }
+        // 切换前后在途的包两种格式都有, 按包头各自识别; 服务器确认后过了排空期只认紧凑格式
+        const bool legacy_ok = !tcp_compact_in_ || cur_time < compact_legacy_until_ms_;
+        int head_len = 0;
+        uint8_t cmd = 0;
+        bool compact = false;
+        // magic只用来区分两种格式, 没协商紧凑格式时和原来一样只核对flow
+        if (legacy_ok && flow == flow_ &&
+            (!kcp_compact_ || ((CsUdpConnHead*)pkg_buf)->magic == (uint8_t)magic_)) {
+            head_len = cs_udp_conn_head_size;
+            cmd = ((CsUdpConnHead*)pkg_buf)->cmd;
+        } else if (kcp_compact_ && CompactMagicMatch(magic_, (uint8_t)pkg_buf[0])) {
+            head_len = 1;
+            cmd = (uint8_t)pkg_buf[0] & 0x1F;
+            compact = true;
+        } else {
+            LOG_ERROR("proto flow[" << flow << "] != flow[" << flow_ << "]");
+            return;
+        }
+        char* msg_buf = pkg_buf + head_len;
+        const int msg_len = pkg_len - head_len;
+
+        if (cmd == CONTROL_UNRELIABLE_MSG) {
+            Output(msg_buf, msg_len, cur_time);
+        } else if (cmd == CONTROL_UNRELIABLE_SEQ_MSG) {
+            OutputUnreliableSeq(msg_buf, msg_len, cur_time);
+        } else if (cmd == CONTROL_RELIABLE_MSG) {
+            InputToKcp(msg_buf, msg_len, cur_time, dgram, compact);
+        } else if (cmd == CONTROL_FEC_MSG) {
+            InputFec(msg_buf, msg_len, cur_time, dgram, compact);
+        } else if (cmd == CONTROL_MTU_PROBE && msg_len >= (int)sizeof(ControlMtuProbe)) {
+            mtu_prober_.OnProbeAck(((const ControlMtuProbe*)msg_buf)->id);
+            ApplyMtu();
+        } else if (cmd == CONTROL_DISCONNECT) {
+            InnerClose(CONTROL_SERVER_CLOSE);
         }
     } else if (pkg_len == -1) {
         const int err = SocketAPI::get_last_error();
         if (err != EWOULDBLOCK && err != EINTR) {
             LOG_ERROR("udp sock[" << udp_sock_ << "] errno[" << err << "] errstr[" << strerror(err)
                                   << "]");
-            InnerClose(CLIENT_CONNECT_ERROR);
+            OnUdpError();
             return;
         }
     }
@@ -702,6 +1731,7 @@ int ConnClientPrivate::HandleUDPRoutePing(int64_t cur_time, char* pkg)
     const int64_t ack_time_ms = *(int64_t*)p;
     const int64_t rtt = cur_time - ack_time_ms;
     LOG_DEBUG("CONTROL_PING:recv udp internet ping rtt[" << rtt << "]");
+    path_monitor_.OnUdpPingAck(ack_time_ms, cur_time);
     return 0;
 }
 
@@ -709,17 +1739,37 @@ void ConnClientPrivate::ReadStream(int64_t cur_time)
 {
     while (true) {
         const int stream_len = read_stream_.Len();
-        if (stream_len < cs_conn_head_size) return;
-        auto* head = (CsConnHead*)read_stream_.Buf();
-        flow_ = head->flow;
-        magic_ = head->magic;
-        const int pkg_len = ntohl(head->sec_pkg_len);
+        int head_len = cs_conn_head_size;
+        int pkg_len = 0;
+        uint8_t cmd = 0;
+        if (tcp_compact_in_) {
+            if (stream_len < 2) return;
+            const uint8_t magic_cmd = (uint8_t)read_stream_.Buf()[0];
+            uint32_t msg_len = 0;
+            const int n = VarintGet(read_stream_.Buf() + 1, stream_len - 1, &msg_len);
+            if (n < 0 && stream_len - 1 < varint_max_bytes) return;
+            if (n < 0 || !CompactMagicMatch(magic_, magic_cmd) || msg_len > (uint32_t)max_pkg_size) {
+                LOG_ERROR("flow[" << flow_ << "] bad compact tcp head");
+                InnerClose(CLIENT_CONNECT_ERROR);
+                return;
+            }
+            head_len = 1 + n;
+            pkg_len = head_len + (int)msg_len;
+            cmd = magic_cmd & 0x1F;
+        } else {
+            if (stream_len < cs_conn_head_size) return;
+            auto* head = (CsConnHead*)read_stream_.Buf();
+            flow_ = head->flow;
+            magic_ = head->magic;
+            pkg_len = ntohl(head->sec_pkg_len);
+            cmd = head->cmd;
+        }
         if (stream_len < pkg_len) return;
 
-        const char* data = read_stream_.Buf() + cs_conn_head_size;
-        const int data_len = pkg_len - cs_conn_head_size;
+        const char* data = read_stream_.Buf() + head_len;
+        const int data_len = pkg_len - head_len;
 
-        if (head->cmd == CONTROL_PING) {
+        if (cmd == CONTROL_PING) {
             if (data_len != (int)sizeof(CsPing)) {
                 LOG_ERROR("ping cmd error");
                 InnerClose(CLIENT_CONNECT_ERROR);
@@ -731,24 +1781,31 @@ void ConnClientPrivate::ReadStream(int64_t cur_time)
             }
             const int64_t ping_rtt = cur_time - ping->time;
             LOG_DEBUG("PING seq=" << ping_seq_ << " ping_rtt=" << ping_rtt);
+            path_monitor_.OnTcpPingAck(ping->time, cur_time);
 
             read_stream_.Skip(pkg_len);
             continue;
-        } else if (head->cmd == CONTROL_RELIABLE_MSG) {
-            InputToKcp(data, data_len, cur_time);
-        } else if (head->cmd == CONTROL_UNRELIABLE_MSG) {
+        } else if (cmd == CONTROL_RELIABLE_MSG) {
+            InputToKcp(data, data_len, cur_time, nullptr, tcp_compact_in_);
+        } else if (cmd == CONTROL_UNRELIABLE_MSG) {
             Output(data, data_len, cur_time);
-        } else if (head->cmd == CONTROL_KCP_INFO) {
-            if (data_len >= (int)sizeof(ControlKCPInfo) && kcp_session_.IsNull()) {
+        } else if (cmd == CONTROL_UNRELIABLE_SEQ_MSG) {
+            OutputUnreliableSeq(data, data_len, cur_time);
+        } else if (cmd == CONTROL_KCP_INFO) {
+            if (data_len >= (int)sizeof(ControlKCPInfo) && kcp_sessions_[0].IsNull()) {
                 const ControlKCPInfo* kcp_info = (ControlKCPInfo*)data;
                 LOG_DEBUG("CONTROL_KCP_INFO");
                 CreateKCP(kcp_info);
+                if (data_len >= (int)(sizeof(ControlKCPInfo) + sizeof(ControlKCPFeature))) {
+                    NegotiateKCPFeature(
+                        (const ControlKCPFeature*)(data + sizeof(ControlKCPInfo)));
+                }
             } else {
                 LOG_ERROR("KCP_INFO length error");
                 InnerClose(CLIENT_CONNECT_ERROR);
                 return;
             }
-        } else if (head->cmd == CONTROL_DISCONNECT) {
+        } else if (cmd == CONTROL_DISCONNECT) {
             if (data_len >= (int)sizeof(int)) {
                 const int control_disconnect_reason = *(int*)data;
                 if (control_disconnect_reason == CONTROL_SERVER_CLOSE) {
@@ -770,7 +1827,17 @@ void ConnClientPrivate::ReadStream(int64_t cur_time)
                 LOG_ERROR("FINI:UNKNOW_REASON, data_len=" << data_len);
                 InnerClose(CONTROL_SERVER_CLOSE);
             }
-        } else if (head->cmd == CONTROL_SYNC_LABEL) {
+        } else if (cmd == CONTROL_KCP_FEATURE) {
+            // 服务器确认下行已切换, 这一帧还是原格式, 之后的按紧凑格式解析
+            if (data_len >= (int)sizeof(ControlKCPFeature)) {
+                const uint32_t features = ((const ControlKCPFeature*)data)->features;
+                if (kcp_compact_ && (features & KCP_FEATURE_COMPACT) != 0) {
+                    tcp_compact_in_ = true;
+                    compact_legacy_until_ms_ = cur_time + compact_legacy_drain_ms;
+                }
+                if (udp_crc_ && (features & KCP_FEATURE_CRC32C) != 0) udp_crc_in_ = true;
+            }
+        } else if (cmd == CONTROL_SYNC_LABEL) {
             if (is_first_connect_) {
                 is_first_connect_ = false;
                 ConnectSuccess();
@@ -780,8 +1847,8 @@ void ConnClientPrivate::ReadStream(int64_t cur_time)
         }
 
         read_stream_.Skip(pkg_len);
-        LOG_DEBUG("CsConnHead pkg_len=" << pkg_len << ", flow=" << head->flow << ", magic="
-                                        << (int)head->magic << ", cmd=" << (int)head->cmd);
+        LOG_DEBUG("CsConnHead pkg_len=" << pkg_len << ", flow=" << flow_ << ", magic="
+                                        << (int)magic_ << ", cmd=" << (int)cmd);
     }
 }
 
@@ -812,25 +1879,146 @@ void ConnClientPrivate::OnTcpWrite()
 void ConnClientPrivate::SendTcpPing(int64_t now_ms, bool immediate)
 {
     if (conn_state_ >= CS_CONNECTED && (immediate || tcp_ping_expire_.TryExpire(now_ms))) {
+        // 路径评估时TCP ping不叠发, 没回的ping本身就说明TCP卡住了
+        if (path_monitor_.TcpPingPending()) return;
         CsPing ping;
         ping.time = now_ms;
         ping_seq_ = ping.time;
         SendTCPBuf(CONTROL_PING, (char*)&ping, (int)sizeof(ping));
+        path_monitor_.OnTcpPingSent(now_ms);
     }
 }
 
-void ConnClientPrivate::SendUdpPing(int64_t now_ms)
+void ConnClientPrivate::SendUdpPing(int64_t now_ms, bool immediate)
 {
     if (udp_sock_ == INVALID_SOCKET) return;
-    if (conn_state_ >= CS_CONNECTED && udp_ping_expire_.TryExpire(now_ms)) {
+    if (conn_state_ >= CS_CONNECTED && (immediate || udp_ping_expire_.TryExpire(now_ms))) {
         const size_t len = sizeof(int) + sizeof(int64_t);
         char buf[len];
         *(int*)buf = 0;
         *(int64_t*)(buf + sizeof(int)) = now_ms;
-        UdpWrite(buf, len);
+        UdpWrite(buf, len, false);
+        path_monitor_.OnUdpPingSent(now_ms);
+    }
+}
+
+// 每个探测间隔ping两条路径, 评估后需要时切换KCP数据的路径并通知服务器
+void ConnClientPrivate::CheckPath(int64_t now_ms)
+{
+    if (conn_state_ != CS_LOGIC_CONNECTED || !path_monitor_.TryProbe(now_ms)) return;
+    SendUdpPing(now_ms, true);
+    SendTcpPing(now_ms, true);
+    const KcpSession& kcp = kcp_sessions_[0];
+    path_monitor_.OnKcpCounters(kcp.SndNxt(), kcp.LostCount(), kcp.RecvSnEnd(), kcp.RecvSnGaps());
+    const bool switched = path_monitor_.Evaluate(now_ms);
+    {
+        std::lock_guard<std::mutex> lock(path_stats_mutex_);
+        path_stats_.transport = path_monitor_.OverTcp() ? CONN_TRANSPORT_TCP : CONN_TRANSPORT_UDP;
+        path_stats_.switches = path_monitor_.Switches();
+        path_stats_.udp_rtt_ms = path_monitor_.UdpRtt();
+        path_stats_.udp_loss = path_monitor_.UdpLoss();
+        path_stats_.udp_score = path_monitor_.UdpScore();
+        path_stats_.tcp_rtt_ms = path_monitor_.TcpRtt();
+        path_stats_.tcp_score = path_monitor_.TcpScore();
+    }
+    if (!switched) return;
+    kcp_over_tcp_ = path_monitor_.OverTcp();
+    ControlKCPPath path;
+    path.trans_type = kcp_over_tcp_ ? PKG_TRANS_TCP : PKG_TRANS_UDP;
+    SendTCPBuf(CONTROL_KCP_PATH, (const char*)&path, (int)sizeof(path));
+    LOG_INFO("flow[" << flow_ << "] kcp path switch to " << (kcp_over_tcp_ ? "tcp" : "udp")
+                     << " udp_score[" << path_monitor_.UdpScore() << "] tcp_score["
+                     << path_monitor_.TcpScore() << "]");
+    if (transport_switch_cb_ != nullptr) {
+        const int transport = kcp_over_tcp_ ? CONN_TRANSPORT_TCP : CONN_TRANSPORT_UDP;
+        PostCtrlEvent([this, transport]() {
+            if (transport_switch_cb_ != nullptr) {
+                CallLuaCallback(user_data_, transport_switch_cb_, nullptr, 0, 0, transport);
+            }
+        }, false);
     }
 }
 
+// 只在KCP走UDP时探测; 确认的mtu变化后应用到所有通道
+void ConnClientPrivate::CheckMtu(int64_t now_ms)
+{
+    if (!kcp_mtu_probe_ || conn_state_ != CS_LOGIC_CONNECTED || !KcpOverUdp() ||
+        udp_sock_ == INVALID_SOCKET) {
+        return;
+    }
+    // 大消息常在其他通道, 各通道的超时丢包都算
+    uint32_t lost = 0;
+    for (const auto& session : kcp_sessions_) lost += session.LostCount();
+    if (lost != mtu_lost_seen_) {
+        mtu_lost_seen_ = lost;
+        mtu_prober_.OnLoss();
+    }
+    uint16_t id = 0;
+    const int mtu = mtu_prober_.NextProbe(now_ms, kcp_sessions_[0].RxSrtt() * 2, &id);
+    if (mtu > 0) SendMtuProbe(id, mtu);
+    ApplyMtu();
+}
+
+// 探测包只在发送时带DF, 平时的datagram允许路由器分片, 黑洞期间按旧mtu切好的segment还能送达.
+// 不走UdpWrite: 超过本机MTU被拒绝不算UDP出错
+void ConnClientPrivate::SendMtuProbe(uint16_t id, int mtu)
+{
+    const int head_len = UdpHeadLen();
+    const int crc_len = udp_crc_ ? udp_crc_size : 0;
+    const int len = head_len + (int)sizeof(FecHead) + mtu + crc_len;
+    PutUdpHead(udp_send_buf_, CONTROL_MTU_PROBE);
+    auto* probe = (ControlMtuProbe*)(udp_send_buf_ + head_len);
+    probe->id = id;
+    probe->mtu = (uint16_t)mtu;
+    const int pad_offset = head_len + (int)sizeof(ControlMtuProbe);
+    memset(udp_send_buf_ + pad_offset, 0, len - crc_len - pad_offset);
+    if (crc_len > 0) UdpCrcAppend(udp_send_buf_, len - crc_len);
+    SocketAPI::set_dont_fragment(udp_sock_, true);
+    const int send_len = SocketAPI::send_ex(udp_sock_, udp_send_buf_, len, 0);
+    const int err = SocketAPI::get_last_error();
+    SocketAPI::set_dont_fragment(udp_sock_, false);
+    mtu_probes_.fetch_add(1, std::memory_order_relaxed);
+    if (send_len < 0 && err == EMSGSIZE) mtu_prober_.OnProbeTooBig();
+}
+
+void ConnClientPrivate::ApplyMtu()
+{
+    const int mtu = mtu_prober_.Mtu();
+    if (mtu == kcp_mtu_) return;
+    LOG_INFO("flow[" << flow_ << "] kcp mtu " << kcp_mtu_ << " -> " << mtu);
+    kcp_mtu_ = mtu;
+    for (auto& session : kcp_sessions_) {
+        if (!session.IsNull()) session.SetMtu(mtu);
+    }
+    mtu_cur_.store(mtu, std::memory_order_relaxed);
+    mtu_black_holes_.store(mtu_prober_.BlackHoles(), std::memory_order_relaxed);
+}
+
+void ConnClientPrivate::GetCoalesceStats(ConnCoalesceStats* stats) const
+{
+    stats->msgs = coalesce_msgs_.load(std::memory_order_relaxed);
+    stats->batches = coalesce_batches_.load(std::memory_order_relaxed);
+}
+
+void ConnClientPrivate::GetChecksumStats(ConnChecksumStats* stats) const
+{
+    stats->verified = udp_crc_verified_.load(std::memory_order_relaxed);
+    stats->drops = udp_crc_drops_.load(std::memory_order_relaxed);
+}
+
+void ConnClientPrivate::GetMtuStats(ConnMtuStats* stats) const
+{
+    stats->mtu = mtu_cur_.load(std::memory_order_relaxed);
+    stats->probes = mtu_probes_.load(std::memory_order_relaxed);
+    stats->black_holes = mtu_black_holes_.load(std::memory_order_relaxed);
+}
+
+void ConnClientPrivate::GetPathStats(ConnPathStats* stats) const
+{
+    std::lock_guard<std::mutex> lock(path_stats_mutex_);
+    *stats = path_stats_;
+}
+
 void ConnClientPrivate::SetConnState(int state)
 {
     conn_state_ = state;
@@ -865,44 +2053,120 @@ void ConnClientPrivate::CheckRelink(int64_t now_ms)
         relink_count_++;
         InnerConnect(ip_, port_, 0);
         if (relink_cb_ != nullptr) {
-            out_queue_.enqueue([this]() {
+            PostCtrlEvent([this]() {
                 if (relink_cb_ != nullptr) {
-                    CallLuaCallback(user_data_, relink_cb_, nullptr, 0, nullptr, relink_count_);
+                    // 第一次重连为0
+                    CallLuaCallback(user_data_, relink_cb_, nullptr, 0, 0, relink_count_ - 1);
                 }
-            });
+            }, true);
         }
     }
 }
 
-int ConnClientPrivate::InputToKcp(const char* msg_buf, int msg_len, int64_t cur_time)
+int ConnClientPrivate::InputToKcp(const char* msg_buf, int msg_len, int64_t cur_time,
+                                  KcpDgram* dgram, bool compact)
 {
-    if (!kcp_session_.IsNull()) {
-        const int ret = kcp_session_.Input(msg_buf, msg_len, cur_time);
+    if (kcp_sessions_[0].IsNull()) {
+        InnerClose(CLIENT_CONNECT_ERROR);
+        return -1;
+    }
+    // 多通道时datagram里可能混有各通道的segment, 按conv分段交给对应通道
+    int offset = 0;
+    while (offset < msg_len) {
+        int channel = 0;
+        int span = msg_len - offset;
+        if (compact) {
+            // 紧凑segment头里只有通道号
+            span = (int)pvp_ikcp_compact_span(msg_buf + offset, msg_len - offset, &channel);
+            if (span < 0 && offset > 0) break;
+            if (span <= 0 || channel >= kcp_max_channels || (channel != 0 && !kcp_channels_)) {
+                LOG_ERROR("flow[" << flow_ << "] kcp input bad compact segment");
+                InnerClose(CLIENT_CONNECT_ERROR);
+                return -1;
+            }
+        } else if (kcp_channels_) {
+            IUINT32 conv = 0;
+            span = (int)pvp_ikcp_conv_span(msg_buf + offset, msg_len - offset, &conv);
+            if (span < 0 && offset > 0) break;  // 末尾不足一个segment头, 同单通道时忽略
+            const uint32_t diff = conv ^ kcp_info_.kcp_conv;
+            channel = (int)(diff >> 24);
+            if (span <= 0 || (diff & 0x00FFFFFF) != 0 || channel >= kcp_max_channels) {
+                LOG_ERROR("flow[" << flow_ << "] kcp input bad conv = " << conv);
+                InnerClose(CLIENT_CONNECT_ERROR);
+                return -1;
+            }
+        }
+        KcpSession* session = GetKcpChannel(channel);
+        const int ret =
+            dgram != nullptr
+                ? session->InputDgram(dgram, msg_buf + offset, span, cur_time, compact)
+                : session->Input(msg_buf + offset, span, cur_time, compact);
         if (ret != 0) {
             LOG_ERROR("pvp_ikcp_input ERROR ret = " << ret << ", flow = " << flow_);
             InnerClose(CLIENT_CONNECT_ERROR);
             return -1;
         }
-        static char pkg[max_pkg_size];
-        int recv_len = 0;
-        while_s(true)
-        {
-            recv_len = kcp_session_.Recv(pkg, max_pkg_size);
-            if (recv_len <= 0) break;
-            // 第一个byte为控制byte
-            const char cmd = pkg[0];
-            if (cmd == CONTROL_DISCONNECT) {
-                LOG_DEBUG("FINI:SERVER_CLOSE");
-                InnerClose(CONTROL_SERVER_CLOSE);
-            } else if (recv_len > 1) {
-                Output(pkg + 1, recv_len - 1, cur_time);
-            }
+        offset += span;
+    }
+    // 高优先级通道的消息先交给上层
+    for (int i = 0; i < kcp_max_channels; ++i) {
+        if (RecvKcpMsgs(channel_order_[i]) != 0) return -1;
+    }
+    return 0;
+}
+
+// 取出一个通道里所有完整的消息, 连接因此关闭时返回-1
+int ConnClientPrivate::RecvKcpMsgs(int channel)
+{
+    KcpSession& session = kcp_sessions_[channel];
+    if (session.IsNull()) return 0;
+    int recv_len = 0;
+    while_s(true)
+    {
+        // 单segment消息直接引用segment, 多fragment消息拼接到池化缓冲, 之后不再拷贝
+        KcpRecvMsg msg;
+        recv_len = session.RecvMsg(&msg, max_pkg_size);
+        if (recv_len <= 0) {
+            KcpSession::FreeMsg(&msg);
+            break;
         }
-        if (recv_len == -3) {
-            LOG_ERROR("flow[" << flow_ << "] kcp_session Recv failed pkg_len > MAX_PKG_SIZE");
-            InnerClose(CLIENT_CONNECT_ERROR);
+        msg.channel = channel;
+        // 第一个byte为控制byte
+        const char cmd = msg.data[0];
+        if (cmd == CONTROL_DISCONNECT) {
+            KcpSession::FreeMsg(&msg);
+            LOG_DEBUG("FINI:SERVER_CLOSE");
+            InnerClose(CONTROL_SERVER_CLOSE);
+            return -1;
+        } else if (((uint8_t)cmd & CONTROL_FLAG_COMPRESSED) != 0) {
+            if (!DecompressMsg(&msg)) {
+                KcpSession::FreeMsg(&msg);
+                LOG_ERROR("flow[" << flow_ << "] decompress msg failed");
+                InnerClose(CLIENT_CONNECT_ERROR);
+                return -1;
+            }
+            msg.channel = channel;
+            if (msg.len > 0) {
+                OutputMsg(&msg);
+            } else {
+                KcpSession::FreeMsg(&msg);
+            }
+        } else if (((uint8_t)cmd & CONTROL_FLAG_BATCH) != 0) {
+            if (!OutputBatch(&msg)) {
+                LOG_ERROR("flow[" << flow_ << "] bad batch msg");
+                InnerClose(CLIENT_CONNECT_ERROR);
+                return -1;
+            }
+        } else if (recv_len > 1) {
+            msg.data += 1;
+            msg.len -= 1;
+            OutputMsg(&msg);
+        } else {
+            KcpSession::FreeMsg(&msg);
         }
-    } else {
+    }
+    if (recv_len == -3) {
+        LOG_ERROR("flow[" << flow_ << "] kcp_session Recv failed pkg_len > MAX_PKG_SIZE");
         InnerClose(CLIENT_CONNECT_ERROR);
         return -1;
     }
@@ -923,36 +2187,403 @@ void ConnClientPrivate::KcpLogFun(const char* log, struct IKCPCB* kcp)
 void ConnClientPrivate::CreateKCP(const ControlKCPInfo* kcp_info)
 {
     LOG_DEBUG("CreateKCP");
-    if (kcp_session_.CreateKCP(kcp_info, ConnClientPrivate::KCPOutput, (void*)this, StaticKcpLogFun,
-                               enable_kcp_log_) != 0) {
+    kcp_info_ = *kcp_info;
+    kcp_sack_ = false;
+    kcp_channels_ = false;
+    if (CreateKcpChannel(0) != 0) {
         LOG_ERROR("CreateKCP Failed");
         return;
     }
     enable_udp_ = kcp_info->enable_udp > 0;
-
-    kcp_session_.Update((uint32_t)TimeAPI::GetTimeMs());
+    kcp_compress_ = false;
+    kcp_batch_ = false;
+    kcp_compact_ = false;
+    tcp_compact_in_ = false;
+    udp_crc_ = false;
+    udp_crc_in_ = false;
+    for (auto& co : coalesce_) {
+        co.buf.clear();
+        co.count = 0;
+    }
+    // 新的KCP对应新的会话, 不可靠消息的seq从头开始
+    kcp_unreliable_seq_ = false;
+    memset(unreliable_send_seq_, 0, sizeof(unreliable_send_seq_));
+    unreliable_recv_valid_ = 0;
+    kcp_fec_ = false;
+    fec_encoder_.Init(0, 0);
+    fec_decoder_.Reset();
+    dup_trace_seen_ = 0;
+    {
+        std::lock_guard<std::mutex> lock(dup_trace_mutex_);
+        dup_trace_.clear();
+    }
+    kcp_path_switch_ = false;
+    kcp_over_tcp_ = false;
+    path_monitor_.Init(0, 0, 0);
+    kcp_multipath_ = false;
+    kcp_mtu_probe_ = false;
+    mtu_prober_.Init(0, 0, 0);
+    kcp_mtu_ = kcp_sessions_[0].Mtu();
+    mtu_cur_.store(kcp_mtu_, std::memory_order_relaxed);
     LOG_DEBUG("CreateKCP success! conv = " << kcp_info->kcp_conv);
 }
 
+// 按kcp_info_创建一个通道的KCP, 通道c的conv为KcpChannelConv(kcp_conv, c)
+int ConnClientPrivate::CreateKcpChannel(int channel)
+{
+    KcpSession& session = kcp_sessions_[channel];
+    ControlKCPInfo info = kcp_info_;
+    info.kcp_conv = KcpChannelConv(kcp_info_.kcp_conv, channel);
+    if (session.CreateKCP(&info, ConnClientPrivate::KCPOutput, (void*)this, StaticKcpLogFun,
+                          enable_kcp_log_) != 0) {
+        return -1;
+    }
+    session.SetAckDelay(kcp_ack_delay_ms_, kcp_ack_every_);
+    session.SetHeadroom(kcp_headroom);
+    session.SetSack(kcp_sack_);
+    session.SetCompact(kcp_compact_, channel);
+    if (congestion_ == CONN_CC_LOSS) {
+        session.SetCongestion(0);
+    } else if (congestion_ == CONN_CC_NONE) {
+        session.SetCongestion(1);
+    } else if (congestion_ == CONN_CC_BBR) {
+        session.SetCongestion(2);
+    }
+    if (dup_adaptive_count_ > 0 &&
+        session.SetDupAdaptive(dup_adaptive_count_, dup_adaptive_wait_ms_, dup_adaptive_loss_on_,
+                               dup_adaptive_loss_off_) != 0) {
+        LOG_ERROR("SetDupSendAdaptive(" << dup_adaptive_count_ << ", " << dup_adaptive_wait_ms_
+                                        << ", " << dup_adaptive_loss_on_ << ", "
+                                        << dup_adaptive_loss_off_ << ") illegal");
+    }
+    if (fec_encoder_.Enabled()) session.DisableDupSend();
+    if (kcp_mtu_probe_) session.SetMtu(kcp_mtu_);
+    if (kcp_channels_) ApplyChannelWeight(channel);
+    session.Update((uint32_t)TimeAPI::GetTimeMs());
+    return 0;
+}
+
+// 取一个通道, 没协商多通道时都落到通道0, 其他通道第一次用到时创建
+KcpSession* ConnClientPrivate::GetKcpChannel(int channel)
+{
+    if (!kcp_channels_ || channel <= 0 || channel >= kcp_max_channels) return &kcp_sessions_[0];
+    if (kcp_sessions_[channel].IsNull() && CreateKcpChannel(channel) != 0) {
+        LOG_ERROR("flow[" << flow_ << "] create kcp channel " << channel << " failed");
+        return &kcp_sessions_[0];
+    }
+    return &kcp_sessions_[channel];
+}
+
+void ConnClientPrivate::ApplyChannelWeight(int channel)
+{
+    const int weight = std::max(1, std::min(100, channel_weight_[channel]));
+    const uint32_t snd_wnd = std::max<uint32_t>(kcp_info_.snd_wnd * weight / 100, 8);
+    kcp_sessions_[channel].SetSndWnd(snd_wnd);
+}
+
+void ConnClientPrivate::SetKcpChannel(int channel, int priority, int weight)
+{
+    if (channel < 0 || channel >= kcp_max_channels) return;
+    in_queue_.enqueue([this, channel, priority, weight]() {
+        channel_priority_[channel] = priority;
+        channel_weight_[channel] = weight;
+        for (int i = 0; i < kcp_max_channels; ++i) channel_order_[i] = i;
+        std::stable_sort(channel_order_, channel_order_ + kcp_max_channels,
+                         [this](int l, int r) { return channel_priority_[l] < channel_priority_[r]; });
+        if (kcp_channels_ && !kcp_sessions_[channel].IsNull()) ApplyChannelWeight(channel);
+    });
+    NotifyWorker();
+}
+
+void ConnClientPrivate::NegotiateKCPFeature(const ControlKCPFeature* server_feature)
+{
+    if (kcp_sessions_[0].IsNull()) return;
+    ControlKCPFeature feature;
+    uint32_t offer = client_kcp_features;
+    if (compress_threshold_ > 0) offer |= KCP_FEATURE_COMPRESS;
+    // MTU探测也需要: 黑洞后按旧mtu切好的segment可能只能走TCP
+    if ((path_probe_ms_ > 0 || multipath_budget_ > 0 || mtu_probe_max_ > 0) && enable_udp_) {
+        offer |= KCP_FEATURE_PATH_SWITCH;
+    }
+    if (mtu_probe_max_ > 0 && enable_udp_) offer |= KCP_FEATURE_MTU_PROBE;
+    if (udp_checksum_ && enable_udp_) offer |= KCP_FEATURE_CRC32C;
+    feature.features = server_feature->features & offer;
+    kcp_sack_ = (feature.features & KCP_FEATURE_SACK) != 0;
+    kcp_sessions_[0].SetSack(kcp_sack_);
+    kcp_compress_ = (feature.features & KCP_FEATURE_COMPRESS) != 0;
+    kcp_batch_ = (feature.features & KCP_FEATURE_BATCH) != 0;
+    kcp_channels_ = (feature.features & KCP_FEATURE_CHANNELS) != 0;
+    kcp_unreliable_seq_ = (feature.features & KCP_FEATURE_UNRELIABLE_SEQ) != 0;
+    kcp_fec_ = (feature.features & KCP_FEATURE_FEC) != 0;
+    kcp_path_switch_ = (feature.features & KCP_FEATURE_PATH_SWITCH) != 0;
+    if (kcp_path_switch_) {
+        path_monitor_.Init(path_probe_ms_, path_margin_, TimeAPI::GetTimeMs());
+        std::lock_guard<std::mutex> lock(path_stats_mutex_);
+        path_stats_ = ConnPathStats{CONN_TRANSPORT_UDP, 0, -1, 0, 0, -1, 0};
+    }
+    kcp_multipath_ = kcp_path_switch_ && multipath_budget_ > 0;
+    multipath_tokens_ = 0;
+    multipath_refill_ms_ = TimeAPI::GetTimeMs();
+    // 平时的datagram清掉DF, 设置不了时不探测, 否则探测包可能被分片后误判为能通过
+    kcp_mtu_probe_ = (feature.features & KCP_FEATURE_MTU_PROBE) != 0 &&
+                     SocketAPI::set_dont_fragment(udp_sock_, false);
+    if (kcp_mtu_probe_) {
+        const int max_mtu = std::min({mtu_probe_max_, (int)kcp_info_.mtu,
+                                      max_udp_pkg_len - kcp_udp_head_size - udp_crc_size});
+        mtu_prober_.Init(kcp_mtu_, max_mtu, TimeAPI::GetTimeMs());
+        mtu_lost_seen_ = 0;
+        for (const auto& session : kcp_sessions_) mtu_lost_seen_ += session.LostCount();
+    }
+    if (kcp_fec_ && enable_udp_ && fec_data_shards_ > 0) {
+        if (fec_encoder_.Init(fec_data_shards_, fec_parity_shards_) != 0) {
+            LOG_ERROR("SetFec(" << fec_data_shards_ << ", " << fec_parity_shards_
+                                << ") illegal, fec disabled");
+        } else {
+            kcp_sessions_[0].DisableDupSend();
+        }
+    }
+    if (kcp_channels_) ApplyChannelWeight(0);
+    SendTCPBuf(CONTROL_KCP_FEATURE, (const char*)&feature, (int)sizeof(feature));
+    // 回复本身还是原格式, 之后上行都用紧凑格式和校验和, 下行等服务器确认
+    kcp_compact_ = (feature.features & KCP_FEATURE_COMPACT) != 0;
+    udp_crc_ = (feature.features & KCP_FEATURE_CRC32C) != 0;
+    if (kcp_compact_) {
+        for (int i = 0; i < kcp_max_channels; ++i) {
+            if (!kcp_sessions_[i].IsNull()) kcp_sessions_[i].SetCompact(true, i);
+        }
+    }
+    LOG_DEBUG("KCP feature server[" << server_feature->features << "] enable[" << feature.features
+                                    << "]");
+}
+
+void ConnClientPrivate::PublishDupTrace()
+{
+    const uint32_t count = kcp_sessions_[0].DupTraceCount();
+    if (count == dup_trace_seen_) return;
+    dup_trace_seen_ = count;
+    IKCPDUPTRACE trace[dup_trace_max];
+    const int n = kcp_sessions_[0].GetDupTrace(trace, dup_trace_max);
+    std::lock_guard<std::mutex> lock(dup_trace_mutex_);
+    dup_trace_.resize(n);
+    for (int i = 0; i < n; ++i) {
+        ConnDupTrace& t = dup_trace_[i];
+        t.ts_ms = trace[i].ts;
+        t.sample_send = trace[i].sample_send;
+        t.sample_lost = trace[i].sample_lost;
+        t.loss = trace[i].loss;
+        t.srtt_ms = trace[i].srtt;
+        t.level = trace[i].level;
+        t.wait_ms = trace[i].wait;
+    }
+}
+
+int ConnClientPrivate::GetDupSendTrace(ConnDupTrace* trace, int max) const
+{
+    std::lock_guard<std::mutex> lock(dup_trace_mutex_);
+    const int n = std::min(max, (int)dup_trace_.size());
+    if (n <= 0) return 0;
+    std::copy(dup_trace_.end() - n, dup_trace_.end(), trace);
+    return n;
+}
+
 int ConnClientPrivate::KCPOutput(const char* data, int len, ikcpcb* kcp, void* user)
 {
     auto* client = (ConnClientPrivate*)user;
     if (client == nullptr) return -1;
 
-    if (client->enable_udp_) {
-        return client->SendUDPBuf(CONTROL_RELIABLE_MSG, data, len);
-    } else {
-        return client->SendTCPBuf(CONTROL_RELIABLE_MSG, data, len);
+    return client->OutputKCP((char*)data, len, kcp->out_critical != 0);
+}
+
+// 多通道打包期间小块输出先攒进kcp_pack_buf_, 攒满或打包结束时一起发, 大块直接发
+int ConnClientPrivate::OutputKCP(char* data, int len, bool critical)
+{
+    if (!kcp_packing_) return SendKCPFrame(data, len, critical);
+    const int limit = (int)kcp_sessions_[0].Mtu();
+    if (kcp_pack_len_ > 0 && kcp_pack_len_ + len > limit) FlushKcpPack();
+    if (len * 2 > limit) return SendKCPFrame(data, len, critical);
+    memcpy(kcp_pack_buf_ + kcp_headroom + kcp_pack_len_, data, len);
+    kcp_pack_len_ += len;
+    kcp_pack_critical_ |= critical;
+    return 0;
+}
+
+void ConnClientPrivate::BeginKcpPack()
+{
+    kcp_packing_ = kcp_channels_;
+}
+
+void ConnClientPrivate::EndKcpPack()
+{
+    FlushKcpPack();
+    kcp_packing_ = false;
+}
+
+void ConnClientPrivate::FlushKcpPack()
+{
+    if (kcp_pack_len_ <= 0) return;
+    const int len = kcp_pack_len_;
+    const bool critical = kcp_pack_critical_;
+    kcp_pack_len_ = 0;
+    kcp_pack_critical_ = false;
+    SendKCPFrame(kcp_pack_buf_ + kcp_headroom, len, critical);
+}
+
+// KCP输出, data前面有kcp_headroom字节可写, 包头原地补在前面, 不再拷贝数据.
+// 关键datagram当前路径发完后再在另一条路径上发一份. 探测到黑洞调小mtu后, 之前按大mtu切好的
+// segment组成的超长datagram能走TCP时走TCP
+int ConnClientPrivate::SendKCPFrame(char* data, int len, bool critical)
+{
+    const bool over_udp = KcpOverUdp() && !(kcp_path_switch_ && kcp_mtu_probe_ && len > kcp_mtu_);
+    const int ret = over_udp ? SendKCPUdp(data, len, true) : SendKCPTcp(data, len);
+    if (critical && kcp_multipath_ && ret >= 0) SendKCPCopy(data, len, !over_udp);
+    return ret;
+}
+
+int ConnClientPrivate::SendKCPUdp(char* data, int len, bool fec)
+{
+    if (udp_sock_ == INVALID_SOCKET) return -1;
+    if (len > max_udp_pkg_len - cs_udp_conn_head_size) {
+        LOG_ERROR("KCPOutput len[" << len << "] illegal");
+        return -1;
+    }
+    // 启用FEC时数据分片的FecHead也原地写在前面
+    auto* fec_head = (FecHead*)(data - sizeof(FecHead));
+    if (fec && fec_encoder_.Enabled() && len <= fec_max_kcp_len &&
+        fec_encoder_.AddData(data, len, TimeAPI::GetTimeMs(), fec_head)) {
+        const int head_len = UdpHeadLen() + (int)sizeof(FecHead);
+        char* pkg_buf = data - head_len;
+        PutUdpHead(pkg_buf, CONTROL_FEC_MSG);
+        fec_send_data_.fetch_add(1, std::memory_order_relaxed);
+        const int ret = UdpWrite(pkg_buf, head_len + len);
+        if (ret >= 0 && fec_encoder_.Full()) return SendFecParity();
+        return ret;
+    }
+    const int head_len = UdpHeadLen();
+    char* pkg_buf = data - head_len;
+    PutUdpHead(pkg_buf, CONTROL_RELIABLE_MSG);
+    return UdpWrite(pkg_buf, head_len + len);
+}
+
+int ConnClientPrivate::SendKCPTcp(char* data, int len)
+{
+    const int head_len = TcpHeadLen(len);
+    char* pkg_buf = data - head_len;
+    PutTcpHead(pkg_buf, CONTROL_RELIABLE_MSG, len);
+    return SendTCPFrame(pkg_buf, head_len + len);
+}
+
+// 冗余的一份不进FEC组; 当前路径已经同步发完, 包头直接覆盖写在同一块headroom里
+void ConnClientPrivate::SendKCPCopy(char* data, int len, bool over_udp)
+{
+    if (over_udp && udp_sock_ == INVALID_SOCKET) return;
+    if (!TakeMultipathBudget(len)) {
+        multipath_budget_drops_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    const int ret = over_udp ? SendKCPUdp(data, len, false) : SendKCPTcp(data, len);
+    if (ret < 0) return;
+    multipath_copy_pkgs_.fetch_add(1, std::memory_order_relaxed);
+    multipath_copy_bytes_.fetch_add(len, std::memory_order_relaxed);
+}
+
+// 令牌桶, 最多攒1/4秒的预算, 至少能过一个最大的datagram
+bool ConnClientPrivate::TakeMultipathBudget(int len)
+{
+    const int64_t now_ms = TimeAPI::GetTimeMs();
+    const int64_t burst = std::max<int64_t>(multipath_budget_ / 4, max_udp_pkg_len) * 1000;
+    multipath_tokens_ = std::min(
+        burst, multipath_tokens_ + std::max<int64_t>(now_ms - multipath_refill_ms_, 0) *
+                                       multipath_budget_);
+    multipath_refill_ms_ = now_ms;
+    if (multipath_tokens_ < (int64_t)len * 1000) return false;
+    multipath_tokens_ -= (int64_t)len * 1000;
+    return true;
+}
+
+// 发出当前FEC组的校验分片, 开始下一组
+int ConnClientPrivate::SendFecParity()
+{
+    int ret = 0;
+    const int head_len = UdpHeadLen();
+    for (int j = 0; j < fec_encoder_.ParityShards() && ret >= 0; ++j) {
+        const int len = fec_encoder_.Parity(j, udp_send_buf_ + head_len,
+                                            max_udp_pkg_len - cs_udp_conn_head_size);
+        if (len < 0) break;
+        PutUdpHead(udp_send_buf_, CONTROL_FEC_MSG);
+        fec_send_parity_.fetch_add(1, std::memory_order_relaxed);
+        ret = UdpWrite(udp_send_buf_, head_len + len);
     }
+    fec_encoder_.NextGroup();
+    return ret < 0 ? ret : 0;
+}
+
+// 流量稀疏时组凑不满, 超时也补发校验分片, 保证恢复延迟有上限
+void ConnClientPrivate::CheckFecGroup(int64_t now_ms)
+{
+    if (fec_encoder_.PendingData() == 0 || udp_sock_ == INVALID_SOCKET) return;
+    if (now_ms - fec_encoder_.GroupStartMs() >= fec_group_timeout_ms) SendFecParity();
+}
+
+// 数据分片直接交给KCP, 恢复出来的datagram随后补上. 服务器切换格式时开始新的一组,
+// 同组的datagram格式相同
+int ConnClientPrivate::InputFec(const char* msg_buf, int msg_len, int64_t cur_time,
+                                KcpDgram* dgram, bool compact)
+{
+    if (fec_decoder_.Input(msg_buf, msg_len) != 0) {
+        LOG_ERROR("flow[" << flow_ << "] bad fec pkg len = " << msg_len);
+        return 0;
+    }
+    if (((const FecHead*)msg_buf)->data_count == 0) {
+        if (InputToKcp(msg_buf + sizeof(FecHead), msg_len - (int)sizeof(FecHead), cur_time,
+                       dgram, compact) != 0) {
+            return -1;
+        }
+    }
+    const char* data = nullptr;
+    int len = 0;
+    while (fec_decoder_.PopRecovered(&data, &len)) {
+        fec_recovered_.fetch_add(1, std::memory_order_relaxed);
+        if (InputToKcp(data, len, cur_time, nullptr, compact) != 0) return -1;
+    }
+    return 0;
+}
+
+// 发送已经带包头的一帧, 写缓冲为空时直接发, 发不完的部分才拷进write_stream_
+int ConnClientPrivate::SendTCPFrame(char* pkg_buf, int total_len)
+{
+    int nwritten = 0;
+    if (write_stream_.Len() <= 0) {
+        nwritten = SocketAPI::send_ex(tcp_sock_, pkg_buf, total_len, 0);
+        if (nwritten < 0) {
+            const int eno = errno;
+            if (eno != EWOULDBLOCK && eno != EAGAIN && eno != EINTR) {
+                LOG_ERROR("send errno[" << eno << "]:" << strerror(eno));
+                InnerClose(CLIENT_CONNECT_ERROR);
+                return -1;
+            }
+            nwritten = 0;
+        }
+        if (nwritten >= total_len) return 0;
+    }
+    const int left = total_len - nwritten;
+    if (write_stream_.EnsureWritable(left) != 0) {
+        LOG_ERROR("flow[" << flow_ << "] EnsureWritable failed total_len=" << left);
+        InnerClose(CLIENT_CONNECT_ERROR);
+        return -1;
+    }
+    memcpy(write_stream_.End(), pkg_buf + nwritten, left);
+    write_stream_.AddSize(left);
+    tcp_writable_ = true;
+    return 0;
 }
 
 void ConnClientPrivate::LogDebug(const char* text)
 {
     if (log_debug_cb_ != nullptr) {
         std::string str(text);
-        out_queue_.enqueue([this, str = std::move(str)]() {
+        PostEvent([this, str = std::move(str)]() {
             if (log_debug_cb_ != nullptr) {
-                CallLuaCallback(user_data_, log_debug_cb_, nullptr, 0, str.c_str(), str.size());
+                CallLuaCallback(user_data_, log_debug_cb_, str.c_str(), (int)str.size(), 0, -1);
             }
         });
     } else {
@@ -963,9 +2594,9 @@ void ConnClientPrivate::LogInfo(const char* text)
 {
     if (log_info_cb_ != nullptr) {
         std::string str(text);
-        out_queue_.enqueue([this, str = std::move(str)]() {
+        PostEvent([this, str = std::move(str)]() {
             if (log_info_cb_ != nullptr) {
-                CallLuaCallback(user_data_, log_info_cb_, nullptr, 0, str.c_str(), str.size());
+                CallLuaCallback(user_data_, log_info_cb_, str.c_str(), (int)str.size(), 0, -1);
             }
         });
     } else {
@@ -976,9 +2607,9 @@ void ConnClientPrivate::LogError(const char* text)
 {
     if (log_error_cb_ != nullptr) {
         std::string str(text);
-        out_queue_.enqueue([this, str = std::move(str)]() {
+        PostEvent([this, str = std::move(str)]() {
             if (log_error_cb_ != nullptr) {
-                CallLuaCallback(user_data_, log_error_cb_, nullptr, 0, str.c_str(), str.size());
+                CallLuaCallback(user_data_, log_error_cb_, str.c_str(), (int)str.size(), 0, -1);
             }
         });
     } else {
@@ -1014,6 +2645,13 @@ void ConnClientPrivate::SetOutputCB(LuaCallback cb)
 {
     output_cb_ = cb;
 }
+void ConnClientPrivate::SetOutputBuffer(bool enable)
+{
+    output_buffer_ = enable;
+#ifndef CONNCLIENT_HEADLESS
+    if (!enable) ReleaseOutputBuffers();
+#endif
+}
 void ConnClientPrivate::SetDisconnectCB(LuaCallback cb)
 {
     disconnect_cb_ = cb;
@@ -1026,6 +2664,11 @@ void ConnClientPrivate::SetRelinkSuccessCB(LuaCallback cb)
 {
     reconnect_success_cb_ = cb;
 }
+void ConnClientPrivate::SetTransportSwitchCB(LuaCallback cb)
+{
+    transport_switch_cb_ = cb;
+}
+
 void ConnClientPrivate::SetRelinkCB(LuaCallback cb)
 {
     relink_cb_ = cb;
@@ -1065,9 +2708,13 @@ ConnClient::~ConnClient()
     }
 }
 
-void ConnClient::Update()
+int ConnClient::Update(int budget_us, int max_events)
+{
+    return m->Update(budget_us, max_events);
+}
+void ConnClient::SetInlineMode(bool enable)
 {
-    m->Update();
+    m->SetInlineMode(enable);
 }
 int ConnClient::Connect(const char* ip, uint32_t port, int timeout_ms)
 {
@@ -1081,9 +2728,13 @@ void ConnClient::Close()
 {
     m->Close();
 }
-int ConnClient::SendMsg(const char* msg_buf, int msg_len)
+int ConnClient::SendMsg(const char* msg_buf, int msg_len, int channel, int flags)
 {
-    return m->SendMsg(msg_buf, msg_len);
+    return m->SendMsg(msg_buf, msg_len, channel, flags);
+}
+int ConnClient::SendMsgV(const ConnMsgVec* vec, int count, int channel, int flags)
+{
+    return m->SendMsgV(vec, count, channel, flags);
 }
 bool ConnClient::IsConnected() const
 {
@@ -1118,6 +2769,10 @@ void ConnClient::SetOutputCB(LuaCallback cb)
 {
     m->SetOutputCB(cb);
 }
+void ConnClient::SetOutputBuffer(bool enable)
+{
+    m->SetOutputBuffer(enable);
+}
 void ConnClient::SetDisconnectCB(LuaCallback cb)
 {
     m->SetDisconnectCB(cb);
@@ -1130,6 +2785,11 @@ void ConnClient::SetRelinkSuccessCB(LuaCallback cb)
 {
     m->SetRelinkSuccessCB(cb);
 }
+void ConnClient::SetTransportSwitchCB(LuaCallback cb)
+{
+    m->SetTransportSwitchCB(cb);
+}
+
 void ConnClient::SetRelinkCB(LuaCallback cb)
 {
     m->SetRelinkCB(cb);
@@ -1150,6 +2810,90 @@ void ConnClient::EnableKcpLog()
 {
     m->EnableKcpLog();
 }
+void ConnClient::SetKcpAckDelay(int max_delay_ms, int ack_every)
+{
+    m->SetKcpAckDelay(max_delay_ms, ack_every);
+}
+void ConnClient::SetKcpChannel(int channel, int priority, int weight)
+{
+    m->SetKcpChannel(channel, priority, weight);
+}
+void ConnClient::SetCompressThreshold(int threshold)
+{
+    m->SetCompressThreshold(threshold);
+}
+int ConnClient::SendUnreliable(const char* msg_buf, int msg_len, int stream)
+{
+    return m->SendUnreliable(msg_buf, msg_len, stream);
+}
+void ConnClient::GetUnreliableStats(ConnUnreliableStats* stats) const
+{
+    m->GetUnreliableStats(stats);
+}
+void ConnClient::SetFec(int data_shards, int parity_shards)
+{
+    m->SetFec(data_shards, parity_shards);
+}
+void ConnClient::GetFecStats(ConnFecStats* stats) const
+{
+    m->GetFecStats(stats);
+}
+void ConnClient::SetCongestionControl(int cc)
+{
+    m->SetCongestionControl(cc);
+}
+void ConnClient::SetTransportAdaptive(int probe_ms, int margin)
+{
+    m->SetTransportAdaptive(probe_ms, margin);
+}
+void ConnClient::GetPathStats(ConnPathStats* stats) const
+{
+    m->GetPathStats(stats);
+}
+void ConnClient::SetMultipathBudget(int bytes_per_sec)
+{
+    m->SetMultipathBudget(bytes_per_sec);
+}
+void ConnClient::GetMultipathStats(ConnMultipathStats* stats) const
+{
+    m->GetMultipathStats(stats);
+}
+void ConnClient::SetMtuProbe(int max_mtu)
+{
+    m->SetMtuProbe(max_mtu);
+}
+void ConnClient::GetMtuStats(ConnMtuStats* stats) const
+{
+    m->GetMtuStats(stats);
+}
+void ConnClient::SetCoalesce(int delay_ms, int max_len)
+{
+    m->SetCoalesce(delay_ms, max_len);
+}
+void ConnClient::GetCoalesceStats(ConnCoalesceStats* stats) const
+{
+    m->GetCoalesceStats(stats);
+}
+void ConnClient::SetUdpChecksum(bool enable)
+{
+    m->SetUdpChecksum(enable);
+}
+void ConnClient::GetChecksumStats(ConnChecksumStats* stats) const
+{
+    m->GetChecksumStats(stats);
+}
+void ConnClient::SetDupSendAdaptive(int max_count, int max_wait_ms, int loss_on, int loss_off)
+{
+    m->SetDupSendAdaptive(max_count, max_wait_ms, loss_on, loss_off);
+}
+int ConnClient::GetDupSendTrace(ConnDupTrace* trace, int max) const
+{
+    return m->GetDupSendTrace(trace, max);
+}
+void ConnClient::GetCompressStats(ConnCompressStats* stats) const
+{
+    m->GetCompressStats(stats);
+}
 void ConnClient::SwitchNetwork()
 {
     m->SwitchNetwork();
@@ -1,10 +1,128 @@
 #pragma once
 
 #include <cstdint>
+
+#ifndef CONNCLIENT_HEADLESS
 #include <dmsdk/script.h>
 
+// Lua回调. 回调函数和设置回调时的脚本实例存在连接userdata的环境表里, 不占注册表的强引用,
+// 脚本不再引用连接时连同回调一起被回收. 实现见myextension.cpp
+struct ConnLuaCallback {
+    int index;  // 在环境表里的下标
+};
+using LuaCallback = const ConnLuaCallback*;
+
+// 压入回调函数, 脚本实例和连接的userdata(user为连接的用户数据)并切到该脚本实例, 之后压入其余参数
+// 调用dmScript::PCall(L, 2 + 其余参数个数, 0), 再调TeardownConnCallback. 连接已被回收或脚本已删除时返回nullptr
+lua_State* SetupConnCallback(LuaCallback callback, void* user);
+void TeardownConnCallback(lua_State* L);
+#else
+#include <functional>
+
+// 无Defold环境(压测工具等)下回调直接调用原生函数, 参数与CallLuaCallback一致: data为消息或日志,
+// channel为消息的通道, value为断开原因/重连次数/传输方式, 没有时为-1
+struct HeadlessCallback {
+    std::function<void(void* user, const char* data, int data_len, int channel, int value)> fun;
+};
+using LuaCallback = HeadlessCallback*;
+#endif
+
+// 聚合发送的一个片段
+struct ConnMsgVec {
+    const char* buf;
+    int len;
+};
+
+// SendMsg/SendMsgV的flags
+enum ConnSendFlag {
+    CONN_SEND_CRITICAL = 1,  // 关键消息, 见ConnClient::SetMultipathBudget
+};
+
+// 可靠消息压缩统计, 只统计实际压缩了的消息
+struct ConnCompressStats {
+    uint64_t send_msgs;         // 上行压缩消息数
+    uint64_t send_raw_bytes;    // 上行压缩前字节数
+    uint64_t send_zip_bytes;    // 上行压缩后字节数
+    uint64_t recv_msgs;         // 下行压缩消息数
+    uint64_t recv_zip_bytes;    // 下行解压前字节数
+    uint64_t recv_raw_bytes;    // 下行解压后字节数
+};
+
+// 带seq的不可靠消息统计
+struct ConnUnreliableStats {
+    uint64_t send_msgs;    // 上行消息数
+    uint64_t recv_msgs;    // 下行交给上层的消息数
+    uint64_t stale_drops;  // 下行乱序或过期丢弃的消息数
+};
+
+// UDP上KCP数据的FEC统计
+struct ConnFecStats {
+    uint64_t send_data_shards;    // 上行编码的数据分片数
+    uint64_t send_parity_shards;  // 上行校验分片数
+    uint64_t recv_recovered;      // 下行靠校验分片恢复的datagram数
+};
+
+// 自适应冗余发送的一次采样和调节结果
+struct ConnDupTrace {
+    uint32_t ts_ms;        // KCP时钟
+    uint32_t sample_send;  // 采样窗口内首次发送的segment数
+    uint32_t sample_lost;  // 窗口内超时或快速重传的segment数
+    uint32_t loss;         // 丢包率EWMA, 千分比
+    int32_t srtt_ms;
+    uint32_t level;        // 调节后的冗余发送次数
+    uint32_t wait_ms;      // 调节后的冗余发送间隔
+};
+
+// 小消息合并发送统计
+struct ConnCoalesceStats {
+    uint64_t msgs;     // 合并进批量消息的上行消息数
+    uint64_t batches;  // 发出的批量消息数
+};
+
+// UDP datagram校验统计
+struct ConnChecksumStats {
+    uint64_t verified;  // 校验通过的下行datagram数
+    uint64_t drops;     // 校验失败丢弃的下行datagram数
+};
+
+// 关键消息多路径冗余发送统计
+struct ConnMultipathStats {
+    uint64_t copy_pkgs;     // 在另一条路径上多发的KCP datagram数
+    uint64_t copy_bytes;    // 多发的KCP数据字节数
+    uint64_t budget_drops;  // 超出预算只走了当前路径的关键datagram数
+};
 
-using LuaCallback = dmScript::LuaCallbackInfo*;
+// 上行路径MTU探测结果
+struct ConnMtuStats {
+    int32_t mtu;           // 当前上行KCP的mtu
+    uint32_t probes;       // 累计发出的探测包数
+    uint32_t black_holes;  // 已确认的mtu后来不通, 退回默认值的次数
+};
+
+// KCP拥塞控制算法, 见ConnClient::SetCongestionControl
+enum ConnCongestion {
+    CONN_CC_SERVER = 0,  // 沿用服务器KCP参数里的nc
+    CONN_CC_LOSS = 1,    // 基于丢包的慢启动+拥塞避免(KCP原有)
+    CONN_CC_NONE = 2,    // 不做拥塞控制, 只受收发窗口限制
+    CONN_CC_BBR = 3,     // 基于瓶颈带宽和最小rtt模型, 按带宽pacing, 链路排队严重时不会撑满队列
+};
+
+// KCP数据走的路径, 见ConnClient::SetTransportAdaptive
+enum ConnTransport {
+    CONN_TRANSPORT_UDP = 0,
+    CONN_TRANSPORT_TCP = 1,
+};
+
+// 路径评估结果, 分数为预计送达时延(ms), 越小越好
+struct ConnPathStats {
+    int transport;       // 当前KCP数据走的路径, ConnTransport
+    uint32_t switches;   // 累计切换次数
+    int32_t udp_rtt_ms;  // UDP ping往返时延, -1为还没有采样
+    uint32_t udp_loss;   // UDP丢包率, 千分比, 取ping丢失率和KCP走UDP时超时重传率的较大值
+    int32_t udp_score;
+    int32_t tcp_rtt_ms;  // TCP ping往返时延, -1为还没有采样
+    int32_t tcp_score;
+};
 
 class ConnClientPrivate;
 class ConnClient
@@ -14,11 +132,25 @@ public:
     ~ConnClient();
 
 public:
-    void Update();
+    // 主线程调用, 处理网络线程交过来的事件. 连接/断开/重连/切换路径等控制事件不计入预算, 但不会越过
+    // 它之前收到的消息: 断开回调总在这个连接的最后一个消息之后;
+    // 收到的消息和日志最多处理max_events个, 用时超过budget_us后停止, 剩下的留到下次. 0为不限制,
+    // 预算内也至少处理一个. 返回处理的消息和日志数
+    int Update(int budget_us = 0, int max_events = 0);
+    // 单线程内联模式, Connect前调用. 不起网络线程, 每次Update()不等待地收包, 驱动KCP后直接回调;
+    // 发送在调用时直接进KCP发出, 回调里发送的消息和攒着的小消息在本次Update结束前发出.
+    // 收发时延取决于Update的调用频率, 适合连接少且每帧都Update的客户端
+    void SetInlineMode(bool enable);
     int Connect(const char* ip, uint32_t port, int timeout_ms);
     int ConnectBlock(const char* ip, uint32_t port, int timeout_ms);
     void Close();
-    int SendMsg(const char* msg_buf, int msg_len);
+    // channel为可靠通道号, 通道间互不阻塞, 服务器不支持多通道时都走通道0; flags见ConnSendFlag
+    int SendMsg(const char* msg_buf, int msg_len, int channel = 0, int flags = 0);
+    // 多个片段按顺序组成一条消息发送, 调用方不需要先拼接
+    int SendMsgV(const ConnMsgVec* vec, int count, int channel = 0, int flags = 0);
+    // 不可靠消息, 有UDP时走UDP, 丢了不重传. 同一stream内收端丢弃比已收到的更旧的包,
+    // 服务器不支持KCP_FEATURE_UNRELIABLE_SEQ时不带seq发送
+    int SendUnreliable(const char* msg_buf, int msg_len, int stream = 0);
     bool IsConnected() const;
 
 public:
@@ -29,14 +161,65 @@ public:
     void SetLogInfoCB(LuaCallback cb);
     void SetLogErrorCB(LuaCallback cb);
     void SetOutputCB(LuaCallback cb);
+    // 打开后output回调收到的消息是dmBuffer(一个uint8的"data"流)而不是Lua字符串, 省掉字符串的驻留和哈希.
+    // buffer只在回调期间有效, 之后会被同样长度的消息复用. 无Defold环境下没有区别
+    void SetOutputBuffer(bool enable);
     void SetDisconnectCB(LuaCallback cb);
     void SetConnectSuccessCB(LuaCallback cb);
     void SetRelinkSuccessCB(LuaCallback cb);
     void SetRelinkCB(LuaCallback);
+    // KCP数据切换路径后回调, 参数为新的路径(ConnTransport)
+    void SetTransportSwitchCB(LuaCallback cb);
     void SetMagicNum(int magic);
     void AddRelinkInterval(int msec);
     void ClearRelinkInterval();
     void EnableKcpLog();
+    // KCP ack延迟策略, 下次创建KCP时生效, 见pvp_ikcp_setackdelay
+    void SetKcpAckDelay(int max_delay_ms, int ack_every);
+    // 不小于threshold字节的上行可靠消息LZ4压缩, 0为关闭, 下次创建KCP时与服务器协商生效
+    void SetCompressThreshold(int threshold);
+    // 上行UDP的KCP数据每data_shards个datagram补parity_shards个校验分片(最多16+4), 丢了不超过
+    // parity_shards个时服务器直接恢复, 不等重传. 启用后不再dupsend. 0为关闭, 下次创建KCP时生效
+    void SetFec(int data_shards, int parity_shards);
+    // 选择KCP拥塞控制算法(ConnCongestion), 下次创建KCP时生效
+    void SetCongestionControl(int cc);
+    // 自适应冗余发送, 代替服务器下发的dupsend参数: 冗余次数在[0, max_count]间按最近的丢包率调节,
+    // 丢包率(千分比)不低于loss_on加一级, 不高于loss_off减一级, 0用默认值30/10; 副本间隔按srtt调节,
+    // 不超过max_wait_ms. max_count为0关闭, 下次创建KCP时生效. 启用FEC后不再dupsend
+    void SetDupSendAdaptive(int max_count, int max_wait_ms, int loss_on = 0, int loss_off = 0);
+    // 默认通道最近至多max条自适应冗余的采样记录(从旧到新), 返回条数
+    int GetDupSendTrace(ConnDupTrace* trace, int max) const;
+    // 按路径评估在UDP和TCP间切换KCP数据(连同不可靠消息): 每probe_ms同时ping两条路径,
+    // 另一条路径的分数比当前路径好margin%(0为30%)并保持一段时间才切换.
+    // 需要服务器启用UDP并支持KCP_FEATURE_PATH_SWITCH, probe_ms为0关闭, 下次创建KCP时生效
+    void SetTransportAdaptive(int probe_ms, int margin = 0);
+    void GetPathStats(ConnPathStats* stats) const;
+    // 带CONN_SEND_CRITICAL的消息所在的KCP datagram(含重传)除了当前路径, 同时在另一条路径
+    // (UDP/TCP)上再发一份, 收端KCP按sn去重. 多发的字节按bytes_per_sec限速, 超出预算的只走当前路径.
+    // 需要服务器启用UDP并支持KCP_FEATURE_PATH_SWITCH, 0为关闭, 下次创建KCP时生效
+    void SetMultipathBudget(int bytes_per_sec);
+    void GetMultipathStats(ConnMultipathStats* stats) const;
+    // 上行KCP的mtu默认不超过500. 启用后用带DF的UDP探测包在[500, max_mtu]间搜索路径能通过的
+    // 最大值并调大mtu, 出现超时丢包时再确认, 不通则退回500. 上限同时不超过服务器下发的mtu;
+    // 以太网IPv4上1400比较稳妥. 需要服务器支持KCP_FEATURE_MTU_PROBE, 0为关闭, 下次创建KCP时生效
+    void SetMtuProbe(int max_mtu);
+    void GetMtuStats(ConnMtuStats* stats) const;
+    // 不超过max_len(0为128)字节的非关键可靠消息先攒起来, 同一通道的合并成一条KCP消息发送,
+    // 攒够一个mtu, 最早的一条等了delay_ms, 或下一次Update(帧末)时发出. 更大的消息和关键消息
+    // 先把本通道攒着的发出去再发, 保持通道内顺序. 需要服务器支持KCP_FEATURE_BATCH,
+    // delay_ms为0关闭, 下次创建KCP时生效
+    void SetCoalesce(int delay_ms, int max_len = 0);
+    void GetCoalesceStats(ConnCoalesceStats* stats) const;
+    // UDP datagram末尾加CRC32C校验和(有SSE4.2/ARMv8 CRC指令时用硬件计算), 收到校验不过的
+    // datagram直接丢弃计数, 不交给KCP, 避免出错的包头让连接断开. 需要服务器支持
+    // KCP_FEATURE_CRC32C, 下次创建KCP时生效
+    void SetUdpChecksum(bool enable);
+    void GetChecksumStats(ConnChecksumStats* stats) const;
+    // 可靠通道的优先级(越小越先发送和回调)和发送窗口占比(1-100%), 默认优先级为通道号, 占比100
+    void SetKcpChannel(int channel, int priority, int weight);
+    void GetCompressStats(ConnCompressStats* stats) const;
+    void GetUnreliableStats(ConnUnreliableStats* stats) const;
+    void GetFecStats(ConnFecStats* stats) const;
     void SwitchNetwork();
 
 private:
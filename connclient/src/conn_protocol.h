@@ -1,6 +1,8 @@
 #pragma once
 #include <cstdint>
 
+#include "crc32c.h"
+
 // TCP pkg
 // | pkg_len | flow    | magic |   cmd  | buf     |
 // |---------|---------|-------|--------|---------|
@@ -45,6 +47,11 @@ enum CsConnCmd {
     CONTROL_LOG = 6,             // 客户端日志
     CONTROL_SYNC_LABEL = 7,      // 传输标签给客户端
     CONTROL_QUEUE = 8,           // 排队信息
+    CONTROL_KCP_FEATURE = 9,     // 客户端回复实际启用的KCP扩展, ControlKCPFeature
+    CONTROL_UNRELIABLE_SEQ_MSG = 10,  // 带UnreliableMsgHead的不可靠消息
+    CONTROL_FEC_MSG = 11,             // KCP datagram的FEC分片, 只走UDP, 见kcp_fec.h
+    CONTROL_KCP_PATH = 12,            // 客户端切换KCP数据的路径, ControlKCPPath, 只走TCP
+    CONTROL_MTU_PROBE = 13,           // 上行MTU探测及其回复, ControlMtuProbe, 只走UDP
 };
 
 enum ControlDisconnectReason {
@@ -99,3 +106,175 @@ struct ControlKCPInfo {
     int high_lost_period;
 } __attribute__((__packed__));
 static_assert(sizeof(ControlKCPInfo) == 93, "unexpected layout");
+
+// KCP扩展能力, 按bit组合
+enum KcpFeature {
+    KCP_FEATURE_SACK = 1 << 0,      // 可以解析IKCP_CMD_SACK
+    KCP_FEATURE_COMPRESS = 1 << 1,  // 可靠消息可以LZ4压缩, 启用后上行可靠消息也带控制byte
+    KCP_FEATURE_CHANNELS = 1 << 2,  // 多个相互独立的可靠通道, 见KcpChannelConv
+    KCP_FEATURE_UNRELIABLE_SEQ = 1 << 3,  // 可以收发CONTROL_UNRELIABLE_SEQ_MSG
+    KCP_FEATURE_FEC = 1 << 4,             // 可以解码CONTROL_FEC_MSG, 各自决定是否编码发送
+    KCP_FEATURE_PATH_SWITCH = 1 << 5,     // KCP数据可以在UDP和TCP间切换, 见ControlKCPPath
+    KCP_FEATURE_MTU_PROBE = 1 << 6,       // 服务器回复CONTROL_MTU_PROBE, 上行KCP可以提高mtu
+    KCP_FEATURE_BATCH = 1 << 7,  // 可靠消息可以是CONTROL_FLAG_BATCH的批量消息, 上行也带控制byte
+    KCP_FEATURE_COMPACT = 1 << 8,  // 紧凑包头格式v2, 见CompactMagicCmd
+    KCP_FEATURE_CRC32C = 1 << 9,   // UDP datagram末尾带CRC32C, 见udp_crc_size
+};
+
+// 启用KCP_FEATURE_CHANNELS后每个连接最多kcp_max_channels个可靠通道, 各自一个KCP,
+// 通道c的conv为KcpChannelConv(kcp_conv, c), 通道0即原来的KCP. 各通道的segment可以
+// 拼在同一个datagram里, 接收方按conv分发. 通道间互不阻塞, 通道内保序
+const int kcp_max_channels = 4;
+
+inline uint32_t KcpChannelConv(uint32_t conv, int channel)
+{
+    return conv ^ ((uint32_t)channel << 24);
+}
+
+// CONTROL_UNRELIABLE_SEQ_MSG的消息头, 其后为消息内容. 每个stream的seq各自从0递增并回绕,
+// 收端每个stream只接受比已收到的更新的seq, 乱序和过期的包直接丢弃. 用独立的cmd而不是给
+// CONTROL_UNRELIABLE_MSG加头, 协商完成前后在途的包不会被误解析
+const int unreliable_max_streams = 16;
+
+struct UnreliableMsgHead {
+    uint8_t stream;
+    uint16_t seq;
+} __attribute__((__packed__));
+static_assert(sizeof(UnreliableMsgHead) == 3, "unexpected layout");
+
+inline bool UnreliableSeqNewer(uint16_t seq, uint16_t last)
+{
+    return (int16_t)(uint16_t)(seq - last) > 0;
+}
+
+// 可靠消息控制byte上的标志位, 低位仍为CsConnCmd
+enum ControlMsgFlag {
+    CONTROL_FLAG_COMPRESSED = 0x80,  // 控制byte之后为CompressedMsgHead+LZ4 block
+    CONTROL_FLAG_BATCH = 0x40,       // 控制byte之后为多条消息, 见BatchPutLen
+};
+
+// LEB128变长整数: 每byte低7位, 最高位为1表示后面还有
+const int varint_max_bytes = 5;
+
+inline int VarintPut(char* p, uint32_t v)
+{
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)v;
+    return n;
+}
+
+// 返回占的字节数, 数据不完整或超过max_bytes返回-1
+inline int VarintGet(const char* p, int avail, uint32_t* v, int max_bytes = varint_max_bytes)
+{
+    uint32_t x = 0;
+    for (int n = 0; n < avail && n < max_bytes; ++n) {
+        x |= (uint32_t)((uint8_t)p[n] & 0x7F) << (7 * n);
+        if (((uint8_t)p[n] & 0x80) == 0) {
+            *v = x;
+            return n + 1;
+        }
+    }
+    return -1;
+}
+
+// 批量消息: 控制byte之后重复[长度][消息], 长度为varint, 不与CONTROL_FLAG_COMPRESSED同时使用.
+// 收端拆开后逐条交给上层, 与分别发送等价
+const int batch_len_max_bytes = 3;  // 单条消息不超过2^21字节
+
+inline int BatchPutLen(char* p, uint32_t len)
+{
+    return VarintPut(p, len);
+}
+
+inline int BatchGetLen(const char* p, int avail, uint32_t* len)
+{
+    return VarintGet(p, avail, len, batch_len_max_bytes);
+}
+
+// 协商了KCP_FEATURE_COMPACT后的紧凑格式(v2):
+// UDP上行 | magic_cmd | flow(varint) | buf |, UDP下行 | magic_cmd | buf |
+// TCP     | magic_cmd | buf长度(varint) | buf |
+// magic_cmd高3位为magic的低3位, 低5位为CsConnCmd. KCP数据用紧凑segment头(pvp_ikcp_setcompact),
+// conv由flow和通道号推出不再传输, ts等字段变长或按差值编码. flow 0的UDP ping保持原格式.
+// 切换: 客户端回复CONTROL_KCP_FEATURE之后上行全部用紧凑格式; 服务器收到后先回一个原格式的
+// CONTROL_KCP_FEATURE(features为已切换的COMPACT/CRC32C), 之后下行用紧凑格式,
+// 客户端收到它之后TCP按紧凑格式解析.
+// UDP每个包自带格式: 原格式包头(flow/magic)对不上且magic_cmd对得上时按紧凑格式解析,
+// 切换前后在途的包都能收. 紧凑包的前几个字节可能恰好和原格式的flow/magic一样, 所以客户端收到
+// 服务器的确认后只在compact_legacy_drain_ms内接受原格式的下行UDP, 之后只按紧凑格式解析.
+// 断线重连后双方回到原格式, 随新的KCP重新协商
+const int compact_head_max_bytes = 1 + varint_max_bytes;
+const int compact_legacy_drain_ms = 2000;
+
+inline uint8_t CompactMagicCmd(uint8_t magic, uint8_t cmd)
+{
+    return (uint8_t)(((magic & 0x07) << 5) | (cmd & 0x1F));
+}
+
+inline bool CompactMagicMatch(uint8_t magic, uint8_t magic_cmd)
+{
+    return (magic_cmd >> 5) == (magic & 0x07);
+}
+
+// 协商了KCP_FEATURE_CRC32C后, 除flow 0的ping外每个UDP datagram末尾加4字节(小端)CRC32C,
+// 覆盖前面的包头和数据. 与紧凑格式同样在回复/确认CONTROL_KCP_FEATURE时切换; 收端在对方确认前
+// 末尾校验得上的去掉校验和, 校验不上的按不带校验和处理, 确认后校验不上的直接丢弃
+const int udp_crc_size = 4;
+
+// 在pkg_buf[len]处追加校验和, 返回新长度, pkg_buf后面至少要有udp_crc_size字节可写
+inline int UdpCrcAppend(char* pkg_buf, int len)
+{
+    const uint32_t crc = Crc32c::Compute(pkg_buf, len);
+    for (int i = 0; i < udp_crc_size; ++i) pkg_buf[len + i] = (char)(crc >> (8 * i));
+    return len + udp_crc_size;
+}
+
+// 末尾的校验和对得上时返回去掉校验和后的长度, 否则返回-1
+inline int UdpCrcStrip(const char* pkg_buf, int len)
+{
+    if (len <= udp_crc_size) return -1;
+    const int body_len = len - udp_crc_size;
+    uint32_t crc = 0;
+    for (int i = 0; i < udp_crc_size; ++i) {
+        crc |= (uint32_t)(uint8_t)pkg_buf[body_len + i] << (8 * i);
+    }
+    return Crc32c::Compute(pkg_buf, body_len) == crc ? body_len : -1;
+}
+
+// 压缩消息头, 其后为LZ4 block, 解压后为raw_len字节的原始消息.
+// 上行消息在客户端回复CONTROL_KCP_FEATURE之后才带控制byte, UDP上KCP数据可能先于TCP上的
+// CONTROL_KCP_FEATURE到达, 服务器需要暂存这期间的上行KCP数据
+struct CompressedMsgHead {
+    uint32_t raw_len;
+} __attribute__((__packed__));
+static_assert(sizeof(CompressedMsgHead) == 4, "unexpected layout");
+
+// 紧跟在ControlKCPInfo之后下发, 老版本服务器没有这部分
+// 客户端只在服务器带了这部分时才回复CONTROL_KCP_FEATURE, 双方各自收到对方的能力后才启用
+struct ControlKCPFeature {
+    uint32_t features;
+} __attribute__((__packed__));
+static_assert(sizeof(ControlKCPFeature) == 4, "unexpected layout");
+
+// 协商了KCP_FEATURE_PATH_SWITCH后, 客户端按路径评估把上行KCP数据和不可靠消息切到UDP或TCP,
+// 并发CONTROL_KCP_PATH让服务器下行也走同一路径. 双方都要能从两条路径收KCP数据,
+// 切换时在途的segment靠KCP重传补上. 客户端在TCP上时仍然发UDP ping探测UDP路径.
+// 客户端也可能把关键消息的KCP datagram同时从两条路径各发一份, 收端KCP按sn去重
+struct ControlKCPPath {
+    uint8_t trans_type;  // PKG_TRANS_UDP或PKG_TRANS_TCP
+} __attribute__((__packed__));
+static_assert(sizeof(ControlKCPPath) == 1, "unexpected layout");
+
+// 协商了KCP_FEATURE_MTU_PROBE后, 客户端用带DF的UDP探测上行路径能通过多大的KCP datagram:
+// 探测包为ControlMtuProbe加填充, 整个datagram与mtu为该值的KCP datagram(带FecHead)一样长.
+// 服务器收到后只回ControlMtuProbe原样的4字节, 客户端确认后调大上行KCP的mtu.
+// 服务器KCP要能收比下发的ControlKCPInfo::mtu更大的segment, 客户端探测的上限不超过它
+struct ControlMtuProbe {
+    uint16_t id;   // 客户端递增, 对应一次探测
+    uint16_t mtu;  // 探测的KCP mtu
+} __attribute__((__packed__));
+static_assert(sizeof(ControlMtuProbe) == 4, "unexpected layout");
@@ -0,0 +1,164 @@
+#include "crc32c.h"
+
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CRC32C_X86
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC32C_TARGET_SSE42
+#else
+#define CRC32C_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#elif (defined(__aarch64__) || defined(_M_ARM64)) && defined(__ARM_FEATURE_CRC32)
+#define CRC32C_ARM
+#include <arm_acle.h>
+#endif
+
+namespace {
+
+const uint32_t crc32c_poly = 0x82F63B78;  // 0x1EDC6F41按位反转
+
+struct Crc32cTable {
+    uint32_t t[8][256];
+    Crc32cTable()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int k = 0; k < 8; ++k) crc = (crc >> 1) ^ (crc32c_poly & (0u - (crc & 1)));
+            t[0][i] = crc;
+        }
+        for (int j = 1; j < 8; ++j) {
+            for (int i = 0; i < 256; ++i) t[j][i] = (t[j - 1][i] >> 8) ^ t[0][t[j - 1][i] & 0xFF];
+        }
+    }
+};
+
+uint32_t ComputeTable(uint32_t crc, const uint8_t* p, size_t len)
+{
+    static const Crc32cTable table;
+    const auto& t = table.t;
+    // 按小端取字, 大端平台逐字节处理
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+    while (len >= 8) {
+        uint32_t lo = 0;
+        uint32_t hi = 0;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+        --len;
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+CRC32C_TARGET_SSE42 uint32_t ComputeSse42(uint32_t crc, const uint8_t* p, size_t len)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t v = 0;
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (len >= 4) {
+        uint32_t v = 0;
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        --len;
+    }
+    return crc;
+}
+
+bool HasSse42()
+{
+#ifdef _MSC_VER
+    int info[4] = {};
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#endif
+
+#ifdef CRC32C_ARM
+uint32_t ComputeArm(uint32_t crc, const uint8_t* p, size_t len)
+{
+    while (len >= 8) {
+        uint64_t v = 0;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32cb(crc, *p++);
+        --len;
+    }
+    return crc;
+}
+#endif
+
+using ComputeFun = uint32_t (*)(uint32_t, const uint8_t*, size_t);
+
+struct Crc32cImpl {
+    ComputeFun fun = ComputeTable;
+    const char* name = "table";
+    Crc32cImpl()
+    {
+#if defined(CRC32C_X86)
+        if (HasSse42()) {
+            fun = ComputeSse42;
+            name = "sse4.2";
+        }
+#elif defined(CRC32C_ARM)
+        fun = ComputeArm;
+        name = "armv8";
+#endif
+    }
+};
+
+const Crc32cImpl& GetImpl()
+{
+    static const Crc32cImpl impl;
+    return impl;
+}
+
+}  // namespace
+
+uint32_t Crc32c::Compute(const void* data, int len)
+{
+    if (len <= 0) return 0;
+    return ~GetImpl().fun(0xFFFFFFFF, (const uint8_t*)data, (size_t)len);
+}
+
+uint32_t Crc32c::ComputeSoftware(const void* data, int len)
+{
+    if (len <= 0) return 0;
+    return ~ComputeTable(0xFFFFFFFF, (const uint8_t*)data, (size_t)len);
+}
+
+const char* Crc32c::Impl()
+{
+    return GetImpl().name;
+}
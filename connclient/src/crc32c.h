@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+
+// CRC32C(Castagnoli, 与iSCSI/ext4相同), 用于UDP datagram的完整性校验.
+// x86上CPU支持SSE4.2时用crc32指令, ARM在编译目标带CRC扩展(如arm64 macOS)时用ARMv8的
+// crc32c指令, 其余情况查表(slicing-by-8). 各实现结果相同
+class Crc32c
+{
+public:
+    static uint32_t Compute(const void* data, int len);
+    // 总是查表, 结果与Compute相同. 用来核对硬件实现
+    static uint32_t ComputeSoftware(const void* data, int len);
+    // 当前使用的实现: "sse4.2", "armv8"或"table"
+    static const char* Impl();
+};
@@ -30,6 +30,7 @@ const IUINT32 IKCP_CMD_ACK = 82;   // cmd: ack
 const IUINT32 IKCP_CMD_WASK = 83;  // cmd: window probe (ask)
 const IUINT32 IKCP_CMD_WINS = 84;  // cmd: window size (tell)
 const IUINT32 IKCP_CMD_DUPS = 85;  // cmd: duplicate send
+const IUINT32 IKCP_CMD_SACK = 86;  // cmd: selective ack, 需协商后才能发送
 const IUINT32 IKCP_ASK_SEND = 1;   // need to send IKCP_CMD_WASK
 const IUINT32 IKCP_ASK_TELL = 2;   // need to send IKCP_CMD_WINS
 const IUINT32 IKCP_WND_SND = 32;
@@ -38,6 +39,9 @@ const IUINT32 IKCP_MTU_DEF = 1400;
 // const IUINT32 IKCP_ACK_FAST = 3;
 const IUINT32 IKCP_INTERVAL = 100;
 const IUINT32 IKCP_OVERHEAD = 19;
+const IUINT32 IKCP_COMPACT_TS = 0x20;   // 紧凑头: 带4字节ts, 否则为相对前一个PUSH/DUPS的差值
+const IUINT32 IKCP_COMPACT_UW = 0x40;   // 紧凑头: 带una和wnd, 否则沿用前一个segment的
+const IUINT32 IKCP_COMPACT_FRG = 0x80;  // 紧凑头: 带frg, 否则为0
 const IUINT32 IKCP_DEADLINK = 20;
 const IUINT32 IKCP_THRESH_INIT = 2;
 const IUINT32 IKCP_THRESH_MIN = 2;
@@ -47,6 +51,15 @@ const IUINT32 IKCP_INTERVAL_LOST = 3000;         // 默认间隔统计丢包时
 const IUINT32 IKCP_DUPSEND_WAIT_DEFAULT = 30;    // 冗余发送最多等待时长默认值(ms)
 const IUINT32 IKCP_DUPSEND_WND_ON_DEFAULT = 30;  // 冗余发包开关的窗口阈值默认值
 #define IKCP_DUPSEND_LEN 32                      // 冗余发送数组长度
+const IUINT32 IKCP_DUP_SAMPLE_MS = 250;       // 自适应冗余: 采样窗口时长
+const IUINT32 IKCP_DUP_SAMPLE_MIN = 16;       // 窗口内首发segment不够这么多时延长窗口
+const IUINT32 IKCP_DUP_SAMPLE_MAX_MS = 2000;  // 窗口最多延长到这么久
+const IUINT32 IKCP_DUP_LOSS_ON_DEFAULT = 30;  // 默认丢包率3%以上加冗余
+const IUINT32 IKCP_DUP_LOSS_OFF_DEFAULT = 10;  // 默认丢包率1%以下减冗余
+const IUINT32 IKCP_DUP_HOLD_UP_MS = 500;      // 调级后至少过这么久才能再加一级
+const IUINT32 IKCP_DUP_HOLD_DOWN_MS = 3000;   // 调级后至少过这么久才能减一级
+const IUINT32 IKCP_DUP_WAIT_MIN = 10;         // 自适应时dupsend_wait下限
+#define IKCP_DUP_TRACE_LEN 64                 // 自适应采样记录条数
 
 
 //---------------------------------------------------------------------
@@ -123,6 +136,43 @@ static inline const char* ikcp_decode32u(const char* p, IUINT32* l)
     return p;
 }
 
+/* encode LEB128 varint */
+static inline char* ikcp_encode_varint(char* p, IUINT32 v)
+{
+    while (v >= 0x80) {
+        *(unsigned char*)p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *(unsigned char*)p++ = (unsigned char)v;
+    return p;
+}
+
+/* decode LEB128 varint, NULL if truncated */
+static inline const char* ikcp_decode_varint(const char* p, const char* end, IUINT32* v)
+{
+    IUINT32 x = 0;
+    int shift;
+    for (shift = 0; shift < 35 && p < end; shift += 7) {
+        const unsigned char c = *(const unsigned char*)p++;
+        x |= (IUINT32)(c & 0x7F) << shift;
+        if ((c & 0x80) == 0) {
+            *v = x;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static inline IUINT32 ikcp_zigzag(IINT32 v)
+{
+    return ((IUINT32)v << 1) ^ (IUINT32)(v >> 31);
+}
+
+static inline IINT32 ikcp_unzigzag(IUINT32 v)
+{
+    return (IINT32)(v >> 1) ^ -(IINT32)(v & 1);
+}
+
 static inline IUINT32 _imin_(IUINT32 a, IUINT32 b)
 {
     return a <= b ? a : b;
@@ -178,13 +228,25 @@ void pvp_ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*))
 // allocate a new kcp segment
 static IKCPSEG* ikcp_segment_new(ikcpcb* kcp, int size)
 {
-    return (IKCPSEG*)ikcp_malloc(sizeof(IKCPSEG) + size);
+    IKCPSEG* seg = (IKCPSEG*)ikcp_malloc(sizeof(IKCPSEG) + size);
+    if (seg != NULL) {
+        seg->ref = NULL;
+        seg->payload = seg->data;
+        seg->critical = 0;
+    }
+    return seg;
+}
+
+static void ikcp_segment_free(IKCPSEG* seg)
+{
+    if (seg->ref != NULL) seg->ref->release(seg->ref);
+    ikcp_free(seg);
 }
 
 // delete a segment
 static void ikcp_segment_delete(ikcpcb* kcp, IKCPSEG* seg)
 {
-    ikcp_free(seg);
+    ikcp_segment_free(seg);
 }
 
 // write log
@@ -206,6 +268,18 @@ static int ikcp_canlog(const ikcpcb* kcp, int mask)
     return 1;
 }
 
+// 输出buffer, 前面预留headroom字节, 返回预留区之后的位置
+static char* ikcp_buffer_new(IUINT32 mtu, int headroom)
+{
+    char* raw = (char*)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3 + headroom);
+    return raw ? raw + headroom : NULL;
+}
+
+static void ikcp_buffer_delete(char* buffer, int headroom)
+{
+    if (buffer) ikcp_free(buffer - headroom);
+}
+
 // output segment
 static int ikcp_output(ikcpcb* kcp, const void* data, int size)
 {
@@ -215,7 +289,9 @@ static int ikcp_output(ikcpcb* kcp, const void* data, int size)
         pvp_ikcp_log(kcp, IKCP_LOG_OUTPUT, "[RO] %ld bytes", (long)size);
     }
     if (size == 0) return 0;
-    return kcp->output((const char*)data, size, kcp, kcp->user);
+    int ret = kcp->output((const char*)data, size, kcp, kcp->user);
+    kcp->out_critical = 0;
+    return ret;
 }
 
 // output queue
@@ -267,8 +343,27 @@ ikcpcb* pvp_ikcp_create(IUINT32 conv, void* user)
     kcp->cursendcount = 0;
     kcp->ts_lost = 0;
     kcp->interval_lost = IKCP_INTERVAL_LOST;
-
-    kcp->buffer = (char*)ikcp_malloc((kcp->mtu + IKCP_OVERHEAD) * 3);
+    kcp->snd_ring = NULL;
+    kcp->snd_ring_mask = 0;
+    kcp->rcv_ring = NULL;
+    kcp->rcv_bitmap = NULL;
+    kcp->rcv_ring_mask = 0;
+    kcp->sack = 0;
+    kcp->compact = 0;
+    kcp->compact_channel = 0;
+    kcp->enc_ts = 0;
+    kcp->enc_una = 0;
+    kcp->enc_wnd = 0;
+    kcp->enc_state = 0;
+    kcp->ack_delay = 0;
+    kcp->ack_freq = 0;
+    kcp->ts_ack = 0;
+    kcp->rcv_head_len = 0;
+    kcp->rcv_head_done = 0;
+    kcp->headroom = 0;
+
+    kcp->buffer_mtu = kcp->mtu;
+    kcp->buffer = ikcp_buffer_new(kcp->buffer_mtu, kcp->headroom);
     if (kcp->buffer == NULL) {
         ikcp_free(kcp);
         return NULL;
@@ -277,7 +372,6 @@ ikcpcb* pvp_ikcp_create(IUINT32 conv, void* user)
     iqueue_init(&kcp->snd_queue);
     iqueue_init(&kcp->rcv_queue);
     iqueue_init(&kcp->snd_buf);
-    iqueue_init(&kcp->rcv_buf);
     kcp->nrcv_buf = 0;
     kcp->nsnd_buf = 0;
     kcp->nrcv_que = 0;
@@ -307,6 +401,31 @@ ikcpcb* pvp_ikcp_create(IUINT32 conv, void* user)
     kcp->dupsend_on = 0;
     kcp->dupsend_wait = IKCP_DUPSEND_WAIT_DEFAULT;
     kcp->dupsend_wnd_on = IKCP_DUPSEND_WND_ON_DEFAULT;
+    kcp->dupsend_eff = 0;
+    kcp->dupsend_wait_max = IKCP_DUPSEND_WAIT_DEFAULT;
+    kcp->dup_loss_on = IKCP_DUP_LOSS_ON_DEFAULT;
+    kcp->dup_loss_off = IKCP_DUP_LOSS_OFF_DEFAULT;
+    kcp->dup_loss = 0;
+    kcp->dup_sample_send = 0;
+    kcp->dup_sample_lost = 0;
+    kcp->ts_dup_sample = 0;
+    kcp->ts_dup_change = 0;
+    kcp->dup_trace = NULL;
+    kcp->dup_trace_count = 0;
+    kcp->rcv_sn_end = 0;
+    kcp->rcv_sn_gaps = 0;
+    kcp->out_critical = 0;
+    kcp->cc = &ikcp_cc_reno;
+    kcp->cc_state = NULL;
+    kcp->pacing_rate = 0;
+    kcp->pacing_budget = 0;
+    kcp->ts_pacing = 0;
+    kcp->delivered = 0;
+    kcp->ts_delivered = 0;
+    kcp->ts_first_sent = 0;
+    kcp->app_limited = 0;
+    kcp->rate_idle = 1;
+    memset(&kcp->rs, 0, sizeof(kcp->rs));
 
     return kcp;
 }
@@ -325,10 +444,15 @@ void pvp_ikcp_release(ikcpcb* kcp)
             iqueue_del(&seg->node);
             ikcp_segment_delete(kcp, seg);
         }
-        while (!iqueue_is_empty(&kcp->rcv_buf)) {
-            seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-            iqueue_del(&seg->node);
-            ikcp_segment_delete(kcp, seg);
+        if (kcp->rcv_ring) {
+            IUINT32 i;
+            for (i = 0; i <= kcp->rcv_ring_mask; i++) {
+                if (kcp->rcv_ring[i] != NULL) {
+                    ikcp_segment_delete(kcp, kcp->rcv_ring[i]);
+                }
+            }
+            ikcp_free(kcp->rcv_ring);
+            ikcp_free(kcp->rcv_bitmap);
         }
         while (!iqueue_is_empty(&kcp->snd_queue)) {
             seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
@@ -340,20 +464,34 @@ void pvp_ikcp_release(ikcpcb* kcp)
             iqueue_del(&seg->node);
             ikcp_segment_delete(kcp, seg);
         }
-        if (kcp->buffer) {
-            ikcp_free(kcp->buffer);
-        }
+        ikcp_buffer_delete(kcp->buffer, kcp->headroom);
         if (kcp->acklist) {
             ikcp_free(kcp->acklist);
         }
+        if (kcp->snd_ring) {
+            ikcp_free(kcp->snd_ring);
+        }
+        if (kcp->dup_trace) {
+            ikcp_free(kcp->dup_trace);
+        }
+        if (kcp->cc_state) {
+            ikcp_free(kcp->cc_state);
+        }
 
         kcp->nrcv_buf = 0;
         kcp->nsnd_buf = 0;
         kcp->nrcv_que = 0;
+        kcp->rcv_head_len = 0;
+        kcp->rcv_head_done = 0;
         kcp->nsnd_que = 0;
         kcp->ackcount = 0;
         kcp->buffer = NULL;
         kcp->acklist = NULL;
+        kcp->snd_ring = NULL;
+        kcp->snd_ring_mask = 0;
+        kcp->rcv_ring = NULL;
+        kcp->rcv_bitmap = NULL;
+        kcp->rcv_ring_mask = 0;
         kcp->dupsendcount = 0;
         kcp->totallostcount = 0;
         kcp->dupack = 0;
@@ -363,6 +501,10 @@ void pvp_ikcp_release(ikcpcb* kcp)
         kcp->ts_lost = 0;
         kcp->dupsend_dynamic = 0;
         kcp->dupsend_on = 0;
+        kcp->dupsend_eff = 0;
+        kcp->dup_trace = NULL;
+        kcp->dup_trace_count = 0;
+        kcp->cc_state = NULL;
 
         ikcp_free(kcp);
     }
@@ -382,19 +524,65 @@ void pvp_ikcp_setoutput(ikcpcb* kcp,
 void pvp_ikcp_setdupsend(ikcpcb* kcp, int count, int dupack, int dup_dynamic, int dup_wait,
                          int dup_wnd_on)
 {
-    kcp->dupsendcount = count;
     kcp->dupack = dupack;
+    if (dup_wnd_on <= 0 || dup_wnd_on > 512) {
+        kcp->dupsend_wnd_on = IKCP_DUPSEND_WND_ON_DEFAULT;
+    } else {
+        kcp->dupsend_wnd_on = dup_wnd_on;
+    }
+    if (dup_dynamic == IKCP_DUPSEND_ADAPTIVE) {
+        pvp_ikcp_setdupadaptive(kcp, count, dup_wait, 0, 0);
+        return;
+    }
+    kcp->dupsendcount = count;
+    kcp->dupsend_eff = count;
     kcp->dupsend_dynamic = dup_dynamic;
     if (dup_wait <= 0 || dup_wait > 100) {
         kcp->dupsend_wait = IKCP_DUPSEND_WAIT_DEFAULT;
     } else {
         kcp->dupsend_wait = dup_wait;
     }
-    if (dup_wnd_on <= 0 || dup_wnd_on > 512) {
-        kcp->dupsend_wnd_on = IKCP_DUPSEND_WND_ON_DEFAULT;
-    } else {
-        kcp->dupsend_wnd_on = dup_wnd_on;
+}
+
+int pvp_ikcp_setdupadaptive(ikcpcb* kcp, int max_count, int max_wait, int loss_on, int loss_off)
+{
+    if (max_count < 0 || max_count > IKCP_DUPSEND_LEN) return -1;
+    if (loss_on <= 0) loss_on = IKCP_DUP_LOSS_ON_DEFAULT;
+    if (loss_off <= 0) loss_off = IKCP_DUP_LOSS_OFF_DEFAULT;
+    if (loss_on > 1000 || loss_off >= loss_on) return -1;
+    if (max_wait <= 0 || max_wait > 100) max_wait = IKCP_DUPSEND_WAIT_DEFAULT;
+    if (max_count > 0 && kcp->dup_trace == NULL) {
+        kcp->dup_trace =
+            (IKCPDUPTRACE*)ikcp_malloc(sizeof(IKCPDUPTRACE) * IKCP_DUP_TRACE_LEN);
+        if (kcp->dup_trace == NULL) return -2;
+    }
+    kcp->dupsendcount = max_count;
+    kcp->dupsend_dynamic = max_count > 0 ? IKCP_DUPSEND_ADAPTIVE : 0;
+    kcp->dupsend_on = 0;
+    kcp->dupsend_eff = 0;
+    kcp->dupsend_wait = max_wait;
+    kcp->dupsend_wait_max = max_wait;
+    kcp->dup_loss_on = loss_on;
+    kcp->dup_loss_off = loss_off;
+    kcp->dup_loss = 0;
+    kcp->dup_sample_send = 0;
+    kcp->dup_sample_lost = 0;
+    kcp->ts_dup_sample = 0;
+    kcp->dup_trace_count = 0;
+    return 0;
+}
+
+int pvp_ikcp_getduptrace(const ikcpcb* kcp, IKCPDUPTRACE* out, int max)
+{
+    if (kcp->dup_trace == NULL || max <= 0) return 0;
+    IUINT32 n = kcp->dup_trace_count < IKCP_DUP_TRACE_LEN ? kcp->dup_trace_count
+                                                          : IKCP_DUP_TRACE_LEN;
+    if (n > (IUINT32)max) n = (IUINT32)max;
+    IUINT32 i;
+    for (i = 0; i < n; i++) {
+        out[i] = kcp->dup_trace[(kcp->dup_trace_count - n + i) % IKCP_DUP_TRACE_LEN];
     }
+    return (int)n;
 }
 
 int pvp_ikcp_getlostrate(ikcpcb* kcp)
@@ -403,6 +591,45 @@ int pvp_ikcp_getlostrate(ikcpcb* kcp)
     return kcp->totallostcount * 100 / kcp->snd_nxt;
 }
 
+void pvp_ikcp_setsack(ikcpcb* kcp, int enable)
+{
+    kcp->sack = enable ? 1 : 0;
+}
+
+void pvp_ikcp_setcompact(ikcpcb* kcp, int enable, int channel)
+{
+    kcp->compact = enable ? 1 : 0;
+    kcp->compact_channel = (IUINT32)channel & 0x03;
+}
+
+int pvp_ikcp_setackdelay(ikcpcb* kcp, int max_delay, int ack_every)
+{
+    if (max_delay < 0 || ack_every < 0) return -1;
+    kcp->ack_delay = (IUINT32)max_delay;
+    kcp->ack_freq = (IUINT32)ack_every;
+    return 0;
+}
+
+int pvp_ikcp_setcc(ikcpcb* kcp, const struct IKCPCC* cc)
+{
+    void* state = NULL;
+    if (cc == NULL) cc = &ikcp_cc_reno;
+    if (cc->state_size > 0) {
+        state = ikcp_malloc(cc->state_size);
+        if (state == NULL) return -2;
+        memset(state, 0, cc->state_size);
+    }
+    if (kcp->cc_state) {
+        ikcp_free(kcp->cc_state);
+    }
+    kcp->cc = cc;
+    kcp->cc_state = state;
+    kcp->pacing_rate = 0;
+    kcp->pacing_budget = 0;
+    if (cc->init) cc->init(kcp, state);
+    return 0;
+}
+
 int pvp_ikcp_getcurlostrate(ikcpcb* kcp)
 {
     if (kcp->lastlostrate > 0) {
@@ -412,6 +639,120 @@ int pvp_ikcp_getcurlostrate(ikcpcb* kcp)
     return kcp->curlostcount * 100 / kcp->cursendcount;
 }
 
+//---------------------------------------------------------------------
+// receive ring
+//---------------------------------------------------------------------
+// rcv_buf只接收[rcv_nxt, rcv_nxt + rcv_wnd)内的sn, 容量不小于rcv_wnd即不会冲突,
+// 去重和按序移入rcv_queue都是O(1)
+static int ikcp_rcv_ring_test(const ikcpcb* kcp, IUINT32 sn)
+{
+    IUINT32 idx = sn & kcp->rcv_ring_mask;
+    return (kcp->rcv_bitmap[idx >> 5] >> (idx & 31)) & 1;
+}
+
+static void ikcp_rcv_ring_reserve(ikcpcb* kcp)
+{
+    IKCPSEG** ring;
+    IUINT32* bitmap;
+    IUINT32 capacity, i;
+
+    if (kcp->rcv_ring != NULL && kcp->rcv_wnd <= kcp->rcv_ring_mask + 1) return;
+
+    for (capacity = 32; capacity < kcp->rcv_wnd; capacity <<= 1)
+        ;
+    ring = (IKCPSEG**)ikcp_malloc(capacity * sizeof(IKCPSEG*));
+    bitmap = (IUINT32*)ikcp_malloc(capacity / 32 * sizeof(IUINT32));
+    if (ring == NULL || bitmap == NULL) {
+        assert(ring != NULL && bitmap != NULL);
+        abort();
+    }
+    memset(ring, 0, capacity * sizeof(IKCPSEG*));
+    memset(bitmap, 0, capacity / 32 * sizeof(IUINT32));
+    if (kcp->rcv_ring != NULL) {
+        for (i = 0; i <= kcp->rcv_ring_mask; i++) {
+            IKCPSEG* seg = kcp->rcv_ring[i];
+            if (seg != NULL) {
+                IUINT32 idx = seg->sn & (capacity - 1);
+                ring[idx] = seg;
+                bitmap[idx >> 5] |= 1u << (idx & 31);
+            }
+        }
+        ikcp_free(kcp->rcv_ring);
+        ikcp_free(kcp->rcv_bitmap);
+    }
+    kcp->rcv_ring = ring;
+    kcp->rcv_bitmap = bitmap;
+    kcp->rcv_ring_mask = capacity - 1;
+}
+
+static void ikcp_rcv_ring_put(ikcpcb* kcp, IKCPSEG* seg)
+{
+    IUINT32 idx = seg->sn & kcp->rcv_ring_mask;
+    kcp->rcv_ring[idx] = seg;
+    kcp->rcv_bitmap[idx >> 5] |= 1u << (idx & 31);
+}
+
+static IKCPSEG* ikcp_rcv_ring_take(ikcpcb* kcp, IUINT32 sn)
+{
+    IUINT32 idx = sn & kcp->rcv_ring_mask;
+    IKCPSEG* seg = kcp->rcv_ring[idx];
+    kcp->rcv_ring[idx] = NULL;
+    kcp->rcv_bitmap[idx >> 5] &= ~(1u << (idx & 31));
+    return seg;
+}
+
+// move available data from rcv_buf -> rcv_queue
+static void ikcp_rcv_buf_promote(ikcpcb* kcp)
+{
+    while (kcp->nrcv_buf > 0 && kcp->nrcv_que < kcp->rcv_wnd) {
+        IKCPSEG* seg;
+        if (!ikcp_rcv_ring_test(kcp, kcp->rcv_nxt)) break;
+        seg = ikcp_rcv_ring_take(kcp, kcp->rcv_nxt);
+        kcp->nrcv_buf--;
+        iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+        kcp->nrcv_que++;
+        kcp->rcv_nxt++;
+        // 首条消息未到齐时, 队列里的segment都属于首条消息
+        if (!kcp->rcv_head_done) {
+            kcp->rcv_head_len += seg->len;
+            if (seg->frg == 0) kcp->rcv_head_done = 1;
+        }
+    }
+}
+
+// 首条消息被取走后重新统计下一条消息, 每个segment在成为首条消息时只统计一次
+static void ikcp_rcv_head_reset(ikcpcb* kcp)
+{
+    struct IQUEUEHEAD* p;
+    kcp->rcv_head_len = 0;
+    kcp->rcv_head_done = 0;
+    for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue; p = p->next) {
+        IKCPSEG* seg = iqueue_entry(p, IKCPSEG, node);
+        kcp->rcv_head_len += seg->len;
+        if (seg->frg == 0) {
+            kcp->rcv_head_done = 1;
+            break;
+        }
+    }
+}
+
+// 取走一条消息后: 补充rcv_queue, 窗口从满恢复时通知对端
+static void ikcp_recv_done(ikcpcb* kcp, int recover)
+{
+    ikcp_rcv_head_reset(kcp);
+
+    // move available data from rcv_buf -> rcv_queue
+    ikcp_rcv_buf_promote(kcp);
+
+    // fast recover
+    if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
+        // ready to send back IKCP_CMD_WINS in ikcp_flush
+        // tell remote my window size
+        kcp->probe |= IKCP_ASK_TELL;
+    }
+}
+
+
 //---------------------------------------------------------------------
 // user/upper level recv: returns size, returns below zero for EAGAIN
 //---------------------------------------------------------------------
@@ -444,7 +785,7 @@ int pvp_ikcp_recv(ikcpcb* kcp, char* buffer, int len)
         p = p->next;
 
         if (buffer) {
-            memcpy(buffer, seg->data, seg->len);
+            memcpy(buffer, seg->payload, seg->len);
             buffer += seg->len;
         }
 
@@ -466,69 +807,91 @@ int pvp_ikcp_recv(ikcpcb* kcp, char* buffer, int len)
 
     assert(len == peeksize);
 
-    // move available data from rcv_buf -> rcv_queue
-    while (!iqueue_is_empty(&kcp->rcv_buf)) {
-        IKCPSEG* seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-        if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-            iqueue_del(&seg->node);
-            kcp->nrcv_buf--;
-            iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-            kcp->nrcv_que++;
-            kcp->rcv_nxt++;
-        } else {
-            break;
-        }
-    }
-
-    // fast recover
-    if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
-        // ready to send back IKCP_CMD_WINS in ikcp_flush
-        // tell remote my window size
-        kcp->probe |= IKCP_ASK_TELL;
+    if (ispeek == 0) {
+        ikcp_recv_done(kcp, recover);
+    } else {
+        ikcp_rcv_buf_promote(kcp);
     }
 
     return len;
 }
 
-
-//---------------------------------------------------------------------
-// peek data size
-//---------------------------------------------------------------------
-int pvp_ikcp_peeksize(const ikcpcb* kcp)
+IKCPSEG* pvp_ikcp_recv_segment(ikcpcb* kcp)
 {
-    struct IQUEUEHEAD* p;
     IKCPSEG* seg;
-    int length = 0;
-
+    int recover;
     assert(kcp);
 
-    if (iqueue_is_empty(&kcp->rcv_queue)) return -1;
+    if (iqueue_is_empty(&kcp->rcv_queue)) return NULL;
 
     seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
-    if (seg->frg == 0) return seg->len;
-
-    if (kcp->nrcv_que < seg->frg + 1) return -1;
+    if (seg->frg != 0) return NULL;
 
-    for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue; p = p->next) {
-        seg = iqueue_entry(p, IKCPSEG, node);
-        length += seg->len;
-        if (seg->frg == 0) break;
+    if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
+        pvp_ikcp_log(kcp, IKCP_LOG_RECV, "recv sn=%lu", seg->sn);
     }
+    recover = (kcp->nrcv_que >= kcp->rcv_wnd) ? 1 : 0;
+    iqueue_del(&seg->node);
+    kcp->nrcv_que--;
+    ikcp_recv_done(kcp, recover);
+    return seg;
+}
+
+void pvp_ikcp_segment_free(IKCPSEG* seg)
+{
+    ikcp_segment_free(seg);
+}
+
 
-    return length;
+//---------------------------------------------------------------------
+// peek data size
+//---------------------------------------------------------------------
+int pvp_ikcp_peeksize(const ikcpcb* kcp)
+{
+    assert(kcp);
+
+    // 首条消息的长度在segment进出rcv_queue时增量维护
+    if (!kcp->rcv_head_done) return -1;
+    return (int)kcp->rcv_head_len;
 }
 
 
 //---------------------------------------------------------------------
 // user/upper level send, returns below zero for error
 //---------------------------------------------------------------------
-int pvp_ikcp_send(ikcpcb* kcp, const char* buffer, int len, IUINT32 current)
+// 从vec[*idx]的*off处顺序取出size字节拷到dst, 片段base为NULL时只前进不拷贝
+static void ikcp_vec_read(const struct IKCPVEC* vec, int* idx, int* off, char* dst, int size)
+{
+    while (size > 0) {
+        const struct IKCPVEC* v = &vec[*idx];
+        int n = v->len - *off;
+        if (n > size) n = size;
+        if (v->base && n > 0) {
+            memcpy(dst, v->base + *off, n);
+        }
+        dst += n;
+        size -= n;
+        *off += n;
+        if (*off >= v->len) {
+            (*idx)++;
+            *off = 0;
+        }
+    }
+}
+
+static int ikcp_sendv(ikcpcb* kcp, const struct IKCPVEC* vec, int nvec, IUINT32 current,
+                      int critical)
 {
     IKCPSEG* seg;
-    int count, i;
+    int count, i, len = 0;
+    int idx = 0, off = 0;
 
     assert(kcp->mss > 0);
-    if (len < 0) return -1;
+    if (nvec < 0 || (nvec > 0 && vec == NULL)) return -1;
+    for (i = 0; i < nvec; i++) {
+        if (vec[i].len < 0 || vec[i].len > 0x7fffffff - len) return -1;
+        len += vec[i].len;
+    }
 
     if (current > 0) kcp->current = current;
 
@@ -546,12 +909,10 @@ int pvp_ikcp_send(ikcpcb* kcp, const char* buffer, int len, IUINT32 current)
                 }
                 iqueue_add_tail(&seg->node, &kcp->snd_queue);
                 memcpy(seg->data, old->data, old->len);
-                if (buffer) {
-                    memcpy(seg->data + old->len, buffer, extend);
-                    buffer += extend;
-                }
+                ikcp_vec_read(vec, &idx, &off, seg->data + old->len, extend);
                 seg->len = old->len + extend;
                 seg->frg = 0;
+                seg->critical = old->critical | critical;
                 len -= extend;
                 iqueue_del_init(&old->node);
                 ikcp_segment_delete(kcp, old);
@@ -579,23 +940,82 @@ int pvp_ikcp_send(ikcpcb* kcp, const char* buffer, int len, IUINT32 current)
         if (seg == NULL) {
             return -2;
         }
-        if (buffer && len > 0) {
-            memcpy(seg->data, buffer, size);
-        }
+        ikcp_vec_read(vec, &idx, &off, seg->data, size);
         seg->len = size;
         seg->frg = (kcp->stream == 0) ? (count - i - 1) : 0;
+        seg->critical = critical;
         iqueue_init(&seg->node);
         iqueue_add_tail(&seg->node, &kcp->snd_queue);
         kcp->nsnd_que++;
-        if (buffer) {
-            buffer += size;
-        }
         len -= size;
     }
 
     return 0;
 }
 
+int pvp_ikcp_sendv(ikcpcb* kcp, const struct IKCPVEC* vec, int nvec, IUINT32 current)
+{
+    return ikcp_sendv(kcp, vec, nvec, current, 0);
+}
+
+int pvp_ikcp_send(ikcpcb* kcp, const char* buffer, int len, IUINT32 current)
+{
+    struct IKCPVEC vec;
+    vec.base = buffer;
+    vec.len = len;
+    return pvp_ikcp_sendv(kcp, &vec, 1, current);
+}
+
+
+//---------------------------------------------------------------------
+// send ring
+//---------------------------------------------------------------------
+// snd_buf中的segment同时挂在按sn索引的环形数组上, ack时O(1)定位.
+// snd_buf中的sn始终连续落在[snd_una, snd_nxt)内, 容量不小于该区间即不会冲突
+static void ikcp_snd_ring_put(ikcpcb* kcp, IKCPSEG* seg)
+{
+    IUINT32 need = kcp->snd_nxt - kcp->snd_una;
+    if (kcp->snd_ring == NULL || need > kcp->snd_ring_mask + 1) {
+        IKCPSEG** ring;
+        IUINT32 capacity;
+        struct IQUEUEHEAD* p;
+
+        for (capacity = 32; capacity < need; capacity <<= 1)
+            ;
+        ring = (IKCPSEG**)ikcp_malloc(capacity * sizeof(IKCPSEG*));
+        if (ring == NULL) {
+            assert(ring != NULL);
+            abort();
+        }
+        memset(ring, 0, capacity * sizeof(IKCPSEG*));
+        for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+            IKCPSEG* s = iqueue_entry(p, IKCPSEG, node);
+            ring[s->sn & (capacity - 1)] = s;
+        }
+        if (kcp->snd_ring != NULL) {
+            ikcp_free(kcp->snd_ring);
+        }
+        kcp->snd_ring = ring;
+        kcp->snd_ring_mask = capacity - 1;
+    }
+    kcp->snd_ring[seg->sn & kcp->snd_ring_mask] = seg;
+}
+
+static IKCPSEG* ikcp_snd_ring_get(const ikcpcb* kcp, IUINT32 sn)
+{
+    IKCPSEG* seg;
+    if (kcp->snd_ring == NULL) return NULL;
+    seg = kcp->snd_ring[sn & kcp->snd_ring_mask];
+    return (seg != NULL && seg->sn == sn) ? seg : NULL;
+}
+
+static void ikcp_snd_ring_del(ikcpcb* kcp, const IKCPSEG* seg)
+{
+    if (kcp->snd_ring != NULL && kcp->snd_ring[seg->sn & kcp->snd_ring_mask] == seg) {
+        kcp->snd_ring[seg->sn & kcp->snd_ring_mask] = NULL;
+    }
+}
+
 
 //---------------------------------------------------------------------
 // parse ack
@@ -618,6 +1038,73 @@ static void ikcp_update_rtt(ikcpcb* kcp, IINT32 rtt)
     kcp->rx_rto = _ibound_(kcp->rx_minrto, rto, IKCP_RTO_MAX);
 }
 
+//---------------------------------------------------------------------
+// delivery rate sample
+//---------------------------------------------------------------------
+static void ikcp_rate_sent(ikcpcb* kcp, IKCPSEG* seg, IUINT32 current)
+{
+    // 空闲后的第一次发送, 采样区间从现在开始算, 不计空闲时间
+    if (kcp->rate_idle) {
+        kcp->ts_delivered = current;
+        kcp->ts_first_sent = current;
+        kcp->rate_idle = 0;
+    }
+    seg->delivered = kcp->delivered;
+    seg->ts_delivered = kcp->ts_delivered;
+    seg->ts_first_sent = kcp->ts_first_sent;
+    seg->app_limited = kcp->app_limited != 0 ? 1 : 0;
+}
+
+static void ikcp_rate_acked(ikcpcb* kcp, const IKCPSEG* seg)
+{
+    IKCPRATESAMPLE* rs = &kcp->rs;
+    kcp->delivered++;
+    kcp->ts_delivered = kcp->current;
+    // 取最晚发出的segment, 它的采样区间最新
+    if (rs->acked == 0 || _itimediff(seg->delivered, rs->prior_delivered) >= 0) {
+        rs->prior_delivered = seg->delivered;
+        rs->prior_ts = seg->ts_delivered;
+        rs->prior_sent = seg->ts_first_sent;
+        rs->sent = seg->ts;
+        rs->app_limited = seg->app_limited;
+        rs->rtt = (seg->xmit == 1) ? _itimediff(kcp->current, seg->ts) : -1;
+    }
+    rs->acked++;
+    kcp->ts_first_sent = seg->ts;
+}
+
+// 排队的segment填不满窗口时, 接下来发出的segment受应用限制, 速率采样偏低
+static void ikcp_check_app_limited(ikcpcb* kcp, IUINT32 cwnd, IUINT32 quota)
+{
+    IINT32 room = _itimediff(kcp->snd_una + cwnd, kcp->snd_nxt);
+    if (room > 0 && kcp->nsnd_que < (IUINT32)room && kcp->nsnd_que < quota) {
+        kcp->app_limited = kcp->delivered + kcp->nsnd_buf + kcp->nsnd_que;
+        if (kcp->app_limited == 0) kcp->app_limited = 1;
+    }
+}
+
+// 按pacing_rate补充额度, 返回现在最多还能移入snd_buf的新segment数
+static IUINT32 ikcp_pacing_quota(ikcpcb* kcp, IUINT32 current)
+{
+    IINT32 elapsed;
+    IINT64 cap;
+    if (kcp->nocwnd != 0 || kcp->pacing_rate == 0) return 0xffffffff;
+    elapsed = _itimediff(current, kcp->ts_pacing);
+    kcp->ts_pacing = current;
+    if (elapsed > 0) kcp->pacing_budget += (IINT64)elapsed * kcp->pacing_rate;
+    // 空闲后最多攒两个interval的额度, 至少能发2个segment
+    cap = (IINT64)kcp->pacing_rate * kcp->interval * 2;
+    if (cap < 2000) cap = 2000;
+    if (kcp->pacing_budget > cap) kcp->pacing_budget = cap;
+    return kcp->pacing_budget > 0 ? (IUINT32)(kcp->pacing_budget / 1000) : 0;
+}
+
+static void ikcp_pacing_used(ikcpcb* kcp, IUINT32 count)
+{
+    if (kcp->nocwnd != 0 || kcp->pacing_rate == 0) return;
+    kcp->pacing_budget -= (IINT64)count * 1000;
+}
+
 static void ikcp_shrink_buf(ikcpcb* kcp)
 {
     struct IQUEUEHEAD* p = kcp->snd_buf.next;
@@ -631,37 +1118,32 @@ static void ikcp_shrink_buf(ikcpcb* kcp)
 
 static void ikcp_parse_ack(ikcpcb* kcp, IUINT32 sn)
 {
-    struct IQUEUEHEAD *p, *next;
+    IKCPSEG* seg;
 
     if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0) return;
 
-    for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-        IKCPSEG* seg = iqueue_entry(p, IKCPSEG, node);
-        next = p->next;
-        if (sn == seg->sn) {
-            IINT32 rtt = _itimediff(kcp->current, seg->first_ts);
-            IINT32 pkg_rtt = _itimediff(kcp->current, seg->ts);
-            if (rtt > 0) {
-                ikcp_update_rtt(kcp, rtt);
-                if (ikcp_canlog(kcp, IKCP_LOG_IN_ACK)) {
-                    if (rtt != pkg_rtt) {
-                        pvp_ikcp_log(kcp, IKCP_LOG_IN_ACK,
-                                     "input ack: sn=%lu rtt=%ld pkg_rtt=%ld rto=%ld", sn, rtt,
-                                     pkg_rtt, (long)kcp->rx_rto);
-                    } else {
-                        pvp_ikcp_log(kcp, IKCP_LOG_IN_ACK, "input ack: sn=%lu rtt=%ld rto=%ld", sn,
-                                     rtt, (long)kcp->rx_rto);
-                    }
+    seg = ikcp_snd_ring_get(kcp, sn);
+    if (seg != NULL) {
+        IINT32 rtt = _itimediff(kcp->current, seg->first_ts);
+        IINT32 pkg_rtt = _itimediff(kcp->current, seg->ts);
+        if (rtt > 0) {
+            ikcp_update_rtt(kcp, rtt);
+            if (ikcp_canlog(kcp, IKCP_LOG_IN_ACK)) {
+                if (rtt != pkg_rtt) {
+                    pvp_ikcp_log(kcp, IKCP_LOG_IN_ACK,
+                                 "input ack: sn=%lu rtt=%ld pkg_rtt=%ld rto=%ld", sn, rtt, pkg_rtt,
+                                 (long)kcp->rx_rto);
+                } else {
+                    pvp_ikcp_log(kcp, IKCP_LOG_IN_ACK, "input ack: sn=%lu rtt=%ld rto=%ld", sn,
+                                 rtt, (long)kcp->rx_rto);
                 }
             }
-            iqueue_del(p);
-            ikcp_segment_delete(kcp, seg);
-            kcp->nsnd_buf--;
-            break;
-        }
-        if (_itimediff(sn, seg->sn) < 0) {
-            break;
         }
+        ikcp_rate_acked(kcp, seg);
+        ikcp_snd_ring_del(kcp, seg);
+        iqueue_del(&seg->node);
+        ikcp_segment_delete(kcp, seg);
+        kcp->nsnd_buf--;
     }
 }
 
@@ -688,6 +1170,8 @@ static void ikcp_parse_una(ikcpcb* kcp, IUINT32 una)
                     }
                 }
             }
+            ikcp_rate_acked(kcp, seg);
+            ikcp_snd_ring_del(kcp, seg);
             iqueue_del(p);
             ikcp_segment_delete(kcp, seg);
             kcp->nsnd_buf--;
@@ -699,22 +1183,35 @@ static void ikcp_parse_una(ikcpcb* kcp, IUINT32 una)
 
 static void ikcp_parse_fastack(ikcpcb* kcp, IUINT32 sn)
 {
-    struct IQUEUEHEAD *p, *next;
+    IUINT32 i;
 
     if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0) return;
 
-    for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-        IKCPSEG* seg = iqueue_entry(p, IKCPSEG, node);
-        next = p->next;
-        if (_itimediff(sn, seg->sn) < 0) {
-            break;
-        } else if (sn != seg->sn) {
+    // snd_una之前的segment都已确认, 只需遍历[snd_una, sn)
+    for (i = kcp->snd_una; _itimediff(sn, i) > 0; i++) {
+        IKCPSEG* seg = ikcp_snd_ring_get(kcp, i);
+        if (seg != NULL) {
             seg->fastack++;
         }
     }
 }
 
 
+// 确认[start, start + count)内所有sn, 区间外的部分由snd_una/snd_nxt裁掉
+static void ikcp_parse_sack(ikcpcb* kcp, IUINT32 start, IUINT32 count)
+{
+    IUINT32 end = start + count;
+    IUINT32 sn;
+
+    if (_itimediff(kcp->snd_una, start) > 0) start = kcp->snd_una;
+    if (_itimediff(end, kcp->snd_nxt) > 0) end = kcp->snd_nxt;
+    for (sn = start; _itimediff(end, sn) > 0; sn++) {
+        if (kcp->nsnd_buf == 0) break;
+        ikcp_parse_ack(kcp, sn);
+    }
+}
+
+
 //---------------------------------------------------------------------
 // ack append
 //---------------------------------------------------------------------
@@ -749,12 +1246,23 @@ static void ikcp_ack_push(ikcpcb* kcp, IUINT32 sn, IUINT32 ts)
         kcp->ackblock = newblock;
     }
 
+    if (kcp->ackcount == 0) kcp->ts_ack = kcp->current;
     ptr = &kcp->acklist[kcp->ackcount * 2];
     ptr[0] = sn;
     ptr[1] = ts;
     kcp->ackcount++;
 }
 
+// 待回的ack是否需要马上发出, 否则留到ack_delay到期或随数据捎带
+// 出现乱序(rcv_buf非空)时立即回, 让对端尽快快速重传
+static int ikcp_ack_due(const ikcpcb* kcp)
+{
+    if (kcp->ackcount == 0) return 0;
+    if (kcp->ack_delay == 0 || kcp->nrcv_buf > 0) return 1;
+    if (kcp->ack_freq > 0 && kcp->ackcount >= kcp->ack_freq) return 1;
+    return _itimediff(kcp->current, kcp->ts_ack + kcp->ack_delay) >= 0;
+}
+
 static void ikcp_ack_get(const ikcpcb* kcp, int p, IUINT32* sn, IUINT32* ts)
 {
     if (sn) sn[0] = kcp->acklist[p * 2 + 0];
@@ -763,85 +1271,361 @@ static void ikcp_ack_get(const ikcpcb* kcp, int p, IUINT32* sn, IUINT32* ts)
 
 
 //---------------------------------------------------------------------
-// parse data
+// parse data
+//---------------------------------------------------------------------
+void ikcp_parse_data(ikcpcb* kcp, IKCPSEG* newseg)
+{
+    IUINT32 sn = newseg->sn;
+
+    if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 || _itimediff(sn, kcp->rcv_nxt) < 0) {
+        ikcp_segment_delete(kcp, newseg);
+        return;
+    }
+
+    ikcp_rcv_ring_reserve(kcp);
+    if (!ikcp_rcv_ring_test(kcp, sn)) {
+        iqueue_init(&newseg->node);
+        ikcp_rcv_ring_put(kcp, newseg);
+        kcp->nrcv_buf++;
+    } else {
+        ikcp_segment_delete(kcp, newseg);
+    }
+
+#if 0
+	printf("rcv_nxt=%lu nrcv_buf=%lu\n", kcp->rcv_nxt, kcp->nrcv_buf);
+#endif
+
+    // move available data from rcv_buf -> rcv_queue
+    ikcp_rcv_buf_promote(kcp);
+
+#if 0
+	ikcp_qprint("queue", &kcp->rcv_queue);
+	printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
+#endif
+
+#if 1
+//	printf("snd(buf=%d, queue=%d)\n", kcp->nsnd_buf, kcp->nsnd_que);
+//	printf("rcv(buf=%d, queue=%d)\n", kcp->nrcv_buf, kcp->nrcv_que);
+#endif
+}
+
+IUINT32 get_id(IUINT32 base, IUINT32 id)
+{
+    id |= base & ~0xffff;
+    if ((IINT64)id < (IINT64)base - 0x8000) {
+        id += 0x10000;
+    } else if ((IINT64)id > (IINT64)base + 0x8000) {
+        id -= 0x10000;
+    }
+    return id;
+}
+
+//---------------------------------------------------------------------
+// congestion control: reno
+//---------------------------------------------------------------------
+// KCP原有算法: 慢启动+拥塞避免, 快速重传时窗口减半, 超时重传时窗口降到1
+static void ikcp_reno_on_ack(ikcpcb* kcp, void*, const IKCPRATESAMPLE* rs)
+{
+    if (_itimediff(kcp->snd_una, rs->prior_una) <= 0) return;
+    if (kcp->cwnd < kcp->rmt_wnd) {
+        IUINT32 mss = kcp->mss;
+        if (kcp->cwnd < kcp->ssthresh) {
+            kcp->cwnd++;
+            kcp->incr += mss;
+        } else {
+            if (kcp->incr < mss) kcp->incr = mss;
+            kcp->incr += (mss * mss) / kcp->incr + (mss / 16);
+            if ((kcp->cwnd + 1) * mss <= kcp->incr) {
+                kcp->cwnd++;
+            }
+        }
+        if (kcp->cwnd > kcp->rmt_wnd) {
+            kcp->cwnd = kcp->rmt_wnd;
+            kcp->incr = kcp->rmt_wnd * mss;
+        }
+    }
+}
+
+static void ikcp_reno_on_loss(ikcpcb* kcp, void*, int timeout, IUINT32 resent, IUINT32 wnd)
+{
+    if (timeout) {
+        kcp->ssthresh = wnd / 2;
+        if (kcp->ssthresh < IKCP_THRESH_MIN) kcp->ssthresh = IKCP_THRESH_MIN;
+        kcp->cwnd = 1;
+        kcp->incr = kcp->mss;
+    } else {
+        IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
+        kcp->ssthresh = inflight / 2;
+        if (kcp->ssthresh < IKCP_THRESH_MIN) kcp->ssthresh = IKCP_THRESH_MIN;
+        kcp->cwnd = kcp->ssthresh + resent;
+        kcp->incr = kcp->cwnd * kcp->mss;
+    }
+}
+
+const IKCPCC ikcp_cc_reno = {"reno", 0, NULL, ikcp_reno_on_ack, ikcp_reno_on_loss};
+
+
+//---------------------------------------------------------------------
+// congestion control: bbr
 //---------------------------------------------------------------------
-void ikcp_parse_data(ikcpcb* kcp, IKCPSEG* newseg)
+// 按BBR的思路用瓶颈带宽(最近几轮交付速率的最大值)和最小rtt估计BDP, 在途数据维持在
+// 约2倍BDP, 按带宽乘pacing增益发送. 丢包本身不降速, 所以链路排队严重(bufferbloat)时
+// 不会把队列撑满, 随机丢包时也不会无谓降速. 单位都是segment, 增益为百分比
+#define IKCP_BBR_BW_ROUNDS 10                 // 瓶颈带宽取最近这么多轮的最大值
+const IUINT32 IKCP_BBR_MIN_RTT_WIN = 10000;   // 最小rtt超过这么久没刷新就进入PROBE_RTT
+const IUINT32 IKCP_BBR_PROBE_RTT_MS = 200;    // PROBE_RTT至少持续时长
+const IUINT32 IKCP_BBR_MIN_CWND = 4;
+const IUINT32 IKCP_BBR_HIGH_GAIN = 289;       // 2/ln2, STARTUP每轮带宽翻倍
+const IUINT32 IKCP_BBR_DRAIN_GAIN = 35;       // 1/HIGH_GAIN, 排空STARTUP攒下的队列
+const IUINT32 IKCP_BBR_CWND_GAIN = 200;
+const IUINT32 IKCP_BBR_FULL_BW_GROWTH = 125;  // 带宽连续3轮增长不到25%认为已到瓶颈
+static const IUINT32 ikcp_bbr_cycle_gain[8] = {125, 75, 100, 100, 100, 100, 100, 100};
+
+enum { IKCP_BBR_STARTUP, IKCP_BBR_DRAIN, IKCP_BBR_PROBE_BW, IKCP_BBR_PROBE_RTT };
+
+struct IKCPBBR {
+    int mode;
+    IUINT32 bw[IKCP_BBR_BW_ROUNDS];  // 各轮最大交付速率(segment/s), 按轮次环形存放
+    IUINT32 round;                   // 已过的往返轮数
+    IUINT32 next_round_delivered;    // 确认到这个delivered时进入下一轮
+    IUINT32 min_rtt;                 // ms, 0为还没有采样
+    IUINT32 ts_min_rtt;
+    IUINT32 full_bw;                 // STARTUP判断带宽是否还在增长
+    int full_bw_count;
+    int full_bw_reached;
+    int cycle_index;                 // PROBE_BW当前增益
+    IUINT32 ts_cycle;
+    IUINT32 ts_probe_rtt_done;       // PROBE_RTT结束时间, 0为还没降到最小窗口
+    int probe_rtt_round_done;
+};
+
+static IUINT32 ikcp_bbr_max_bw(const IKCPBBR* bbr)
 {
-    struct IQUEUEHEAD *p, *prev;
-    IUINT32 sn = newseg->sn;
-    int repeat = 0;
+    IUINT32 bw = 0;
+    int i;
+    for (i = 0; i < IKCP_BBR_BW_ROUNDS; i++) {
+        if (bbr->bw[i] > bw) bw = bbr->bw[i];
+    }
+    return bw;
+}
 
-    if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 || _itimediff(sn, kcp->rcv_nxt) < 0) {
-        ikcp_segment_delete(kcp, newseg);
-        return;
+// 按增益换算的在途segment数. ack最快每个interval才回一次, rtt按不小于interval算,
+// 否则本机/局域网上min_rtt接近0, BDP只剩最小窗口
+static IUINT32 ikcp_bbr_bdp(const ikcpcb* kcp, const IKCPBBR* bbr, IUINT32 gain)
+{
+    IUINT32 rtt = bbr->min_rtt > 0 ? bbr->min_rtt : (IUINT32)_imax_(kcp->rx_srtt, 1);
+    rtt = _imax_(rtt, kcp->interval);
+    IINT64 bdp = (IINT64)ikcp_bbr_max_bw(bbr) * rtt * gain / 100000;
+    return bdp < 0xffff ? (IUINT32)bdp : 0xffff;
+}
+
+static void ikcp_bbr_init(ikcpcb*, void* state)
+{
+    IKCPBBR* bbr = (IKCPBBR*)state;
+    bbr->mode = IKCP_BBR_STARTUP;
+}
+
+static void ikcp_bbr_on_ack(ikcpcb* kcp, void* state, const IKCPRATESAMPLE* rs)
+{
+    IKCPBBR* bbr = (IKCPBBR*)state;
+    IUINT32 current = kcp->current;
+    IUINT32 max_bw, pacing_gain, cwnd_gain, cwnd;
+    int round_start = 0;
+    int min_rtt_expired;
+
+    // 往返轮次: 本轮开始后发出的segment被确认即进入下一轮
+    if (_itimediff(rs->prior_delivered, bbr->next_round_delivered) >= 0) {
+        bbr->next_round_delivered = kcp->delivered;
+        bbr->round++;
+        bbr->bw[bbr->round % IKCP_BBR_BW_ROUNDS] = 0;
+        round_start = 1;
     }
 
-    for (p = kcp->rcv_buf.prev; p != &kcp->rcv_buf; p = prev) {
-        IKCPSEG* seg = iqueue_entry(p, IKCPSEG, node);
-        prev = p->prev;
-        if (seg->sn == sn) {
-            repeat = 1;
-            break;
-        }
-        if (_itimediff(sn, seg->sn) > 0) {
-            break;
+    // 受应用限制的采样偏低, 只在超过当前估计时采用
+    max_bw = ikcp_bbr_max_bw(bbr);
+    if (rs->delivered > 0) {
+        IUINT32 bw = (IUINT32)((IINT64)rs->delivered * 1000 / rs->interval);
+        if (!rs->app_limited || bw >= max_bw) {
+            IUINT32* slot = &bbr->bw[bbr->round % IKCP_BBR_BW_ROUNDS];
+            if (bw > *slot) *slot = bw;
         }
     }
+    max_bw = ikcp_bbr_max_bw(bbr);
 
-    if (repeat == 0) {
-        iqueue_init(&newseg->node);
-        iqueue_add(&newseg->node, p);
-        kcp->nrcv_buf++;
-    } else {
-        ikcp_segment_delete(kcp, newseg);
+    min_rtt_expired =
+        bbr->min_rtt > 0 && _itimediff(current, bbr->ts_min_rtt) > (IINT32)IKCP_BBR_MIN_RTT_WIN;
+    if (rs->rtt >= 0 && (bbr->min_rtt == 0 || (IUINT32)rs->rtt <= bbr->min_rtt || min_rtt_expired)) {
+        bbr->min_rtt = rs->rtt > 0 ? (IUINT32)rs->rtt : 1;
+        bbr->ts_min_rtt = current;
     }
 
-#if 0
-	ikcp_qprint("rcvbuf", &kcp->rcv_buf);
-	printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
-#endif
+    // STARTUP: 带宽不再明显增长时认为到达瓶颈
+    if (!bbr->full_bw_reached && round_start && !rs->app_limited) {
+        if ((IINT64)max_bw * 100 >= (IINT64)bbr->full_bw * IKCP_BBR_FULL_BW_GROWTH) {
+            bbr->full_bw = max_bw;
+            bbr->full_bw_count = 0;
+        } else if (++bbr->full_bw_count >= 3) {
+            bbr->full_bw_reached = 1;
+        }
+    }
 
-    // move available data from rcv_buf -> rcv_queue
-    while (!iqueue_is_empty(&kcp->rcv_buf)) {
-        IKCPSEG* seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-        if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-            iqueue_del(&seg->node);
-            kcp->nrcv_buf--;
-            iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-            kcp->nrcv_que++;
-            kcp->rcv_nxt++;
-        } else {
-            break;
+    if (bbr->mode == IKCP_BBR_STARTUP && bbr->full_bw_reached) {
+        bbr->mode = IKCP_BBR_DRAIN;
+    }
+    if (bbr->mode == IKCP_BBR_DRAIN && kcp->nsnd_buf <= ikcp_bbr_bdp(kcp, bbr, 100)) {
+        bbr->mode = IKCP_BBR_PROBE_BW;
+        bbr->cycle_index = 2;
+        bbr->ts_cycle = current;
+    }
+    if (bbr->mode == IKCP_BBR_PROBE_BW &&
+        _itimediff(current, bbr->ts_cycle) > (IINT32)_imax_(bbr->min_rtt, kcp->interval)) {
+        bbr->cycle_index = (bbr->cycle_index + 1) % 8;
+        bbr->ts_cycle = current;
+    }
+
+    // PROBE_RTT: 在途降到最小窗口保持一段时间, 让队列排空以测到真实的最小rtt
+    if (min_rtt_expired && bbr->mode != IKCP_BBR_PROBE_RTT) {
+        bbr->mode = IKCP_BBR_PROBE_RTT;
+        bbr->ts_probe_rtt_done = 0;
+    }
+    if (bbr->mode == IKCP_BBR_PROBE_RTT) {
+        if (bbr->ts_probe_rtt_done == 0 && kcp->nsnd_buf <= IKCP_BBR_MIN_CWND) {
+            bbr->ts_probe_rtt_done = current + IKCP_BBR_PROBE_RTT_MS;
+            if (bbr->ts_probe_rtt_done == 0) bbr->ts_probe_rtt_done = 1;
+            bbr->probe_rtt_round_done = 0;
+            bbr->next_round_delivered = kcp->delivered;
+        } else if (bbr->ts_probe_rtt_done != 0) {
+            if (round_start) bbr->probe_rtt_round_done = 1;
+            if (bbr->probe_rtt_round_done && _itimediff(current, bbr->ts_probe_rtt_done) >= 0) {
+                bbr->ts_min_rtt = current;
+                bbr->mode = bbr->full_bw_reached ? IKCP_BBR_PROBE_BW : IKCP_BBR_STARTUP;
+                bbr->cycle_index = 2;
+                bbr->ts_cycle = current;
+            }
         }
     }
 
-#if 0
-	ikcp_qprint("queue", &kcp->rcv_queue);
-	printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
-#endif
+    switch (bbr->mode) {
+    case IKCP_BBR_STARTUP:
+        pacing_gain = IKCP_BBR_HIGH_GAIN;
+        cwnd_gain = IKCP_BBR_HIGH_GAIN;
+        break;
+    case IKCP_BBR_DRAIN:
+        pacing_gain = IKCP_BBR_DRAIN_GAIN;
+        cwnd_gain = IKCP_BBR_HIGH_GAIN;
+        break;
+    case IKCP_BBR_PROBE_BW:
+        pacing_gain = ikcp_bbr_cycle_gain[bbr->cycle_index];
+        cwnd_gain = IKCP_BBR_CWND_GAIN;
+        break;
+    default:
+        pacing_gain = 100;
+        cwnd_gain = IKCP_BBR_CWND_GAIN;
+        break;
+    }
 
-#if 1
-//	printf("snd(buf=%d, queue=%d)\n", kcp->nsnd_buf, kcp->nsnd_que);
-//	printf("rcv(buf=%d, queue=%d)\n", kcp->nrcv_buf, kcp->nrcv_que);
-#endif
+    // 还没有带宽采样时沿用初始窗口, 不限速
+    if (max_bw == 0) return;
+    kcp->pacing_rate = (IUINT32)_imax_((IUINT32)((IINT64)max_bw * pacing_gain / 100), 1);
+    // 多留2个segment给延迟ack和小包合并
+    cwnd = ikcp_bbr_bdp(kcp, bbr, cwnd_gain) + 2;
+    if (bbr->mode == IKCP_BBR_PROBE_RTT) cwnd = IKCP_BBR_MIN_CWND;
+    kcp->cwnd = _ibound_(IKCP_BBR_MIN_CWND, cwnd, _imax_(kcp->rmt_wnd, IKCP_BBR_MIN_CWND));
 }
 
-IUINT32 get_id(IUINT32 base, IUINT32 id)
+// 丢包不代表拥塞, 只在超时重传时把窗口压到最小, 等新的确认按模型恢复
+static void ikcp_bbr_on_loss(ikcpcb* kcp, void*, int timeout, IUINT32, IUINT32)
 {
-    id |= base & ~0xffff;
-    if ((IINT64)id < (IINT64)base - 0x8000) {
-        id += 0x10000;
-    } else if ((IINT64)id > (IINT64)base + 0x8000) {
-        id -= 0x10000;
+    if (timeout) kcp->cwnd = IKCP_BBR_MIN_CWND;
+}
+
+const IKCPCC ikcp_cc_bbr = {"bbr", (int)sizeof(IKCPBBR), ikcp_bbr_init, ikcp_bbr_on_ack,
+                            ikcp_bbr_on_loss};
+
+
+//---------------------------------------------------------------------
+// compact segment head
+//---------------------------------------------------------------------
+// | flags(1B) | ts | sn(2B) | una(2B) | wnd(varint) | frg(varint) | len(varint) |
+// flags低3位为cmd-IKCP_CMD_PUSH, 3-4位为通道号, 高3位见IKCP_COMPACT_*. una/wnd/frg按标志省略.
+// PUSH/DUPS的ts为4字节, 或相对同一datagram里前一个PUSH/DUPS的zigzag varint;
+// ACK/SACK的ts是回显的本端时间, 只带低16位, 收到时按当前时间还原; WASK/WINS不带ts.
+// 每次output的第一个segment不依赖前面的内容, 拼在一起的datagram可以逐段解码
+struct IKCPCOMPACTHEAD {
+    IUINT32 cmd;
+    IUINT32 channel;
+    IUINT32 frg;
+    IUINT32 wnd;
+    IUINT32 ts;
+    IUINT32 sn;
+    IUINT32 una;
+    IUINT32 len;
+    IUINT32 push_ts;  // 前一个PUSH/DUPS的ts
+    int state;        // bit0为push_ts有效, bit1为una/wnd有效
+};
+
+// 解出一个紧凑segment头, h里保留前面segment的上下文. 数据不完整或缺少上下文返回NULL
+static const char* ikcp_decode_compact(const char* p, const char* end, IUINT32 current,
+                                       struct IKCPCOMPACTHEAD* h)
+{
+    IUINT32 flags, v;
+    IUINT16 w;
+    if (p >= end) return NULL;
+    flags = *(const unsigned char*)p++;
+    h->cmd = IKCP_CMD_PUSH + (flags & 0x07);
+    h->channel = (flags >> 3) & 0x03;
+    if (h->cmd > IKCP_CMD_SACK) return NULL;
+    h->ts = 0;
+    if (h->cmd == IKCP_CMD_PUSH || h->cmd == IKCP_CMD_DUPS) {
+        if (flags & IKCP_COMPACT_TS) {
+            if (end - p < 4) return NULL;
+            p = ikcp_decode32u(p, &h->push_ts);
+        } else {
+            if ((h->state & 1) == 0) return NULL;
+            p = ikcp_decode_varint(p, end, &v);
+            if (p == NULL) return NULL;
+            h->push_ts += (IUINT32)ikcp_unzigzag(v);
+        }
+        h->state |= 1;
+        h->ts = h->push_ts;
+    } else if (h->cmd == IKCP_CMD_ACK || h->cmd == IKCP_CMD_SACK) {
+        if (end - p < 2) return NULL;
+        p = ikcp_decode16u(p, &w);
+        h->ts = current - (IUINT16)((IUINT16)current - w);
     }
-    return id;
+    if (end - p < 2) return NULL;
+    p = ikcp_decode16u(p, &w);
+    h->sn = w;
+    if (flags & IKCP_COMPACT_UW) {
+        if (end - p < 2) return NULL;
+        p = ikcp_decode16u(p, &w);
+        h->una = w;
+        p = ikcp_decode_varint(p, end, &h->wnd);
+        if (p == NULL) return NULL;
+        h->state |= 2;
+    } else if ((h->state & 2) == 0) {
+        return NULL;
+    }
+    h->frg = 0;
+    if (flags & IKCP_COMPACT_FRG) {
+        p = ikcp_decode_varint(p, end, &h->frg);
+        if (p == NULL) return NULL;
+    }
+    p = ikcp_decode_varint(p, end, &h->len);
+    if (p == NULL || h->frg > 0xFFFF || h->wnd > 0xFFFF || h->len > 0xFFFF) return NULL;
+    return p;
 }
 
+
 //---------------------------------------------------------------------
 // input data
 //---------------------------------------------------------------------
-int pvp_ikcp_input(ikcpcb* kcp, const char* data, long size, IUINT32 current)
+static int ikcp_input(ikcpcb* kcp, const char* data, long size, IUINT32 current,
+                      struct IKCPREF* ref, int compact)
 {
+    struct IKCPCOMPACTHEAD head;
+    const char* begin = data;
+
     if (current > 0) kcp->current = current;
     if (kcp->state == (IUINT32)-1) {
         kcp->state = 0;
@@ -856,7 +1640,8 @@ int pvp_ikcp_input(ikcpcb* kcp, const char* data, long size, IUINT32 current)
         pvp_ikcp_log(kcp, IKCP_LOG_INPUT, "[RI] %d bytes", size);
     }
 
-    if (data == NULL || (int)size < (int)IKCP_OVERHEAD) return -1;
+    if (data == NULL || (int)size < (compact ? 1 : (int)IKCP_OVERHEAD)) return -1;
+    memset(&head, 0, sizeof(head));
 
     while (1) {
         IUINT16 tmp_sn, tmp_una, len;
@@ -866,26 +1651,47 @@ int pvp_ikcp_input(ikcpcb* kcp, const char* data, long size, IUINT32 current)
         IUINT16 frg;
         IKCPSEG* seg;
 
-        if (size < (int)IKCP_OVERHEAD) break;
+        if (compact) {
+            // 末尾解不出完整的头时与普通格式一样忽略, 第一个就解不出为错误
+            const char* next;
+            if (size <= 0) break;
+            next = ikcp_decode_compact(data, data + size, kcp->current, &head);
+            if (next == NULL) {
+                if (data == begin) return -1;
+                break;
+            }
+            conv = kcp->conv;
+            cmd = (IUINT8)head.cmd;
+            frg = (IUINT16)head.frg;
+            wnd = (IUINT16)head.wnd;
+            ts = head.ts;
+            tmp_sn = (IUINT16)head.sn;
+            tmp_una = (IUINT16)head.una;
+            len = (IUINT16)head.len;
+            size -= (long)(next - data);
+            data = next;
+        } else {
+            if (size < (int)IKCP_OVERHEAD) break;
+
+            data = ikcp_decode32u(data, &conv);
+            if (conv != kcp->conv) return -1;
 
-        data = ikcp_decode32u(data, &conv);
-        if (conv != kcp->conv) return -1;
+            data = ikcp_decode8u(data, &cmd);
+            data = ikcp_decode16u(data, &frg);
+            data = ikcp_decode16u(data, &wnd);
+            data = ikcp_decode32u(data, &ts);
+            data = ikcp_decode16u(data, &tmp_sn);
+            data = ikcp_decode16u(data, &tmp_una);
+            data = ikcp_decode16u(data, &len);
 
-        data = ikcp_decode8u(data, &cmd);
-        data = ikcp_decode16u(data, &frg);
-        data = ikcp_decode16u(data, &wnd);
-        data = ikcp_decode32u(data, &ts);
-        data = ikcp_decode16u(data, &tmp_sn);
-        data = ikcp_decode16u(data, &tmp_una);
-        data = ikcp_decode16u(data, &len);
+            size -= IKCP_OVERHEAD;
+        }
         IUINT32 una = get_id(kcp->snd_nxt, tmp_una);
 
-        size -= IKCP_OVERHEAD;
-
         if ((long)size < (long)len) return -2;
 
         if (cmd != IKCP_CMD_PUSH && cmd != IKCP_CMD_ACK && cmd != IKCP_CMD_WASK &&
-            cmd != IKCP_CMD_WINS && cmd != IKCP_CMD_DUPS)
+            cmd != IKCP_CMD_WINS && cmd != IKCP_CMD_DUPS && cmd != IKCP_CMD_SACK)
             return -3;
 
         kcp->rmt_wnd = wnd;
@@ -904,6 +1710,31 @@ int pvp_ikcp_input(ikcpcb* kcp, const char* data, long size, IUINT32 current)
                     maxack = sn;
                 }
             }
+        } else if (cmd == IKCP_CMD_SACK) {
+            // frg为区间个数, 每个区间为相对una的偏移和连续sn个数
+            IUINT32 sn = get_id(kcp->snd_nxt, tmp_sn);
+            const char* range = data;
+            IUINT16 offset, count;
+            int i;
+            if ((int)len < (int)frg * 4) return -2;
+            for (i = 0; i < (int)frg; i++) {
+                range = ikcp_decode16u(range, &offset);
+                range = ikcp_decode16u(range, &count);
+                ikcp_parse_sack(kcp, una + offset, count);
+            }
+            ikcp_shrink_buf(kcp);
+            if (ikcp_canlog(kcp, IKCP_LOG_IN_ACK)) {
+                pvp_ikcp_log(kcp, IKCP_LOG_IN_ACK, "input sack: una=%lu sn=%lu ranges=%d", una,
+                             sn, (int)frg);
+            }
+            if (flag == 0) {
+                flag = 1;
+                maxack = sn;
+            } else {
+                if (_itimediff(sn, maxack) > 0) {
+                    maxack = sn;
+                }
+            }
         } else if (cmd == IKCP_CMD_PUSH || cmd == IKCP_CMD_DUPS) {
             IUINT32 sn = get_id(kcp->rcv_nxt, tmp_sn);
             if (ikcp_canlog(kcp, IKCP_LOG_IN_DATA)) {
@@ -913,8 +1744,12 @@ int pvp_ikcp_input(ikcpcb* kcp, const char* data, long size, IUINT32 current)
                 if (cmd == IKCP_CMD_PUSH || kcp->dupack) {
                     ikcp_ack_push(kcp, sn, ts);
                 }
+                if (_itimediff(sn, kcp->rcv_sn_end) >= 0) {
+                    kcp->rcv_sn_gaps += sn - kcp->rcv_sn_end;
+                    kcp->rcv_sn_end = sn + 1;
+                }
                 if (_itimediff(sn, kcp->rcv_nxt) >= 0) {
-                    seg = ikcp_segment_new(kcp, len);
+                    seg = ikcp_segment_new(kcp, (ref != NULL) ? 0 : len);
                     seg->conv = conv;
                     seg->cmd = cmd;
                     seg->frg = frg;
@@ -924,7 +1759,12 @@ int pvp_ikcp_input(ikcpcb* kcp, const char* data, long size, IUINT32 current)
                     seg->una = una;
                     seg->len = len;
 
-                    if (len > 0) {
+                    if (ref != NULL) {
+                        // 直接引用datagram里的数据
+                        ref->retain(ref);
+                        seg->ref = ref;
+                        seg->payload = (char*)data;
+                    } else if (len > 0) {
                         memcpy(seg->data, data, len);
                     }
 
@@ -955,35 +1795,88 @@ int pvp_ikcp_input(ikcpcb* kcp, const char* data, long size, IUINT32 current)
         ikcp_parse_fastack(kcp, maxack);
     }
 
-    if (_itimediff(kcp->snd_una, una) > 0) {
-        if (kcp->cwnd < kcp->rmt_wnd) {
-            IUINT32 mss = kcp->mss;
-            if (kcp->cwnd < kcp->ssthresh) {
-                kcp->cwnd++;
-                kcp->incr += mss;
-            } else {
-                if (kcp->incr < mss) kcp->incr = mss;
-                kcp->incr += (mss * mss) / kcp->incr + (mss / 16);
-                if ((kcp->cwnd + 1) * mss <= kcp->incr) {
-                    kcp->cwnd++;
-                }
-            }
-            if (kcp->cwnd > kcp->rmt_wnd) {
-                kcp->cwnd = kcp->rmt_wnd;
-                kcp->incr = kcp->rmt_wnd * mss;
-            }
+    if (kcp->rs.acked > 0) {
+        IKCPRATESAMPLE* rs = &kcp->rs;
+        rs->prior_una = una;
+        rs->delivered = kcp->delivered - rs->prior_delivered;
+        // 确认可能成批到达, 发送间隔更长时用发送间隔, 避免高估速率
+        rs->interval = _itimediff(kcp->current, rs->prior_ts);
+        if (rs->interval < _itimediff(rs->sent, rs->prior_sent)) {
+            rs->interval = _itimediff(rs->sent, rs->prior_sent);
         }
+        if (rs->interval < 1) rs->interval = 1;
+        kcp->cc->on_ack(kcp, kcp->cc_state, rs);
+        rs->acked = 0;
+    }
+    if (kcp->app_limited != 0 && _itimediff(kcp->delivered, kcp->app_limited) > 0) {
+        kcp->app_limited = 0;
     }
+    if (kcp->nsnd_buf == 0) kcp->rate_idle = 1;
 
     return 0;
 }
 
+int pvp_ikcp_input(ikcpcb* kcp, const char* data, long size, IUINT32 current)
+{
+    return ikcp_input(kcp, data, size, current, NULL, 0);
+}
+
+int pvp_ikcp_input_ref(ikcpcb* kcp, const char* data, long size, IUINT32 current,
+                       struct IKCPREF* ref)
+{
+    return ikcp_input(kcp, data, size, current, ref, 0);
+}
+
+int pvp_ikcp_input_compact(ikcpcb* kcp, const char* data, long size, IUINT32 current,
+                           struct IKCPREF* ref)
+{
+    return ikcp_input(kcp, data, size, current, ref, 1);
+}
+
 
 //---------------------------------------------------------------------
 // ikcp_encode_seg
 //---------------------------------------------------------------------
-static char* ikcp_encode_seg(char* ptr, const IKCPSEG* seg)
+// 紧凑头, 格式见ikcp_decode_compact. 写在buffer开头时为一次output的第一个segment, 不沿用前面的
+static char* ikcp_encode_compact(ikcpcb* kcp, char* ptr, const IKCPSEG* seg)
+{
+    IUINT32 flags = (seg->cmd - IKCP_CMD_PUSH) | (kcp->compact_channel << 3);
+    char* p = ptr + 1;
+    if (ptr == kcp->buffer) kcp->enc_state = 0;
+    if (seg->cmd == IKCP_CMD_PUSH || seg->cmd == IKCP_CMD_DUPS) {
+        if (kcp->enc_state & 1) {
+            p = ikcp_encode_varint(p, ikcp_zigzag((IINT32)(seg->ts - kcp->enc_ts)));
+        } else {
+            flags |= IKCP_COMPACT_TS;
+            p = ikcp_encode32u(p, seg->ts);
+        }
+        kcp->enc_ts = seg->ts;
+        kcp->enc_state |= 1;
+    } else if (seg->cmd == IKCP_CMD_ACK || seg->cmd == IKCP_CMD_SACK) {
+        p = ikcp_encode16u(p, (IUINT16)seg->ts);
+    }
+    p = ikcp_encode16u(p, (IUINT16)seg->sn);
+    if ((kcp->enc_state & 2) == 0 || (IUINT16)seg->una != kcp->enc_una ||
+        (IUINT16)seg->wnd != kcp->enc_wnd) {
+        flags |= IKCP_COMPACT_UW;
+        kcp->enc_una = (IUINT16)seg->una;
+        kcp->enc_wnd = (IUINT16)seg->wnd;
+        kcp->enc_state |= 2;
+        p = ikcp_encode16u(p, (IUINT16)kcp->enc_una);
+        p = ikcp_encode_varint(p, kcp->enc_wnd);
+    }
+    if ((IUINT16)seg->frg != 0) {
+        flags |= IKCP_COMPACT_FRG;
+        p = ikcp_encode_varint(p, (IUINT16)seg->frg);
+    }
+    p = ikcp_encode_varint(p, (IUINT16)seg->len);
+    *(unsigned char*)ptr = (unsigned char)flags;
+    return p;
+}
+
+static char* ikcp_encode_seg(ikcpcb* kcp, char* ptr, const IKCPSEG* seg)
 {
+    if (kcp->compact) return ikcp_encode_compact(kcp, ptr, seg);
     ptr = ikcp_encode32u(ptr, seg->conv);
     ptr = ikcp_encode8u(ptr, (IUINT8)seg->cmd);
     ptr = ikcp_encode16u(ptr, (IUINT16)seg->frg);
@@ -1005,6 +1898,121 @@ static int ikcp_wnd_unused(const ikcpcb* kcp)
 }
 
 
+//---------------------------------------------------------------------
+// ikcp_flush_sack
+//---------------------------------------------------------------------
+// 把acklist合并为一个SACK segment写入buffer, 返回新的写入位置
+// | header(sn=最大ack sn, ts=其ts, frg=区间数, len=4*frg) | offset(2B) | count(2B) | ...
+// una之后rcv_buf里已收到的sn全部按区间带上, 丢掉一个SACK也不影响后续确认
+static char* ikcp_flush_sack(ikcpcb* kcp, char* ptr, const IKCPSEG* ack)
+{
+    char* buffer = kcp->buffer;
+    IKCPSEG seg = *ack;
+    IUINT32 sn, end, found = 0;
+    int i, size, maxrange, nrange = 0;
+    char *range, *head_end;
+
+    seg.cmd = IKCP_CMD_SACK;
+    ikcp_ack_get(kcp, 0, &seg.sn, &seg.ts);
+    for (i = 1; i < (int)kcp->ackcount; i++) {
+        IUINT32 acksn, ackts;
+        ikcp_ack_get(kcp, i, &acksn, &ackts);
+        if (_itimediff(acksn, seg.sn) > 0) {
+            seg.sn = acksn;
+            seg.ts = ackts;
+        }
+    }
+
+    // 区间数不超过rcv_buf中segment数, 放不下就先把已有内容发出去
+    maxrange = ((int)kcp->mtu - (int)IKCP_OVERHEAD) / 4;
+    if ((int)kcp->nrcv_buf < maxrange) maxrange = (int)kcp->nrcv_buf;
+    size = (int)(ptr - buffer);
+    if (size + (int)IKCP_OVERHEAD + maxrange * 4 > (int)kcp->mtu) {
+        ikcp_output(kcp, buffer, size);
+        ptr = buffer;
+    }
+
+    range = ptr + IKCP_OVERHEAD;
+    end = seg.sn + 1;
+    for (sn = kcp->rcv_nxt; found < kcp->nrcv_buf && _itimediff(end, sn) > 0; sn++) {
+        IUINT32 start;
+        if (!ikcp_rcv_ring_test(kcp, sn)) continue;
+        if (nrange == maxrange) {
+            // 装不下的区间不确认, fastack也只算到已确认的最大sn
+            seg.sn = sn - 1;
+            break;
+        }
+        start = sn;
+        while (_itimediff(end, sn + 1) > 0 && ikcp_rcv_ring_test(kcp, sn + 1)) sn++;
+        found += sn - start + 1;
+        range = ikcp_encode16u(range, (unsigned short)(start - seg.una));
+        range = ikcp_encode16u(range, (unsigned short)(sn - start + 1));
+        nrange++;
+    }
+    seg.frg = nrange;
+    seg.len = nrange * 4;
+    // 紧凑头更短, 区间跟着前移
+    head_end = ikcp_encode_seg(kcp, ptr, &seg);
+    if (head_end != ptr + IKCP_OVERHEAD) {
+        memmove(head_end, ptr + IKCP_OVERHEAD, seg.len);
+        range = head_end + seg.len;
+    }
+    if (ikcp_canlog(kcp, IKCP_LOG_OUT_ACK)) {
+        pvp_ikcp_log(kcp, IKCP_LOG_OUT_ACK, "send sack una=%lu sn=%lu ranges=%d acks=%lu",
+                     seg.una, seg.sn, nrange, kcp->ackcount);
+    }
+    return range;
+}
+
+
+// 把所有待回ack写入buffer, seg为ack模板(conv/wnd/una), 返回新的写入位置
+static char* ikcp_flush_ack(ikcpcb* kcp, char* ptr, IKCPSEG* seg)
+{
+    char* buffer = kcp->buffer;
+    int count = kcp->ackcount;
+    int i, size;
+
+    seg->cmd = IKCP_CMD_ACK;
+    if (kcp->sack && count > 0) {
+        ptr = ikcp_flush_sack(kcp, ptr, seg);
+        count = 0;
+    }
+    for (i = 0; i < count; i++) {
+        size = (int)(ptr - buffer);
+        if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
+            ikcp_output(kcp, buffer, size);
+            ptr = buffer;
+        }
+        ikcp_ack_get(kcp, i, &seg->sn, &seg->ts);
+        ptr = ikcp_encode_seg(kcp, ptr, seg);
+        if (ikcp_canlog(kcp, IKCP_LOG_OUT_DATA)) {
+            pvp_ikcp_log(kcp, IKCP_LOG_OUT_DATA, "send sn=%lu len=%lu ack", seg->sn, seg->len);
+        }
+    }
+    kcp->ackcount = 0;
+    return ptr;
+}
+
+// ack延迟到期但没有数据要发时单独回ack
+static void ikcp_flush_ack_only(ikcpcb* kcp)
+{
+    char* ptr;
+    IKCPSEG seg;
+
+    seg.conv = kcp->conv;
+    seg.frg = 0;
+    seg.wnd = ikcp_wnd_unused(kcp);
+    seg.una = kcp->rcv_nxt;
+    seg.len = 0;
+    seg.sn = 0;
+    seg.ts = 0;
+    ptr = ikcp_flush_ack(kcp, kcp->buffer, &seg);
+    if (ptr != kcp->buffer) {
+        ikcp_output(kcp, kcp->buffer, (int)(ptr - kcp->buffer));
+    }
+}
+
+
 //---------------------------------------------------------------------
 // ikcp_flush
 //---------------------------------------------------------------------
@@ -1013,8 +2021,9 @@ void pvp_ikcp_flush(ikcpcb* kcp)
     IUINT32 current = kcp->current;
     char* buffer = kcp->buffer;
     char* ptr = buffer;
-    int count, size, i;
-    IUINT32 resent, cwnd;
+    int size, i;
+    IUINT32 resent, cwnd, quota;
+    IUINT32 moved = 0;
     IUINT32 rtomin;
     struct IQUEUEHEAD* p;
     int change = 0;
@@ -1034,22 +2043,10 @@ void pvp_ikcp_flush(ikcpcb* kcp)
     seg.ts = 0;
 
     // flush acknowledges
-    count = kcp->ackcount;
-    for (i = 0; i < count; i++) {
-        size = (int)(ptr - buffer);
-        if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-            ikcp_output(kcp, buffer, size);
-            ptr = buffer;
-        }
-        ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
-        ptr = ikcp_encode_seg(ptr, &seg);
-        if (ikcp_canlog(kcp, IKCP_LOG_OUT_DATA)) {
-            pvp_ikcp_log(kcp, IKCP_LOG_OUT_DATA, "send sn=%lu len=%lu ack", seg.sn, seg.len);
-        }
+    if (ikcp_ack_due(kcp)) {
+        ptr = ikcp_flush_ack(kcp, ptr, &seg);
     }
 
-    kcp->ackcount = 0;
-
     // probe window size (if remote window size equals zero)
     if (kcp->rmt_wnd == 0) {
         if (kcp->probe_wait == 0) {
@@ -1077,7 +2074,7 @@ void pvp_ikcp_flush(ikcpcb* kcp)
             ikcp_output(kcp, buffer, size);
             ptr = buffer;
         }
-        ptr = ikcp_encode_seg(ptr, &seg);
+        ptr = ikcp_encode_seg(kcp, ptr, &seg);
     }
 
     // flush window probing commands
@@ -1088,7 +2085,7 @@ void pvp_ikcp_flush(ikcpcb* kcp)
             ikcp_output(kcp, buffer, size);
             ptr = buffer;
         }
-        ptr = ikcp_encode_seg(ptr, &seg);
+        ptr = ikcp_encode_seg(kcp, ptr, &seg);
     }
 
     kcp->probe = 0;
@@ -1096,11 +2093,14 @@ void pvp_ikcp_flush(ikcpcb* kcp)
     // calculate window size
     cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
     if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
+    quota = ikcp_pacing_quota(kcp, current);
+    ikcp_check_app_limited(kcp, cwnd, quota);
 
     // move data from snd_queue to snd_buf
-    while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
+    while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0 && moved < quota) {
         IKCPSEG* newseg;
         if (iqueue_is_empty(&kcp->snd_queue)) break;
+        moved++;
 
         newseg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
 
@@ -1115,6 +2115,7 @@ void pvp_ikcp_flush(ikcpcb* kcp)
         newseg->ts = current;
         newseg->sn = kcp->snd_nxt++;
         newseg->una = kcp->rcv_nxt;
+        ikcp_snd_ring_put(kcp, newseg);
         newseg->resendts = current;
         newseg->rto = kcp->rx_rto;
         newseg->fastack = 0;
@@ -1123,6 +2124,7 @@ void pvp_ikcp_flush(ikcpcb* kcp)
         newseg->dupsendcount = 0;
         newseg->first_ts = 0;
     }
+    ikcp_pacing_used(kcp, moved);
 
     // calculate resent
     resent = (kcp->fastresend > 0) ? (IUINT32)kcp->fastresend : 0xffffffff;
@@ -1139,6 +2141,7 @@ void pvp_ikcp_flush(ikcpcb* kcp)
             segment->xmit++;
             segment->first_ts = current;
             kcp->cursendcount++;
+            kcp->dup_sample_send++;
             segment->rto = kcp->rx_rto;
             segment->resendts = current + segment->rto + rtomin;
             if (ikcp_canlog(kcp, IKCP_LOG_OUT_DATA)) {
@@ -1159,6 +2162,7 @@ void pvp_ikcp_flush(ikcpcb* kcp)
             if (segment->lost == 0) {
                 kcp->totallostcount++;
                 kcp->curlostcount++;
+                kcp->dup_sample_lost++;
                 segment->lost = 1;
             }
             if (ikcp_canlog(kcp, IKCP_LOG_OUT_DATA)) {
@@ -1172,6 +2176,13 @@ void pvp_ikcp_flush(ikcpcb* kcp)
             segment->fastack = 0;
             segment->resendts = current + segment->rto;
             change++;
+            // 自适应冗余要尽早看到丢包, 快速重传也算丢失
+            if (segment->lost == 0 && kcp->dupsend_dynamic == IKCP_DUPSEND_ADAPTIVE) {
+                kcp->totallostcount++;
+                kcp->curlostcount++;
+                kcp->dup_sample_lost++;
+                segment->lost = 1;
+            }
             if (ikcp_canlog(kcp, IKCP_LOG_OUT_DATA)) {
                 pvp_ikcp_log(kcp, IKCP_LOG_OUT_DATA, "send sn=%lu len=%lu rto=%lu fastack",
                              segment->sn, segment->len, segment->rto);
@@ -1179,7 +2190,7 @@ void pvp_ikcp_flush(ikcpcb* kcp)
         }
 
         if (kcp->dupsend_on && !needsend) {
-            if (segment->dupsendcount < kcp->dupsendcount) {
+            if (segment->dupsendcount < kcp->dupsend_eff) {
                 if (dup_idx < IKCP_DUPSEND_LEN) {
                     long delta = _itimediff(current, segment->ts);
                     if (delta >= kcp->dupsend_wait || delta < 0) {
@@ -1192,6 +2203,7 @@ void pvp_ikcp_flush(ikcpcb* kcp)
         if (needsend) {
             int size, need;
             segment->ts = current;
+            ikcp_rate_sent(kcp, segment, current);
             segment->wnd = seg.wnd;
             segment->una = kcp->rcv_nxt;
 
@@ -1203,7 +2215,8 @@ void pvp_ikcp_flush(ikcpcb* kcp)
                 ptr = buffer;
             }
 
-            ptr = ikcp_encode_seg(ptr, segment);
+            ptr = ikcp_encode_seg(kcp, ptr, segment);
+            kcp->out_critical |= segment->critical;
             if (segment->cmd == IKCP_CMD_DUPS) {
                 segment->cmd = IKCP_CMD_PUSH;
             }
@@ -1241,7 +2254,8 @@ void pvp_ikcp_flush(ikcpcb* kcp)
         dup_seg->dupsendcount++;
         dup_seg->cmd = IKCP_CMD_DUPS;
         kcp->xmit++;
-        ptr = ikcp_encode_seg(ptr, dup_seg);
+        ptr = ikcp_encode_seg(kcp, ptr, dup_seg);
+        kcp->out_critical |= dup_seg->critical;
         if (dup_seg->len > 0) {
             memcpy(ptr, dup_seg->data, dup_seg->len);
             ptr += dup_seg->len;
@@ -1249,6 +2263,10 @@ void pvp_ikcp_flush(ikcpcb* kcp)
         // 恢复原始命令字
         dup_seg->cmd = IKCP_CMD_PUSH;
     }
+    // 延迟的ack捎带在最后一个数据包里
+    if (kcp->ackcount > 0 && ptr != buffer) {
+        ptr = ikcp_flush_ack(kcp, ptr, &seg);
+    }
     size = (int)(ptr - buffer);
     if (size > 0) {
         ikcp_output(kcp, buffer, size);
@@ -1256,19 +2274,12 @@ void pvp_ikcp_flush(ikcpcb* kcp)
 
     // update ssthresh
     if (change) {
-        IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
-        kcp->ssthresh = inflight / 2;
-        if (kcp->ssthresh < IKCP_THRESH_MIN) kcp->ssthresh = IKCP_THRESH_MIN;
-        kcp->cwnd = kcp->ssthresh + resent;
-        kcp->incr = kcp->cwnd * kcp->mss;
+        kcp->cc->on_loss(kcp, kcp->cc_state, 0, resent, cwnd);
         kcp->cur_rtt = 490;
     }
 
     if (lost) {
-        kcp->ssthresh = cwnd / 2;
-        if (kcp->ssthresh < IKCP_THRESH_MIN) kcp->ssthresh = IKCP_THRESH_MIN;
-        kcp->cwnd = 1;
-        kcp->incr = kcp->mss;
+        kcp->cc->on_loss(kcp, kcp->cc_state, 1, resent, cwnd);
         kcp->cur_rtt = 490;
     }
 
@@ -1278,11 +2289,9 @@ void pvp_ikcp_flush(ikcpcb* kcp)
     }
 }
 
-int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current)
+// 新消息入队后立即把窗口内的新segment发出去
+static int ikcp_send_flush(ikcpcb* kcp, IUINT32 current)
 {
-    int ret = pvp_ikcp_send(kcp, u_buffer, len, current);
-    if (ret != 0) return ret;
-
     if (kcp->updated == 0) return 0;
 
     if (current > 0)
@@ -1296,10 +2305,13 @@ int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current
     // calculate window size
     IUINT32 cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
     if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
+    IUINT32 quota = ikcp_pacing_quota(kcp, current);
+    IUINT32 moved = 0;
     IUINT32 rtomin = (kcp->nodelay == 0) ? (kcp->rx_rto >> 3) : 0;
+    ikcp_check_app_limited(kcp, cwnd, quota);
 
     int seg_wnd = ikcp_wnd_unused(kcp);
-    int size, need, i;
+    int size, need;
 
     IKCPSEG seg;
     seg.conv = kcp->conv;
@@ -1312,23 +2324,16 @@ int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current
     seg.ts = 0;
 
     // flush acknowledges
-    int count = kcp->ackcount;
-    for (i = 0; i < count; i++) {
-        size = (int)(ptr - buffer);
-        if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-            ikcp_output(kcp, buffer, size);
-            ptr = buffer;
-        }
-        ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
-        ptr = ikcp_encode_seg(ptr, &seg);
+    if (ikcp_ack_due(kcp)) {
+        ptr = ikcp_flush_ack(kcp, ptr, &seg);
     }
-    kcp->ackcount = 0;
 
     // move data from snd_queue to snd_buf
     IKCPSEG* send_first_seg = NULL;
-    while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
+    while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0 && moved < quota) {
         IKCPSEG* newseg;
         if (iqueue_is_empty(&kcp->snd_queue)) break;
+        moved++;
 
         newseg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
 
@@ -1343,6 +2348,7 @@ int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current
         newseg->ts = current;
         newseg->sn = kcp->snd_nxt++;
         newseg->una = kcp->rcv_nxt;
+        ikcp_snd_ring_put(kcp, newseg);
         newseg->resendts = current;
         newseg->rto = kcp->rx_rto;
         newseg->fastack = 0;
@@ -1358,6 +2364,7 @@ int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current
         if (segment->xmit == 0) {
             segment->first_ts = current;
             kcp->cursendcount++;
+            kcp->dup_sample_send++;
         }
 
         kcp->xmit++;
@@ -1365,6 +2372,7 @@ int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current
         segment->rto = kcp->rx_rto;
         segment->resendts = current + segment->rto + rtomin;
         segment->ts = current;
+        ikcp_rate_sent(kcp, segment, current);
 
         size = (int)(ptr - buffer);
         need = IKCP_OVERHEAD + segment->len;
@@ -1374,7 +2382,8 @@ int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current
             ptr = buffer;
         }
 
-        ptr = ikcp_encode_seg(ptr, segment);
+        ptr = ikcp_encode_seg(kcp, ptr, segment);
+        kcp->out_critical |= segment->critical;
         if (ikcp_canlog(kcp, IKCP_LOG_OUT_DATA)) {
             pvp_ikcp_log(kcp, IKCP_LOG_OUT_DATA, "send sn=%lu len=%lu rto=%lu first", segment->sn,
                          segment->len, segment->rto);
@@ -1386,6 +2395,8 @@ int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current
         }
     }
 
+    ikcp_pacing_used(kcp, moved);
+
     struct IQUEUEHEAD *p, *prev;
     IUINT32 dup_send_count = 0;
     if (send_first_seg != NULL) {
@@ -1400,7 +2411,7 @@ int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current
                 break;
             }
 
-            if (dup_send_count >= kcp->dupsendcount) break;
+            if (dup_send_count >= kcp->dupsend_eff) break;
             dup_send_count++;
             dup_seg->ts = current;
             dup_seg->wnd = seg_wnd;
@@ -1409,7 +2420,8 @@ int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current
             dup_seg->cmd = IKCP_CMD_DUPS;
 
             kcp->xmit++;
-            ptr = ikcp_encode_seg(ptr, dup_seg);
+            ptr = ikcp_encode_seg(kcp, ptr, dup_seg);
+            kcp->out_critical |= dup_seg->critical;
             if (dup_seg->len > 0) {
                 memcpy(ptr, dup_seg->data, dup_seg->len);
                 ptr += dup_seg->len;
@@ -1423,6 +2435,11 @@ int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current
         }
     }
 
+    // 延迟的ack随PUSH一起发出
+    if (kcp->ackcount > 0 && ptr != buffer) {
+        ptr = ikcp_flush_ack(kcp, ptr, &seg);
+    }
+
     // flash remain segments again
     size = (int)(ptr - buffer);
     if (size > 0) {
@@ -1431,6 +2448,27 @@ int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current
     return 0;
 }
 
+int pvp_ikcp_send_ex(ikcpcb* kcp, const char* u_buffer, int len, IUINT32 current)
+{
+    int ret = pvp_ikcp_send(kcp, u_buffer, len, current);
+    if (ret != 0) return ret;
+    return ikcp_send_flush(kcp, current);
+}
+
+int pvp_ikcp_sendv_ex(ikcpcb* kcp, const struct IKCPVEC* vec, int nvec, IUINT32 current)
+{
+    int ret = pvp_ikcp_sendv(kcp, vec, nvec, current);
+    if (ret != 0) return ret;
+    return ikcp_send_flush(kcp, current);
+}
+
+int pvp_ikcp_sendv_critical_ex(ikcpcb* kcp, const struct IKCPVEC* vec, int nvec, IUINT32 current)
+{
+    int ret = ikcp_sendv(kcp, vec, nvec, current, 1);
+    if (ret != 0) return ret;
+    return ikcp_send_flush(kcp, current);
+}
+
 // 更新丢包率
 void pvp_ikcp_update_lost(ikcpcb* kcp, IUINT32 current)
 {
@@ -1470,6 +2508,74 @@ void pvp_ikcp_update_dupsend_on(ikcpcb* kcp)
     }
 }
 
+// 自适应冗余发送: 每个采样窗口结束时更新丢包率EWMA, 逐级调节冗余次数和dupsend_wait.
+// 冗余会掩盖丢包(副本先到原包就不算丢), 所以加级快减级慢, 靠滞回和保持时间避免来回抖动
+static void ikcp_update_dupsend_adaptive(ikcpcb* kcp, IUINT32 current)
+{
+    if (kcp->ts_dup_sample == 0) {
+        kcp->ts_dup_sample = current;
+        kcp->ts_dup_change = current;
+        return;
+    }
+    IINT32 slap = _itimediff(current, kcp->ts_dup_sample);
+    if (slap >= 0) {
+        if (slap < (IINT32)IKCP_DUP_SAMPLE_MS) return;
+        if (kcp->dup_sample_send < IKCP_DUP_SAMPLE_MIN && slap < (IINT32)IKCP_DUP_SAMPLE_MAX_MS)
+            return;
+    }
+    kcp->ts_dup_sample = current;
+    // 空闲时没有新的丢包信息, 保持原状
+    if (kcp->dup_sample_send == 0) {
+        kcp->dup_sample_lost = 0;
+        return;
+    }
+    IUINT32 lost = _imin_(kcp->dup_sample_lost, kcp->dup_sample_send);
+    IUINT32 sample = lost * 1000 / kcp->dup_sample_send;
+    kcp->dup_loss = (kcp->dup_loss * 3 + sample) / 4;
+
+    IUINT32 level = kcp->dupsend_eff;
+    IINT32 held = _itimediff(current, kcp->ts_dup_change);
+    if (kcp->dup_loss >= kcp->dup_loss_on && level < kcp->dupsendcount &&
+        (held >= (IINT32)IKCP_DUP_HOLD_UP_MS || held < 0)) {
+        level++;
+    } else if (kcp->dup_loss <= kcp->dup_loss_off && level > 0 &&
+               (held >= (IINT32)IKCP_DUP_HOLD_DOWN_MS || held < 0)) {
+        level--;
+    }
+    if (level != kcp->dupsend_eff) {
+        kcp->dupsend_eff = level;
+        kcp->ts_dup_change = current;
+    }
+    kcp->dupsend_on = level > 0 ? 1 : 0;
+
+    // 各份副本在一个rtt内均匀发出, 赶在超时重传之前
+    IUINT32 wait = kcp->dupsend_wait_max;
+    if (kcp->rx_srtt > 0) {
+        wait = _ibound_(IKCP_DUP_WAIT_MIN, (IUINT32)kcp->rx_srtt / (level + 1),
+                        kcp->dupsend_wait_max);
+    }
+    kcp->dupsend_wait = wait;
+
+    IKCPDUPTRACE* trace = &kcp->dup_trace[kcp->dup_trace_count % IKCP_DUP_TRACE_LEN];
+    trace->ts = current;
+    trace->sample_send = kcp->dup_sample_send;
+    trace->sample_lost = lost;
+    trace->loss = kcp->dup_loss;
+    trace->srtt = kcp->rx_srtt;
+    trace->level = level;
+    trace->wait = wait;
+    kcp->dup_trace_count++;
+    if (ikcp_canlog(kcp, IKCP_LOG_DUPSEND)) {
+        pvp_ikcp_log(kcp, IKCP_LOG_DUPSEND,
+                     "dupsend sample=%lu/%lu loss=%lu srtt=%ld level=%lu wait=%lu",
+                     (unsigned long)lost, (unsigned long)kcp->dup_sample_send,
+                     (unsigned long)kcp->dup_loss, (long)kcp->rx_srtt, (unsigned long)level,
+                     (unsigned long)wait);
+    }
+    kcp->dup_sample_send = 0;
+    kcp->dup_sample_lost = 0;
+}
+
 //---------------------------------------------------------------------
 // update state (call it repeatedly, every 10ms-100ms), or you can ask
 // ikcp_check when to call it again (without ikcp_input/_send calling).
@@ -1487,7 +2593,11 @@ void pvp_ikcp_update(ikcpcb* kcp, IUINT32 current)
     }
 
     if (kcp->dupsendcount > 0) {
-        pvp_ikcp_update_dupsend_on(kcp);
+        if (kcp->dupsend_dynamic == IKCP_DUPSEND_ADAPTIVE) {
+            ikcp_update_dupsend_adaptive(kcp, current);
+        } else {
+            pvp_ikcp_update_dupsend_on(kcp);
+        }
     }
 
     slap = _itimediff(kcp->current, kcp->ts_flush);
@@ -1503,6 +2613,8 @@ void pvp_ikcp_update(ikcpcb* kcp, IUINT32 current)
             kcp->ts_flush = kcp->current + kcp->interval;
         }
         pvp_ikcp_flush(kcp);
+    } else if (ikcp_ack_due(kcp)) {
+        ikcp_flush_ack_only(kcp);
     }
     pvp_ikcp_update_lost(kcp, current);
 }
@@ -1538,6 +2650,13 @@ IUINT32 pvp_ikcp_check(const ikcpcb* kcp, IUINT32 current)
 
     tm_flush = _itimediff(ts_flush, current);
 
+    if (kcp->ack_delay > 0 && kcp->ackcount > 0) {
+        IINT32 diff;
+        if (ikcp_ack_due(kcp)) return current;
+        diff = _itimediff(kcp->ts_ack + kcp->ack_delay, current);
+        if (diff < tm_flush) tm_flush = diff;
+    }
+
     for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
         const IKCPSEG* seg = iqueue_entry(p, const IKCPSEG, node);
         IINT32 diff = _itimediff(seg->resendts, current);
@@ -1546,7 +2665,7 @@ IUINT32 pvp_ikcp_check(const ikcpcb* kcp, IUINT32 current)
         }
         if (diff < tm_packet) tm_packet = diff;
 
-        if (kcp->dupsend_on && seg->dupsendcount < kcp->dupsendcount) {
+        if (kcp->dupsend_on && seg->dupsendcount < kcp->dupsend_eff) {
             diff = _itimediff(seg->ts + kcp->dupsend_wait, current);
             if (diff <= 0) {
                 return current;
@@ -1566,12 +2685,28 @@ int pvp_ikcp_setmtu(ikcpcb* kcp, int mtu)
 {
     char* buffer;
     if (mtu < 50 || mtu < (int)IKCP_OVERHEAD) return -1;
-    buffer = (char*)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3);
-    if (buffer == NULL) return -2;
+    // 已发送未确认的segment可能按更大的mss切过, 超过mtu的单独成一个datagram输出
+    if ((IUINT32)mtu > kcp->buffer_mtu) {
+        buffer = ikcp_buffer_new(mtu, kcp->headroom);
+        if (buffer == NULL) return -2;
+        ikcp_buffer_delete(kcp->buffer, kcp->headroom);
+        kcp->buffer = buffer;
+        kcp->buffer_mtu = mtu;
+    }
     kcp->mtu = mtu;
     kcp->mss = kcp->mtu - IKCP_OVERHEAD;
-    ikcp_free(kcp->buffer);
+    return 0;
+}
+
+int pvp_ikcp_setheadroom(ikcpcb* kcp, int headroom)
+{
+    char* buffer;
+    if (headroom < 0) return -1;
+    buffer = ikcp_buffer_new(kcp->buffer_mtu, headroom);
+    if (buffer == NULL) return -2;
+    ikcp_buffer_delete(kcp->buffer, kcp->headroom);
     kcp->buffer = buffer;
+    kcp->headroom = headroom;
     return 0;
 }
 
@@ -1615,8 +2750,12 @@ int pvp_ikcp_nodelay(ikcpcb* kcp, int nodelay, int interval, int resend, int nc)
     if (resend >= 0) {
         kcp->fastresend = resend;
     }
-    if (nc >= 0) {
+    if (nc == 2) {
+        kcp->nocwnd = 0;
+        if (kcp->cc != &ikcp_cc_bbr) pvp_ikcp_setcc(kcp, &ikcp_cc_bbr);
+    } else if (nc >= 0) {
         kcp->nocwnd = nc;
+        if (nc == 0 && kcp->cc != &ikcp_cc_reno) pvp_ikcp_setcc(kcp, &ikcp_cc_reno);
     }
     return 0;
 }
@@ -1648,3 +2787,41 @@ IUINT32 pvp_ikcp_getconv(const void* ptr)
     ikcp_decode32u((const char*)ptr, &conv);
     return conv;
 }
+
+long pvp_ikcp_compact_span(const char* data, long size, int* channel)
+{
+    struct IKCPCOMPACTHEAD head;
+    long span = 0;
+    if (data == NULL || size <= 0) return -1;
+    memset(&head, 0, sizeof(head));
+    *channel = -1;
+    while (span < size) {
+        const char* next = ikcp_decode_compact(data + span, data + size, 0, &head);
+        if (next == NULL) break;
+        if (*channel < 0) {
+            *channel = (int)head.channel;
+        } else if ((int)head.channel != *channel) {
+            break;
+        }
+        if (data + size - next < (long)head.len) return -1;
+        span = (long)(next - data) + (long)head.len;
+    }
+    return span > 0 ? span : -1;
+}
+
+long pvp_ikcp_conv_span(const char* data, long size, IUINT32* conv)
+{
+    long span = 0;
+    if (data == NULL || size < (long)IKCP_OVERHEAD) return -1;
+    ikcp_decode32u(data, conv);
+    while (size - span >= (long)IKCP_OVERHEAD) {
+        IUINT32 seg_conv;
+        IUINT16 len;
+        ikcp_decode32u(data + span, &seg_conv);
+        if (seg_conv != *conv) break;
+        ikcp_decode16u(data + span + IKCP_OVERHEAD - 2, &len);
+        if (size - span - (long)IKCP_OVERHEAD < (long)len) return -1;
+        span += IKCP_OVERHEAD + len;
+    }
+    return span;
+}
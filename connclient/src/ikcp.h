@@ -252,6 +252,68 @@ typedef struct IQUEUEHEAD iqueue_head;
 #endif
 
 
+//=====================================================================
+// 零拷贝输入时segment引用的外部缓冲, 缓冲结构体以IKCPREF开头, 引用计数由调用方实现.
+// 摘出的segment可能在其他线程释放, 所以release需要线程安全
+//=====================================================================
+struct IKCPREF {
+    void (*retain)(struct IKCPREF* ref);
+    void (*release)(struct IKCPREF* ref);
+};
+
+//=====================================================================
+// 聚合发送的一个片段, 同struct iovec, 不依赖平台头文件
+//=====================================================================
+struct IKCPVEC {
+    const char* base;
+    int len;
+};
+
+//=====================================================================
+// 自适应冗余发送的一次采样和调节结果, 见pvp_ikcp_setdupadaptive
+//=====================================================================
+struct IKCPDUPTRACE {
+    IUINT32 ts;           // kcp时钟
+    IUINT32 sample_send;  // 采样窗口内首次发送的segment数
+    IUINT32 sample_lost;  // 窗口内超时或快速重传的segment数
+    IUINT32 loss;         // 丢包率EWMA, 千分比
+    IINT32 srtt;
+    IUINT32 level;        // 调节后的冗余发送次数
+    IUINT32 wait;         // 调节后的dupsend_wait
+};
+
+
+//=====================================================================
+// 一次input得到的确认和交付速率采样, 交给拥塞控制.
+// 速率按最晚发出的已确认segment计算: 从它发出时到现在新确认的segment数/经过的时间
+//=====================================================================
+struct IKCPRATESAMPLE {
+    IUINT32 acked;            // 本次新确认的segment数
+    IUINT32 prior_una;        // 本次input前的snd_una
+    IUINT32 prior_delivered;  // 该segment发出时的kcp->delivered
+    IUINT32 prior_ts;         // 该segment发出时的kcp->ts_delivered
+    IUINT32 prior_sent;       // 该segment发出时的kcp->ts_first_sent
+    IUINT32 sent;             // 该segment的发送时间
+    IUINT32 delivered;        // 采样区间内确认的segment数
+    IINT32 interval;          // 采样区间时长(ms), 取发送和确认两段的较长者, 不小于1
+    IINT32 rtt;               // 该segment只发过一次时为它的rtt, 否则为-1
+    int app_limited;          // 该segment发出时发送端受应用限制, 速率偏低
+};
+
+//=====================================================================
+// 拥塞控制接口, 通过kcp->cwnd限制在途segment数, kcp->pacing_rate限制发送速率.
+// 状态由kcp按state_size分配并清零, 见pvp_ikcp_setcc
+//=====================================================================
+struct IKCPCC {
+    const char* name;
+    int state_size;
+    void (*init)(struct IKCPCB* kcp, void* state);
+    // 本次input有新确认的segment
+    void (*on_ack)(struct IKCPCB* kcp, void* state, const struct IKCPRATESAMPLE* rs);
+    // flush发现丢包, timeout为0时是快速重传(resent为触发次数), wnd为当时的发送窗口
+    void (*on_loss)(struct IKCPCB* kcp, void* state, int timeout, IUINT32 resent, IUINT32 wnd);
+};
+
 //=====================================================================
 // SEGMENT
 //=====================================================================
@@ -272,6 +334,13 @@ struct IKCPSEG {
     IUINT32 lost;
     IUINT32 dupsendcount;
     IUINT32 first_ts;
+    IUINT32 delivered;     // 最近一次发送时的kcp->delivered, 用于速率采样
+    IUINT32 ts_delivered;  // 最近一次发送时的kcp->ts_delivered
+    IUINT32 ts_first_sent; // 最近一次发送时的kcp->ts_first_sent
+    int app_limited;       // 最近一次发送时受应用限制
+    int critical;          // 关键消息的segment, 见pvp_ikcp_sendv_critical_ex
+    struct IKCPREF* ref;  // 非空时数据在ref引用的缓冲里, 见pvp_ikcp_input_ref
+    char* payload;        // 数据起始位置, 指向data或ref的缓冲, 收到的segment都通过它读数据
     char data[1];
 };
 
@@ -294,7 +363,6 @@ struct IKCPCB {
     struct IQUEUEHEAD snd_queue;
     struct IQUEUEHEAD rcv_queue;
     struct IQUEUEHEAD snd_buf;
-    struct IQUEUEHEAD rcv_buf;
     IUINT32* acklist;
     IUINT32 ackcount;
     IUINT32 ackblock;
@@ -316,6 +384,50 @@ struct IKCPCB {
     IUINT32 cursendcount;    // 当前发包数
     IUINT32 ts_lost;         // 上次统计当前丢包数的时间戳
     IUINT32 interval_lost;   // 间隔统计丢包时长
+    IUINT32 dupsend_eff;     // 生效的冗余发送次数, 自适应时由丢包率调节, 否则等于dupsendcount
+    IUINT32 dupsend_wait_max;  // 自适应: dupsend_wait上限
+    IUINT32 dup_loss_on;       // 自适应: 丢包率EWMA(千分比)不低于此值时加一级冗余
+    IUINT32 dup_loss_off;      // 自适应: 不高于此值时减一级
+    IUINT32 dup_loss;          // 自适应: 丢包率EWMA, 千分比
+    IUINT32 dup_sample_send;   // 自适应: 当前采样窗口首次发送的segment数
+    IUINT32 dup_sample_lost;   // 自适应: 当前采样窗口丢失的segment数
+    IUINT32 ts_dup_sample;     // 自适应: 当前采样窗口开始时间
+    IUINT32 ts_dup_change;     // 自适应: 上次调级时间
+    struct IKCPDUPTRACE* dup_trace;  // 自适应: 最近的采样记录, 环形数组
+    IUINT32 dup_trace_count;         // 自适应: 累计记录数, 写位置为count % 容量
+    IUINT32 rcv_sn_end;   // 收到过的最大sn+1
+    IUINT32 rcv_sn_gaps;  // 收到的sn跳过的个数累计, 估计下行丢包用, 乱序也会计入
+    int out_critical;     // 正在output的datagram里有关键segment, 只在output回调里有意义
+    struct IKCPSEG** snd_ring;  // snd_buf按sn索引的环形数组, 下标为sn & snd_ring_mask
+    IUINT32 snd_ring_mask;      // 环形数组容量-1, 容量为2的幂
+    struct IKCPSEG** rcv_ring;  // rcv_buf, 乱序到达的segment按sn & rcv_ring_mask存放
+    IUINT32* rcv_bitmap;        // rcv_ring各槽位是否有segment
+    IUINT32 rcv_ring_mask;      // 环形数组容量-1, 容量为2的幂且不小于rcv_wnd
+    int sack;                   // 对端支持IKCP_CMD_SACK, 用区间确认代替逐个sn的ACK
+    int compact;                // 输出紧凑segment头, 见pvp_ikcp_setcompact
+    IUINT32 compact_channel;    // 紧凑头里的通道号
+    IUINT32 enc_ts;             // 紧凑头编码: 当前datagram里上一个PUSH/DUPS的ts
+    IUINT32 enc_una;            // 紧凑头编码: 当前datagram里上一次带上的una和wnd
+    IUINT32 enc_wnd;
+    int enc_state;              // 紧凑头编码: bit0为enc_ts有效, bit1为enc_una/enc_wnd有效
+    IUINT32 ack_delay;          // ack最多延迟时长(ms), 期间尽量随数据捎带, 0为不延迟
+    IUINT32 ack_freq;           // 延迟期间攒够这么多个待回ack立即回, 0为不限制
+    IUINT32 ts_ack;             // 最早一个待回ack的产生时间
+    IUINT32 rcv_head_len;       // rcv_queue首条消息已在队列中的字节数
+    int rcv_head_done;          // 首条消息的最后一个fragment已在rcv_queue中, peeksize为rcv_head_len
+    int headroom;               // buffer前预留的字节数, output回调可以在buf前面原地写传输层包头
+    IUINT32 buffer_mtu;         // buffer按这个mtu分配, 只增不减: 调小mtu后按旧mss切好的segment仍放得下
+    const struct IKCPCC* cc;    // 拥塞控制, nocwnd为0时生效
+    void* cc_state;
+    IUINT32 pacing_rate;        // 发送速率上限(segment/s), 由拥塞控制设置, 0为不限
+    IINT64 pacing_budget;       // 可发送额度, 单位为1/1000个segment
+    IUINT32 ts_pacing;          // 上次补充额度的时间
+    IUINT32 delivered;          // 累计确认的segment数
+    IUINT32 ts_delivered;       // 最近一次确认的时间, 没有在途数据时为下次发送的时间
+    IUINT32 ts_first_sent;      // 最近确认的segment的发送时间
+    IUINT32 app_limited;        // 非0时delivered超过该值前发出的segment都受应用限制
+    int rate_idle;              // 没有在途数据, 下次发送时重置ts_delivered
+    struct IKCPRATESAMPLE rs;   // 本次input累计的采样
     int (*output)(const char* buf, int len, struct IKCPCB* kcp, void* user);
     void (*writelog)(const char* log, struct IKCPCB* kcp, void* user);
 };
@@ -335,6 +447,9 @@ typedef struct IKCPCB ikcpcb;
 #define IKCP_LOG_OUT_ACK 512
 #define IKCP_LOG_OUT_PROBE 1024
 #define IKCP_LOG_OUT_WINS 2048
+#define IKCP_LOG_DUPSEND 4096
+
+#define IKCP_DUPSEND_ADAPTIVE 2  // dupsend_dynamic取值: 按丢包率自适应
 
 #ifdef __cplusplus
 extern "C" {
@@ -344,6 +459,11 @@ extern "C" {
 // interface
 //---------------------------------------------------------------------
 
+// 内置拥塞控制: 基于丢包的慢启动+拥塞避免(KCP原有, 默认); 基于瓶颈带宽和最小rtt模型的
+// BBR风格算法, 按带宽pacing, 在途数据维持在约2倍BDP, 不会把瓶颈队列撑满
+extern const struct IKCPCC ikcp_cc_reno;
+extern const struct IKCPCC ikcp_cc_bbr;
+
 // create a new kcp control object, 'conv' must equal in two endpoint
 // from the same connection. 'user' will be passed to the output callback
 // output callback can be setup like this: 'kcp->output = my_udp_output'
@@ -353,6 +473,7 @@ ikcpcb* pvp_ikcp_create(IUINT32 conv, void* user);
 void pvp_ikcp_release(ikcpcb* kcp);
 
 // set output callback, which will be invoked by kcp
+// buf前面有kcp->headroom字节可写(见pvp_ikcp_setheadroom), 回调可以原地补上包头后直接发送
 void pvp_ikcp_setoutput(ikcpcb* kcp,
                         int (*output)(const char* buf, int len, ikcpcb* kcp, void* user));
 
@@ -361,14 +482,45 @@ void pvp_ikcp_setdupsend(ikcpcb* kcp, int count, int dupack, int dup_dynamic, in
 int pvp_ikcp_getlostrate(ikcpcb* kcp);
 int pvp_ikcp_getcurlostrate(ikcpcb* kcp);
 int pvp_ikcp_interval_lost(ikcpcb* kcp, int interval);
+// 切换拥塞控制, NULL为ikcp_cc_reno, 失败返回-2. 只在nocwnd为0时生效
+int pvp_ikcp_setcc(ikcpcb* kcp, const struct IKCPCC* cc);
+// 自适应冗余发送: 按最近的丢包率在[0, max_count]间逐级调节冗余发送次数, 丢包率EWMA(千分比)
+// 不低于loss_on时加一级, 不高于loss_off时减一级, 两者之间保持不变; dupsend_wait取srtt/(级数+1),
+// 不超过max_wait. loss_on/loss_off小于等于0用默认值. max_count为0关闭, 参数非法返回-1
+int pvp_ikcp_setdupadaptive(ikcpcb* kcp, int max_count, int max_wait, int loss_on, int loss_off);
+// 取最近至多max条自适应采样记录(从旧到新), 返回条数
+int pvp_ikcp_getduptrace(const ikcpcb* kcp, struct IKCPDUPTRACE* out, int max);
+// 对端能解析IKCP_CMD_SACK时开启, 之后确认改为una+已收sn区间, 一个segment代替多个ACK
+void pvp_ikcp_setsack(ikcpcb* kcp, int enable);
+// 紧凑segment头(省掉conv, 通道号占2bit, 其余字段变长或沿用同一datagram里前一个segment),
+// enable后输出改用紧凑头; 收到的数据是哪种格式由调用方按传输层包头决定, 紧凑格式用
+// pvp_ikcp_input_compact. 紧凑头不长于IKCP_OVERHEAD, 分片和合包的长度计算不变
+void pvp_ikcp_setcompact(ikcpcb* kcp, int enable, int channel);
+// ack延迟策略: 待回ack最多等max_delay毫秒, 攒够ack_every个或出现乱序时立即回,
+// 等待期间有数据发送就捎带出去. max_delay为0关闭(默认, 每次flush都回ack)
+int pvp_ikcp_setackdelay(ikcpcb* kcp, int max_delay, int ack_every);
 
 // user/upper level recv: returns size, returns below zero for EAGAIN
 int pvp_ikcp_recv(ikcpcb* kcp, char* buffer, int len);
 
+// 零拷贝接收: 下一条消息只有一个segment时把它从rcv_queue摘下返回, 消息即seg->payload/seg->len,
+// 调用方持有segment, 用完调用pvp_ikcp_segment_free(可在其他线程, 也可晚于kcp释放).
+// 没有完整消息或消息有多个fragment时返回NULL, 此时用pvp_ikcp_peeksize+pvp_ikcp_recv
+IKCPSEG* pvp_ikcp_recv_segment(ikcpcb* kcp);
+void pvp_ikcp_segment_free(IKCPSEG* seg);
+
 // user/upper level send, returns below zero for error
 int pvp_ikcp_send(ikcpcb* kcp, const char* buffer, int len, IUINT32 current);
 int pvp_ikcp_send_ex(ikcpcb* kcp, const char* buffer, int len, IUINT32 current);
 
+// 聚合发送: 多个片段按顺序组成一条消息, 分片时直接从各片段拷进segment, 不需要先拼接
+int pvp_ikcp_sendv(ikcpcb* kcp, const struct IKCPVEC* vec, int nvec, IUINT32 current);
+int pvp_ikcp_sendv_ex(ikcpcb* kcp, const struct IKCPVEC* vec, int nvec, IUINT32 current);
+// 同pvp_ikcp_sendv_ex, 消息的segment标记为关键: 所在datagram输出(含重传和冗余发送)期间
+// kcp->out_critical为1, output回调据此在另一条路径上冗余发送一份
+int pvp_ikcp_sendv_critical_ex(ikcpcb* kcp, const struct IKCPVEC* vec, int nvec,
+                               IUINT32 current);
+
 // update state (call it repeatedly, every 10ms-100ms), or you can ask
 // ikcp_check when to call it again (without ikcp_input/_send calling).
 // 'current' - current timestamp in millisec.
@@ -386,6 +538,14 @@ IUINT32 pvp_ikcp_check(const ikcpcb* kcp, IUINT32 current);
 // when you received a low level packet (eg. UDP packet), call it
 int pvp_ikcp_input(ikcpcb* kcp, const char* data, long size, IUINT32 current);
 
+// 零拷贝输入: data位于ref引用的缓冲里, 收到的PUSH segment直接引用data不再分配和拷贝数据,
+// 每个引用retain一次, segment被recv取走或释放时release
+int pvp_ikcp_input_ref(ikcpcb* kcp, const char* data, long size, IUINT32 current,
+                       struct IKCPREF* ref);
+// 同pvp_ikcp_input_ref, data为紧凑segment头格式, ref可以为NULL
+int pvp_ikcp_input_compact(ikcpcb* kcp, const char* data, long size, IUINT32 current,
+                           struct IKCPREF* ref);
+
 // flush pending data
 void pvp_ikcp_flush(ikcpcb* kcp);
 
@@ -395,6 +555,9 @@ int pvp_ikcp_peeksize(const ikcpcb* kcp);
 // change MTU size, default is 1400
 int pvp_ikcp_setmtu(ikcpcb* kcp, int mtu);
 
+// 在输出buffer前预留headroom字节, 供output回调原地写传输层包头, 免去一次拷贝
+int pvp_ikcp_setheadroom(ikcpcb* kcp, int headroom);
+
 // set maximum window size: sndwnd=32, rcvwnd=32 by default
 int pvp_ikcp_wndsize(ikcpcb* kcp, int sndwnd, int rcvwnd);
 
@@ -405,7 +568,8 @@ int pvp_ikcp_waitsnd(const ikcpcb* kcp);
 // nodelay: 0:disable(default), 1:enable
 // interval: internal update timer interval in millisec, default is 100ms
 // resend: 0:disable fast resend(default), 1:enable fast resend
-// nc: 0:normal congestion control(default), 1:disable congestion control
+// nc: 0:normal congestion control(default), 1:disable congestion control,
+//     2:ikcp_cc_bbr (0/2也会切换pvp_ikcp_setcc, 自定义算法在此之后设置)
 int pvp_ikcp_nodelay(ikcpcb* kcp, int nodelay, int interval, int resend, int nc);
 
 
@@ -417,6 +581,12 @@ void pvp_ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*));
 // read conv
 IUINT32 pvp_ikcp_getconv(const void* ptr);
 
+// 一个datagram里可以混有多个conv的segment(多通道), 返回开头连续属于同一conv的segment总长度,
+// conv为这些segment的conv. 数据不完整返回-1
+long pvp_ikcp_conv_span(const char* data, long size, IUINT32* conv);
+// 同pvp_ikcp_conv_span, data为紧凑segment头格式, 按头里的通道号分段
+long pvp_ikcp_compact_span(const char* data, long size, int* channel);
+
 
 #ifdef __cplusplus
 }
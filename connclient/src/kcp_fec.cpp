@@ -0,0 +1,408 @@
+#include "kcp_fec.h"
+
+#include <cstring>
+#include <utility>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define FEC_USE_SSSE3 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define FEC_USE_NEON 1
+#endif
+
+namespace {
+
+// GF(2^8), 本原多项式x^8+x^4+x^3+x^2+1
+struct GfTables {
+    uint8_t exp[512];
+    uint8_t log[256];
+    // coef[j][i]: 第j个校验分片里第i个数据分片的系数
+    uint8_t coef[fec_max_parity_shards][fec_max_data_shards];
+
+    GfTables();
+};
+
+uint8_t GfMulRaw(const GfTables& t, uint8_t a, uint8_t b)
+{
+    if (a == 0 || b == 0) return 0;
+    return t.exp[t.log[a] + t.log[b]];
+}
+
+uint8_t GfInvRaw(const GfTables& t, uint8_t a)
+{
+    return t.exp[255 - t.log[a]];
+}
+
+GfTables::GfTables()
+{
+    int x = 1;
+    for (int i = 0; i < 255; ++i) {
+        exp[i] = (uint8_t)x;
+        exp[i + 255] = (uint8_t)x;
+        log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11D;
+    }
+    exp[510] = exp[0];
+    exp[511] = exp[1];
+    log[0] = 0;
+    // Cauchy矩阵1/(x_j+y_i), x_j=fec_max_data_shards+j, y_i=i, 任意方阵子式非奇异.
+    // 每列再除以第0行的值, 第0行全为1, 非奇异性不变
+    for (int j = 0; j < fec_max_parity_shards; ++j) {
+        for (int i = 0; i < fec_max_data_shards; ++i) {
+            const uint8_t cauchy = GfInvRaw(*this, (uint8_t)((fec_max_data_shards + j) ^ i));
+            coef[j][i] = GfMulRaw(*this, cauchy, (uint8_t)(fec_max_data_shards ^ i));
+        }
+    }
+}
+
+const GfTables& Gf()
+{
+    static const GfTables tables;
+    return tables;
+}
+
+uint8_t GfMul(uint8_t a, uint8_t b)
+{
+    return GfMulRaw(Gf(), a, b);
+}
+
+void XorRegion(uint8_t* dst, const uint8_t* src, int len)
+{
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t d;
+        uint64_t s;
+        memcpy(&d, dst + i, 8);
+        memcpy(&s, src + i, 8);
+        d ^= s;
+        memcpy(dst + i, &d, 8);
+    }
+    for (; i < len; ++i) dst[i] ^= src[i];
+}
+
+// c*x按高低4位拆成两张16项的表, 正好对应一次pshufb/tbl查表
+void MulAddScalar(uint8_t* dst, const uint8_t* src, int len, const uint8_t* lo,
+                  const uint8_t* hi)
+{
+    for (int i = 0; i < len; ++i) dst[i] ^= lo[src[i] & 0x0F] ^ hi[src[i] >> 4];
+}
+
+#ifdef FEC_USE_SSSE3
+__attribute__((target("ssse3"))) void MulAddSsse3(uint8_t* dst, const uint8_t* src, int len,
+                                                   const uint8_t* lo, const uint8_t* hi)
+{
+    const __m128i tbl_lo = _mm_loadu_si128((const __m128i*)lo);
+    const __m128i tbl_hi = _mm_loadu_si128((const __m128i*)hi);
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        const __m128i l = _mm_shuffle_epi8(tbl_lo, _mm_and_si128(s, mask));
+        const __m128i h = _mm_shuffle_epi8(tbl_hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    MulAddScalar(dst + i, src + i, len - i, lo, hi);
+}
+
+bool HasSsse3()
+{
+    static const bool has = __builtin_cpu_supports("ssse3");
+    return has;
+}
+#endif
+
+#ifdef FEC_USE_NEON
+void MulAddNeon(uint8_t* dst, const uint8_t* src, int len, const uint8_t* lo, const uint8_t* hi)
+{
+    const uint8x16_t tbl_lo = vld1q_u8(lo);
+    const uint8x16_t tbl_hi = vld1q_u8(hi);
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const uint8x16_t s = vld1q_u8(src + i);
+        const uint8x16_t l = vqtbl1q_u8(tbl_lo, vandq_u8(s, mask));
+        const uint8x16_t h = vqtbl1q_u8(tbl_hi, vshrq_n_u8(s, 4));
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), veorq_u8(l, h)));
+    }
+    MulAddScalar(dst + i, src + i, len - i, lo, hi);
+}
+#endif
+
+// dst += c * src
+void GfMulAdd(uint8_t* dst, const uint8_t* src, uint8_t c, int len)
+{
+    if (c == 0 || len <= 0) return;
+    if (c == 1) {
+        XorRegion(dst, src, len);
+        return;
+    }
+    uint8_t lo[16];
+    uint8_t hi[16];
+    for (int x = 0; x < 16; ++x) {
+        lo[x] = GfMul(c, (uint8_t)x);
+        hi[x] = GfMul(c, (uint8_t)(x << 4));
+    }
+#if defined(FEC_USE_SSSE3)
+    if (HasSsse3()) {
+        MulAddSsse3(dst, src, len, lo, hi);
+        return;
+    }
+#elif defined(FEC_USE_NEON)
+    MulAddNeon(dst, src, len, lo, hi);
+    return;
+#endif
+    MulAddScalar(dst, src, len, lo, hi);
+}
+
+// n阶方阵求逆, 奇异返回false
+bool GfInvert(uint8_t m[fec_max_parity_shards][fec_max_parity_shards],
+              uint8_t inv[fec_max_parity_shards][fec_max_parity_shards], int n)
+{
+    for (int r = 0; r < n; ++r) {
+        for (int c = 0; c < n; ++c) inv[r][c] = r == c ? 1 : 0;
+    }
+    for (int c = 0; c < n; ++c) {
+        int pivot = c;
+        while (pivot < n && m[pivot][c] == 0) ++pivot;
+        if (pivot == n) return false;
+        if (pivot != c) {
+            for (int k = 0; k < n; ++k) {
+                std::swap(m[pivot][k], m[c][k]);
+                std::swap(inv[pivot][k], inv[c][k]);
+            }
+        }
+        const uint8_t scale = GfInvRaw(Gf(), m[c][c]);
+        for (int k = 0; k < n; ++k) {
+            m[c][k] = GfMul(m[c][k], scale);
+            inv[c][k] = GfMul(inv[c][k], scale);
+        }
+        for (int r = 0; r < n; ++r) {
+            if (r == c || m[r][c] == 0) continue;
+            const uint8_t f = m[r][c];
+            for (int k = 0; k < n; ++k) {
+                m[r][k] ^= GfMul(f, m[c][k]);
+                inv[r][k] ^= GfMul(f, inv[c][k]);
+            }
+        }
+    }
+    return true;
+}
+
+int PopCount(uint32_t v)
+{
+    int n = 0;
+    for (; v != 0; v &= v - 1) ++n;
+    return n;
+}
+
+}  // namespace
+
+int FecEncoder::Init(int data_shards, int parity_shards)
+{
+    if (data_shards == 0) {
+        data_shards_ = 0;
+        parity_shards_ = 0;
+        return 0;
+    }
+    if (data_shards < 1 || data_shards > fec_max_data_shards || parity_shards < 1 ||
+        parity_shards > fec_max_parity_shards) {
+        return -1;
+    }
+    data_shards_ = data_shards;
+    parity_shards_ = parity_shards;
+    for (int j = 0; j < parity_shards_; ++j) parity_[j].assign(2 + fec_max_data_len, 0);
+    count_ = 0;
+    parity_len_ = 0;
+    return 0;
+}
+
+bool FecEncoder::AddData(const char* data, int len, int64_t now_ms, FecHead* head)
+{
+    if (!Enabled() || Full() || len <= 0 || len > fec_max_data_len) return false;
+    const uint8_t len_bytes[2] = {(uint8_t)(len & 0xFF), (uint8_t)(len >> 8)};
+    const uint8_t(&coef)[fec_max_parity_shards][fec_max_data_shards] = Gf().coef;
+    for (int j = 0; j < parity_shards_; ++j) {
+        uint8_t* parity = parity_[j].data();
+        GfMulAdd(parity, len_bytes, coef[j][count_], 2);
+        GfMulAdd(parity + 2, (const uint8_t*)data, coef[j][count_], len);
+    }
+    if (count_ == 0) start_ms_ = now_ms;
+    head->group = group_;
+    head->index = (uint8_t)count_;
+    head->data_count = 0;
+    head->parity_count = 0;
+    count_++;
+    if (2 + len > parity_len_) parity_len_ = 2 + len;
+    return true;
+}
+
+int FecEncoder::Parity(int j, char* out, int cap) const
+{
+    if (count_ <= 0 || j < 0 || j >= parity_shards_) return -1;
+    const int len = (int)sizeof(FecHead) + parity_len_;
+    if (len > cap) return -1;
+    auto* head = (FecHead*)out;
+    head->group = group_;
+    head->index = (uint8_t)j;
+    head->data_count = (uint8_t)count_;
+    head->parity_count = (uint8_t)parity_shards_;
+    memcpy(out + sizeof(FecHead), parity_[j].data(), parity_len_);
+    return len;
+}
+
+void FecEncoder::NextGroup()
+{
+    for (int j = 0; j < parity_shards_; ++j) memset(parity_[j].data(), 0, parity_len_);
+    count_ = 0;
+    parity_len_ = 0;
+    group_++;
+}
+
+void FecDecoder::Reset()
+{
+    for (auto& g : groups_) g.used = false;
+    has_latest_ = false;
+    recovered_num_ = 0;
+    recovered_pos_ = 0;
+}
+
+// 取组号对应的槽位, 比最新的组旧window个以上的返回nullptr
+FecDecoder::Group* FecDecoder::GetGroup(uint16_t group)
+{
+    if (!has_latest_ || (int16_t)(uint16_t)(group - latest_group_) > 0) {
+        latest_group_ = group;
+        has_latest_ = true;
+    } else if ((uint16_t)(latest_group_ - group) >= window) {
+        return nullptr;
+    }
+    // 65536是window的整数倍, 回绕后槽位不变
+    Group* g = &groups_[group % window];
+    if (!g->used || g->group != group) {
+        g->used = true;
+        g->done = false;
+        g->group = group;
+        g->data_count = 0;
+        g->parity_count = 0;
+        g->data_mask = 0;
+        g->parity_mask = 0;
+        g->shard_len = 0;
+    }
+    return g;
+}
+
+int FecDecoder::Input(const char* pkg, int len)
+{
+    recovered_num_ = 0;
+    recovered_pos_ = 0;
+    if (len <= (int)sizeof(FecHead)) return -1;
+    FecHead head;
+    memcpy(&head, pkg, sizeof(head));
+    const uint8_t* payload = (const uint8_t*)pkg + sizeof(FecHead);
+    const int payload_len = len - (int)sizeof(FecHead);
+
+    if (head.data_count == 0) {
+        if (head.index >= fec_max_data_shards || payload_len > fec_max_data_len) return -1;
+    } else if (head.data_count > fec_max_data_shards || head.parity_count < 1 ||
+               head.parity_count > fec_max_parity_shards || head.index >= head.parity_count ||
+               payload_len < 2 || payload_len > 2 + fec_max_data_len) {
+        return -1;
+    }
+    Group* g = GetGroup(head.group);
+    if (g == nullptr || g->done) return 0;
+
+    if (head.data_count == 0) {
+        const uint32_t bit = 1u << head.index;
+        if ((g->data_mask & bit) != 0) return 0;
+        std::vector<uint8_t>& shard = g->data[head.index];
+        shard.resize(2 + payload_len);
+        shard[0] = (uint8_t)(payload_len & 0xFF);
+        shard[1] = (uint8_t)(payload_len >> 8);
+        memcpy(shard.data() + 2, payload, payload_len);
+        g->data_mask |= bit;
+    } else {
+        if (g->data_count == 0) {
+            g->data_count = head.data_count;
+            g->parity_count = head.parity_count;
+            g->shard_len = payload_len;
+        } else if (g->data_count != head.data_count || g->shard_len != payload_len) {
+            return 0;
+        }
+        const uint32_t bit = 1u << head.index;
+        if ((g->parity_mask & bit) != 0) return 0;
+        g->parity[head.index].assign(payload, payload + payload_len);
+        g->parity_mask |= bit;
+    }
+    TryRecover(g);
+    return 0;
+}
+
+void FecDecoder::TryRecover(Group* g)
+{
+    if (g->data_count == 0) return;
+    int missing[fec_max_parity_shards];
+    int missing_num = 0;
+    for (int i = 0; i < g->data_count; ++i) {
+        if ((g->data_mask & (1u << i)) != 0) {
+            // 比校验分片还长说明不是同一组的数据, 放弃这一组
+            if ((int)g->data[i].size() > g->shard_len) {
+                g->done = true;
+                return;
+            }
+            continue;
+        }
+        if (missing_num == fec_max_parity_shards) return;
+        missing[missing_num++] = i;
+    }
+    if (missing_num == 0) {
+        g->done = true;
+        return;
+    }
+    if (PopCount(g->parity_mask) < missing_num) return;
+
+    // 取前missing_num个收到的校验分片, 减去已收到数据分片的贡献得到伴随式
+    const uint8_t(&coef)[fec_max_parity_shards][fec_max_data_shards] = Gf().coef;
+    int rows[fec_max_parity_shards];
+    int row_num = 0;
+    for (int j = 0; j < g->parity_count && row_num < missing_num; ++j) {
+        if ((g->parity_mask & (1u << j)) != 0) rows[row_num++] = j;
+    }
+    for (int a = 0; a < missing_num; ++a) {
+        std::vector<uint8_t>& syn = syndrome_[a];
+        syn = g->parity[rows[a]];
+        for (int i = 0; i < g->data_count; ++i) {
+            if ((g->data_mask & (1u << i)) == 0) continue;
+            GfMulAdd(syn.data(), g->data[i].data(), coef[rows[a]][i], (int)g->data[i].size());
+        }
+    }
+    uint8_t m[fec_max_parity_shards][fec_max_parity_shards];
+    uint8_t inv[fec_max_parity_shards][fec_max_parity_shards];
+    for (int a = 0; a < missing_num; ++a) {
+        for (int b = 0; b < missing_num; ++b) m[a][b] = coef[rows[a]][missing[b]];
+    }
+    g->done = true;
+    if (!GfInvert(m, inv, missing_num)) return;
+    for (int b = 0; b < missing_num; ++b) {
+        std::vector<uint8_t>& out = recovered_[recovered_num_];
+        out.assign(g->shard_len, 0);
+        for (int a = 0; a < missing_num; ++a) {
+            GfMulAdd(out.data(), syndrome_[a].data(), inv[b][a], g->shard_len);
+        }
+        const int data_len = out[0] | (out[1] << 8);
+        if (data_len <= 0 || 2 + data_len > g->shard_len) continue;
+        out.resize(2 + data_len);
+        recovered_num_++;
+        recovered_count_++;
+    }
+}
+
+bool FecDecoder::PopRecovered(const char** data, int* len)
+{
+    if (recovered_pos_ >= recovered_num_) return false;
+    const std::vector<uint8_t>& out = recovered_[recovered_pos_++];
+    *data = (const char*)out.data() + 2;
+    *len = (int)out.size() - 2;
+    return true;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// UDP上KCP datagram的分组前向纠错(系统Reed-Solomon码, GF(2^8)上的Cauchy矩阵).
+// 每组最多fec_max_data_shards个数据分片, 组满或超时后补发parity个校验分片,
+// 同一组里丢了不超过parity个数据分片时收端可以直接恢复, 不必等KCP超时重传.
+// 第一个校验分片的系数全为1, 只有1个校验分片时就是XOR校验
+//
+// 数据分片: | FecHead(data_count=0) | KCP datagram |
+// 校验分片: | FecHead | 对各数据分片[2字节长度+datagram, 补0到等长]的编码 |
+const int fec_max_data_shards = 16;
+const int fec_max_parity_shards = 4;
+const int fec_max_data_len = 2048;  // 单个数据分片里KCP datagram的最大长度
+
+struct FecHead {
+    uint16_t group;        // 组号, 回绕
+    uint8_t index;         // 数据分片为组内序号, 校验分片为第几个校验分片
+    uint8_t data_count;    // 校验分片所在组的数据分片数, 数据分片为0
+    uint8_t parity_count;  // 校验分片所在组的校验分片数, 数据分片为0
+} __attribute__((__packed__));
+static_assert(sizeof(FecHead) == 5, "unexpected layout");
+
+class FecEncoder
+{
+public:
+    // data_shards为0时关闭, 参数超出范围返回-1
+    int Init(int data_shards, int parity_shards);
+    bool Enabled() const { return data_shards_ > 0; }
+    // 把一个数据分片计入当前组并填写它的FecHead, 太长不能编码时返回false
+    bool AddData(const char* data, int len, int64_t now_ms, FecHead* head);
+    bool Full() const { return count_ >= data_shards_; }
+    int PendingData() const { return count_; }
+    int64_t GroupStartMs() const { return start_ms_; }
+    int ParityShards() const { return parity_shards_; }
+    // 当前组第j个校验分片(含FecHead)写到out, 返回长度, cap不够返回-1
+    int Parity(int j, char* out, int cap) const;
+    // 当前组的校验分片发完后开始下一组
+    void NextGroup();
+
+private:
+    int data_shards_ = {0};
+    int parity_shards_ = {0};
+    uint16_t group_ = {0};
+    int count_ = {0};
+    int parity_len_ = {0};
+    int64_t start_ms_ = {0};
+    std::vector<uint8_t> parity_[fec_max_parity_shards];
+};
+
+class FecDecoder
+{
+public:
+    // 输入一个FEC分片(含FecHead), 数据分片由调用方自己交给KCP, 这里只留底.
+    // 之后用PopRecovered取出恢复出来的数据分片. 格式错误返回-1
+    int Input(const char* pkg, int len);
+    // 取一个恢复出的KCP datagram, 在下次Input之前有效
+    bool PopRecovered(const char** data, int* len);
+    uint64_t RecoveredCount() const { return recovered_count_; }
+    void Reset();
+
+private:
+    struct Group {
+        bool used = {false};
+        bool done = {false};
+        uint16_t group = {0};
+        int data_count = {0};
+        int parity_count = {0};
+        uint32_t data_mask = {0};
+        uint32_t parity_mask = {0};
+        int shard_len = {0};
+        std::vector<uint8_t> data[fec_max_data_shards];  // [2字节长度+datagram]
+        std::vector<uint8_t> parity[fec_max_parity_shards];
+    };
+    static const int window = 8;  // 同时跟踪的组数, 更旧的组直接丢弃
+
+    Group* GetGroup(uint16_t group);
+    void TryRecover(Group* g);
+
+    Group groups_[window];
+    bool has_latest_ = {false};
+    uint16_t latest_group_ = {0};
+    std::vector<uint8_t> syndrome_[fec_max_parity_shards];
+    std::vector<uint8_t> recovered_[fec_max_parity_shards];  // 一次Input最多恢复parity个分片
+    int recovered_num_ = {0};
+    int recovered_pos_ = {0};
+    uint64_t recovered_count_ = {0};
+};
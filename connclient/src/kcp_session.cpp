@@ -1,7 +1,40 @@
 #include "kcp_session.h"
 
+#include <new>
+
+#include "buf_pool.h"
+
 #define KCP_MTU 500
 
+KcpDgram* KcpDgram::New(int capacity)
+{
+    char* buf = BufPool::Alloc((int)sizeof(KcpDgram) + capacity);
+    if (buf == nullptr) return nullptr;
+    auto* dgram = new (buf) KcpDgram();
+    dgram->ref_.retain = KcpDgram::RefRetain;
+    dgram->ref_.release = KcpDgram::RefRelease;
+    dgram->capacity_ = capacity;
+    return dgram;
+}
+
+void KcpDgram::Release()
+{
+    if (refcount_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        this->~KcpDgram();
+        BufPool::Free((char*)this);
+    }
+}
+
+void KcpDgram::RefRetain(IKCPREF* ref)
+{
+    reinterpret_cast<KcpDgram*>(ref)->Retain();
+}
+
+void KcpDgram::RefRelease(IKCPREF* ref)
+{
+    reinterpret_cast<KcpDgram*>(ref)->Release();
+}
+
 KcpSession::~KcpSession()
 {
     Release();
@@ -34,25 +67,95 @@ int KcpSession::CreateKCP(const ControlKCPInfo* kcp_info, kcp_output output, voi
     return 0;
 }
 
-int KcpSession::Input(const char* buf, int len, int64_t cur_time)
+int KcpSession::Input(const char* buf, int len, int64_t cur_time, bool compact)
 {
     if (kcp_ == nullptr) return 0;
     update_now_ = true;
+    if (compact) return pvp_ikcp_input_compact(kcp_, buf, len, (uint32_t)cur_time, nullptr);
     return pvp_ikcp_input(kcp_, buf, len, (uint32_t)cur_time);
 }
 
+int KcpSession::InputDgram(KcpDgram* dgram, const char* buf, int len, int64_t cur_time,
+                           bool compact)
+{
+    if (kcp_ == nullptr) return 0;
+    update_now_ = true;
+    if (compact) {
+        return pvp_ikcp_input_compact(kcp_, buf, len, (uint32_t)cur_time, dgram->Ref());
+    }
+    return pvp_ikcp_input_ref(kcp_, buf, len, (uint32_t)cur_time, dgram->Ref());
+}
+
 int KcpSession::Send(const char* buf, int len, int64_t cur_time)
 {
     if (kcp_ == nullptr) return 0;
     return pvp_ikcp_send_ex(kcp_, buf, len, (uint32_t)cur_time);
 }
 
+int KcpSession::SendV(const IKCPVEC* vec, int nvec, int64_t cur_time, bool critical)
+{
+    if (kcp_ == nullptr) return 0;
+    if (critical) return pvp_ikcp_sendv_critical_ex(kcp_, vec, nvec, (uint32_t)cur_time);
+    return pvp_ikcp_sendv_ex(kcp_, vec, nvec, (uint32_t)cur_time);
+}
+
 int KcpSession::Recv(char* buf, int len)
 {
     if (kcp_ == nullptr) return 0;
     return pvp_ikcp_recv(kcp_, buf, len);
 }
 
+int KcpSession::RecvMsg(KcpRecvMsg* msg, int max_len)
+{
+    if (kcp_ == nullptr) return -1;
+    const int peek_size = pvp_ikcp_peeksize(kcp_);
+    if (peek_size < 0) return -1;
+    if (peek_size > max_len) return -3;
+
+    IKCPSEG* seg = pvp_ikcp_recv_segment(kcp_);
+    if (seg != nullptr) {
+        msg->seg = seg;
+        msg->data = seg->payload;
+        msg->len = (int)seg->len;
+        return msg->len;
+    }
+    msg->buf = BufPool::Alloc(peek_size);
+    if (msg->buf == nullptr) return -2;
+    const int len = pvp_ikcp_recv(kcp_, msg->buf, peek_size);
+    if (len < 0) {
+        FreeMsg(msg);
+        return len;
+    }
+    msg->data = msg->buf;
+    msg->len = len;
+    return len;
+}
+
+void KcpSession::FreeMsg(KcpRecvMsg* msg)
+{
+    if (msg->shared != nullptr) {
+        KcpSharedMsg* shared = msg->shared;
+        if (shared->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            FreeMsg(&shared->msg);
+            delete shared;
+        }
+        *msg = KcpRecvMsg();
+        return;
+    }
+    if (msg->seg != nullptr) pvp_ikcp_segment_free(msg->seg);
+    if (msg->buf != nullptr) BufPool::Free(msg->buf);
+    *msg = KcpRecvMsg();
+}
+
+KcpSharedMsg* KcpSession::ShareMsg(KcpRecvMsg* msg, int refs)
+{
+    KcpSharedMsg* shared = new KcpSharedMsg();
+    shared->msg = *msg;
+    shared->refcount.store(refs, std::memory_order_relaxed);
+    *msg = KcpRecvMsg();
+    return shared;
+}
+
 uint32_t KcpSession::Check(uint32_t current_ms)
 {
     if (kcp_ == nullptr) return 0;
@@ -159,12 +262,110 @@ int32_t KcpSession::State() const
     return (int)kcp_->state;
 }
 
+void KcpSession::SetSack(bool enable)
+{
+    if (kcp_ == nullptr) return;
+    pvp_ikcp_setsack(kcp_, enable ? 1 : 0);
+}
+
+void KcpSession::SetCompact(bool enable, int channel)
+{
+    if (kcp_ == nullptr) return;
+    pvp_ikcp_setcompact(kcp_, enable ? 1 : 0, channel);
+}
+
+void KcpSession::SetAckDelay(int max_delay_ms, int ack_every)
+{
+    if (kcp_ == nullptr) return;
+    pvp_ikcp_setackdelay(kcp_, max_delay_ms, ack_every);
+}
+
+void KcpSession::SetHeadroom(int headroom)
+{
+    if (kcp_ == nullptr) return;
+    pvp_ikcp_setheadroom(kcp_, headroom);
+}
+
+void KcpSession::SetSndWnd(uint32_t snd_wnd)
+{
+    if (kcp_ == nullptr) return;
+    pvp_ikcp_wndsize(kcp_, (int)snd_wnd, 0);
+}
+
+void KcpSession::DisableDupSend()
+{
+    if (kcp_ == nullptr) return;
+    kcp_->dupsendcount = 0;
+    kcp_->dupsend_eff = 0;
+    kcp_->dupsend_on = 0;
+}
+
+void KcpSession::SetCongestion(int nc)
+{
+    if (kcp_ == nullptr) return;
+    pvp_ikcp_nodelay(kcp_, -1, -1, -1, nc);
+}
+
+int KcpSession::SetDupAdaptive(int max_count, int max_wait_ms, int loss_on, int loss_off)
+{
+    if (kcp_ == nullptr) return -1;
+    return pvp_ikcp_setdupadaptive(kcp_, max_count, max_wait_ms, loss_on, loss_off);
+}
+
+uint32_t KcpSession::DupTraceCount() const
+{
+    if (kcp_ == nullptr) return 0;
+    return kcp_->dup_trace_count;
+}
+
+int KcpSession::GetDupTrace(IKCPDUPTRACE* out, int max) const
+{
+    if (kcp_ == nullptr) return 0;
+    return pvp_ikcp_getduptrace(kcp_, out, max);
+}
+
+uint32_t KcpSession::Mtu() const
+{
+    if (kcp_ == nullptr) return 0;
+    return kcp_->mtu;
+}
+
+uint32_t KcpSession::Mss() const
+{
+    if (kcp_ == nullptr) return 0;
+    return kcp_->mss;
+}
+
+void KcpSession::SetMtu(int mtu)
+{
+    if (kcp_ == nullptr) return;
+    pvp_ikcp_setmtu(kcp_, mtu);
+}
+
 uint32_t KcpSession::Xmit() const
 {
     if (kcp_ == nullptr) return 0;
     return kcp_->xmit;
 }
 
+uint32_t KcpSession::LostCount() const
+{
+    if (kcp_ == nullptr) return 0;
+    return kcp_->totallostcount;
+}
+
+uint32_t KcpSession::RecvSnEnd() const
+{
+    if (kcp_ == nullptr) return 0;
+    return kcp_->rcv_sn_end;
+}
+
+uint32_t KcpSession::RecvSnGaps() const
+{
+    if (kcp_ == nullptr) return 0;
+    return kcp_->rcv_sn_gaps;
+}
+
 uint32_t KcpSession::GetConv() const
 {
     return kcp_conv_;
@@ -2,9 +2,52 @@
 
 #include <stdint.h>
 
+#include <atomic>
+
 #include "conn_protocol.h"
 #include "ikcp.h"
 
+// 引用计数的池化datagram缓冲, 零拷贝输入(InputDgram)时KCP segment直接引用其中的数据,
+// 最后一个引用释放后归还BufPool. New返回时引用计数为1, 由调用方Release
+class KcpDgram
+{
+public:
+    static KcpDgram* New(int capacity);
+    void Retain() { refcount_.fetch_add(1, std::memory_order_relaxed); }
+    void Release();
+    char* Data() { return (char*)(this + 1); }
+    int Capacity() const { return capacity_; }
+    IKCPREF* Ref() { return &ref_; }
+
+private:
+    KcpDgram() = default;
+    static void RefRetain(IKCPREF* ref);
+    static void RefRelease(IKCPREF* ref);
+
+    IKCPREF ref_;  // 必须是第一个成员, ikcp回调时按IKCPREF*转换回来
+    std::atomic<int> refcount_ = {1};
+    int capacity_ = {0};
+};
+
+struct KcpSharedMsg;
+
+// KCP收到的一条完整消息, 单segment消息直接引用segment内数据, 多fragment消息拼接到
+// BufPool分配的缓冲里. 不依赖KcpSession生命周期, 可跨线程传递, 用完调用KcpSession::FreeMsg
+struct KcpRecvMsg {
+    const char* data = {nullptr};
+    int len = {0};
+    IKCPSEG* seg = {nullptr};
+    char* buf = {nullptr};
+    int channel = {0};  // 收到消息的可靠通道
+    KcpSharedMsg* shared = {nullptr};  // 不为空时data指向共享消息的一段, seg/buf为空
+};
+
+// 几条消息共用的一条KCP消息(批量消息拆开后的各条), 最后一个引用释放时释放原消息
+struct KcpSharedMsg {
+    std::atomic<int> refcount = {0};
+    KcpRecvMsg msg;
+};
+
 using kcp_output = int (*)(const char*, int, ikcpcb*, void*);
 using kcp_write_log = void (*)(const char* log, struct IKCPCB* kcp, void* user);
 
@@ -15,10 +58,20 @@ public:
     ~KcpSession();
 
 public:
-    // wrapper kcp
-    int Input(const char* buf, int len, int64_t cur_time);
+    // wrapper kcp, compact为buf是紧凑segment头格式, 见pvp_ikcp_setcompact
+    int Input(const char* buf, int len, int64_t cur_time, bool compact = false);
+    // buf位于dgram内, 收到的segment引用dgram而不拷贝数据
+    int InputDgram(KcpDgram* dgram, const char* buf, int len, int64_t cur_time,
+                   bool compact = false);
     int Send(const char* buf, int len, int64_t cur_time);
+    // critical为关键消息, 见pvp_ikcp_sendv_critical_ex
+    int SendV(const IKCPVEC* vec, int nvec, int64_t cur_time, bool critical = false);
     int Recv(char* buf, int len);
+    // 取下一条消息, 返回消息长度; 没有完整消息返回-1, 超过max_len返回-3
+    int RecvMsg(KcpRecvMsg* msg, int max_len);
+    static void FreeMsg(KcpRecvMsg* msg);
+    // 把msg交给一个引用计数为refs的KcpSharedMsg, msg清空. 各引用用FreeMsg释放
+    static KcpSharedMsg* ShareMsg(KcpRecvMsg* msg, int refs);
     uint32_t Check(uint32_t current_ms);
     void Update(uint32_t current_ms);
     void Release();
@@ -36,7 +89,29 @@ public:
     uint32_t RcvNxt() const;
     int RxSrtt() const;
     uint32_t Xmit() const;
+    // 超时重传过的segment累计数, 每个segment只算一次
+    uint32_t LostCount() const;
+    // 收到过的最大sn+1, 以及其间跳过的sn累计数
+    uint32_t RecvSnEnd() const;
+    uint32_t RecvSnGaps() const;
     int32_t State() const;
+    void SetSack(bool enable);
+    void SetCompact(bool enable, int channel);
+    void SetAckDelay(int max_delay_ms, int ack_every);
+    void SetHeadroom(int headroom);
+    void SetSndWnd(uint32_t snd_wnd);
+    void DisableDupSend();
+    // 拥塞控制, 同pvp_ikcp_nodelay的nc: 0基于丢包, 1不做拥塞控制, 2 BBR风格
+    void SetCongestion(int nc);
+    // 见pvp_ikcp_setdupadaptive
+    int SetDupAdaptive(int max_count, int max_wait_ms, int loss_on, int loss_off);
+    // 自适应冗余的采样记录累计条数, 变化了再用GetDupTrace取
+    uint32_t DupTraceCount() const;
+    int GetDupTrace(IKCPDUPTRACE* out, int max) const;
+    uint32_t Mtu() const;
+    uint32_t Mss() const;
+    // 会话中途调整mtu, 只影响之后切分的segment, 见pvp_ikcp_setmtu
+    void SetMtu(int mtu);
 
 public:
     int CreateKCP(const ControlKCPInfo* kcp_info, kcp_output output, void* user,
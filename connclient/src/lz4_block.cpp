@@ -0,0 +1,172 @@
+#include "lz4_block.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+const int min_match = 4;
+const int last_literals = 5;  // block最后5个字节必须是literal
+const int mf_limit = 12;      // 最后一个match必须在结尾12字节之前开始
+const int max_distance = 65535;
+const int hash_log = 12;
+const int skip_trigger = 6;  // 连续找不到match时逐渐加大步长, 不可压缩数据很快扫过
+
+uint32_t Read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t Hash(uint32_t seq)
+{
+    return (seq * 2654435761u) >> (32 - hash_log);
+}
+
+// 写长度的扩展部分, len已减去token里的15
+uint8_t* WriteLen(uint8_t* op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// 读长度的扩展部分, 累加到len上, 超过limit或输入不够时返回false
+bool ReadLen(const uint8_t** ip, const uint8_t* iend, int* len, int limit)
+{
+    uint8_t b;
+    do {
+        if (*ip >= iend) return false;
+        b = *(*ip)++;
+        *len += b;
+        if (*len > limit) return false;
+    } while (b == 255);
+    return true;
+}
+
+uint8_t* WriteSequence(uint8_t* op, const uint8_t* anchor, int lit_len)
+{
+    uint8_t* token = op++;
+    if (lit_len >= 15) {
+        *token = 15 << 4;
+        op = WriteLen(op, lit_len - 15);
+    } else {
+        *token = (uint8_t)(lit_len << 4);
+    }
+    memcpy(op, anchor, lit_len);
+    return op + lit_len;
+}
+
+}  // namespace
+
+int Lz4Block::Bound(int src_len)
+{
+    if (src_len < 0) return 0;
+    return src_len + src_len / 255 + 16;
+}
+
+int Lz4Block::Compress(const char* src, int src_len, char* dst, int dst_cap)
+{
+    if (src_len < 0 || src_len > 0x7E000000 || dst_cap < Bound(src_len)) return 0;
+
+    const uint8_t* base = (const uint8_t*)src;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    const uint8_t* iend = base + src_len;
+    uint8_t* op = (uint8_t*)dst;
+
+    if (src_len > mf_limit) {
+        const uint8_t* mflimit = iend - mf_limit;
+        const uint8_t* matchlimit = iend - last_literals;
+        uint32_t table[1 << hash_log];
+        memset(table, 0, sizeof(table));
+        int miss = 0;
+        while (ip < mflimit) {
+            const uint32_t seq = Read32(ip);
+            const uint32_t h = Hash(seq);
+            const uint8_t* ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+            if (ref >= ip || ip - ref > max_distance || Read32(ref) != seq) {
+                ip += 1 + (miss++ >> skip_trigger);
+                continue;
+            }
+            miss = 0;
+            // 向前扩展
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+            // 向后扩展, 留出结尾的literal
+            const uint8_t* mp = ip + min_match;
+            const uint8_t* rp = ref + min_match;
+            while (mp < matchlimit && *mp == *rp) {
+                ++mp;
+                ++rp;
+            }
+            uint8_t* token = op;
+            op = WriteSequence(op, anchor, (int)(ip - anchor));
+            const int offset = (int)(ip - ref);
+            *op++ = (uint8_t)(offset & 0xFF);
+            *op++ = (uint8_t)(offset >> 8);
+            const int match_len = (int)(mp - ip) - min_match;
+            if (match_len >= 15) {
+                *token |= 15;
+                op = WriteLen(op, match_len - 15);
+            } else {
+                *token |= (uint8_t)match_len;
+            }
+            ip = mp;
+            anchor = ip;
+            // 补一个match尾部的位置, 提高连续重复数据的命中率
+            if (ip - 2 > base) table[Hash(Read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+    op = WriteSequence(op, anchor, (int)(iend - anchor));
+    return (int)(op - (uint8_t*)dst);
+}
+
+int Lz4Block::Decompress(const char* src, int src_len, char* dst, int dst_len)
+{
+    if (src == nullptr || src_len <= 0 || dst_len < 0) return -1;
+
+    const uint8_t* ip = (const uint8_t*)src;
+    const uint8_t* iend = ip + src_len;
+    uint8_t* const obase = (uint8_t*)dst;
+    uint8_t* op = obase;
+    uint8_t* const oend = obase + dst_len;
+
+    while (true) {
+        if (ip >= iend) return -1;
+        const uint8_t token = *ip++;
+        int lit_len = token >> 4;
+        if (lit_len == 15 && !ReadLen(&ip, iend, &lit_len, dst_len)) return -1;
+        if (lit_len > iend - ip || lit_len > oend - op) return -1;
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        // 最后一个sequence只有literal
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        const int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - obase) return -1;
+        int match_len = token & 15;
+        if (match_len == 15 && !ReadLen(&ip, iend, &match_len, dst_len)) return -1;
+        match_len += min_match;
+        if (match_len > oend - op) return -1;
+        const uint8_t* match = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, match, match_len);
+            op += match_len;
+        } else {
+            // 重叠拷贝, 逐字节复制实现重复
+            for (int i = 0; i < match_len; ++i) *op++ = *match++;
+        }
+    }
+    return op == oend ? dst_len : -1;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// LZ4 block格式的压缩/解压, 只有单个block, 不带frame头和校验,
+// 与liblz4的LZ4_compress_default/LZ4_decompress_safe互通
+class Lz4Block
+{
+public:
+    // 压缩输出的最大长度, Compress的dst至少要这么大
+    static int Bound(int src_len);
+    // 返回压缩后的长度, 参数非法或dst_cap小于Bound(src_len)时返回0
+    static int Compress(const char* src, int src_len, char* dst, int dst_cap);
+    // 解压出的数据必须正好dst_len字节, 输入损坏或长度不符返回-1, 不会越界读写
+    static int Decompress(const char* src, int src_len, char* dst, int dst_len);
+};
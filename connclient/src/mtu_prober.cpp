@@ -0,0 +1,94 @@
+#include "mtu_prober.h"
+
+#include <algorithm>
+
+void MtuProber::Init(int base, int max, int64_t now_ms)
+{
+    *this = MtuProber();
+    base_ = base;
+    max_ = max;
+    mtu_ = base;
+    if (Enabled()) StartSearch(max);
+    raise_ms_ = now_ms;
+}
+
+void MtuProber::StartSearch(int hi)
+{
+    state_ = MTU_SEARCH;
+    lo_ = mtu_;
+    hi_ = hi;
+    try_hi_ = true;
+}
+
+int MtuProber::NextProbe(int64_t now_ms, int timeout_ms, uint16_t* id)
+{
+    if (!Enabled()) return 0;
+    if (probe_mtu_ > 0) {
+        if (now_ms < probe_deadline_ms_) return 0;
+        if (++tries_ >= mtu_probe_max_tries) {
+            OnProbeFail();
+        }
+    }
+    if (probe_mtu_ == 0) {
+        if (state_ == MTU_DONE) {
+            if (loss_pending_ && now_ms - confirm_ms_ >= mtu_confirm_interval_ms) {
+                state_ = MTU_CONFIRM;
+                probe_mtu_ = mtu_;
+                confirm_ms_ = now_ms;
+                loss_pending_ = false;
+            } else if (now_ms >= raise_ms_ && mtu_ < max_) {
+                StartSearch(max_);
+            }
+        }
+        if (state_ == MTU_SEARCH) {
+            if (hi_ - lo_ < mtu_probe_granularity) {
+                state_ = MTU_DONE;
+                raise_ms_ = now_ms + mtu_raise_interval_ms;
+                return 0;
+            }
+            probe_mtu_ = try_hi_ ? hi_ : (lo_ + hi_ + 1) / 2;
+            try_hi_ = false;
+        }
+        if (probe_mtu_ == 0) return 0;
+        tries_ = 0;
+        probe_id_++;
+    }
+    probe_deadline_ms_ = now_ms + std::max(timeout_ms, mtu_probe_min_timeout_ms);
+    probes_++;
+    *id = probe_id_;
+    return probe_mtu_;
+}
+
+void MtuProber::OnProbeAck(uint16_t id)
+{
+    if (probe_mtu_ == 0 || id != probe_id_) return;
+    if (state_ == MTU_SEARCH) {
+        lo_ = probe_mtu_;
+        mtu_ = probe_mtu_;
+    } else {
+        state_ = MTU_DONE;
+    }
+    probe_mtu_ = 0;
+}
+
+void MtuProber::OnProbeTooBig()
+{
+    if (probe_mtu_ == 0) return;
+    OnProbeFail();
+}
+
+// 一个大小探测了足够多次都没有回复
+void MtuProber::OnProbeFail()
+{
+    if (state_ == MTU_SEARCH) {
+        hi_ = probe_mtu_ - 1;
+    } else if (state_ == MTU_CONFIRM) {
+        // 黑洞: 已确认的mtu不通了, 退回base, 在base和原mtu之间重新搜索
+        black_holes_++;
+        const int old_mtu = mtu_;
+        mtu_ = base_;
+        StartSearch(old_mtu - 1);
+        try_hi_ = false;
+    }
+    probe_mtu_ = 0;
+}
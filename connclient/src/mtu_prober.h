@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+
+// 上行KCP datagram的路径MTU探测(简化的PLPMTUD, RFC 8899).
+// 从base开始, 先直接探测上限, 不通再在[已确认, 上限]间二分, 每个大小最多探测mtu_probe_max_tries次.
+// 已提高mtu后KCP出现超时丢包时按当前mtu再确认一次, 不通视为黑洞, 退回base重新搜索.
+// 搜索结束后每mtu_raise_interval_ms再从当前mtu往上搜一次, 路径变好时能升回去
+const int mtu_probe_max_tries = 3;
+const int mtu_probe_granularity = 16;      // 上下界差距小于此值结束搜索
+const int mtu_probe_min_timeout_ms = 200;  // 探测等回复的最短时间, 实际按2倍srtt
+const int mtu_confirm_interval_ms = 1000;  // 丢包触发的确认探测至少间隔这么久
+const int mtu_raise_interval_ms = 600000;
+
+class MtuProber
+{
+public:
+    // base为不探测也能用的mtu, max为探测上限, max不大于base时关闭
+    void Init(int base, int max, int64_t now_ms);
+    bool Enabled() const { return max_ > base_; }
+    // 当前确认能通过的mtu, 探测成功或检测到黑洞时变化
+    int Mtu() const { return mtu_; }
+    // 该发探测时返回探测的mtu并填id, 否则返回0; timeout_ms为这次探测等回复的时间
+    int NextProbe(int64_t now_ms, int timeout_ms, uint16_t* id);
+    void OnProbeAck(uint16_t id);
+    // 本机直接拒绝了探测包(EMSGSIZE), 这个大小不用再试
+    void OnProbeTooBig();
+    // KCP出现超时丢包, mtu高于base时稍后确认一次
+    void OnLoss() { loss_pending_ = mtu_ > base_; }
+
+    uint32_t Probes() const { return probes_; }
+    uint32_t BlackHoles() const { return black_holes_; }
+
+private:
+    enum State {
+        MTU_SEARCH,
+        MTU_CONFIRM,
+        MTU_DONE,
+    };
+    void StartSearch(int hi);
+    void OnProbeFail();
+
+    State state_ = {MTU_DONE};
+    int base_ = {0};
+    int max_ = {0};
+    int mtu_ = {0};
+    int lo_ = {0};  // 搜索区间, lo_已确认
+    int hi_ = {0};
+    bool try_hi_ = {false};  // 搜索的第一次直接探测上界
+    int probe_mtu_ = {0};    // 在途探测的大小, 0为没有
+    int tries_ = {0};
+    uint16_t probe_id_ = {0};
+    int64_t probe_deadline_ms_ = {0};
+    int64_t raise_ms_ = {0};  // 搜索结束后下次往上搜的时间
+    int64_t confirm_ms_ = {0};  // 上次确认探测的时间
+    bool loss_pending_ = {false};
+    uint32_t probes_ = {0};
+    uint32_t black_holes_ = {0};
+};
@@ -6,34 +6,177 @@
 // include the Defold SDK
 #include <dmsdk/sdk.h>
 
+#include <algorithm>
+#include <chrono>
 #include <vector>
 
 #include "conn_client.h"
 
+// Lua拿到的连接是full userdata, 里面只存句柄(槽位下标+代数), 不直接存指针.
+// 槽位释放时代数加一, 已关闭连接的旧句柄校验失败, 查找是O(1)
+static const char* const conn_meta_name = "connclient.conn";
+
+struct ConnHandle {
+    uint32_t index;
+    uint32_t generation;
+};
+
+struct ConnSlot {
+    ConnClient* conn;
+    uint32_t generation;
+    uint32_t dense;  // 在g_connclients里的下标
+};
+
+std::vector<ConnSlot> g_conn_slots;
+std::vector<uint32_t> g_conn_free_slots;
+// 存活的连接, 紧凑排列供OnUpdate遍历, g_conn_dense_slot[i]为g_connclients[i]的槽位
 std::vector<ConnClient*> g_connclients;
+std::vector<uint32_t> g_conn_dense_slot;
+// 每帧所有连接处理消息的总预算, 见connclient.set_update_budget, 0为不限制
+int g_update_budget_us = 0;
+int g_update_max_events = 0;
+// 已关闭待释放的连接. close/__gc可能发生在连接自己的回调里, 等Update结束再delete
+std::vector<ConnClient*> g_closed_conns;
 
-static bool IsConnectionValid(ConnClient* conn)
+// 回调在连接userdata环境表里的下标
+enum ConnCallbackIndex {
+    CONN_CB_LOG_DEBUG = 1,
+    CONN_CB_LOG_INFO,
+    CONN_CB_LOG_ERROR,
+    CONN_CB_OUTPUT,
+    CONN_CB_DISCONNECT,
+    CONN_CB_CONNECT_SUCCESS,
+    CONN_CB_RELINK_SUCCESS,
+    CONN_CB_RELINK,
+    CONN_CB_TRANSPORT_SWITCH,
+    CONN_CB_COUNT,
+};
+static ConnLuaCallback g_conn_callbacks[CONN_CB_COUNT];
+// 回调都在主线程里调用, 用扩展初始化时的lua_State
+static lua_State* g_conn_lua = nullptr;
+// 注册表里的弱值表: 连接的用户数据(ConnClient*) -> 连接的userdata, 回调时据此把userdata交给脚本.
+// 不持有userdata, 脚本不再引用连接时照常回收
+static const char* const conn_userdata_name = "connclient.userdata";
+
+static ConnHandle AddConnection(ConnClient* conn)
 {
-    if (conn) {
-        for (int i = 0; i < g_connclients.size(); ++i) {
-            if (g_connclients[i] == conn) {
-                return true;
-            }
-        }
+    uint32_t index = 0;
+    if (!g_conn_free_slots.empty()) {
+        index = g_conn_free_slots.back();
+        g_conn_free_slots.pop_back();
+    } else {
+        index = (uint32_t)g_conn_slots.size();
+        g_conn_slots.push_back(ConnSlot{nullptr, 1, 0});
     }
-    return false;
+    ConnSlot& slot = g_conn_slots[index];
+    slot.conn = conn;
+    slot.dense = (uint32_t)g_connclients.size();
+    g_connclients.push_back(conn);
+    g_conn_dense_slot.push_back(index);
+    return ConnHandle{index, slot.generation};
 }
 
-static void RemoveConnection(ConnClient* conn)
+static ConnClient* FindConnection(const ConnHandle* handle)
 {
-    if (conn) {
-        for (auto it = g_connclients.begin(); it != g_connclients.end(); ++it) {
-            if (*it == conn) {
-                g_connclients.erase(it);
-                break;
-            }
-        }
+    if (handle->index >= g_conn_slots.size()) return nullptr;
+    const ConnSlot& slot = g_conn_slots[handle->index];
+    if (slot.generation != handle->generation) return nullptr;
+    return slot.conn;
+}
+
+// 句柄作废, 连接移到g_closed_conns等待释放
+static void RemoveConnection(const ConnHandle* handle)
+{
+    ConnClient* conn = FindConnection(handle);
+    if (conn == nullptr) return;
+    ConnSlot& slot = g_conn_slots[handle->index];
+    // 末尾的连接挪到空出的位置
+    const uint32_t last_index = g_conn_dense_slot.back();
+    g_connclients[slot.dense] = g_connclients.back();
+    g_conn_dense_slot[slot.dense] = last_index;
+    g_conn_slots[last_index].dense = slot.dense;
+    g_connclients.pop_back();
+    g_conn_dense_slot.pop_back();
+
+    slot.conn = nullptr;
+    slot.generation++;
+    g_conn_free_slots.push_back(handle->index);
+    g_closed_conns.push_back(conn);
+}
+
+static void FreeClosedConnections()
+{
+    for (size_t i = 0; i < g_closed_conns.size(); ++i) {
+        delete g_closed_conns[i];
+    }
+    g_closed_conns.clear();
+}
+
+lua_State* SetupConnCallback(LuaCallback callback, void* user)
+{
+    lua_State* L = g_conn_lua;
+    if (L == nullptr || callback == nullptr) return nullptr;
+    const int top = lua_gettop(L);
+
+    // 连接的userdata已被回收(正在__gc里关闭)时不再回调
+    lua_getfield(L, LUA_REGISTRYINDEX, conn_userdata_name);
+    lua_pushlightuserdata(L, user);
+    lua_rawget(L, -2);
+    if (lua_type(L, -1) != LUA_TUSERDATA) {
+        lua_settop(L, top);
+        return nullptr;
+    }
+    lua_getfenv(L, -1);
+    lua_rawgeti(L, -1, callback->index);
+    if (!lua_istable(L, -1)) {
+        lua_settop(L, top);
+        return nullptr;
     }
+    // 栈上依次留下: 原来的脚本实例, 回调函数, 脚本实例(self), 连接userdata
+    dmScript::GetInstance(L);
+    lua_rawgeti(L, -2, 1);
+    lua_rawgeti(L, -3, 2);
+    lua_pushvalue(L, top + 2);
+    for (int i = 0; i < 4; ++i) {
+        lua_remove(L, top + 1);
+    }
+
+    lua_pushvalue(L, -2);
+    dmScript::SetInstance(L);
+    if (!dmScript::IsInstanceValid(L)) {
+        lua_pushvalue(L, top + 1);
+        dmScript::SetInstance(L);
+        lua_settop(L, top);
+        return nullptr;
+    }
+    return L;
+}
+
+void TeardownConnCallback(lua_State* L)
+{
+    // 恢复原来的脚本实例
+    dmScript::SetInstance(L);
+}
+
+// 把第2个参数的函数和当前脚本实例存到连接(第1个参数)环境表的index处, 传nil清除
+static LuaCallback set_conn_callback(lua_State* L, int index)
+{
+    lua_getfenv(L, 1);
+    LuaCallback callback = nullptr;
+    if (lua_isnoneornil(L, 2)) {
+        lua_pushnil(L);
+    } else {
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+        lua_createtable(L, 2, 0);
+        lua_pushvalue(L, 2);
+        lua_rawseti(L, -2, 1);
+        dmScript::GetInstance(L);
+        lua_rawseti(L, -2, 2);
+        callback = &g_conn_callbacks[index];
+    }
+    lua_rawseti(L, -2, index);
+    lua_pop(L, 1);
+    return callback;
 }
 
 static int lua_connclient_create(lua_State* L)
@@ -45,24 +188,45 @@ static int lua_connclient_create(lua_State* L)
     ConnClient* conn = new ConnClient();
     conn->SetMagicNum(magic);
 
-    g_connclients.push_back(conn);
+    ConnHandle* handle = (ConnHandle*)lua_newuserdata(L, sizeof(ConnHandle));
+    *handle = AddConnection(conn);
+    luaL_getmetatable(L, conn_meta_name);
+    lua_setmetatable(L, -2);
+    // 环境表存回调
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, conn_userdata_name);
     lua_pushlightuserdata(L, conn);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
     return 1;
 }
 
+// set_update_budget(budget_us, max_events) 每帧所有连接处理收到的消息和日志的总时间(微秒)和数量上限,
+// 平分给各连接, 前面的连接没用完的留给后面的. 连接生命周期等控制事件不受限制. 0为不限制
+static int lua_connclient_set_update_budget(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    g_update_budget_us = std::max((int)luaL_checkinteger(L, 1), 0);
+    g_update_max_events = std::max((int)luaL_optinteger(L, 2, 0), 0);
+    return 0;
+}
+
+static ConnHandle* check_conn_handle(lua_State* L)
+{
+    return (ConnHandle*)luaL_checkudata(L, 1, conn_meta_name);
+}
+
 static ConnClient* pop_conn_client(lua_State* L)
 {
-    if (!lua_islightuserdata(L, 1)) {
-        luaL_error(L, "The first argument must be a valid connection!");
-        return nullptr;
-    }
-    ConnClient* conn = (ConnClient*)lua_touserdata(L, 1);
-    if (IsConnectionValid(conn)) {
-        return conn;
-    } else {
+    ConnClient* conn = FindConnection(check_conn_handle(L));
+    if (conn == nullptr) {
         luaL_error(L, "Invalid connection");
-        return nullptr;
     }
+    return conn;
 }
 
 static int lua_connclient_connect(lua_State* L)
@@ -76,7 +240,7 @@ static int lua_connclient_connect(lua_State* L)
         int timeout_ms = luaL_checkinteger(L, 4);
         int ret = conn->Connect(ip, port, timeout_ms);
         if (ret != 0) {
-            delete conn;
+            RemoveConnection(check_conn_handle(L));
             return luaL_error(L, "client->Connect failed");
         }
     }
@@ -90,20 +254,145 @@ static int lua_connclient_close(lua_State* L)
     ConnClient* conn = pop_conn_client(L);
     if (conn) {
         conn->Close();
-        RemoveConnection(conn);
+        RemoveConnection(check_conn_handle(L));
+    }
+    return 0;
+}
+
+// userdata被回收时关闭还没close的连接. 回调存在userdata自己的环境表里, 回调引用了连接或脚本实例
+// 也不妨碍回收, 脚本删除后连接随之关闭
+static int lua_connclient_gc(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnHandle* handle = check_conn_handle(L);
+    ConnClient* conn = FindConnection(handle);
+    if (conn) {
+        conn->Close();
+        RemoveConnection(handle);
     }
     return 0;
 }
 
+static int lua_connclient_tostring(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    ConnHandle* handle = check_conn_handle(L);
+    lua_pushfstring(L, "connclient.conn(%d:%d%s)", (int)handle->index, (int)handle->generation,
+                    FindConnection(handle) ? "" : ", closed");
+    return 1;
+}
+
 static int lua_connclient_send(lua_State* L)
 {
     DM_LUA_STACK_CHECK(L, 0);
 
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        const int top = lua_gettop(L);
+        if (top <= 2) {
+            size_t msg_len = 0;
+            const char* msg_buf = luaL_checklstring(L, 2, &msg_len);
+            conn->SendMsg(msg_buf, (int)msg_len);
+        } else {
+            // send(conn, head, body, ...) 多个字符串按顺序组成一条消息, 省掉Lua里的拼接
+            std::vector<ConnMsgVec> vec(top - 1);
+            for (int i = 2; i <= top; ++i) {
+                size_t len = 0;
+                vec[i - 2].buf = luaL_checklstring(L, i, &len);
+                vec[i - 2].len = (int)len;
+            }
+            conn->SendMsgV(vec.data(), (int)vec.size());
+        }
+    }
+    return 0;
+}
+
+// send_buffer(conn, buf, channel) 发送dmBuffer的全部字节, 不用先转成Lua字符串
+static int lua_connclient_send_buffer(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        dmBuffer::HBuffer buffer = dmScript::CheckBufferUnpack(L, 2);
+        const int channel = luaL_optinteger(L, 3, 0);
+        void* bytes = nullptr;
+        uint32_t size = 0;
+        if (dmBuffer::GetBytes(buffer, &bytes, &size) != dmBuffer::RESULT_OK) {
+            return luaL_error(L, "Invalid buffer");
+        }
+        conn->SendMsg((const char*)bytes, (int)size, channel);
+    }
+    return 0;
+}
+
+// send_channel(conn, channel, msg, ...) 发到指定可靠通道, 多个字符串同send
+static int lua_connclient_send_channel(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        const int channel = luaL_checkinteger(L, 2);
+        const int top = lua_gettop(L);
+        std::vector<ConnMsgVec> vec(std::max(top - 2, 1));
+        for (int i = 3; i <= std::max(top, 3); ++i) {
+            size_t len = 0;
+            vec[i - 3].buf = luaL_checklstring(L, i, &len);
+            vec[i - 3].len = (int)len;
+        }
+        conn->SendMsgV(vec.data(), (int)vec.size(), channel);
+    }
+    return 0;
+}
+
+// send_critical(conn, channel, msg, ...) 关键消息, 启用了set_multipath_budget时同时走两条路径
+static int lua_connclient_send_critical(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        const int channel = luaL_checkinteger(L, 2);
+        const int top = lua_gettop(L);
+        std::vector<ConnMsgVec> vec(std::max(top - 2, 1));
+        for (int i = 3; i <= std::max(top, 3); ++i) {
+            size_t len = 0;
+            vec[i - 3].buf = luaL_checklstring(L, i, &len);
+            vec[i - 3].len = (int)len;
+        }
+        conn->SendMsgV(vec.data(), (int)vec.size(), channel, CONN_SEND_CRITICAL);
+    }
+    return 0;
+}
+
+// send_unreliable(conn, msg, stream) 不可靠发送, 同一stream内收端丢弃过期的包
+static int lua_connclient_send_unreliable(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
     ConnClient* conn = pop_conn_client(L);
     if (conn) {
         size_t msg_len = 0;
         const char* msg_buf = luaL_checklstring(L, 2, &msg_len);
-        conn->SendMsg(msg_buf, (int)msg_len);
+        int stream = luaL_optinteger(L, 3, 0);
+        conn->SendUnreliable(msg_buf, (int)msg_len, stream);
+    }
+    return 0;
+}
+
+static int lua_connclient_set_channel(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        int channel = luaL_checkinteger(L, 2);
+        int priority = luaL_checkinteger(L, 3);
+        int weight = luaL_optinteger(L, 4, 100);
+        conn->SetKcpChannel(channel, priority, weight);
     }
     return 0;
 }
@@ -132,13 +421,346 @@ static int lua_connclient_set_magic_num(lua_State* L)
     return 0;
 }
 
+// set_inline_mode(conn, enable) connect前调用, 不起网络线程, 收发都在每帧的更新里完成
+static int lua_connclient_set_inline_mode(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        conn->SetInlineMode(lua_toboolean(L, 2) != 0);
+    }
+    return 0;
+}
+
+static int lua_connclient_set_kcp_ack_delay(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        int max_delay_ms = luaL_checkinteger(L, 2);
+        int ack_every = luaL_optinteger(L, 3, 0);
+        conn->SetKcpAckDelay(max_delay_ms, ack_every);
+    }
+    return 0;
+}
+
+static int lua_connclient_set_compress_threshold(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        int threshold = luaL_checkinteger(L, 2);
+        conn->SetCompressThreshold(threshold);
+    }
+    return 0;
+}
+
+static int lua_connclient_set_fec(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        int data_shards = luaL_checkinteger(L, 2);
+        int parity_shards = luaL_optinteger(L, 3, 1);
+        conn->SetFec(data_shards, parity_shards);
+    }
+    return 0;
+}
+
+static int lua_connclient_get_fec_stats(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    ConnClient* conn = pop_conn_client(L);
+    ConnFecStats stats = {};
+    if (conn) {
+        conn->GetFecStats(&stats);
+    }
+    lua_newtable(L);
+    lua_pushnumber(L, (lua_Number)stats.send_data_shards);
+    lua_setfield(L, -2, "send_data_shards");
+    lua_pushnumber(L, (lua_Number)stats.send_parity_shards);
+    lua_setfield(L, -2, "send_parity_shards");
+    lua_pushnumber(L, (lua_Number)stats.recv_recovered);
+    lua_setfield(L, -2, "recv_recovered");
+    return 1;
+}
+
+static int lua_connclient_set_congestion(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        int cc = luaL_checkinteger(L, 2);
+        conn->SetCongestionControl(cc);
+    }
+    return 0;
+}
+
+static int lua_connclient_set_dup_adaptive(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        int max_count = luaL_checkinteger(L, 2);
+        int max_wait_ms = luaL_optinteger(L, 3, 0);
+        int loss_on = luaL_optinteger(L, 4, 0);
+        int loss_off = luaL_optinteger(L, 5, 0);
+        conn->SetDupSendAdaptive(max_count, max_wait_ms, loss_on, loss_off);
+    }
+    return 0;
+}
+
+static int lua_connclient_set_transport_adaptive(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        int probe_ms = luaL_checkinteger(L, 2);
+        int margin = luaL_optinteger(L, 3, 0);
+        conn->SetTransportAdaptive(probe_ms, margin);
+    }
+    return 0;
+}
+
+static int lua_connclient_set_multipath_budget(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        int bytes_per_sec = luaL_checkinteger(L, 2);
+        conn->SetMultipathBudget(bytes_per_sec);
+    }
+    return 0;
+}
+
+static int lua_connclient_get_multipath_stats(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    ConnClient* conn = pop_conn_client(L);
+    ConnMultipathStats stats = {};
+    if (conn) {
+        conn->GetMultipathStats(&stats);
+    }
+    lua_newtable(L);
+    lua_pushnumber(L, (lua_Number)stats.copy_pkgs);
+    lua_setfield(L, -2, "copy_pkgs");
+    lua_pushnumber(L, (lua_Number)stats.copy_bytes);
+    lua_setfield(L, -2, "copy_bytes");
+    lua_pushnumber(L, (lua_Number)stats.budget_drops);
+    lua_setfield(L, -2, "budget_drops");
+    return 1;
+}
+
+static int lua_connclient_set_mtu_probe(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        int max_mtu = luaL_checkinteger(L, 2);
+        conn->SetMtuProbe(max_mtu);
+    }
+    return 0;
+}
+
+static int lua_connclient_get_mtu_stats(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    ConnClient* conn = pop_conn_client(L);
+    ConnMtuStats stats = {};
+    if (conn) {
+        conn->GetMtuStats(&stats);
+    }
+    lua_newtable(L);
+    lua_pushnumber(L, stats.mtu);
+    lua_setfield(L, -2, "mtu");
+    lua_pushnumber(L, (lua_Number)stats.probes);
+    lua_setfield(L, -2, "probes");
+    lua_pushnumber(L, (lua_Number)stats.black_holes);
+    lua_setfield(L, -2, "black_holes");
+    return 1;
+}
+
+static int lua_connclient_set_coalesce(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        int delay_ms = luaL_checkinteger(L, 2);
+        int max_len = luaL_optinteger(L, 3, 0);
+        conn->SetCoalesce(delay_ms, max_len);
+    }
+    return 0;
+}
+
+static int lua_connclient_get_coalesce_stats(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    ConnClient* conn = pop_conn_client(L);
+    ConnCoalesceStats stats = {};
+    if (conn) {
+        conn->GetCoalesceStats(&stats);
+    }
+    lua_newtable(L);
+    lua_pushnumber(L, (lua_Number)stats.msgs);
+    lua_setfield(L, -2, "msgs");
+    lua_pushnumber(L, (lua_Number)stats.batches);
+    lua_setfield(L, -2, "batches");
+    return 1;
+}
+
+static int lua_connclient_set_udp_checksum(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        conn->SetUdpChecksum(lua_toboolean(L, 2) != 0);
+    }
+    return 0;
+}
+
+static int lua_connclient_get_checksum_stats(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    ConnClient* conn = pop_conn_client(L);
+    ConnChecksumStats stats = {};
+    if (conn) {
+        conn->GetChecksumStats(&stats);
+    }
+    lua_newtable(L);
+    lua_pushnumber(L, (lua_Number)stats.verified);
+    lua_setfield(L, -2, "verified");
+    lua_pushnumber(L, (lua_Number)stats.drops);
+    lua_setfield(L, -2, "drops");
+    return 1;
+}
+
+static int lua_connclient_get_path_stats(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    ConnClient* conn = pop_conn_client(L);
+    ConnPathStats stats = {};
+    if (conn) {
+        conn->GetPathStats(&stats);
+    }
+    lua_newtable(L);
+    lua_pushnumber(L, stats.transport);
+    lua_setfield(L, -2, "transport");
+    lua_pushnumber(L, stats.switches);
+    lua_setfield(L, -2, "switches");
+    lua_pushnumber(L, stats.udp_rtt_ms);
+    lua_setfield(L, -2, "udp_rtt_ms");
+    lua_pushnumber(L, stats.udp_loss);
+    lua_setfield(L, -2, "udp_loss");
+    lua_pushnumber(L, stats.udp_score);
+    lua_setfield(L, -2, "udp_score");
+    lua_pushnumber(L, stats.tcp_rtt_ms);
+    lua_setfield(L, -2, "tcp_rtt_ms");
+    lua_pushnumber(L, stats.tcp_score);
+    lua_setfield(L, -2, "tcp_score");
+    return 1;
+}
+
+// 返回采样记录数组, 从旧到新
+static int lua_connclient_get_dup_trace(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    ConnClient* conn = pop_conn_client(L);
+    ConnDupTrace trace[64];
+    int n = 0;
+    if (conn) {
+        n = conn->GetDupSendTrace(trace, 64);
+    }
+    lua_createtable(L, n, 0);
+    for (int i = 0; i < n; ++i) {
+        lua_createtable(L, 0, 7);
+        lua_pushnumber(L, trace[i].ts_ms);
+        lua_setfield(L, -2, "ts");
+        lua_pushnumber(L, trace[i].sample_send);
+        lua_setfield(L, -2, "sample_send");
+        lua_pushnumber(L, trace[i].sample_lost);
+        lua_setfield(L, -2, "sample_lost");
+        lua_pushnumber(L, trace[i].loss);
+        lua_setfield(L, -2, "loss");
+        lua_pushnumber(L, trace[i].srtt_ms);
+        lua_setfield(L, -2, "srtt");
+        lua_pushnumber(L, trace[i].level);
+        lua_setfield(L, -2, "level");
+        lua_pushnumber(L, trace[i].wait_ms);
+        lua_setfield(L, -2, "wait");
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+static int lua_connclient_get_compress_stats(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    ConnClient* conn = pop_conn_client(L);
+    ConnCompressStats stats = {};
+    if (conn) {
+        conn->GetCompressStats(&stats);
+    }
+    lua_newtable(L);
+    lua_pushnumber(L, (lua_Number)stats.send_msgs);
+    lua_setfield(L, -2, "send_msgs");
+    lua_pushnumber(L, (lua_Number)stats.send_raw_bytes);
+    lua_setfield(L, -2, "send_raw_bytes");
+    lua_pushnumber(L, (lua_Number)stats.send_zip_bytes);
+    lua_setfield(L, -2, "send_zip_bytes");
+    lua_pushnumber(L, (lua_Number)stats.recv_msgs);
+    lua_setfield(L, -2, "recv_msgs");
+    lua_pushnumber(L, (lua_Number)stats.recv_zip_bytes);
+    lua_setfield(L, -2, "recv_zip_bytes");
+    lua_pushnumber(L, (lua_Number)stats.recv_raw_bytes);
+    lua_setfield(L, -2, "recv_raw_bytes");
+    return 1;
+}
+
+static int lua_connclient_get_unreliable_stats(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    ConnClient* conn = pop_conn_client(L);
+    ConnUnreliableStats stats = {};
+    if (conn) {
+        conn->GetUnreliableStats(&stats);
+    }
+    lua_newtable(L);
+    lua_pushnumber(L, (lua_Number)stats.send_msgs);
+    lua_setfield(L, -2, "send_msgs");
+    lua_pushnumber(L, (lua_Number)stats.recv_msgs);
+    lua_setfield(L, -2, "recv_msgs");
+    lua_pushnumber(L, (lua_Number)stats.stale_drops);
+    lua_setfield(L, -2, "stale_drops");
+    return 1;
+}
+
 static int lua_connclient_set_logdebug_cb(lua_State* L)
 {
     DM_LUA_STACK_CHECK(L, 0);
 
     ConnClient* conn = pop_conn_client(L);
     if (conn) {
-        conn->SetLogDebugCB(dmScript::CreateCallback(L, 2));
+        conn->SetLogDebugCB(set_conn_callback(L, CONN_CB_LOG_DEBUG));
     }
     return 0;
 }
@@ -149,7 +771,7 @@ static int lua_connclient_set_loginfo_cb(lua_State* L)
 
     ConnClient* conn = pop_conn_client(L);
     if (conn) {
-        conn->SetLogInfoCB(dmScript::CreateCallback(L, 2));
+        conn->SetLogInfoCB(set_conn_callback(L, CONN_CB_LOG_INFO));
     }
     return 0;
 }
@@ -160,7 +782,7 @@ static int lua_connclient_set_logerror_cb(lua_State* L)
 
     ConnClient* conn = pop_conn_client(L);
     if (conn) {
-        conn->SetLogErrorCB(dmScript::CreateCallback(L, 2));
+        conn->SetLogErrorCB(set_conn_callback(L, CONN_CB_LOG_ERROR));
     }
     return 0;
 }
@@ -171,7 +793,19 @@ static int lua_connclient_set_output_cb(lua_State* L)
 
     ConnClient* conn = pop_conn_client(L);
     if (conn) {
-        conn->SetOutputCB(dmScript::CreateCallback(L, 2));
+        conn->SetOutputCB(set_conn_callback(L, CONN_CB_OUTPUT));
+    }
+    return 0;
+}
+
+// set_output_buffer(conn, enable) 打开后output回调的消息参数为dmBuffer, 只在回调期间有效
+static int lua_connclient_set_output_buffer(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        conn->SetOutputBuffer(lua_toboolean(L, 2) != 0);
     }
     return 0;
 }
@@ -182,7 +816,7 @@ static int lua_connclient_set_disconnect_cb(lua_State* L)
 
     ConnClient* conn = pop_conn_client(L);
     if (conn) {
-        conn->SetDisconnectCB(dmScript::CreateCallback(L, 2));
+        conn->SetDisconnectCB(set_conn_callback(L, CONN_CB_DISCONNECT));
     }
     return 0;
 }
@@ -193,7 +827,7 @@ static int lua_connclient_set_connectsuccess_cb(lua_State* L)
 
     ConnClient* conn = pop_conn_client(L);
     if (conn) {
-        conn->SetConnectSuccessCB(dmScript::CreateCallback(L, 2));
+        conn->SetConnectSuccessCB(set_conn_callback(L, CONN_CB_CONNECT_SUCCESS));
     }
     return 0;
 }
@@ -204,7 +838,7 @@ static int lua_connclient_set_relinksuccess_cb(lua_State* L)
 
     ConnClient* conn = pop_conn_client(L);
     if (conn) {
-        conn->SetRelinkSuccessCB(dmScript::CreateCallback(L, 2));
+        conn->SetRelinkSuccessCB(set_conn_callback(L, CONN_CB_RELINK_SUCCESS));
     }
     return 0;
 }
@@ -215,37 +849,104 @@ static int lua_connclient_set_relink_cb(lua_State* L)
 
     ConnClient* conn = pop_conn_client(L);
     if (conn) {
-        conn->SetRelinkCB(dmScript::CreateCallback(L, 2));
+        conn->SetRelinkCB(set_conn_callback(L, CONN_CB_RELINK));
     }
     return 0;
 }
 
-static const luaL_reg connclient_module_methods[] = {
-    {"create", lua_connclient_create},
+static int lua_connclient_set_transport_switch_cb(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ConnClient* conn = pop_conn_client(L);
+    if (conn) {
+        conn->SetTransportSwitchCB(set_conn_callback(L, CONN_CB_TRANSPORT_SWITCH));
+    }
+    return 0;
+}
+
+// 连接的方法, 既可以client:send(...)调用, 也可以connclient.send(client, ...)
+static const luaL_reg connclient_conn_methods[] = {
     {"connect", lua_connclient_connect},
     {"close", lua_connclient_close},
     {"send", lua_connclient_send},
+    {"send_buffer", lua_connclient_send_buffer},
+    {"send_channel", lua_connclient_send_channel},
+    {"send_critical", lua_connclient_send_critical},
+    {"send_unreliable", lua_connclient_send_unreliable},
+    {"set_channel", lua_connclient_set_channel},
     {"add_relink_interval", lua_connclient_add_relink_interval},
     {"set_magic_num", lua_connclient_set_magic_num},
+    {"set_inline_mode", lua_connclient_set_inline_mode},
+    {"set_kcp_ack_delay", lua_connclient_set_kcp_ack_delay},
+    {"set_compress_threshold", lua_connclient_set_compress_threshold},
+    {"get_compress_stats", lua_connclient_get_compress_stats},
+    {"set_fec", lua_connclient_set_fec},
+    {"get_fec_stats", lua_connclient_get_fec_stats},
+    {"set_congestion", lua_connclient_set_congestion},
+    {"set_dup_adaptive", lua_connclient_set_dup_adaptive},
+    {"get_dup_trace", lua_connclient_get_dup_trace},
+    {"set_transport_adaptive", lua_connclient_set_transport_adaptive},
+    {"get_path_stats", lua_connclient_get_path_stats},
+    {"set_multipath_budget", lua_connclient_set_multipath_budget},
+    {"get_multipath_stats", lua_connclient_get_multipath_stats},
+    {"set_mtu_probe", lua_connclient_set_mtu_probe},
+    {"get_mtu_stats", lua_connclient_get_mtu_stats},
+    {"set_coalesce", lua_connclient_set_coalesce},
+    {"get_coalesce_stats", lua_connclient_get_coalesce_stats},
+    {"set_udp_checksum", lua_connclient_set_udp_checksum},
+    {"get_checksum_stats", lua_connclient_get_checksum_stats},
+    {"get_unreliable_stats", lua_connclient_get_unreliable_stats},
     {"set_logdebug_cb", lua_connclient_set_logdebug_cb},
     {"set_loginfo_cb", lua_connclient_set_loginfo_cb},
     {"set_logerror_cb", lua_connclient_set_logerror_cb},
     {"set_output_cb", lua_connclient_set_output_cb},
+    {"set_output_buffer", lua_connclient_set_output_buffer},
     {"set_disconnect_cb", lua_connclient_set_disconnect_cb},
     {"set_connectsuccess_cb", lua_connclient_set_connectsuccess_cb},
     {"set_relinksuccess_cb", lua_connclient_set_relinksuccess_cb},
     {"set_relink_cb", lua_connclient_set_relink_cb},
+    {"set_transport_switch_cb", lua_connclient_set_transport_switch_cb},
+    {0, 0}};
+
+static const luaL_reg connclient_module_methods[] = {
+    {"create", lua_connclient_create},
+    {"set_update_budget", lua_connclient_set_update_budget},
+    {0, 0}};
+
+static const luaL_reg connclient_conn_meta[] = {
+    {"__gc", lua_connclient_gc},
+    {"__tostring", lua_connclient_tostring},
     {0, 0}};
 
 static void LuaInit(lua_State* L)
 {
-    int top = lua_gettop(L);
+    DM_LUA_STACK_CHECK(L, 0);
+
+    g_conn_lua = L;
+    for (int i = 0; i < CONN_CB_COUNT; ++i) {
+        g_conn_callbacks[i].index = i;
+    }
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, conn_userdata_name);
+
+    // 连接userdata的metatable, __index为方法表
+    luaL_newmetatable(L, conn_meta_name);
+    luaL_register(L, NULL, connclient_conn_meta);
+    lua_newtable(L);
+    luaL_register(L, NULL, connclient_conn_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
 
     // Register lua names
     luaL_register(L, MODULE_NAME, connclient_module_methods);
+    luaL_register(L, NULL, connclient_conn_methods);
 
     lua_pop(L, 1);
-    assert(top == lua_gettop(L));
 }
 
 static dmExtension::Result AppInitializeMyExtension(dmExtension::AppParams* params)
@@ -271,14 +972,41 @@ static dmExtension::Result AppFinalizeMyExtension(dmExtension::AppParams* params
 static dmExtension::Result FinalizeMyExtension(dmExtension::Params* params)
 {
     dmLogInfo("FinalizeMyExtension");
+    // 脚本没有close的连接在这里关掉, 之后Lua状态销毁时__gc看到的句柄都已失效
+    while (!g_connclients.empty()) {
+        const uint32_t index = g_conn_dense_slot.back();
+        const ConnHandle handle = {index, g_conn_slots[index].generation};
+        g_connclients.back()->Close();
+        RemoveConnection(&handle);
+    }
+    FreeClosedConnections();
+    g_conn_lua = nullptr;
     return dmExtension::RESULT_OK;
 }
 
 static dmExtension::Result OnUpdateMyExtension(dmExtension::Params* params)
 {
-    for (int i = 0; i < g_connclients.size(); ++i) {
-        g_connclients[i]->Update();
+    // 回调里close的连接会和末尾交换位置, 被换到前面的那个这一帧少更新一次, 下一帧补上
+    const auto start = std::chrono::steady_clock::now();
+    int events_left = g_update_max_events;
+    for (size_t i = 0; i < g_connclients.size(); ++i) {
+        const int conns_left = (int)(g_connclients.size() - i);
+        int budget_us = 0;
+        if (g_update_budget_us > 0) {
+            const int64_t used_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                                        std::chrono::steady_clock::now() - start)
+                                        .count();
+            // 总预算用完后每个连接仍至少处理一个
+            budget_us = std::max((int)((g_update_budget_us - used_us) / conns_left), 1);
+        }
+        int max_events = 0;
+        if (g_update_max_events > 0) {
+            max_events = std::max(events_left / conns_left, 1);
+        }
+        const int handled = g_connclients[i]->Update(budget_us, max_events);
+        events_left -= handled;
     }
+    FreeClosedConnections();
     return dmExtension::RESULT_OK;
 }
 
@@ -0,0 +1,128 @@
+#include "path_monitor.h"
+
+#include <algorithm>
+
+void PathMonitor::Init(int probe_ms, int margin, int64_t now_ms)
+{
+    *this = PathMonitor();
+    probe_ms_ = std::max(probe_ms, 0);
+    margin_ = margin > 0 ? std::min(margin, 90) : 30;
+    next_probe_ms_ = now_ms;
+    switch_ts_ = now_ms;
+}
+
+bool PathMonitor::TryProbe(int64_t now_ms)
+{
+    if (!Enabled() || now_ms < next_probe_ms_) return false;
+    next_probe_ms_ = now_ms + probe_ms_;
+    return true;
+}
+
+void PathMonitor::OnUdpPingSent(int64_t ts)
+{
+    if (!Enabled()) return;
+    udp_ping_ts_[udp_ping_next_] = ts;
+    udp_ping_acked_[udp_ping_next_] = false;
+    udp_ping_next_ = (udp_ping_next_ + 1) % path_udp_ping_window;
+}
+
+void PathMonitor::OnUdpPingAck(int64_t ts, int64_t now_ms)
+{
+    if (!Enabled() || ts <= 0) return;
+    for (int i = 0; i < path_udp_ping_window; ++i) {
+        if (udp_ping_ts_[i] == ts && !udp_ping_acked_[i]) {
+            udp_ping_acked_[i] = true;
+            const int rtt = (int)std::max<int64_t>(now_ms - ts, 0);
+            udp_rtt_ = udp_rtt_ < 0 ? rtt : (udp_rtt_ * 7 + rtt) / 8;
+            return;
+        }
+    }
+}
+
+void PathMonitor::OnTcpPingSent(int64_t ts)
+{
+    if (Enabled()) tcp_ping_ts_ = ts;
+}
+
+void PathMonitor::OnTcpPingAck(int64_t ts, int64_t now_ms)
+{
+    if (!Enabled() || ts <= 0) return;
+    const int rtt = (int)std::max<int64_t>(now_ms - ts, 0);
+    tcp_rtt_ = tcp_rtt_ < 0 ? rtt : (tcp_rtt_ * 7 + rtt) / 8;
+    if (ts >= tcp_ping_ts_) tcp_ping_ts_ = 0;
+}
+
+void PathMonitor::OnKcpCounters(uint32_t sent, uint32_t lost, uint32_t recv, uint32_t recv_gaps)
+{
+    if (over_tcp_) {
+        // TCP上KCP的超时和空洞不代表UDP; 旧的UDP丢包率逐渐淡出
+        kcp_sent_ = sent;
+        kcp_lost_ = lost;
+        kcp_recv_ = recv;
+        kcp_recv_gaps_ = recv_gaps;
+        kcp_loss_ = kcp_loss_ * 3 / 4;
+        return;
+    }
+    // 样本太少的方向不更新, 攒到下次
+    uint32_t sample = 0;
+    bool sampled = false;
+    const uint32_t dsent = sent - kcp_sent_;
+    if (dsent >= 8) {
+        sample = std::min(lost - kcp_lost_, dsent) * 1000 / dsent;
+        sampled = true;
+        kcp_sent_ = sent;
+        kcp_lost_ = lost;
+    }
+    const uint32_t drecv = recv - kcp_recv_;
+    if (drecv >= 8) {
+        sample = std::max(sample, std::min(recv_gaps - kcp_recv_gaps_, drecv) * 1000 / drecv);
+        sampled = true;
+        kcp_recv_ = recv;
+        kcp_recv_gaps_ = recv_gaps;
+    }
+    if (sampled) kcp_loss_ = (kcp_loss_ * 3 + sample) / 4;
+}
+
+bool PathMonitor::Evaluate(int64_t now_ms)
+{
+    if (!Enabled()) return false;
+    // 回了的ping和超时没回的ping才算数, 刚发出的还不确定
+    int decided = 0;
+    int lost = 0;
+    for (int i = 0; i < path_udp_ping_window; ++i) {
+        if (udp_ping_ts_[i] == 0) continue;
+        if (udp_ping_acked_[i]) {
+            decided++;
+        } else if (now_ms - udp_ping_ts_[i] >= path_ping_timeout_ms) {
+            decided++;
+            lost++;
+        }
+    }
+    if (decided > 0) ping_loss_ = (uint32_t)(lost * 1000 / decided);
+    udp_loss_ = std::max(ping_loss_, kcp_loss_);
+
+    // 期望送达时延: 往返时延加上按丢包率摊下来的重传等待, 丢包率封顶95%
+    const int udp_rtt = udp_rtt_ >= 0 ? udp_rtt_ : path_ping_timeout_ms;
+    const int64_t loss = std::min<uint32_t>(udp_loss_, 950);
+    udp_score_ = udp_rtt + (int)(loss * (udp_rtt + path_loss_penalty_ms) / (1000 - loss));
+    // TCP丢包体现为队头阻塞, 直接反映在ping时延上
+    int tcp_rtt = tcp_rtt_ >= 0 ? tcp_rtt_ : path_ping_timeout_ms;
+    if (tcp_ping_ts_ != 0) tcp_rtt = std::max(tcp_rtt, (int)(now_ms - tcp_ping_ts_));
+    tcp_score_ = tcp_rtt;
+
+    const int cur = over_tcp_ ? tcp_score_ : udp_score_;
+    const int alt = over_tcp_ ? udp_score_ : tcp_score_;
+    const bool better =
+        (int64_t)alt * 100 <= (int64_t)cur * (100 - margin_) && cur - alt >= path_min_gain_ms;
+    if (!better) {
+        better_since_ = 0;
+        return false;
+    }
+    if (better_since_ == 0) better_since_ = now_ms;
+    if (now_ms - better_since_ < path_hold_ms || now_ms - switch_ts_ < path_dwell_ms) return false;
+    over_tcp_ = !over_tcp_;
+    better_since_ = 0;
+    switch_ts_ = now_ms;
+    switches_++;
+    return true;
+}
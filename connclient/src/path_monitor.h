@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+
+// KCP数据走UDP还是TCP的在线评估.
+// UDP路径看flow 0 ping的往返时延和丢失率, 以及KCP走UDP期间上行的超时重传率和下行的sn空洞率;
+// TCP路径看TCP ping的往返时延, 还没回的ping按已等待的时长算.
+// 两条路径各算一个分数(预计送达时延, ms, 越小越好), 另一条路径明显更好并且保持
+// path_hold_ms才切换, 切换后至少停留path_dwell_ms, 避免来回抖动
+const int path_udp_ping_window = 8;     // UDP丢失率按最近这么多个ping算
+const int path_ping_timeout_ms = 1000;  // ping超过这么久没回算丢失
+const int path_loss_penalty_ms = 100;   // 每次丢包在往返时延之外额外的重传等待
+const int path_min_gain_ms = 20;        // 分数至少好这么多才切换, 时延都很小时不来回切
+const int path_hold_ms = 1500;
+const int path_dwell_ms = 5000;
+
+class PathMonitor
+{
+public:
+    // probe_ms为ping间隔, 0为关闭; margin为切换要求的分数改善百分比, 0用默认值30
+    void Init(int probe_ms, int margin, int64_t now_ms);
+    bool Enabled() const { return probe_ms_ > 0; }
+    bool OverTcp() const { return over_tcp_; }
+    // 到了该发探测ping的时间
+    bool TryProbe(int64_t now_ms);
+    void OnUdpPingSent(int64_t ts);
+    void OnUdpPingAck(int64_t ts, int64_t now_ms);
+    // TCP ping同一时间只有一个在途
+    bool TcpPingPending() const { return tcp_ping_ts_ != 0; }
+    void OnTcpPingSent(int64_t ts);
+    void OnTcpPingAck(int64_t ts, int64_t now_ms);
+    // KCP上行累计首次发送和超时丢失的segment数, 下行收到的sn范围和其中跳过的sn数,
+    // 只有走UDP期间的增量计入UDP丢包率
+    void OnKcpCounters(uint32_t sent, uint32_t lost, uint32_t recv, uint32_t recv_gaps);
+    // 更新两条路径的分数, 需要切换时返回true, OverTcp()已经是新的路径
+    bool Evaluate(int64_t now_ms);
+
+    uint32_t Switches() const { return switches_; }
+    int UdpRtt() const { return udp_rtt_; }
+    uint32_t UdpLoss() const { return udp_loss_; }
+    int UdpScore() const { return udp_score_; }
+    int TcpRtt() const { return tcp_rtt_; }
+    int TcpScore() const { return tcp_score_; }
+
+private:
+    int probe_ms_ = {0};
+    int margin_ = {0};
+    bool over_tcp_ = {false};
+    int64_t next_probe_ms_ = {0};
+    int64_t udp_ping_ts_[path_udp_ping_window] = {};  // 环形, 0为空
+    bool udp_ping_acked_[path_udp_ping_window] = {};
+    int udp_ping_next_ = {0};
+    int udp_rtt_ = {-1};  // EWMA, -1为还没有采样
+    uint32_t ping_loss_ = {0};  // 千分比
+    uint32_t kcp_loss_ = {0};
+    uint32_t udp_loss_ = {0};
+    uint32_t kcp_sent_ = {0};
+    uint32_t kcp_lost_ = {0};
+    uint32_t kcp_recv_ = {0};
+    uint32_t kcp_recv_gaps_ = {0};
+    int64_t tcp_ping_ts_ = {0};
+    int tcp_rtt_ = {-1};
+    int udp_score_ = {0};
+    int tcp_score_ = {0};
+    int64_t better_since_ = {0};  // 另一条路径开始明显更好的时间, 0为没有
+    int64_t switch_ts_ = {0};
+    uint32_t switches_ = {0};
+};
@@ -22,6 +22,8 @@ int SocketAPI::get_last_error()
             return ECONNABORTED;
         case WSAEWOULDBLOCK:
             return EWOULDBLOCK;
+        case WSAEMSGSIZE:
+            return EMSGSIZE;
         default:
             return err;
     }
@@ -281,6 +283,25 @@ bool SocketAPI::set_tcp_no_delay(int fd)
     return setsockopt_ex(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&tcp_nodelay_enable, sizeof(tcp_nodelay_enable));
 }
 
+bool SocketAPI::set_dont_fragment(SOCKET s, bool on)
+{
+#if defined(IP_MTU_DISCOVER)
+    // Linux/Android: PROBE带DF且不受内核缓存的路径MTU限制, DONT不带DF
+    int val = on ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
+    return setsockopt_ex(s, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+#elif defined(IP_DONTFRAG)
+    int val = on ? 1 : 0;
+    return setsockopt_ex(s, IPPROTO_IP, IP_DONTFRAG, &val, sizeof(val));
+#elif defined(OS_WIN32)
+    DWORD val = on ? 1 : 0;
+    return setsockopt_ex(s, IPPROTO_IP, IP_DONTFRAGMENT, &val, sizeof(val));
+#else
+    (void)s;
+    (void)on;
+    return false;
+#endif
+}
+
 bool SocketAPI::shutdown_ex(SOCKET s, int how)
 {
     if (shutdown(s, how) < 0) {
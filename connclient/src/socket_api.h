@@ -56,6 +56,8 @@ int select_ex(int maxfdp1, fd_set* readset, fd_set* writeset, fd_set* exceptset,
 void set_send_buf(SOCKET s, int len);
 void set_recv_buf(SOCKET s, int len);
 bool set_tcp_no_delay(int fd);
+// IPv4 UDP socket之后发出的datagram是否带DF, 不支持的平台返回false
+bool set_dont_fragment(SOCKET s, bool on);
 
 SOCKET InitUDPListenSocket(const char* ip, uint32_t port, bool nonblock = true);
 std::string GetSockAddrStr(const struct sockaddr_in& addr);
@@ -0,0 +1,839 @@
+#include "echo_peer.h"
+
+#include <poll.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "common_def.h"
+#include "load_msg.h"
+#include "lz4_block.h"
+#include "time_api.h"
+
+const int cs_conn_head_size = sizeof(CsConnHead);
+const int cs_udp_conn_head_size = sizeof(CsUdpConnHead);
+const int recv_one_time_size = 1024 * 16;
+const int max_udp_pkg_len = 2048;
+const int max_pkg_size = 3 * 1024 * 1024;
+const size_t max_pending_udp = 256;  // 等待KCP扩展协商期间最多暂存的上行datagram数
+const int fec_group_timeout_ms = 10;
+
+EchoPeer::~EchoPeer()
+{
+    Stop();
+}
+
+int EchoPeer::Start(const EchoPeerOptions& options)
+{
+    options_ = options;
+    start_ms_ = TimeAPI::GetTimeMs();
+    if (options_.compress > 0) options_.kcp_features |= KCP_FEATURE_COMPRESS;
+    SocketAPI::init_sock_env();
+
+    listen_sock_ = SocketAPI::socket_ex(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_sock_ == INVALID_SOCKET) return -1;
+    int reuse_addr_ok = 1;
+    SocketAPI::setsockopt_ex(listen_sock_, SOL_SOCKET, SO_REUSEADDR, &reuse_addr_ok,
+                             sizeof(reuse_addr_ok));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(options_.ip.c_str());
+    addr.sin_port = htons(options_.port);
+    if (!SocketAPI::bind_ex(listen_sock_, (struct sockaddr*)&addr, sizeof(addr)) ||
+        !SocketAPI::listen_ex(listen_sock_, 4096)) {
+        std::cerr << "echo peer bind/listen failed: " << strerror(errno) << std::endl;
+        Stop();
+        return -1;
+    }
+    SocketAPI::setsocketnonblocking_ex(listen_sock_, true);
+
+    udp_sock_ = SocketAPI::InitUDPListenSocket(options_.ip.c_str(), options_.port, true);
+    if (udp_sock_ == INVALID_SOCKET) {
+        std::cerr << "echo peer udp bind failed: " << strerror(errno) << std::endl;
+        Stop();
+        return -1;
+    }
+    SocketAPI::set_recv_buf(udp_sock_, 8 * 1024 * 1024);
+    SocketAPI::set_send_buf(udp_sock_, 8 * 1024 * 1024);
+    return 0;
+}
+
+void EchoPeer::Stop()
+{
+    for (auto& it : conns_) {
+        PeerConn* conn = it.second;
+        if (conn->fd != -1) SocketAPI::closesocket_ex(conn->fd);
+        ReleaseConn(conn);
+    }
+    conns_.clear();
+    if (listen_sock_ != -1) {
+        SocketAPI::closesocket_ex(listen_sock_);
+        listen_sock_ = -1;
+    }
+    if (udp_sock_ != -1) {
+        SocketAPI::closesocket_ex(udp_sock_);
+        udp_sock_ = -1;
+    }
+}
+
+void EchoPeer::Run(volatile bool* running)
+{
+    std::vector<struct pollfd> pfds;
+    std::vector<PeerConn*> pconns;
+    while (*running) {
+        pfds.clear();
+        pconns.clear();
+        pfds.push_back({listen_sock_, POLLIN, 0});
+        pfds.push_back({udp_sock_, POLLIN, 0});
+        for (auto& it : conns_) {
+            PeerConn* conn = it.second;
+            if (conn->detached) continue;
+            const short events = POLLIN | (conn->tcp_writable ? POLLOUT : 0);
+            pfds.push_back({conn->fd, events, 0});
+            pconns.push_back(conn);
+        }
+
+        const int retval = poll(pfds.data(), pfds.size(), 1);
+        const uint32_t now_ms = (uint32_t)TimeAPI::GetTimeMs();
+        if (retval > 0) {
+            if (pfds[0].revents & POLLIN) OnAccept(now_ms);
+            if (pfds[1].revents & POLLIN) OnUdpRead(now_ms);
+            for (size_t i = 0; i < pconns.size(); ++i) {
+                PeerConn* conn = pconns[i];
+                const short revents = pfds[i + 2].revents;
+                if (revents & (POLLIN | POLLERR | POLLHUP)) {
+                    OnTcpRead(conn, now_ms);
+                    if (conn->fd == -1) continue;
+                }
+                if (revents & POLLOUT) OnTcpWrite(conn);
+            }
+        } else if (retval == -1 && errno != EINTR) {
+            std::cerr << "echo peer poll: " << strerror(errno) << std::endl;
+        }
+
+        // 断开的连接延后到这里释放, 避免poll结果里的指针失效
+        for (auto it = conns_.begin(); it != conns_.end();) {
+            if (it->second->fd == -1 && !it->second->detached) {
+                ReleaseConn(it->second);
+                it = conns_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        TickKcp((uint32_t)TimeAPI::GetTimeMs());
+    }
+    fprintf(stderr, "echo peer: udp in %llu pkts, %llu bytes\n",
+            (unsigned long long)udp_in_pkts_, (unsigned long long)udp_in_bytes_);
+    if (crc_drops_ > 0) {
+        fprintf(stderr, "echo peer: checksum dropped %llu datagrams\n",
+                (unsigned long long)crc_drops_);
+    }
+    if (fec_recovered_ > 0) {
+        fprintf(stderr, "echo peer: fec recovered %llu datagrams\n",
+                (unsigned long long)fec_recovered_);
+    }
+    if (batch_in_batches_ > 0) {
+        fprintf(stderr, "echo peer: batch in %llu batches, %llu msgs\n",
+                (unsigned long long)batch_in_batches_, (unsigned long long)batch_in_msgs_);
+    }
+    if (unreliable_in_msgs_ > 0 || unreliable_stale_drops_ > 0) {
+        fprintf(stderr, "echo peer: unreliable in %llu msgs, %llu stale dropped\n",
+                (unsigned long long)unreliable_in_msgs_,
+                (unsigned long long)unreliable_stale_drops_);
+    }
+    if (options_.dup_adaptive > 0) {
+        for (const auto& it : conns_) CountDupSend(it.second);
+        if (dup_kcps_ > 0) {
+            fprintf(stderr, "echo peer: dupsend avg level %.2f, avg loss %.1f permille\n",
+                    (double)dup_level_sum_ / dup_kcps_, (double)dup_loss_sum_ / dup_kcps_);
+        }
+    }
+    if (relinks_ > 0) {
+        fprintf(stderr, "echo peer: %llu relinks\n", (unsigned long long)relinks_);
+    }
+    if (path_to_tcp_ > 0 || path_to_udp_ > 0) {
+        fprintf(stderr, "echo peer: kcp path switched to tcp %llu times, to udp %llu times\n",
+                (unsigned long long)path_to_tcp_, (unsigned long long)path_to_udp_);
+    }
+    if (options_.compress > 0) {
+        fprintf(stderr, "echo peer: lz4 in %llu -> %llu bytes, out %llu -> %llu bytes\n",
+                (unsigned long long)zip_in_bytes_, (unsigned long long)unzip_in_bytes_,
+                (unsigned long long)unzip_out_bytes_, (unsigned long long)zip_out_bytes_);
+    }
+}
+
+void EchoPeer::TickKcp(uint32_t now_ms)
+{
+    for (auto& it : conns_) {
+        PeerConn* conn = it.second;
+        if (conn->kcps[0] == nullptr || conn->fd == -1) continue;
+        if (options_.relink_ms > 0 && conn->feature_known && !conn->relinked &&
+            (int32_t)(now_ms - conn->feature_ms) >= options_.relink_ms) {
+            DetachConn(conn);
+            continue;
+        }
+        if (conn->fec_encoder.PendingData() > 0 &&
+            (int64_t)now_ms - conn->fec_encoder.GroupStartMs() >= fec_group_timeout_ms) {
+            SendFecParity(conn);
+        }
+        if ((int32_t)(now_ms - conn->next_update_ms) >= 0) {
+            uint32_t next_ms = now_ms + (uint32_t)options_.interval;
+            for (ikcpcb* kcp : conn->kcps) {
+                if (kcp == nullptr) continue;
+                pvp_ikcp_update(kcp, now_ms);
+                const uint32_t check_ms = pvp_ikcp_check(kcp, now_ms);
+                if ((int32_t)(check_ms - next_ms) < 0) next_ms = check_ms;
+            }
+            conn->next_update_ms = next_ms;
+        }
+    }
+}
+
+void EchoPeer::OnAccept(uint32_t now_ms)
+{
+    while (true) {
+        struct sockaddr_in addr;
+        uint32_t addr_len = sizeof(addr);
+        const int fd = SocketAPI::accept_ex(listen_sock_, (struct sockaddr*)&addr, &addr_len);
+        if (fd == INVALID_SOCKET) return;
+        SocketAPI::setsocketnonblocking_ex(fd, true);
+        SocketAPI::set_tcp_no_delay(fd);
+        if (RelinkConn(fd)) continue;
+
+        auto* conn = new PeerConn();
+        conn->peer = this;
+        conn->fd = fd;
+        conn->flow = next_flow_++;
+        // 每个连接一个非0的magic, 随TCP包头下发, 客户端之后的包头都带上它
+        conn->magic = (uint8_t)(conn->flow * 13 + 7);
+        CreateKcp(conn, 0, now_ms);
+        conns_[conn->flow] = conn;
+
+        ControlKCPInfo kcp_info;
+        memset(&kcp_info, 0, sizeof(kcp_info));
+        kcp_info.kcp_conv = (uint32_t)conn->flow;
+        kcp_info.nodelay = 1;
+        kcp_info.interval = options_.interval;
+        kcp_info.resend = 2;
+        kcp_info.nc = options_.nc;
+        kcp_info.mtu = options_.mtu;
+        kcp_info.rx_minrto = 30;
+        kcp_info.fastresend = 2;
+        kcp_info.snd_wnd = options_.snd_wnd;
+        kcp_info.rcv_wnd = options_.rcv_wnd;
+        kcp_info.rmt_wnd = options_.rcv_wnd;
+        kcp_info.enable_udp = options_.enable_udp ? 1 : 0;
+        // ControlKCPFeature紧跟在ControlKCPInfo之后
+        char info_buf[sizeof(ControlKCPInfo) + sizeof(ControlKCPFeature)];
+        ControlKCPFeature feature;
+        feature.features = options_.kcp_features;
+        memcpy(info_buf, &kcp_info, sizeof(kcp_info));
+        memcpy(info_buf + sizeof(kcp_info), &feature, sizeof(feature));
+        SendTCPBuf(conn, CONTROL_KCP_INFO, info_buf, (int)sizeof(info_buf));
+        SendTCPBuf(conn, CONTROL_SYNC_LABEL, nullptr, 0);
+    }
+}
+
+void EchoPeer::OnTcpRead(PeerConn* conn, uint32_t now_ms)
+{
+    if (conn->read_stream.EnsureWritable(recv_one_time_size) != 0) {
+        CloseConn(conn);
+        return;
+    }
+    const int nread =
+        SocketAPI::recv_ex(conn->fd, conn->read_stream.End(), recv_one_time_size, 0);
+    if (nread > 0) {
+        conn->read_stream.AddSize(nread);
+        ReadStream(conn, now_ms);
+    } else if (nread == 0 || (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR)) {
+        CloseConn(conn);
+    }
+}
+
+void EchoPeer::ReadStream(PeerConn* conn, uint32_t now_ms)
+{
+    while (conn->fd != -1) {
+        const int stream_len = conn->read_stream.Len();
+        const char* buf = conn->read_stream.Buf();
+        int head_len = cs_conn_head_size;
+        int pkg_len = 0;
+        uint8_t cmd = 0;
+        if (conn->compact) {
+            // 客户端回复CONTROL_KCP_FEATURE之后的帧都是紧凑格式
+            if (stream_len < 2) return;
+            uint32_t msg_len = 0;
+            const int n = VarintGet(buf + 1, stream_len - 1, &msg_len);
+            if (n < 0 && stream_len - 1 < varint_max_bytes) return;
+            if (n < 0 || !CompactMagicMatch(conn->magic, (uint8_t)buf[0]) ||
+                msg_len > (uint32_t)max_pkg_size) {
+                CloseConn(conn);
+                return;
+            }
+            head_len = 1 + n;
+            pkg_len = head_len + (int)msg_len;
+            cmd = (uint8_t)buf[0] & 0x1F;
+        } else {
+            if (stream_len < cs_conn_head_size) return;
+            auto* head = (CsConnHead*)buf;
+            pkg_len = ntohl(head->sec_pkg_len);
+            if (pkg_len < cs_conn_head_size || pkg_len > max_pkg_size) {
+                CloseConn(conn);
+                return;
+            }
+            conn->magic = head->magic;
+            cmd = head->cmd;
+        }
+        if (stream_len < pkg_len) return;
+
+        const char* data = buf + head_len;
+        const int data_len = pkg_len - head_len;
+        if (cmd == CONTROL_PING) {
+            SendTCPBuf(conn, CONTROL_PING, data, data_len);
+        } else if (cmd == CONTROL_RELIABLE_MSG) {
+            InputToKcp(conn, data, data_len, now_ms, conn->compact);
+        } else if (cmd == CONTROL_UNRELIABLE_MSG || cmd == CONTROL_UNRELIABLE_SEQ_MSG) {
+            OnUnreliableMsg(conn, cmd, data, data_len);
+        } else if (cmd == CONTROL_KCP_FEATURE && data_len >= (int)sizeof(ControlKCPFeature)) {
+            OnKcpFeature(conn, ((const ControlKCPFeature*)data)->features, now_ms);
+        } else if (cmd == CONTROL_KCP_PATH && data_len >= (int)sizeof(ControlKCPPath)) {
+            conn->kcp_over_tcp = ((const ControlKCPPath*)data)->trans_type == PKG_TRANS_TCP;
+            (conn->kcp_over_tcp ? path_to_tcp_ : path_to_udp_)++;
+        }
+        conn->read_stream.Skip(pkg_len);
+    }
+}
+
+void EchoPeer::OnUdpRead(uint32_t now_ms)
+{
+    char pkg_buf[max_udp_pkg_len];
+    while (true) {
+        struct sockaddr_in addr;
+        uint32_t addr_len = sizeof(addr);
+        int pkg_len = SocketAPI::recvfrom_ex(udp_sock_, pkg_buf, max_udp_pkg_len, 0,
+                                             (struct sockaddr*)&addr, &addr_len);
+        if (pkg_len < 0) return;
+        if (pkg_len < 2 || UdpBlocked()) continue;
+        udp_in_pkts_++;
+        udp_in_bytes_ += pkg_len;
+
+        if (pkg_len == sizeof(int) + sizeof(int64_t) && ((CsUdpConnHead*)pkg_buf)->flow == 0) {
+            // UDP ping原样回传
+            SocketAPI::sendto_ex(udp_sock_, pkg_buf, pkg_len, 0, (struct sockaddr*)&addr,
+                                 addr_len);
+            continue;
+        }
+        if (options_.up_loss > 0 && rand() % 100 < options_.up_loss) continue;
+        if (OverPathMtu(pkg_len)) continue;
+        // 客户端回复CONTROL_KCP_FEATURE后就带校验和, 之前的不带; 收到回复后校验不过的丢弃
+        int crc_len = -1;
+        if ((options_.kcp_features & KCP_FEATURE_CRC32C) != 0) {
+            crc_len = UdpCrcStrip(pkg_buf, pkg_len);
+            if (crc_len >= 0) pkg_len = crc_len;
+        }
+        int head_len = 0;
+        uint8_t cmd = 0;
+        bool compact = false;
+        PeerConn* conn = ParseUdpHead(pkg_buf, pkg_len, &head_len, &cmd, &compact);
+        if (conn != nullptr && conn->crc && crc_len < 0) {
+            crc_drops_++;
+            continue;
+        }
+        if (conn == nullptr || conn->fd == -1) continue;
+        conn->udp_addr = addr;
+        conn->udp_addr_valid = true;
+        const char* msg = pkg_buf + head_len;
+        const int msg_len = pkg_len - head_len;
+        if (cmd == CONTROL_RELIABLE_MSG) {
+            OnUdpKcpData(conn, msg, msg_len, now_ms, compact);
+        } else if (cmd == CONTROL_FEC_MSG) {
+            OnFecMsg(conn, msg, msg_len, now_ms, compact);
+        } else if (cmd == CONTROL_UNRELIABLE_MSG || cmd == CONTROL_UNRELIABLE_SEQ_MSG) {
+            OnUnreliableMsg(conn, cmd, msg, msg_len);
+        } else if (cmd == CONTROL_MTU_PROBE && msg_len >= (int)sizeof(ControlMtuProbe)) {
+            SendUDPBuf(conn, CONTROL_MTU_PROBE, msg, (int)sizeof(ControlMtuProbe));
+        }
+    }
+}
+
+// 原格式的flow和magic都对得上按原格式解析, 否则提供了紧凑格式时按紧凑格式找连接.
+// 客户端回复CONTROL_KCP_FEATURE后就改用紧凑格式, UDP可能比这个回复先到
+EchoPeer::PeerConn* EchoPeer::ParseUdpHead(const char* pkg_buf, int pkg_len, int* head_len,
+                                           uint8_t* cmd, bool* compact)
+{
+    if (pkg_len >= cs_udp_conn_head_size) {
+        auto* head = (const CsUdpConnHead*)pkg_buf;
+        auto it = conns_.find(head->flow);
+        if (it != conns_.end() && it->second->magic == head->magic) {
+            *head_len = cs_udp_conn_head_size;
+            *cmd = head->cmd;
+            *compact = false;
+            return it->second;
+        }
+    }
+    if ((options_.kcp_features & KCP_FEATURE_COMPACT) == 0) return nullptr;
+    uint32_t flow = 0;
+    const int n = VarintGet(pkg_buf + 1, pkg_len - 1, &flow);
+    if (n < 0) return nullptr;
+    auto it = conns_.find((int)flow);
+    if (it == conns_.end() || !CompactMagicMatch(it->second->magic, (uint8_t)pkg_buf[0])) {
+        return nullptr;
+    }
+    *head_len = 1 + n;
+    *cmd = (uint8_t)pkg_buf[0] & 0x1F;
+    *compact = true;
+    return it->second;
+}
+
+ikcpcb* EchoPeer::CreateKcp(PeerConn* conn, int channel, uint32_t now_ms)
+{
+    ikcpcb* kcp = pvp_ikcp_create(KcpChannelConv((uint32_t)conn->flow, channel), conn);
+    kcp->output = EchoPeer::KCPOutput;
+    pvp_ikcp_nodelay(kcp, 1, options_.interval, 2, options_.nc);
+    pvp_ikcp_wndsize(kcp, options_.snd_wnd, options_.rcv_wnd);
+    pvp_ikcp_setmtu(kcp, options_.mtu);
+    kcp->fastresend = 2;
+    pvp_ikcp_setackdelay(kcp, options_.ack_delay, options_.ack_every);
+    if (options_.dup_adaptive > 0) pvp_ikcp_setdupadaptive(kcp, options_.dup_adaptive, 0, 0, 0);
+    if (channel > 0) pvp_ikcp_setsack(kcp, conn->kcps[0]->sack);
+    if (conn->compact) pvp_ikcp_setcompact(kcp, 1, channel);
+    pvp_ikcp_update(kcp, now_ms);
+    conn->kcps[channel] = kcp;
+    conn->next_update_ms = now_ms;
+    return kcp;
+}
+
+void EchoPeer::OnUdpKcpData(PeerConn* conn, const char* data, int len, uint32_t now_ms,
+                            bool compact)
+{
+    // 提供了压缩或批量时, 上行格式要等CONTROL_KCP_FEATURE到了才能确定, 先暂存
+    if ((options_.kcp_features & (KCP_FEATURE_COMPRESS | KCP_FEATURE_BATCH)) != 0 &&
+        !conn->feature_known &&
+        conn->pending_udp.size() < max_pending_udp) {
+        conn->pending_udp.emplace_back(std::string(data, len), compact);
+        return;
+    }
+    InputToKcp(conn, data, len, now_ms, compact);
+}
+
+void EchoPeer::OnFecMsg(PeerConn* conn, const char* data, int len, uint32_t now_ms,
+                        bool compact)
+{
+    if (conn->fec_decoder.Input(data, len) != 0) return;
+    if (((const FecHead*)data)->data_count == 0) {
+        OnUdpKcpData(conn, data + sizeof(FecHead), len - (int)sizeof(FecHead), now_ms, compact);
+    }
+    const char* recovered = nullptr;
+    int recovered_len = 0;
+    while (conn->fd != -1 && conn->fec_decoder.PopRecovered(&recovered, &recovered_len)) {
+        fec_recovered_++;
+        OnUdpKcpData(conn, recovered, recovered_len, now_ms, compact);
+    }
+}
+
+void EchoPeer::InputToKcp(PeerConn* conn, const char* data, int len, uint32_t now_ms,
+                          bool compact)
+{
+    // 提供了多通道时按conv分段, 每段交给对应通道的KCP; 紧凑格式按segment头里的通道号分段
+    int offset = 0;
+    while (offset < len && conn->fd != -1) {
+        int channel = 0;
+        int span = len - offset;
+        if (compact) {
+            span = (int)pvp_ikcp_compact_span(data + offset, len - offset, &channel);
+            if (span < 0 && offset > 0) break;
+            if (span <= 0 || channel >= kcp_max_channels) {
+                std::cerr << "echo peer flow[" << conn->flow << "] bad compact segment"
+                          << std::endl;
+                CloseConn(conn);
+                return;
+            }
+        } else if ((options_.kcp_features & KCP_FEATURE_CHANNELS) != 0) {
+            IUINT32 conv = 0;
+            span = (int)pvp_ikcp_conv_span(data + offset, len - offset, &conv);
+            if (span < 0 && offset > 0) break;
+            const uint32_t diff = conv ^ (uint32_t)conn->flow;
+            channel = (int)(diff >> 24);
+            if (span <= 0 || (diff & 0x00FFFFFF) != 0 || channel >= kcp_max_channels) {
+                std::cerr << "echo peer flow[" << conn->flow << "] bad conv " << conv << std::endl;
+                CloseConn(conn);
+                return;
+            }
+        }
+        ikcpcb* kcp = conn->kcps[channel];
+        if (kcp == nullptr) kcp = CreateKcp(conn, channel, now_ms);
+        const int ret = compact ? pvp_ikcp_input_compact(kcp, data + offset, span, now_ms, nullptr)
+                                : pvp_ikcp_input(kcp, data + offset, span, now_ms);
+        if (ret != 0) {
+            std::cerr << "echo peer flow[" << conn->flow << "] pvp_ikcp_input failed" << std::endl;
+            CloseConn(conn);
+            return;
+        }
+        RecvKcpMsgs(conn, kcp, now_ms);
+        offset += span;
+    }
+    // 有ack要回, 尽快flush
+    conn->next_update_ms = now_ms;
+}
+
+void EchoPeer::RecvKcpMsgs(PeerConn* conn, ikcpcb* kcp, uint32_t now_ms)
+{
+    while (conn->fd != -1) {
+        const int peek_size = pvp_ikcp_peeksize(kcp);
+        if (peek_size < 0) break;
+        if (peek_size > (int)recv_buf_.size()) recv_buf_.resize(peek_size);
+        const int recv_len = pvp_ikcp_recv(kcp, recv_buf_.data(), (int)recv_buf_.size());
+        if (recv_len < 0) break;
+        if (!conn->compress && !conn->batch) {
+            EchoMsg(conn, kcp, recv_buf_.data(), recv_len, now_ms);
+            continue;
+        }
+        // 协商了压缩或批量, 第一个byte为控制byte
+        if (recv_len < 1) continue;
+        if (((uint8_t)recv_buf_[0] & CONTROL_FLAG_BATCH) != 0) {
+            EchoBatch(conn, kcp, recv_buf_.data(), recv_len, now_ms);
+            continue;
+        }
+        if (((uint8_t)recv_buf_[0] & CONTROL_FLAG_COMPRESSED) == 0) {
+            EchoMsg(conn, kcp, recv_buf_.data() + 1, recv_len - 1, now_ms);
+            continue;
+        }
+        const int head_len = 1 + (int)sizeof(CompressedMsgHead);
+        const uint32_t raw_len =
+            recv_len > head_len ? ((CompressedMsgHead*)(recv_buf_.data() + 1))->raw_len : 0;
+        if (raw_len == 0 || raw_len > (uint32_t)max_pkg_size) {
+            CloseConn(conn);
+            break;
+        }
+        if (unzip_buf_.size() < raw_len) unzip_buf_.resize(raw_len);
+        if (Lz4Block::Decompress(recv_buf_.data() + head_len, recv_len - head_len,
+                                 unzip_buf_.data(), (int)raw_len) < 0) {
+            std::cerr << "echo peer flow[" << conn->flow << "] decompress failed" << std::endl;
+            CloseConn(conn);
+            break;
+        }
+        zip_in_bytes_ += recv_len;
+        unzip_in_bytes_ += raw_len;
+        EchoMsg(conn, kcp, unzip_buf_.data(), (int)raw_len, now_ms);
+    }
+}
+
+// 批量消息拆开逐条回显
+void EchoPeer::EchoBatch(PeerConn* conn, ikcpcb* kcp, char* msg, int len, uint32_t now_ms)
+{
+    int offset = 1;
+    while (offset < len && conn->fd != -1) {
+        uint32_t entry_len = 0;
+        const int n = BatchGetLen(msg + offset, len - offset, &entry_len);
+        if (n < 0 || entry_len > (uint32_t)(len - offset - n)) {
+            std::cerr << "echo peer flow[" << conn->flow << "] bad batch msg" << std::endl;
+            CloseConn(conn);
+            return;
+        }
+        offset += n;
+        batch_in_msgs_++;
+        if (!options_.echo_batch) {
+            EchoMsg(conn, kcp, msg + offset, (int)entry_len, now_ms);
+        } else if (entry_len >= sizeof(LoadMsgHead)) {
+            ((LoadMsgHead*)(msg + offset))->peer_us = LoadNowUs();
+        }
+        offset += (int)entry_len;
+    }
+    batch_in_batches_++;
+    // 控制byte已带CONTROL_FLAG_BATCH
+    if (options_.echo_batch && conn->fd != -1) pvp_ikcp_send_ex(kcp, msg, len, now_ms);
+}
+
+void EchoPeer::EchoMsg(PeerConn* conn, ikcpcb* kcp, char* msg, int len, uint32_t now_ms)
+{
+    if (len >= (int)sizeof(LoadMsgHead)) {
+        auto* load_head = (LoadMsgHead*)msg;
+        load_head->peer_us = LoadNowUs();
+    }
+    if (conn->compress && len >= options_.compress) {
+        const int head_len = 1 + (int)sizeof(CompressedMsgHead);
+        send_buf_.resize(head_len + Lz4Block::Bound(len));
+        const int zip_len = Lz4Block::Compress(msg, len, &send_buf_[head_len],
+                                               (int)send_buf_.size() - head_len);
+        if (zip_len > 0 && head_len + zip_len < len + 1) {
+            send_buf_[0] = (char)((int)CONTROL_RELIABLE_MSG | CONTROL_FLAG_COMPRESSED);
+            ((CompressedMsgHead*)&send_buf_[1])->raw_len = (uint32_t)len;
+            unzip_out_bytes_ += len;
+            zip_out_bytes_ += head_len + zip_len;
+            pvp_ikcp_send_ex(kcp, send_buf_.data(), head_len + zip_len, now_ms);
+            return;
+        }
+    }
+    // 下行消息第一个byte为控制byte
+    send_buf_.resize(len + 1);
+    send_buf_[0] = (char)CONTROL_RELIABLE_MSG;
+    if (len > 0) memcpy(&send_buf_[1], msg, len);
+    pvp_ikcp_send_ex(kcp, send_buf_.data(), (int)send_buf_.size(), now_ms);
+}
+
+// 上行不可靠消息丢弃过期的, 其余填上收到时间后按不可靠消息回传
+void EchoPeer::OnUnreliableMsg(PeerConn* conn, uint8_t cmd, const char* data, int len)
+{
+    const int head_len = cmd == CONTROL_UNRELIABLE_SEQ_MSG ? (int)sizeof(UnreliableMsgHead) : 0;
+    if (len <= head_len) return;
+    if (head_len > 0) {
+        const auto* head = (const UnreliableMsgHead*)data;
+        if (head->stream >= unreliable_max_streams) return;
+        const uint32_t bit = 1u << head->stream;
+        if ((conn->unreliable_recv_valid & bit) != 0 &&
+            !UnreliableSeqNewer(head->seq, conn->unreliable_recv_seq[head->stream])) {
+            unreliable_stale_drops_++;
+            return;
+        }
+        conn->unreliable_recv_valid |= bit;
+        conn->unreliable_recv_seq[head->stream] = head->seq;
+    }
+    unreliable_in_msgs_++;
+    const int stream = head_len > 0 ? ((const UnreliableMsgHead*)data)->stream : 0;
+    const int out_head_len = conn->unreliable_seq ? (int)sizeof(UnreliableMsgHead) : 0;
+    send_buf_.resize(out_head_len + len - head_len);
+    memcpy(&send_buf_[out_head_len], data + head_len, len - head_len);
+    if (out_head_len > 0) {
+        auto* head = (UnreliableMsgHead*)&send_buf_[0];
+        head->stream = (uint8_t)stream;
+        head->seq = conn->unreliable_send_seq[stream]++;
+    }
+    if (len - head_len >= (int)sizeof(LoadMsgHead)) {
+        ((LoadMsgHead*)&send_buf_[out_head_len])->peer_us = LoadNowUs();
+    }
+    const uint8_t out_cmd = conn->unreliable_seq ? CONTROL_UNRELIABLE_SEQ_MSG : CONTROL_UNRELIABLE_MSG;
+    if (options_.enable_udp && conn->udp_addr_valid && !conn->kcp_over_tcp) {
+        SendUDPBuf(conn, out_cmd, send_buf_.data(), (int)send_buf_.size());
+    } else {
+        SendTCPBuf(conn, out_cmd, send_buf_.data(), (int)send_buf_.size());
+    }
+}
+
+void EchoPeer::OnKcpFeature(PeerConn* conn, uint32_t features, uint32_t now_ms)
+{
+    features &= options_.kcp_features;
+    for (ikcpcb* kcp : conn->kcps) {
+        if (kcp != nullptr) pvp_ikcp_setsack(kcp, (features & KCP_FEATURE_SACK) != 0);
+    }
+    conn->compress = (features & KCP_FEATURE_COMPRESS) != 0;
+    conn->batch = (features & KCP_FEATURE_BATCH) != 0;
+    conn->unreliable_seq = (features & KCP_FEATURE_UNRELIABLE_SEQ) != 0;
+    if ((features & KCP_FEATURE_FEC) != 0 && options_.fec_data > 0) {
+        conn->fec_encoder.Init(options_.fec_data, options_.fec_parity);
+    }
+    const uint32_t switched = features & (KCP_FEATURE_COMPACT | KCP_FEATURE_CRC32C);
+    if (switched != 0) {
+        // 确认还用原格式, 之后下行改用新格式, 下行FEC上面刚从新的一组开始
+        ControlKCPFeature ack;
+        ack.features = switched;
+        SendTCPBuf(conn, CONTROL_KCP_FEATURE, (const char*)&ack, (int)sizeof(ack));
+        conn->crc = (switched & KCP_FEATURE_CRC32C) != 0;
+    }
+    if ((switched & KCP_FEATURE_COMPACT) != 0) {
+        conn->compact = true;
+        for (int i = 0; i < kcp_max_channels; ++i) {
+            if (conn->kcps[i] != nullptr) pvp_ikcp_setcompact(conn->kcps[i], 1, i);
+        }
+    }
+    conn->feature_known = true;
+    conn->feature_ms = now_ms;
+    std::vector<std::pair<std::string, bool>> pending;
+    pending.swap(conn->pending_udp);
+    for (const auto& pkg : pending) {
+        if (conn->fd == -1) break;
+        InputToKcp(conn, pkg.first.data(), (int)pkg.first.size(), now_ms, pkg.second);
+    }
+}
+
+int EchoPeer::KCPOutput(const char* data, int len, ikcpcb* kcp, void* user)
+{
+    auto* conn = (PeerConn*)user;
+    if (conn == nullptr || conn->fd == -1) return -1;
+    if (conn->peer->options_.enable_udp && conn->udp_addr_valid && !conn->kcp_over_tcp) {
+        if (conn->fec_encoder.Enabled()) return conn->peer->SendFecData(conn, data, len);
+        return conn->peer->SendUDPBuf(conn, CONTROL_RELIABLE_MSG, data, len);
+    }
+    return conn->peer->SendTCPBuf(conn, CONTROL_RELIABLE_MSG, data, len);
+}
+
+int EchoPeer::SendFecData(PeerConn* conn, const char* data, int len)
+{
+    char pkg_buf[max_udp_pkg_len];
+    auto* fec_head = (FecHead*)pkg_buf;
+    if (len > max_udp_pkg_len - cs_udp_conn_head_size - (int)sizeof(FecHead) - 2 ||
+        !conn->fec_encoder.AddData(data, len, TimeAPI::GetTimeMs(), fec_head)) {
+        return SendUDPBuf(conn, CONTROL_RELIABLE_MSG, data, len);
+    }
+    memcpy(pkg_buf + sizeof(FecHead), data, len);
+    SendUDPBuf(conn, CONTROL_FEC_MSG, pkg_buf, (int)sizeof(FecHead) + len);
+    if (conn->fec_encoder.Full()) SendFecParity(conn);
+    return 0;
+}
+
+void EchoPeer::SendFecParity(PeerConn* conn)
+{
+    char pkg_buf[max_udp_pkg_len];
+    for (int j = 0; j < conn->fec_encoder.ParityShards(); ++j) {
+        const int len =
+            conn->fec_encoder.Parity(j, pkg_buf, max_udp_pkg_len - cs_udp_conn_head_size);
+        if (len > 0) SendUDPBuf(conn, CONTROL_FEC_MSG, pkg_buf, len);
+    }
+    conn->fec_encoder.NextGroup();
+}
+
+int EchoPeer::SendTCPBuf(PeerConn* conn, uint8_t cmd, const char* msg_buf, int msg_len)
+{
+    if (conn->fd == -1) return -1;
+    char compact_head[compact_head_max_bytes];
+    int head_len = cs_conn_head_size;
+    if (conn->compact) {
+        compact_head[0] = (char)CompactMagicCmd(conn->magic, cmd);
+        head_len = 1 + VarintPut(compact_head + 1, (uint32_t)msg_len);
+    }
+    const int total_len = head_len + msg_len;
+    if (conn->write_stream.EnsureWritable(total_len) != 0) {
+        CloseConn(conn);
+        return -1;
+    }
+    if (conn->compact) {
+        memcpy(conn->write_stream.End(), compact_head, head_len);
+    } else {
+        auto* head = (CsConnHead*)conn->write_stream.End();
+        head->sec_pkg_len = htonl(total_len);
+        head->flow = conn->flow;
+        head->magic = conn->magic;
+        head->cmd = cmd;
+    }
+    if (msg_buf != nullptr && msg_len > 0) {
+        memcpy(conn->write_stream.End() + head_len, msg_buf, msg_len);
+    }
+    conn->write_stream.AddSize(total_len);
+    OnTcpWrite(conn);
+    return 0;
+}
+
+int EchoPeer::SendUDPBuf(PeerConn* conn, uint8_t cmd, const char* msg_buf, int msg_len)
+{
+    if (msg_len < 0 || msg_len > max_udp_pkg_len - cs_udp_conn_head_size) return -1;
+    if (options_.loss > 0 && rand() % 100 < options_.loss) return 0;
+    if (UdpBlocked()) return 0;
+    char pkg_buf[max_udp_pkg_len + udp_crc_size];
+    int head_len = cs_udp_conn_head_size;
+    if (conn->compact) {
+        // 紧凑格式下行不带flow
+        pkg_buf[0] = (char)CompactMagicCmd(conn->magic, cmd);
+        head_len = 1;
+    } else {
+        auto* head = (CsUdpConnHead*)pkg_buf;
+        head->flow = conn->flow;
+        head->magic = options_.udp_magic ? conn->magic : 0;
+        head->cmd = cmd;
+    }
+    if (msg_buf != nullptr && msg_len > 0) {
+        memcpy(pkg_buf + head_len, msg_buf, msg_len);
+    }
+    int len = head_len + msg_len;
+    if (conn->crc) len = UdpCrcAppend(pkg_buf, len);
+    if (options_.corrupt > 0 && rand() % 100 < options_.corrupt) {
+        pkg_buf[rand() % len] ^= (char)(1 << (rand() % 8));
+    }
+    // 回显端不因UDP发送失败断开, 由KCP重传兜底
+    SocketAPI::sendto_ex(udp_sock_, pkg_buf, len, 0,
+                         (struct sockaddr*)&conn->udp_addr, sizeof(conn->udp_addr));
+    return 0;
+}
+
+void EchoPeer::OnTcpWrite(PeerConn* conn)
+{
+    if (conn->fd == -1) return;
+    const int need_send_len = conn->write_stream.Len();
+    if (need_send_len <= 0) {
+        conn->tcp_writable = false;
+        return;
+    }
+    const int nwritten = SocketAPI::send_ex(conn->fd, conn->write_stream.Buf(), need_send_len, 0);
+    if (nwritten > 0) {
+        conn->write_stream.Skip(nwritten);
+    } else if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+        CloseConn(conn);
+        return;
+    }
+    conn->tcp_writable = nwritten < need_send_len;
+}
+
+bool EchoPeer::UdpBlocked() const
+{
+    if (options_.udp_block_end <= 0) return false;
+    const int64_t elapsed = TimeAPI::GetTimeMs() - start_ms_;
+    return elapsed >= options_.udp_block_start * 1000LL && elapsed < options_.udp_block_end * 1000LL;
+}
+
+bool EchoPeer::OverPathMtu(int pkg_len) const
+{
+    if (options_.path_mtu <= 0 || pkg_len <= options_.path_mtu) return false;
+    return TimeAPI::GetTimeMs() - start_ms_ >= options_.path_mtu_start * 1000LL;
+}
+
+void EchoPeer::CountDupSend(const PeerConn* conn)
+{
+    const ikcpcb* kcp = conn->kcps[0];
+    if (kcp == nullptr || kcp->dupsend_dynamic != IKCP_DUPSEND_ADAPTIVE) return;
+    dup_kcps_++;
+    dup_level_sum_ += kcp->dupsend_eff;
+    dup_loss_sum_ += kcp->dup_loss;
+}
+
+void EchoPeer::ReleaseConn(PeerConn* conn)
+{
+    CountDupSend(conn);
+    for (ikcpcb* kcp : conn->kcps) {
+        if (kcp != nullptr) pvp_ikcp_release(kcp);
+    }
+    delete conn;
+}
+
+// 只断开TCP, KCP和flow留着, 断开期间不收发
+void EchoPeer::DetachConn(PeerConn* conn)
+{
+    CloseConn(conn);
+    conn->detached = true;
+    conn->relinked = true;
+}
+
+// 有等待重连的连接时把新的TCP接上去, 只下发CONTROL_SYNC_LABEL. 客户端保留了KCP,
+// 两边都回到原格式, 不再重新协商
+bool EchoPeer::RelinkConn(int fd)
+{
+    PeerConn* conn = nullptr;
+    for (auto& it : conns_) {
+        if (it.second->detached && (conn == nullptr || it.second->flow < conn->flow)) {
+            conn = it.second;
+        }
+    }
+    if (conn == nullptr) return false;
+    conn->fd = fd;
+    conn->detached = false;
+    conn->tcp_writable = false;
+    conn->udp_addr_valid = false;
+    conn->kcp_over_tcp = false;
+    conn->read_stream.Reset();
+    conn->write_stream.Reset();
+    conn->compact = false;
+    conn->crc = false;
+    for (ikcpcb* kcp : conn->kcps) {
+        if (kcp != nullptr) pvp_ikcp_setcompact(kcp, 0, 0);
+    }
+    relinks_++;
+    SendTCPBuf(conn, CONTROL_SYNC_LABEL, nullptr, 0);
+    return true;
+}
+
+void EchoPeer::CloseConn(PeerConn* conn)
+{
+    if (conn->fd == -1) return;
+    // kcp可能正处于output回调中, 释放延后到Run的清理阶段
+    SocketAPI::closesocket_ex(conn->fd);
+    conn->fd = -1;
+}
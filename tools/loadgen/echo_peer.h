@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "conn_protocol.h"
+#include "ikcp.h"
+#include "kcp_fec.h"
+#include "socket_api.h"
+#include "stream.h"
+
+// 本地回显服务端, 只实现ConnClient用到的那部分ConnSvr协议:
+// TCP握手下发CONTROL_KCP_INFO/CONTROL_SYNC_LABEL, 回应TCP/UDP ping,
+// 收到的可靠消息加上控制byte原样回传, 供压测和回环验证使用.
+// 同时实现KCP扩展协商(CONTROL_KCP_FEATURE), 退出时打印UDP上行统计.
+// 多通道时消息从哪个通道来就从哪个通道回, 不可靠消息按不可靠消息回
+struct EchoPeerOptions {
+    std::string ip = "0.0.0.0";
+    uint16_t port = 10101;
+    bool enable_udp = true;
+    uint32_t mtu = 500;
+    uint32_t snd_wnd = 256;
+    uint32_t rcv_wnd = 256;
+    int interval = 10;
+    // 随KCP_INFO下发的扩展能力
+    uint32_t kcp_features = KCP_FEATURE_SACK | KCP_FEATURE_CHANNELS | KCP_FEATURE_UNRELIABLE_SEQ |
+                            KCP_FEATURE_FEC | KCP_FEATURE_PATH_SWITCH | KCP_FEATURE_MTU_PROBE |
+                            KCP_FEATURE_BATCH | KCP_FEATURE_COMPACT | KCP_FEATURE_CRC32C;
+    int loss = 0;                              // KCP数据走UDP下行时的随机丢包率(%)
+    int up_loss = 0;                           // 收到的UDP(flow 0的ping除外)随机丢包率(%)
+    int ack_delay = 0;                         // 见pvp_ikcp_setackdelay
+    int ack_every = 0;
+    int compress = 0;  // 不小于该长度的下行消息LZ4压缩, 同时下发KCP_FEATURE_COMPRESS, 0为关闭
+    int fec_data = 0;  // 协商了KCP_FEATURE_FEC时下行UDP的FEC分组, 0为不编码
+    int fec_parity = 0;
+    int dup_adaptive = 0;  // 下行KCP自适应冗余发送的最大次数, 见pvp_ikcp_setdupadaptive, 0为关闭
+    int nc = 1;  // 两端KCP的拥塞控制, 同pvp_ikcp_nodelay的nc, 也下发给客户端
+    int udp_block_start = 0;  // 启动后[start, end)秒内UDP收发全部丢弃, 模拟UDP被封, end为0不启用
+    int udp_block_end = 0;
+    // 启动path_mtu_start秒后丢弃长度超过path_mtu的上行UDP datagram, 模拟路径MTU黑洞, 0不启用
+    int path_mtu = 0;
+    int path_mtu_start = 0;
+    int corrupt = 0;  // 下行UDP(ping除外)随机翻转1个bit的比例(%), 模拟链路上出错的datagram
+    bool echo_batch = false;  // 上行批量消息整条按批量消息回传(各条填上peer_us), 否则拆开逐条回传
+    // 协商完KCP扩展relink_ms毫秒后断开一次TCP, 保留KCP等客户端重连, 新连接接到最早断开的连接上,
+    // 双方回到原格式. 0不启用
+    int relink_ms = 0;
+    bool udp_magic = true;  // 原格式的UDP下行包头带magic, 否则填0(老服务器只保证flow)
+};
+
+class EchoPeer
+{
+public:
+    EchoPeer() = default;
+    ~EchoPeer();
+
+public:
+    int Start(const EchoPeerOptions& options);
+    void Run(volatile bool* running);
+    void Stop();
+
+private:
+    struct PeerConn {
+        EchoPeer* peer = {nullptr};
+        int fd = {-1};
+        int flow = {0};
+        uint8_t magic = {0};
+        bool tcp_writable = {false};
+        bool udp_addr_valid = {false};
+        struct sockaddr_in udp_addr;
+        Stream read_stream;
+        Stream write_stream;
+        ikcpcb* kcps[kcp_max_channels] = {};  // 下标为通道号, 非0通道收到数据时创建
+        uint32_t next_update_ms = {0};
+        bool feature_known = {false};  // 已收到CONTROL_KCP_FEATURE
+        bool compress = {false};       // 已协商KCP_FEATURE_COMPRESS, 上行消息带控制byte
+        bool batch = {false};          // 已协商KCP_FEATURE_BATCH, 上行消息带控制byte
+        bool compact = {false};        // 已协商KCP_FEATURE_COMPACT, TCP收发和UDP下行用紧凑格式
+        bool crc = {false};            // 已协商KCP_FEATURE_CRC32C, UDP收发都带校验和
+        bool unreliable_seq = {false};  // 已协商KCP_FEATURE_UNRELIABLE_SEQ
+        bool kcp_over_tcp = {false};    // 客户端用CONTROL_KCP_PATH把KCP数据切到了TCP
+        bool detached = {false};        // 为模拟重连断开了TCP, 等客户端重连
+        bool relinked = {false};
+        uint32_t feature_ms = {0};      // 收到CONTROL_KCP_FEATURE的时间
+        uint16_t unreliable_send_seq[unreliable_max_streams] = {};
+        uint16_t unreliable_recv_seq[unreliable_max_streams] = {};
+        uint32_t unreliable_recv_valid = {0};
+        FecEncoder fec_encoder;
+        FecDecoder fec_decoder;
+        // 协商完成前到达的上行KCP数据, second为是否紧凑格式
+        std::vector<std::pair<std::string, bool>> pending_udp;
+    };
+
+    void OnAccept(uint32_t now_ms);
+    void OnTcpRead(PeerConn* conn, uint32_t now_ms);
+    void OnTcpWrite(PeerConn* conn);
+    void OnUdpRead(uint32_t now_ms);
+    void ReadStream(PeerConn* conn, uint32_t now_ms);
+    ikcpcb* CreateKcp(PeerConn* conn, int channel, uint32_t now_ms);
+    void InputToKcp(PeerConn* conn, const char* data, int len, uint32_t now_ms, bool compact);
+    void RecvKcpMsgs(PeerConn* conn, ikcpcb* kcp, uint32_t now_ms);
+    void EchoMsg(PeerConn* conn, ikcpcb* kcp, char* msg, int len, uint32_t now_ms);
+    void EchoBatch(PeerConn* conn, ikcpcb* kcp, char* msg, int len, uint32_t now_ms);
+    void OnUdpKcpData(PeerConn* conn, const char* data, int len, uint32_t now_ms, bool compact);
+    void OnFecMsg(PeerConn* conn, const char* data, int len, uint32_t now_ms, bool compact);
+    PeerConn* ParseUdpHead(const char* pkg_buf, int pkg_len, int* head_len, uint8_t* cmd,
+                           bool* compact);
+    int SendFecData(PeerConn* conn, const char* data, int len);
+    void SendFecParity(PeerConn* conn);
+    void OnUnreliableMsg(PeerConn* conn, uint8_t cmd, const char* data, int len);
+    void OnKcpFeature(PeerConn* conn, uint32_t features, uint32_t now_ms);
+    int SendTCPBuf(PeerConn* conn, uint8_t cmd, const char* msg_buf, int msg_len);
+    int SendUDPBuf(PeerConn* conn, uint8_t cmd, const char* msg_buf, int msg_len);
+    static int KCPOutput(const char* data, int len, ikcpcb* kcp, void* user);
+    void CloseConn(PeerConn* conn);
+    void DetachConn(PeerConn* conn);
+    bool RelinkConn(int fd);
+    void ReleaseConn(PeerConn* conn);
+    void CountDupSend(const PeerConn* conn);
+    void TickKcp(uint32_t now_ms);
+    bool UdpBlocked() const;
+    bool OverPathMtu(int pkg_len) const;
+
+private:
+    EchoPeerOptions options_;
+    int listen_sock_ = {-1};
+    int udp_sock_ = {-1};
+    int next_flow_ = {1};
+    int64_t start_ms_ = {0};
+    std::unordered_map<int, PeerConn*> conns_;
+    std::vector<char> recv_buf_;
+    std::string send_buf_;
+    std::vector<char> unzip_buf_;
+    uint64_t udp_in_pkts_ = {0};
+    uint64_t udp_in_bytes_ = {0};
+    uint64_t zip_in_bytes_ = {0};   // 上行压缩消息解压前/后字节数
+    uint64_t unzip_in_bytes_ = {0};
+    uint64_t zip_out_bytes_ = {0};  // 下行压缩消息压缩前/后字节数
+    uint64_t unzip_out_bytes_ = {0};
+    uint64_t batch_in_batches_ = {0};  // 上行批量消息数和其中的消息条数
+    uint64_t batch_in_msgs_ = {0};
+    uint64_t unreliable_in_msgs_ = {0};
+    uint64_t unreliable_stale_drops_ = {0};
+    uint64_t fec_recovered_ = {0};
+    uint64_t crc_drops_ = {0};  // 上行校验不过丢弃的datagram数
+    uint64_t path_to_tcp_ = {0};  // 客户端切换KCP路径的次数
+    uint64_t path_to_udp_ = {0};
+    uint64_t relinks_ = {0};  // 模拟断线后重连上的次数
+    uint64_t dup_kcps_ = {0};       // 已释放连接默认通道的自适应冗余结果, 退出时汇总
+    uint64_t dup_level_sum_ = {0};
+    uint64_t dup_loss_sum_ = {0};
+};
@@ -0,0 +1,55 @@
+// conn_echo_peer: 独立运行的回显服务端, 供远端压测或手工验证
+//
+// 用法: conn_echo_peer [--ip=IP] [--port=PORT] [--mode=udp|tcp] [--sack=0|1] [--loss=PERCENT]
+//                      [--compact=0|1]
+#include <signal.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "echo_peer.h"
+
+static volatile bool g_running = true;
+
+static void OnSignal(int)
+{
+    g_running = false;
+}
+
+int main(int argc, char** argv)
+{
+    EchoPeerOptions options;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--ip=", 5) == 0) {
+            options.ip = argv[i] + 5;
+        } else if (strncmp(argv[i], "--port=", 7) == 0) {
+            options.port = (uint16_t)atoi(argv[i] + 7);
+        } else if (strcmp(argv[i], "--mode=udp") == 0 || strcmp(argv[i], "--mode=tcp") == 0) {
+            options.enable_udp = strcmp(argv[i], "--mode=udp") == 0;
+        } else if (strncmp(argv[i], "--sack=", 7) == 0) {
+            if (atoi(argv[i] + 7) == 0) options.kcp_features &= ~KCP_FEATURE_SACK;
+        } else if (strncmp(argv[i], "--compact=", 10) == 0) {
+            if (atoi(argv[i] + 10) == 0) options.kcp_features &= ~KCP_FEATURE_COMPACT;
+        } else if (strncmp(argv[i], "--loss=", 7) == 0) {
+            options.loss = atoi(argv[i] + 7);
+        } else {
+            fprintf(stderr,
+                    "usage: %s [--ip=IP] [--port=PORT] [--mode=udp|tcp] [--sack=0|1] "
+                    "[--loss=PERCENT] [--compact=0|1]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+
+    EchoPeer peer;
+    if (peer.Start(options) != 0) return 1;
+    printf("echo peer listening on %s:%d (%s)\n", options.ip.c_str(), options.port,
+           options.enable_udp ? "udp" : "tcp");
+    peer.Run(&g_running);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// 压测消息头, 位于每条应用消息的最前面, 其后为填充数据
+// | conn_id | seq     | send_us | peer_us |
+// |---------|---------|---------|---------|
+// | 4 Bytes | 4 Bytes | 8 Bytes | 8 Bytes |
+// send_us由压测端发送时填写, peer_us由回显端收到时填写,
+// 两者都取自steady_clock, 同机运行时可计算单向时延
+struct LoadMsgHead {
+    uint32_t conn_id;
+    uint32_t seq;
+    int64_t send_us;
+    int64_t peer_us;
+} __attribute__((__packed__));
+static_assert(sizeof(LoadMsgHead) == 24, "unexpected layout");
+
+inline int64_t LoadNowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
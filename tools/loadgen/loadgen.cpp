@@ -0,0 +1,713 @@
+// conn_loadgen: 无Defold环境下用ConnClient建立大量连接做压测
+//
+// 默认fork一个本地回显端(EchoPeer), 也可以用--host指定外部服务器.
+// 每条消息带LoadMsgHead, 回显端填写收到时间, 统计往返/单向时延分位数,
+// 总吞吐, 每连接CPU和内存占用.
+//
+// 用法: conn_loadgen [--conns=N] [--size=BYTES] [--rate=MSG_PER_SEC] [--duration=SEC]
+//                    [--warmup=SEC] [--mode=udp|tcp] [--host=IP] [--port=PORT] [--ramp=N]
+//                    [--sack=0|1] [--loss=PERCENT] [--ack-delay=MS] [--ack-every=N]
+//                    [--compress=BYTES] [--bulk=BYTES] [--bulk-rate=MSG_PER_SEC]
+//                    [--bulk-channel=N] [--unreliable=0|1] [--fec=DATA,PARITY]
+//                    [--dup-adaptive=MAX] [--cc=loss|none|bbr] [--path-probe=MS]
+//                    [--udp-block=START,END] [--up-loss=PERCENT] [--critical=0|1]
+//                    [--multipath-budget=BYTES_PER_SEC] [--mtu-probe=MAX]
+//                    [--path-mtu=BYTES[,FROM_SEC]] [--coalesce=DELAY_MS[,MAXLEN]]
+//                    [--compact=0|1] [--checksum=0|1] [--corrupt=PERCENT]
+//                    [--update-budget=US[,MAX_EVENTS]] [--inline=0|1] [--echo-batch=0|1]
+// --sack/--loss只作用于本地回显端: 是否协商SACK, KCP下行UDP丢包率.
+// --ack-delay/--ack-every同时设置两端的KCP ack延迟策略, --compress同时设置两端的压缩阈值.
+// --bulk在--bulk-channel通道上额外发大消息, 只计吞吐不计时延, 用来观察大消息对
+// 默认通道上小消息时延的影响(--bulk-channel=0即与小消息共用一个KCP).
+// --unreliable=1时小消息用SendUnreliable发送, 回显端按不可靠消息回传.
+// --fec两端都对UDP上的KCP数据做FEC, 配合--loss看下行丢包时省掉的重传等待
+// --dup-adaptive两端都按丢包率自适应冗余发送, 最多MAX份副本
+// --cc两端KCP的拥塞控制算法, 默认none(nc=1)
+// --path-probe按路径评估在UDP/TCP间切换KCP数据, --udp-block让本地回显端在这段时间(秒)内丢弃全部UDP
+// --up-loss让本地回显端随机丢弃收到的UDP, 模拟上行丢包.
+// --critical=1时小消息按关键消息发送, --multipath-budget启用关键消息的UDP/TCP双路径冗余
+// --mtu-probe让客户端探测上行路径MTU, 最大到MAX(回显端同时下发这个mtu);
+// --path-mtu让本地回显端从FROM_SEC秒起丢弃超过BYTES的上行UDP datagram, 模拟路径MTU黑洞
+// --coalesce让客户端把不超过MAXLEN的小消息最多攒DELAY_MS合成一条KCP消息发送
+// --compact=0让本地回显端不提供紧凑包头格式, 与默认对比回显端统计的udp in字节数
+// --checksum=1让客户端协商UDP datagram的CRC32C校验和, --corrupt让本地回显端随机翻转下行UDP的
+// 一个bit, 不开校验和时出错的KCP包头可能让连接断开
+// --update-budget每帧所有连接的Update最多用US微秒, 处理MAX_EVENTS个消息, 按扩展里的方式平分给各连接;
+// 结果里的update行为每帧所有连接Update的总用时
+// --inline=1时客户端用单线程内联模式, 不起网络线程, 收发都在主循环的Update/Send里完成
+// --echo-batch=1让本地回显端把--coalesce攒成的批量消息整条回传, 客户端拆开交付
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "conn_client.h"
+#include "crc32c.h"
+#include "echo_peer.h"
+#include "load_msg.h"
+#include "time_api.h"
+
+struct LoadOptions {
+    int conns = 100;
+    int msg_size = 64;
+    double rate = 10;
+    int duration_s = 10;
+    int warmup_s = 2;
+    bool enable_udp = true;
+    std::string host;
+    uint16_t port = 10101;
+    int ramp_per_sec = 500;
+    bool sack = true;
+    int loss = 0;
+    int ack_delay = 0;
+    int ack_every = 0;
+    int compress = 0;
+    int bulk_size = 0;
+    double bulk_rate = 2;
+    int bulk_channel = 1;
+    bool unreliable = false;
+    int fec_data = 0;
+    int fec_parity = 0;
+    int dup_adaptive = 0;
+    int cc = CONN_CC_NONE;
+    int path_probe = 0;
+    int udp_block_start = 0;
+    int udp_block_end = 0;
+    int up_loss = 0;
+    bool critical = false;
+    int multipath_budget = 0;
+    int mtu_probe = 0;
+    int path_mtu = 0;
+    int path_mtu_start = 0;
+    int coalesce_delay = 0;
+    int coalesce_max_len = 0;
+    bool echo_batch = false;
+    bool compact = true;
+    bool checksum = false;
+    int corrupt = 0;
+    int update_budget_us = 0;
+    int update_max_events = 0;
+    bool inline_mode = false;
+};
+
+struct LoadStats {
+    uint64_t connected = {0};
+    uint64_t disconnected = {0};
+    uint64_t sent_msgs = {0};
+    uint64_t recv_msgs = {0};
+    uint64_t sent_bytes = {0};
+    uint64_t recv_bytes = {0};
+    uint64_t bulk_recv_msgs = {0};
+    std::vector<int64_t> rtt_us;
+    std::vector<int64_t> up_us;
+    std::vector<int64_t> down_us;
+    std::vector<int64_t> update_us;  // 每帧所有连接Update的总用时
+};
+
+struct LoadConn {
+    ConnClient client;
+    uint32_t id = {0};
+    bool connected = {false};
+    uint32_t seq = {0};
+    double send_credit = {0};
+    double bulk_credit = {0};
+    HeadlessCallback output_cb;
+    HeadlessCallback connect_cb;
+    HeadlessCallback disconnect_cb;
+};
+
+static volatile bool g_running = true;
+const uint32_t bulk_msg_flag = 0x80000000u;  // conn_id最高位标记大消息
+
+static void OnSignal(int)
+{
+    g_running = false;
+}
+
+static bool ParseArg(const char* arg, const char* name, std::string* value)
+{
+    const size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=') return false;
+    *value = arg + len + 1;
+    return true;
+}
+
+static int ParseOptions(int argc, char** argv, LoadOptions* options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string value;
+        if (ParseArg(argv[i], "--conns", &value)) {
+            options->conns = std::max(1, atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--size", &value)) {
+            options->msg_size = std::max((int)sizeof(LoadMsgHead), atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--rate", &value)) {
+            options->rate = std::max(0.0, atof(value.c_str()));
+        } else if (ParseArg(argv[i], "--duration", &value)) {
+            options->duration_s = std::max(1, atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--warmup", &value)) {
+            options->warmup_s = std::max(0, atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--mode", &value)) {
+            if (value != "udp" && value != "tcp") return -1;
+            options->enable_udp = value == "udp";
+        } else if (ParseArg(argv[i], "--host", &value)) {
+            options->host = value;
+        } else if (ParseArg(argv[i], "--port", &value)) {
+            options->port = (uint16_t)atoi(value.c_str());
+        } else if (ParseArg(argv[i], "--ramp", &value)) {
+            options->ramp_per_sec = std::max(1, atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--sack", &value)) {
+            options->sack = atoi(value.c_str()) != 0;
+        } else if (ParseArg(argv[i], "--loss", &value)) {
+            options->loss = std::max(0, atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--ack-delay", &value)) {
+            options->ack_delay = std::max(0, atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--ack-every", &value)) {
+            options->ack_every = std::max(0, atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--compress", &value)) {
+            options->compress = std::max(0, atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--bulk", &value)) {
+            options->bulk_size = std::max(0, atoi(value.c_str()));
+            if (options->bulk_size > 0) {
+                options->bulk_size = std::max((int)sizeof(LoadMsgHead), options->bulk_size);
+            }
+        } else if (ParseArg(argv[i], "--bulk-rate", &value)) {
+            options->bulk_rate = std::max(0.0, atof(value.c_str()));
+        } else if (ParseArg(argv[i], "--bulk-channel", &value)) {
+            options->bulk_channel = atoi(value.c_str());
+            if (options->bulk_channel < 0 || options->bulk_channel >= kcp_max_channels) return -1;
+        } else if (ParseArg(argv[i], "--unreliable", &value)) {
+            options->unreliable = atoi(value.c_str()) != 0;
+        } else if (ParseArg(argv[i], "--fec", &value)) {
+            if (sscanf(value.c_str(), "%d,%d", &options->fec_data, &options->fec_parity) != 2) {
+                return -1;
+            }
+        } else if (ParseArg(argv[i], "--dup-adaptive", &value)) {
+            options->dup_adaptive = atoi(value.c_str());
+        } else if (ParseArg(argv[i], "--path-probe", &value)) {
+            options->path_probe = atoi(value.c_str());
+        } else if (ParseArg(argv[i], "--up-loss", &value)) {
+            options->up_loss = std::max(0, atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--critical", &value)) {
+            options->critical = atoi(value.c_str()) != 0;
+        } else if (ParseArg(argv[i], "--multipath-budget", &value)) {
+            options->multipath_budget = std::max(0, atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--mtu-probe", &value)) {
+            options->mtu_probe = std::max(0, atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--path-mtu", &value)) {
+            if (sscanf(value.c_str(), "%d,%d", &options->path_mtu, &options->path_mtu_start) < 1) {
+                return -1;
+            }
+        } else if (ParseArg(argv[i], "--coalesce", &value)) {
+            if (sscanf(value.c_str(), "%d,%d", &options->coalesce_delay,
+                       &options->coalesce_max_len) < 1) {
+                return -1;
+            }
+        } else if (ParseArg(argv[i], "--echo-batch", &value)) {
+            options->echo_batch = atoi(value.c_str()) != 0;
+        } else if (ParseArg(argv[i], "--compact", &value)) {
+            options->compact = atoi(value.c_str()) != 0;
+        } else if (ParseArg(argv[i], "--checksum", &value)) {
+            options->checksum = atoi(value.c_str()) != 0;
+        } else if (ParseArg(argv[i], "--corrupt", &value)) {
+            options->corrupt = std::max(0, atoi(value.c_str()));
+        } else if (ParseArg(argv[i], "--update-budget", &value)) {
+            if (sscanf(value.c_str(), "%d,%d", &options->update_budget_us,
+                       &options->update_max_events) < 1) {
+                return -1;
+            }
+        } else if (ParseArg(argv[i], "--inline", &value)) {
+            options->inline_mode = atoi(value.c_str()) != 0;
+        } else if (ParseArg(argv[i], "--udp-block", &value)) {
+            if (sscanf(value.c_str(), "%d,%d", &options->udp_block_start,
+                       &options->udp_block_end) != 2) {
+                return -1;
+            }
+        } else if (ParseArg(argv[i], "--cc", &value)) {
+            if (value == "loss") {
+                options->cc = CONN_CC_LOSS;
+            } else if (value == "none") {
+                options->cc = CONN_CC_NONE;
+            } else if (value == "bbr") {
+                options->cc = CONN_CC_BBR;
+            } else {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int64_t GetRssKB()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) return atoll(line.c_str() + 6);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static int64_t GetCpuUs()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void RaiseFdLimit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// 本地回显端跑在子进程中, CPU和内存不计入压测端
+static pid_t ForkEchoPeer(const LoadOptions& options)
+{
+    int ready_pipe[2];
+    if (pipe(ready_pipe) != 0) return -1;
+    const pid_t pid = fork();
+    if (pid == 0) {
+        close(ready_pipe[0]);
+        signal(SIGTERM, OnSignal);
+        EchoPeerOptions peer_options;
+        peer_options.ip = "127.0.0.1";
+        peer_options.port = options.port;
+        peer_options.enable_udp = options.enable_udp;
+        if (!options.sack) peer_options.kcp_features &= ~KCP_FEATURE_SACK;
+        if (!options.compact) peer_options.kcp_features &= ~KCP_FEATURE_COMPACT;
+        peer_options.loss = options.loss;
+        peer_options.up_loss = options.up_loss;
+        peer_options.corrupt = options.corrupt;
+        peer_options.echo_batch = options.echo_batch;
+        if (options.mtu_probe > 0) peer_options.mtu = (uint32_t)options.mtu_probe;
+        peer_options.path_mtu = options.path_mtu;
+        peer_options.path_mtu_start = options.path_mtu_start;
+        peer_options.ack_delay = options.ack_delay;
+        peer_options.ack_every = options.ack_every;
+        peer_options.compress = options.compress;
+        peer_options.fec_data = options.fec_data;
+        peer_options.fec_parity = options.fec_parity;
+        peer_options.dup_adaptive = options.dup_adaptive;
+        peer_options.udp_block_start = options.udp_block_start;
+        peer_options.udp_block_end = options.udp_block_end;
+        peer_options.nc = options.cc == CONN_CC_LOSS ? 0 : (options.cc == CONN_CC_BBR ? 2 : 1);
+        EchoPeer peer;
+        const char ok = peer.Start(peer_options) == 0 ? 1 : 0;
+        write(ready_pipe[1], &ok, 1);
+        close(ready_pipe[1]);
+        if (ok) peer.Run(&g_running);
+        _exit(ok ? 0 : 1);
+    }
+    close(ready_pipe[1]);
+    char ok = 0;
+    read(ready_pipe[0], &ok, 1);
+    close(ready_pipe[0]);
+    if (pid > 0 && !ok) {
+        waitpid(pid, nullptr, 0);
+        return -1;
+    }
+    return pid;
+}
+
+static void PrintLatency(const char* name, std::vector<int64_t>* samples)
+{
+    if (samples->empty()) {
+        printf("  %-10s no samples\n", name);
+        return;
+    }
+    std::sort(samples->begin(), samples->end());
+    auto at = [samples](double q) {
+        size_t idx = (size_t)(q * (samples->size() - 1));
+        return (*samples)[idx] / 1000.0;
+    };
+    printf("  %-10s p50 %8.3f  p90 %8.3f  p99 %8.3f  p99.9 %8.3f  max %8.3f ms\n", name, at(0.5),
+           at(0.9), at(0.99), at(0.999), samples->back() / 1000.0);
+}
+
+static void SetupConn(LoadConn* conn, const LoadOptions& options, LoadStats* stats,
+                      const bool* measuring)
+{
+    conn->client.SetErrorLogMode();
+    conn->client.SetInlineMode(options.inline_mode);
+    conn->client.SetKcpAckDelay(options.ack_delay, options.ack_every);
+    conn->client.SetCompressThreshold(options.compress);
+    conn->client.SetFec(options.fec_data, options.fec_parity);
+    conn->client.SetDupSendAdaptive(options.dup_adaptive, 0);
+    conn->client.SetCongestionControl(options.cc);
+    conn->client.SetTransportAdaptive(options.path_probe);
+    conn->client.SetMultipathBudget(options.multipath_budget);
+    conn->client.SetMtuProbe(options.mtu_probe);
+    conn->client.SetCoalesce(options.coalesce_delay, options.coalesce_max_len);
+    conn->client.SetUdpChecksum(options.checksum);
+    conn->connect_cb.fun = [conn, stats](void*, const char*, int, int, int) {
+        conn->connected = true;
+        stats->connected++;
+    };
+    conn->disconnect_cb.fun = [conn, stats](void*, const char*, int, int, int) {
+        if (conn->connected) stats->disconnected++;
+        conn->connected = false;
+    };
+    conn->output_cb.fun = [stats, measuring](void*, const char* data, int data_len, int, int) {
+        if (data_len < (int)sizeof(LoadMsgHead)) return;
+        const int64_t now_us = LoadNowUs();
+        LoadMsgHead head;
+        memcpy(&head, data, sizeof(head));
+        stats->recv_bytes += data_len;
+        if ((head.conn_id & bulk_msg_flag) != 0) {
+            stats->bulk_recv_msgs++;
+            return;
+        }
+        stats->recv_msgs++;
+        if (!*measuring) return;
+        stats->rtt_us.push_back(now_us - head.send_us);
+        if (head.peer_us > 0) {
+            stats->up_us.push_back(head.peer_us - head.send_us);
+            stats->down_us.push_back(now_us - head.peer_us);
+        }
+    };
+    conn->client.SetConnectSuccessCB(&conn->connect_cb);
+    conn->client.SetDisconnectCB(&conn->disconnect_cb);
+    conn->client.SetOutputCB(&conn->output_cb);
+}
+
+int main(int argc, char** argv)
+{
+    LoadOptions options;
+    if (ParseOptions(argc, argv, &options) != 0) {
+        fprintf(stderr,
+                "usage: %s [--conns=N] [--size=BYTES] [--rate=MSG_PER_SEC] [--duration=SEC]\n"
+                "          [--warmup=SEC] [--mode=udp|tcp] [--host=IP] [--port=PORT] [--ramp=N]\n"
+                "          [--sack=0|1] [--loss=PERCENT] [--ack-delay=MS] [--ack-every=N]\n"
+                "          [--compress=BYTES] [--bulk=BYTES] [--bulk-rate=MSG_PER_SEC]\n"
+                "          [--bulk-channel=N] [--unreliable=0|1] [--fec=DATA,PARITY]\n"
+                "          [--dup-adaptive=MAX] [--cc=loss|none|bbr] [--path-probe=MS]\n"
+                "          [--udp-block=START,END] [--up-loss=PERCENT] [--critical=0|1]\n"
+                "          [--multipath-budget=BYTES_PER_SEC] [--mtu-probe=MAX]\n"
+                "          [--path-mtu=BYTES[,FROM_SEC]] [--coalesce=DELAY_MS[,MAXLEN]]\n"
+                "          [--compact=0|1] [--checksum=0|1] [--corrupt=PERCENT]\n"
+                "          [--update-budget=US[,MAX_EVENTS]] [--inline=0|1] [--echo-batch=0|1]\n",
+                argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    RaiseFdLimit();
+
+    pid_t peer_pid = 0;
+    std::string host = options.host;
+    if (host.empty()) {
+        peer_pid = ForkEchoPeer(options);
+        if (peer_pid < 0) {
+            fprintf(stderr, "start echo peer failed\n");
+            return 1;
+        }
+        host = "127.0.0.1";
+    }
+    signal(SIGINT, OnSignal);
+
+    const int64_t rss_base_kb = GetRssKB();
+    LoadStats stats;
+    bool measuring = false;
+    std::vector<LoadConn*> conns;
+    conns.reserve(options.conns);
+
+    std::vector<char> msg(options.msg_size, 'x');
+    std::vector<char> bulk_msg(options.bulk_size, 'b');
+    const int64_t start_ms = TimeAPI::GetTimeMs();
+    int64_t last_ms = start_ms;
+    int64_t warmup_end_ms = 0;
+    int64_t measure_start_ms = 0;
+    int64_t measure_end_ms = 0;
+    int64_t cpu_start_us = 0;
+    int64_t cpu_end_us = 0;
+    int64_t rss_connected_kb = 0;
+    uint64_t sent_start = 0;
+    uint64_t recv_start = 0;
+    uint64_t sent_bytes_start = 0;
+    uint64_t recv_bytes_start = 0;
+
+    while (g_running) {
+        const int64_t now_ms = TimeAPI::GetTimeMs();
+        const double dt = (now_ms - last_ms) / 1000.0;
+        last_ms = now_ms;
+
+        // 按ramp速率逐步建连, 避免瞬间把回显端的accept队列打满
+        const int64_t want = std::min<int64_t>(
+            options.conns, (now_ms - start_ms) * options.ramp_per_sec / 1000 + 1);
+        while ((int64_t)conns.size() < want) {
+            auto* conn = new LoadConn();
+            conn->id = (uint32_t)conns.size();
+            SetupConn(conn, options, &stats, &measuring);
+            conn->client.Connect(host.c_str(), options.port, 5000);
+            conns.push_back(conn);
+        }
+
+        const bool all_started = (int)conns.size() == options.conns;
+        if (all_started && measure_start_ms == 0 &&
+            (stats.connected >= (uint64_t)options.conns ||
+             now_ms - start_ms > options.conns * 1000LL / options.ramp_per_sec + 5000)) {
+            // 热身结束后开始统计
+            if (warmup_end_ms == 0) {
+                rss_connected_kb = GetRssKB();
+                warmup_end_ms = now_ms + options.warmup_s * 1000LL;
+            }
+            if (now_ms >= warmup_end_ms) {
+                measuring = true;
+                measure_start_ms = now_ms;
+                cpu_start_us = GetCpuUs();
+                sent_start = stats.sent_msgs;
+                recv_start = stats.recv_msgs;
+                sent_bytes_start = stats.sent_bytes;
+                recv_bytes_start = stats.recv_bytes;
+            }
+        }
+        if (measuring && now_ms - measure_start_ms >= options.duration_s * 1000LL) {
+            measure_end_ms = now_ms;
+            cpu_end_us = GetCpuUs();
+            break;
+        }
+
+        // 同myextension.cpp的OnUpdateMyExtension, 前面的连接没用完的预算留给后面的
+        int64_t update_used_us = 0;
+        int events_left = options.update_max_events;
+        for (size_t i = 0; i < conns.size(); ++i) {
+            auto* conn = conns[i];
+            const int conns_left = (int)(conns.size() - i);
+            int budget_us = 0;
+            if (options.update_budget_us > 0) {
+                budget_us =
+                    std::max((int)((options.update_budget_us - update_used_us) / conns_left), 1);
+            }
+            int max_events = 0;
+            if (options.update_max_events > 0) {
+                max_events = std::max(events_left / conns_left, 1);
+            }
+            const int64_t conn_start_us = LoadNowUs();
+            events_left -= conn->client.Update(budget_us, max_events);
+            update_used_us += LoadNowUs() - conn_start_us;
+            if (!conn->connected) continue;
+            conn->send_credit = std::min(conn->send_credit + options.rate * dt, 1000.0);
+            while (conn->send_credit >= 1) {
+                conn->send_credit -= 1;
+                LoadMsgHead head;
+                head.conn_id = conn->id;
+                head.seq = conn->seq++;
+                head.send_us = LoadNowUs();
+                head.peer_us = 0;
+                memcpy(msg.data(), &head, sizeof(head));
+                const int ret = options.unreliable
+                                    ? conn->client.SendUnreliable(msg.data(), (int)msg.size())
+                                    : conn->client.SendMsg(msg.data(), (int)msg.size(), 0,
+                                                           options.critical ? CONN_SEND_CRITICAL
+                                                                            : 0);
+                if (ret == 0) {
+                    stats.sent_msgs++;
+                    stats.sent_bytes += msg.size();
+                }
+            }
+            if (options.bulk_size <= 0) continue;
+            conn->bulk_credit = std::min(conn->bulk_credit + options.bulk_rate * dt, 100.0);
+            while (conn->bulk_credit >= 1) {
+                conn->bulk_credit -= 1;
+                LoadMsgHead head;
+                head.conn_id = conn->id | bulk_msg_flag;
+                head.seq = 0;
+                head.send_us = LoadNowUs();
+                head.peer_us = 0;
+                memcpy(bulk_msg.data(), &head, sizeof(head));
+                if (conn->client.SendMsg(bulk_msg.data(), (int)bulk_msg.size(),
+                                         options.bulk_channel) == 0) {
+                    stats.sent_bytes += bulk_msg.size();
+                }
+            }
+        }
+        if (measuring) stats.update_us.push_back(update_used_us);
+        TimeAPI::SleepMs(1);
+    }
+    if (measure_end_ms == 0) {
+        measure_end_ms = TimeAPI::GetTimeMs();
+        cpu_end_us = GetCpuUs();
+    }
+    if (measure_start_ms == 0) {
+        measure_start_ms = start_ms;
+        cpu_start_us = 0;
+    }
+    if (rss_connected_kb == 0) rss_connected_kb = GetRssKB();
+
+    const double secs = std::max(1, (int)(measure_end_ms - measure_start_ms)) / 1000.0;
+    const uint64_t sent = stats.sent_msgs - sent_start;
+    const uint64_t recv = stats.recv_msgs - recv_start;
+    const int n = std::max(1, (int)conns.size());
+    printf("conns %d connected %llu disconnected %llu mode %s size %d rate %.1f/s\n",
+           (int)conns.size(), (unsigned long long)stats.connected,
+           (unsigned long long)stats.disconnected, options.enable_udp ? "udp" : "tcp",
+           options.msg_size, options.rate);
+    printf("throughput (%.1fs): sent %.0f msg/s %.3f MB/s, recv %.0f msg/s %.3f MB/s\n", secs,
+           sent / secs, (stats.sent_bytes - sent_bytes_start) / secs / 1048576.0, recv / secs,
+           (stats.recv_bytes - recv_bytes_start) / secs / 1048576.0);
+    if (options.bulk_size > 0) {
+        printf("bulk: size %d rate %.1f/s channel %d, recv %llu msgs\n", options.bulk_size,
+               options.bulk_rate, options.bulk_channel, (unsigned long long)stats.bulk_recv_msgs);
+    }
+    printf("latency:\n");
+    PrintLatency("rtt", &stats.rtt_us);
+    if (peer_pid > 0) {
+        PrintLatency("up", &stats.up_us);
+        PrintLatency("down", &stats.down_us);
+    } else {
+        // 外部服务器与本机时钟不同源, 单向时延无意义
+        printf("  one-way latency only available with the local echo peer\n");
+    }
+    printf("main thread:\n");
+    PrintLatency("update", &stats.update_us);
+    const double cpu_pct = (cpu_end_us - cpu_start_us) / 10000.0 / secs;
+    printf("cpu: %.1f%% total, %.3f%% per conn\n", cpu_pct, cpu_pct / n);
+    printf("rss: %lld KB total, %.1f KB per conn\n", (long long)rss_connected_kb,
+           (rss_connected_kb - rss_base_kb) / (double)n);
+    if (options.compress > 0) {
+        ConnCompressStats total = {};
+        for (auto* conn : conns) {
+            ConnCompressStats one;
+            conn->client.GetCompressStats(&one);
+            total.send_msgs += one.send_msgs;
+            total.send_raw_bytes += one.send_raw_bytes;
+            total.send_zip_bytes += one.send_zip_bytes;
+            total.recv_msgs += one.recv_msgs;
+            total.recv_zip_bytes += one.recv_zip_bytes;
+            total.recv_raw_bytes += one.recv_raw_bytes;
+        }
+        printf("lz4: up %llu msgs %llu -> %llu bytes, down %llu msgs %llu -> %llu bytes\n",
+               (unsigned long long)total.send_msgs, (unsigned long long)total.send_raw_bytes,
+               (unsigned long long)total.send_zip_bytes, (unsigned long long)total.recv_msgs,
+               (unsigned long long)total.recv_zip_bytes, (unsigned long long)total.recv_raw_bytes);
+    }
+    if (options.fec_data > 0) {
+        ConnFecStats total = {};
+        for (auto* conn : conns) {
+            ConnFecStats one;
+            conn->client.GetFecStats(&one);
+            total.send_data_shards += one.send_data_shards;
+            total.send_parity_shards += one.send_parity_shards;
+            total.recv_recovered += one.recv_recovered;
+        }
+        printf("fec: up %llu data + %llu parity shards, down %llu datagrams recovered\n",
+               (unsigned long long)total.send_data_shards,
+               (unsigned long long)total.send_parity_shards,
+               (unsigned long long)total.recv_recovered);
+    }
+    if (options.dup_adaptive > 0) {
+        // 各连接最后一次采样的结果
+        uint64_t samples = 0, level_sum = 0, loss_sum = 0;
+        for (auto* conn : conns) {
+            ConnDupTrace trace;
+            if (conn->client.GetDupSendTrace(&trace, 1) != 1) continue;
+            samples++;
+            level_sum += trace.level;
+            loss_sum += trace.loss;
+        }
+        if (samples > 0) {
+            printf("dupsend: up avg level %.2f, avg loss %.1f permille (%llu conns sampled)\n",
+                   (double)level_sum / samples, (double)loss_sum / samples,
+                   (unsigned long long)samples);
+        }
+    }
+    if (options.path_probe > 0) {
+        uint64_t over_tcp = 0, switches = 0, udp_loss_sum = 0;
+        for (auto* conn : conns) {
+            ConnPathStats path;
+            conn->client.GetPathStats(&path);
+            if (path.transport == CONN_TRANSPORT_TCP) over_tcp++;
+            switches += path.switches;
+            udp_loss_sum += path.udp_loss;
+        }
+        printf("path: %llu/%zu conns on tcp, %llu switches, avg udp loss %.1f permille\n",
+               (unsigned long long)over_tcp, conns.size(), (unsigned long long)switches,
+               conns.empty() ? 0.0 : (double)udp_loss_sum / conns.size());
+    }
+    if (options.mtu_probe > 0) {
+        uint64_t mtu_sum = 0, probes = 0, black_holes = 0;
+        for (auto* conn : conns) {
+            ConnMtuStats mtu;
+            conn->client.GetMtuStats(&mtu);
+            mtu_sum += mtu.mtu;
+            probes += mtu.probes;
+            black_holes += mtu.black_holes;
+        }
+        printf("mtu: avg %.1f, %llu probes, %llu black holes\n",
+               conns.empty() ? 0.0 : (double)mtu_sum / conns.size(), (unsigned long long)probes,
+               (unsigned long long)black_holes);
+    }
+    if (options.coalesce_delay > 0) {
+        ConnCoalesceStats total = {};
+        for (auto* conn : conns) {
+            ConnCoalesceStats one;
+            conn->client.GetCoalesceStats(&one);
+            total.msgs += one.msgs;
+            total.batches += one.batches;
+        }
+        printf("coalesce: %llu msgs in %llu batches\n", (unsigned long long)total.msgs,
+               (unsigned long long)total.batches);
+    }
+    if (options.checksum) {
+        ConnChecksumStats total = {};
+        for (auto* conn : conns) {
+            ConnChecksumStats one;
+            conn->client.GetChecksumStats(&one);
+            total.verified += one.verified;
+            total.drops += one.drops;
+        }
+        printf("checksum (%s): %llu verified, %llu dropped\n", Crc32c::Impl(),
+               (unsigned long long)total.verified, (unsigned long long)total.drops);
+    }
+    if (options.multipath_budget > 0) {
+        ConnMultipathStats total = {};
+        for (auto* conn : conns) {
+            ConnMultipathStats one;
+            conn->client.GetMultipathStats(&one);
+            total.copy_pkgs += one.copy_pkgs;
+            total.copy_bytes += one.copy_bytes;
+            total.budget_drops += one.budget_drops;
+        }
+        printf("multipath: %llu copies, %llu bytes, %llu over budget\n",
+               (unsigned long long)total.copy_pkgs, (unsigned long long)total.copy_bytes,
+               (unsigned long long)total.budget_drops);
+    }
+    if (options.unreliable) {
+        ConnUnreliableStats total = {};
+        for (auto* conn : conns) {
+            ConnUnreliableStats one;
+            conn->client.GetUnreliableStats(&one);
+            total.send_msgs += one.send_msgs;
+            total.recv_msgs += one.recv_msgs;
+            total.stale_drops += one.stale_drops;
+        }
+        printf("unreliable: sent %llu msgs, recv %llu msgs, %llu stale dropped\n",
+               (unsigned long long)total.send_msgs, (unsigned long long)total.recv_msgs,
+               (unsigned long long)total.stale_drops);
+    }
+    fflush(stdout);
+
+    for (auto* conn : conns) {
+        delete conn;
+    }
+    if (peer_pid > 0) {
+        kill(peer_pid, SIGTERM);
+        waitpid(peer_pid, nullptr, 0);
+    }
+    return 0;
+}
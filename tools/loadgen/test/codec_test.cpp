@@ -0,0 +1,482 @@
+// conn_codec_test: 不经过网络, 直接验证connclient的几个编解码:
+// Lz4Block压缩往返和损坏输入; FEC每组丢1-4个分片时的恢复, 小分组逐个试遍所有可恢复的丢失组合;
+// 紧凑segment头在sn/ts回绕附近的收发(含SACK), 多通道拼成的datagram分段解码, 紧凑头长度;
+// CRC32C的标准测试值, 以及硬件实现与查表在各种长度和对齐下结果相同
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "crc32c.h"
+#include "ikcp.h"
+#include "kcp_fec.h"
+#include "lz4_block.h"
+#include "test_util.h"
+
+static std::mt19937 g_rand(20240613);
+
+static std::string RandomBytes(int len, int alphabet)
+{
+    std::string s(len, 0);
+    for (char& c : s) {
+        c = (char)(g_rand() % alphabet);
+    }
+    return s;
+}
+
+static void TestLz4RoundTrip()
+{
+    const int sizes[] = {1, 4, 12, 13, 64, 255, 256, 1000, 4096, 65535, 65536, 200000};
+    // alphabet越小越容易出现匹配, 256接近不可压缩
+    const int alphabets[] = {1, 4, 256};
+    for (int size : sizes) {
+        for (int alphabet : alphabets) {
+            const std::string src = RandomBytes(size, alphabet);
+            std::vector<char> zip(Lz4Block::Bound(size));
+            const int zip_len = Lz4Block::Compress(src.data(), size, zip.data(), (int)zip.size());
+            TEST_CHECK(zip_len > 0 && zip_len <= Lz4Block::Bound(size));
+            if (alphabet == 1 && size >= 256) TEST_CHECK(zip_len < size / 8);
+            std::string out(size, 0);
+            TEST_CHECK(Lz4Block::Decompress(zip.data(), zip_len, &out[0], size) == size);
+            TEST_CHECK(out == src);
+            // 声明的解压长度不符
+            std::vector<char> big(size + 1);
+            TEST_CHECK(Lz4Block::Decompress(zip.data(), zip_len, big.data(), size + 1) == -1);
+            TEST_CHECK(Lz4Block::Decompress(zip.data(), zip_len, big.data(), size - 1) == -1);
+            // 截断的输入
+            TEST_CHECK(Lz4Block::Decompress(zip.data(), zip_len - 1, big.data(), size) == -1);
+        }
+    }
+    // dst不够Bound时不压缩
+    const std::string src = RandomBytes(100, 256);
+    std::vector<char> zip(Lz4Block::Bound(100));
+    TEST_CHECK(Lz4Block::Compress(src.data(), 100, zip.data(), (int)zip.size() - 1) == 0);
+
+    // 手工构造的block: 1个字面量'a', offset 1匹配14字节, 最后5个字面量
+    const char block[] = {0x1A, 'a', 0x01, 0x00, 0x50, 'a', 'a', 'a', 'a', 'a'};
+    char out[20];
+    TEST_CHECK(Lz4Block::Decompress(block, sizeof(block), out, 20) == 20);
+    TEST_CHECK(std::string(out, 20) == std::string(20, 'a'));
+}
+
+static void TestLz4Malformed()
+{
+    char out[4096];
+    // offset为0, offset超出已输出的数据, 匹配超出dst
+    const char zero_offset[] = {0x1A, 'a', 0x00, 0x00, 0x50, 'a', 'a', 'a', 'a', 'a'};
+    TEST_CHECK(Lz4Block::Decompress(zero_offset, sizeof(zero_offset), out, 20) == -1);
+    const char far_offset[] = {0x1A, 'a', 0x02, 0x00, 0x50, 'a', 'a', 'a', 'a', 'a'};
+    TEST_CHECK(Lz4Block::Decompress(far_offset, sizeof(far_offset), out, 20) == -1);
+    TEST_CHECK(Lz4Block::Decompress(zero_offset, sizeof(zero_offset), out, 10) == -1);
+    // 长度扩展字节没有结束
+    const char open_len[] = {(char)0xF0, (char)0xFF, (char)0xFF};
+    TEST_CHECK(Lz4Block::Decompress(open_len, sizeof(open_len), out, sizeof(out)) == -1);
+    TEST_CHECK(Lz4Block::Decompress(nullptr, 0, out, 0) == -1);
+
+    // 随机翻转和随机数据: 要么报错要么正好解出dst_len字节, 越界由ASan构建发现
+    const std::string src = RandomBytes(3000, 8);
+    std::vector<char> zip(Lz4Block::Bound(3000));
+    const int zip_len = Lz4Block::Compress(src.data(), 3000, zip.data(), (int)zip.size());
+    TEST_CHECK(zip_len > 0);
+    for (int i = 0; i < 20000; ++i) {
+        std::vector<char> bad(zip.begin(), zip.begin() + zip_len);
+        const int flips = 1 + g_rand() % 4;
+        for (int f = 0; f < flips; ++f) {
+            bad[g_rand() % zip_len] ^= (char)(1 << (g_rand() % 8));
+        }
+        std::vector<char> dst(3000);
+        const int ret = Lz4Block::Decompress(bad.data(), zip_len, dst.data(), 3000);
+        TEST_CHECK(ret == -1 || ret == 3000);
+    }
+    for (int i = 0; i < 20000; ++i) {
+        const std::string junk = RandomBytes(1 + g_rand() % 64, 256);
+        std::vector<char> dst(1 + g_rand() % 256);
+        const int ret = Lz4Block::Decompress(junk.data(), (int)junk.size(), dst.data(),
+                                             (int)dst.size());
+        TEST_CHECK(ret == -1 || ret == (int)dst.size());
+    }
+}
+
+// 编码一组data_count个datagram, 丢掉lost里为true的分片(前data_count个为数据分片)后乱序交给decoder,
+// 返回丢掉的datagram是否都恢复了且恢复出的都是这一组的datagram
+static bool FecGroupLost(FecEncoder* encoder, FecDecoder* decoder, int data_count, int parity,
+                         const std::vector<bool>& lost, int64_t now_ms)
+{
+    std::vector<std::string> datagrams;
+    std::vector<std::string> shards;
+    for (int i = 0; i < data_count; ++i) {
+        datagrams.push_back(RandomBytes(1 + g_rand() % 1400, 256));
+        FecHead head;
+        TEST_CHECK(encoder->AddData(datagrams[i].data(), (int)datagrams[i].size(), now_ms, &head));
+        TEST_CHECK(head.index == i && head.data_count == 0);
+        shards.push_back(std::string((const char*)&head, sizeof(head)) + datagrams[i]);
+    }
+    TEST_CHECK(encoder->PendingData() == data_count);
+    for (int j = 0; j < parity; ++j) {
+        std::vector<char> buf(sizeof(FecHead) + 2 + fec_max_data_len);
+        const int len = encoder->Parity(j, buf.data(), (int)buf.size());
+        TEST_CHECK(len > (int)sizeof(FecHead));
+        TEST_CHECK(encoder->Parity(j, buf.data(), len - 1) == -1);
+        shards.push_back(std::string(buf.data(), len));
+    }
+    encoder->NextGroup();
+
+    std::vector<int> order(shards.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = (int)i;
+    }
+    std::shuffle(order.begin(), order.end(), g_rand);
+
+    std::vector<std::string> recovered;
+    for (int i : order) {
+        if (lost[i]) continue;
+        TEST_CHECK(decoder->Input(shards[i].data(), (int)shards[i].size()) >= 0);
+        const char* data = nullptr;
+        int len = 0;
+        while (decoder->PopRecovered(&data, &len)) {
+            recovered.push_back(std::string(data, len));
+        }
+    }
+    if (std::count(lost.begin(), lost.end(), true) > parity) return recovered.empty();
+    // 校验分片先到时还没到的数据分片也会被恢复出来, 丢掉的必须都在其中
+    std::sort(datagrams.begin(), datagrams.end());
+    for (const std::string& r : recovered) {
+        if (!std::binary_search(datagrams.begin(), datagrams.end(), r)) return false;
+    }
+    std::sort(recovered.begin(), recovered.end());
+    for (int i = 0; i < data_count; ++i) {
+        if (lost[i] && !std::binary_search(recovered.begin(), recovered.end(),
+                                           shards[i].substr(sizeof(FecHead)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 同FecGroupLost, 随机丢lost_data个数据分片和lost_parity个校验分片
+static bool FecGroup(FecEncoder* encoder, FecDecoder* decoder, int data_count, int parity,
+                     int lost_data, int lost_parity, int64_t now_ms)
+{
+    std::vector<bool> lost(data_count + parity, false);
+    for (int n = 0; n < lost_data;) {
+        const int i = g_rand() % data_count;
+        if (!lost[i]) lost[i] = true, n++;
+    }
+    for (int n = 0; n < lost_parity;) {
+        const int i = data_count + g_rand() % parity;
+        if (!lost[i]) lost[i] = true, n++;
+    }
+    return FecGroupLost(encoder, decoder, data_count, parity, lost, now_ms);
+}
+
+// 丢的分片不超过校验分片数就必须全部恢复, 与丢的是哪几个无关
+static void TestFecEveryLossPattern()
+{
+    for (int data_shards = 1; data_shards <= 6; ++data_shards) {
+        for (int parity = 1; parity <= 3 && parity <= fec_max_parity_shards; ++parity) {
+            FecEncoder encoder;
+            FecDecoder decoder;
+            TEST_CHECK(encoder.Init(data_shards, parity) == 0);
+            const int total = data_shards + parity;
+            int64_t now_ms = 1000;
+            int patterns = 0;
+            for (int mask = 1; mask < (1 << total); ++mask) {
+                std::vector<bool> lost(total, false);
+                int lost_count = 0;
+                for (int i = 0; i < total; ++i) {
+                    if (mask & (1 << i)) lost[i] = true, lost_count++;
+                }
+                if (lost_count > parity) continue;
+                TEST_CHECK(FecGroupLost(&encoder, &decoder, data_shards, parity, lost, now_ms));
+                now_ms += 10;
+                patterns++;
+            }
+            TEST_CHECK(patterns > 0);
+        }
+    }
+}
+
+static void TestFec()
+{
+    for (int parity = 1; parity <= fec_max_parity_shards; ++parity) {
+        for (int data_shards : {parity, 4, 10, fec_max_data_shards}) {
+            FecEncoder encoder;
+            FecDecoder decoder;
+            TEST_CHECK(encoder.Init(data_shards, parity) == 0);
+            int64_t now_ms = 1000;
+            // 丢1到parity个数据分片, 以及数据和校验分片一起丢
+            for (int lost = 1; lost <= parity && lost <= data_shards; ++lost) {
+                for (int round = 0; round < 20; ++round) {
+                    TEST_CHECK(FecGroup(&encoder, &decoder, data_shards, parity, lost, 0, now_ms));
+                    TEST_CHECK(FecGroup(&encoder, &decoder, data_shards, parity, lost,
+                                        parity - lost, now_ms));
+                    now_ms += 10;
+                }
+            }
+            // 超时发出的不满的组
+            if (data_shards > 2) {
+                TEST_CHECK(FecGroup(&encoder, &decoder, data_shards - 1, parity, 1, 0, now_ms));
+            }
+            // 丢的比校验分片多, 恢复不了也不能交出错误的数据
+            if (parity < data_shards) {
+                TEST_CHECK(FecGroup(&encoder, &decoder, data_shards, parity, parity + 1, 0, now_ms));
+            }
+        }
+    }
+    FecEncoder encoder;
+    TEST_CHECK(encoder.Init(fec_max_data_shards + 1, 1) == -1);
+    TEST_CHECK(encoder.Init(4, fec_max_parity_shards + 1) == -1);
+    FecDecoder decoder;
+    const char short_pkg[sizeof(FecHead)] = {};
+    TEST_CHECK(decoder.Input(short_pkg, sizeof(short_pkg)) == -1);
+}
+
+// 两个紧凑头的KCP对连, 中间按比例丢datagram
+struct CompactLink {
+    ikcpcb* kcp = nullptr;
+    std::deque<std::string>* to_peer = nullptr;
+    int loss = 0;
+};
+
+static int CompactOutput(const char* buf, int len, ikcpcb* kcp, void* user)
+{
+    CompactLink* link = (CompactLink*)user;
+    if ((int)(g_rand() % 100) >= link->loss) link->to_peer->push_back(std::string(buf, len));
+    return 0;
+}
+
+static void CompactRoundTrip(IUINT32 start_sn, IUINT32 start_ms, int loss, int sack = 0)
+{
+    std::deque<std::string> a_to_b;
+    std::deque<std::string> b_to_a;
+    CompactLink a;
+    CompactLink b;
+    a.to_peer = &a_to_b;
+    b.to_peer = &b_to_a;
+    a.loss = loss;
+    b.loss = loss;
+    a.kcp = pvp_ikcp_create(1, &a);
+    b.kcp = pvp_ikcp_create(1, &b);
+    for (CompactLink* link : {&a, &b}) {
+        pvp_ikcp_setoutput(link->kcp, CompactOutput);
+        pvp_ikcp_nodelay(link->kcp, 1, 10, 2, 1);
+        pvp_ikcp_wndsize(link->kcp, 128, 128);
+        pvp_ikcp_setmtu(link->kcp, 500);
+        pvp_ikcp_setcompact(link->kcp, 1, 0);
+        pvp_ikcp_setsack(link->kcp, sack);
+        link->kcp->snd_una = start_sn;
+        link->kcp->snd_nxt = start_sn;
+        link->kcp->rcv_nxt = start_sn;
+    }
+
+    // 每条消息的sn跨过16位和32位回绕, 时钟跨过32位回绕; 有多fragment的消息
+    const int msg_count = 600;
+    std::vector<std::string> sent;
+    std::vector<std::string> received;
+    IUINT32 now = start_ms;
+    int next = 0;
+    char buf[8192];
+    for (int step = 0; step < 20000 && received.size() < (size_t)msg_count; ++step) {
+        while (next < msg_count && pvp_ikcp_waitsnd(a.kcp) < 64) {
+            const int len = (next % 50 == 0) ? 1200 + g_rand() % 3000 : 1 + g_rand() % 200;
+            sent.push_back(RandomBytes(len, 256));
+            TEST_CHECK(pvp_ikcp_send(a.kcp, sent.back().data(), len, now) >= 0);
+            next++;
+        }
+        pvp_ikcp_update(a.kcp, now);
+        pvp_ikcp_update(b.kcp, now);
+        while (!a_to_b.empty()) {
+            const std::string& pkg = a_to_b.front();
+            TEST_CHECK(pvp_ikcp_input_compact(b.kcp, pkg.data(), (long)pkg.size(), now, nullptr) ==
+                       0);
+            a_to_b.pop_front();
+        }
+        while (!b_to_a.empty()) {
+            const std::string& pkg = b_to_a.front();
+            TEST_CHECK(pvp_ikcp_input_compact(a.kcp, pkg.data(), (long)pkg.size(), now, nullptr) ==
+                       0);
+            b_to_a.pop_front();
+        }
+        int len;
+        while ((len = pvp_ikcp_recv(b.kcp, buf, sizeof(buf))) >= 0) {
+            received.push_back(std::string(buf, len));
+        }
+        now += 5;
+    }
+    TEST_CHECK(received.size() == (size_t)msg_count);
+    TEST_CHECK(received == sent);
+    TEST_CHECK(b.kcp->rcv_nxt - start_sn >= (IUINT32)msg_count);
+    if (start_sn > 0xFFFF0000) TEST_CHECK(b.kcp->rcv_nxt < start_sn);
+    if (start_ms > 0xFFFF0000) TEST_CHECK(now < start_ms);
+    // ack的ts只带低16位, 还原错了rtt会变成很大的值
+    TEST_CHECK(a.kcp->rx_srtt >= 0 && a.kcp->rx_srtt < 1000);
+    pvp_ikcp_release(a.kcp);
+    pvp_ikcp_release(b.kcp);
+}
+
+static void TestCompactWrap()
+{
+    CompactRoundTrip(0xFFF0, 0x7FFFFF00, 0);
+    CompactRoundTrip(0xFFF0, 0xFFFFFFF0, 10);
+    CompactRoundTrip(0xFFFFFF00, 0xFFFFFFF0, 0);
+    CompactRoundTrip(0xFFFFFF00, 0xFFFFFFC0, 10);
+    // 丢包时的确认走紧凑头的SACK
+    CompactRoundTrip(0xFFF0, 0xFFFFFFF0, 10, 1);
+    CompactRoundTrip(0xFFFFFF00, 0xFFFFFFC0, 20, 1);
+    // 不完整和非法的紧凑头
+    ikcpcb* kcp = pvp_ikcp_create(1, nullptr);
+    pvp_ikcp_setcompact(kcp, 1, 0);
+    const char bad_cmd[] = {0x07, 0, 0, 0, 0};
+    TEST_CHECK(pvp_ikcp_input_compact(kcp, bad_cmd, sizeof(bad_cmd), 0, nullptr) < 0);
+    const char no_context[] = {0x00, 0x00, 0x00, 0x00};  // PUSH沿用前一个ts, 但没有前一个
+    TEST_CHECK(pvp_ikcp_input_compact(kcp, no_context, sizeof(no_context), 0, nullptr) < 0);
+    int channel = -1;
+    TEST_CHECK(pvp_ikcp_compact_span(no_context, sizeof(no_context), &channel) < 0);
+    pvp_ikcp_release(kcp);
+}
+
+// 通道0和通道2各一个datagram拼在一起, 按通道号分段后各自解码; 小消息的紧凑头比原格式短得多
+static void TestCompactChannels()
+{
+    const int msg_len = 40;
+    const int msg_count = 3;
+    std::deque<std::string> out[3];
+    CompactLink links[3];
+    for (int i = 0; i < 3; ++i) {
+        links[i].to_peer = &out[i];
+        links[i].kcp = pvp_ikcp_create(1, &links[i]);
+        pvp_ikcp_setoutput(links[i].kcp, CompactOutput);
+        pvp_ikcp_nodelay(links[i].kcp, 1, 10, 2, 1);
+    }
+    // links[2]是原格式, 用来比较包头长度
+    pvp_ikcp_setcompact(links[0].kcp, 1, 0);
+    pvp_ikcp_setcompact(links[1].kcp, 1, 2);
+    std::vector<std::string> sent;
+    for (int n = 0; n < msg_count; ++n) {
+        sent.push_back(RandomBytes(msg_len, 256));
+        for (CompactLink& link : links) {
+            TEST_CHECK(pvp_ikcp_send(link.kcp, sent.back().data(), msg_len, 1000) >= 0);
+        }
+    }
+    for (CompactLink& link : links) {
+        pvp_ikcp_update(link.kcp, 1000);
+        TEST_CHECK(link.to_peer->size() == 1);
+    }
+    const int compact_head = (int)out[0].front().size() - msg_len * msg_count;
+    const int legacy_head = (int)out[2].front().size() - msg_len * msg_count;
+    TEST_CHECK(legacy_head == 19 * msg_count);
+    TEST_CHECK(compact_head <= 12 + 5 * (msg_count - 1));
+    TEST_CHECK((int)out[1].front().size() == (int)out[0].front().size());
+
+    const std::string dgram = out[0].front() + out[1].front();
+    int channel = -1;
+    const long span0 = pvp_ikcp_compact_span(dgram.data(), (long)dgram.size(), &channel);
+    TEST_CHECK(span0 == (long)out[0].front().size() && channel == 0);
+    const long span2 =
+        pvp_ikcp_compact_span(dgram.data() + span0, (long)dgram.size() - span0, &channel);
+    TEST_CHECK(span2 == (long)out[1].front().size() && channel == 2);
+
+    const long offsets[] = {0, span0};
+    const long spans[] = {span0, span2};
+    for (int i = 0; i < 2; ++i) {
+        ikcpcb* peer = pvp_ikcp_create(1, nullptr);
+        pvp_ikcp_setcompact(peer, 1, i * 2);
+        TEST_CHECK(pvp_ikcp_input_compact(peer, dgram.data() + offsets[i], spans[i], 1000,
+                                          nullptr) == 0);
+        char buf[256];
+        for (const std::string& msg : sent) {
+            TEST_CHECK(pvp_ikcp_recv(peer, buf, sizeof(buf)) == msg_len &&
+                       std::string(buf, msg_len) == msg);
+        }
+        pvp_ikcp_release(peer);
+    }
+    for (CompactLink& link : links) {
+        pvp_ikcp_release(link.kcp);
+    }
+}
+
+// 紧凑头下丢掉sn 3, 7, 8, 15: 接收端回一个SACK, 发送端据此只剩这4个待确认
+static void TestCompactSack()
+{
+    std::deque<std::string> a_to_b;
+    std::deque<std::string> b_to_a;
+    CompactLink a;
+    CompactLink b;
+    a.to_peer = &a_to_b;
+    b.to_peer = &b_to_a;
+    a.kcp = pvp_ikcp_create(1, &a);
+    b.kcp = pvp_ikcp_create(1, &b);
+    for (CompactLink* link : {&a, &b}) {
+        pvp_ikcp_setoutput(link->kcp, CompactOutput);
+        pvp_ikcp_nodelay(link->kcp, 1, 10, 2, 1);
+        pvp_ikcp_setcompact(link->kcp, 1, 0);
+        pvp_ikcp_setsack(link->kcp, 1);
+    }
+    // 合包按原格式头长计算, 一个datagram只放得下一个segment
+    pvp_ikcp_setmtu(a.kcp, 50);
+    for (int i = 0; i < 20; ++i) {
+        const std::string msg(10, (char)i);
+        TEST_CHECK(pvp_ikcp_send(a.kcp, msg.data(), (int)msg.size(), 1000) >= 0);
+    }
+    pvp_ikcp_update(a.kcp, 1000);
+    pvp_ikcp_update(b.kcp, 1000);
+    TEST_CHECK(a_to_b.size() == 20);
+    for (int sn = 0; sn < 20; ++sn) {
+        if (sn == 3 || sn == 7 || sn == 8 || sn == 15) continue;
+        TEST_CHECK(pvp_ikcp_input_compact(b.kcp, a_to_b[sn].data(), (long)a_to_b[sn].size(), 1000,
+                                          nullptr) == 0);
+    }
+    pvp_ikcp_flush(b.kcp);
+    TEST_CHECK(b_to_a.size() == 1);
+    // flags(1) ts(2) sn(2) una(2) wnd(1-2) frg(1) len(1) 加3个4字节的区间, 原格式是19+12
+    TEST_CHECK(b_to_a.front().size() <= 11 + 3 * 4);
+    TEST_CHECK(pvp_ikcp_input_compact(a.kcp, b_to_a.front().data(), (long)b_to_a.front().size(),
+                                      1000, nullptr) == 0);
+    TEST_CHECK(a.kcp->snd_una == 3 && a.kcp->nsnd_buf == 4);
+    pvp_ikcp_release(a.kcp);
+    pvp_ikcp_release(b.kcp);
+}
+
+static void TestCrc32c()
+{
+    // RFC 3720 B.4的测试值
+    TEST_CHECK(Crc32c::Compute("123456789", 9) == 0xE3069283);
+    const std::string zeros(32, 0);
+    const std::string ones(32, (char)0xFF);
+    TEST_CHECK(Crc32c::Compute(zeros.data(), 32) == 0x8A9136AA);
+    TEST_CHECK(Crc32c::Compute(ones.data(), 32) == 0x62A8AB43);
+    TEST_CHECK(Crc32c::ComputeSoftware(zeros.data(), 32) == 0x8A9136AA);
+    TEST_CHECK(Crc32c::Compute(zeros.data(), 0) == 0);
+
+    // 不同的起始对齐和长度, 覆盖硬件实现8/4/1字节各段的组合
+    const std::string buf = RandomBytes(4096, 256);
+    for (int offset = 0; offset < 8; ++offset) {
+        for (int len = 1; len <= 64; ++len) {
+            TEST_CHECK(Crc32c::Compute(buf.data() + offset, len) ==
+                       Crc32c::ComputeSoftware(buf.data() + offset, len));
+        }
+        for (int round = 0; round < 50; ++round) {
+            const int len = 1 + g_rand() % (4096 - 8);
+            TEST_CHECK(Crc32c::Compute(buf.data() + offset, len) ==
+                       Crc32c::ComputeSoftware(buf.data() + offset, len));
+        }
+    }
+    printf("crc32c impl: %s\n", Crc32c::Impl());
+}
+
+int main()
+{
+    TestLz4RoundTrip();
+    TestLz4Malformed();
+    TestFec();
+    TestFecEveryLossPattern();
+    TestCompactWrap();
+    TestCompactChannels();
+    TestCompactSack();
+    TestCrc32c();
+    printf("codec test passed\n");
+    return 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+#include <dmsdk/dlib/hash.h>
+
+namespace dmBuffer {
+typedef struct BufferImpl* HBuffer;
+
+enum Result {
+    RESULT_OK = 0,
+    RESULT_ALLOCATION_ERROR = 2,
+    RESULT_BUFFER_INVALID = 3,
+};
+
+enum ValueType {
+    VALUE_TYPE_UINT8 = 0,
+};
+
+struct StreamDeclaration {
+    dmhash_t m_Name;
+    ValueType m_Type;
+    uint8_t m_Count;
+    uint32_t m_Flags;
+    uint32_t m_Reserved;
+};
+
+// 只支持一个uint8流
+Result Create(uint32_t num_elements, const StreamDeclaration* streams_decl, uint8_t streams_decl_count,
+              HBuffer* out_buffer);
+void Destroy(HBuffer buffer);
+Result GetBytes(HBuffer buffer, void** out_bytes, uint32_t* out_size);
+}  // namespace dmBuffer
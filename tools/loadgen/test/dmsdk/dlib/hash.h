@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstdint>
+
+typedef uint64_t dmhash_t;
+
+dmhash_t dmHashString64(const char* string);
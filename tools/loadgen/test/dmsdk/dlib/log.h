@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstdio>
+
+// 测试里日志直接打到stderr
+#define dmLogInfo(...) ((void)0)
+#define dmLogWarning(...) (fprintf(stderr, "WARNING: " __VA_ARGS__), fputc('\n', stderr))
+#define dmLogError(...) (fprintf(stderr, "ERROR: " __VA_ARGS__), fputc('\n', stderr))
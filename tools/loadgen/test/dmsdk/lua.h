@@ -0,0 +1,106 @@
+#pragma once
+
+// 测试用的Lua替身: 只有connclient扩展和测试用到的Lua 5.1接口, 没有解释器和GC,
+// 函数都是C函数, 对象在lua_close时统一释放. 实现见dmsdk_stub.cpp
+#include <cstddef>
+
+struct lua_State;
+typedef double lua_Number;
+typedef ptrdiff_t lua_Integer;
+typedef int (*lua_CFunction)(lua_State* L);
+
+struct luaL_Reg {
+    const char* name;
+    lua_CFunction func;
+};
+typedef luaL_Reg luaL_reg;
+
+#define LUA_REGISTRYINDEX (-10000)
+#define LUA_GLOBALSINDEX (-10002)
+#define LUA_MULTRET (-1)
+
+#define LUA_TNONE (-1)
+#define LUA_TNIL 0
+#define LUA_TBOOLEAN 1
+#define LUA_TLIGHTUSERDATA 2
+#define LUA_TNUMBER 3
+#define LUA_TSTRING 4
+#define LUA_TTABLE 5
+#define LUA_TFUNCTION 6
+#define LUA_TUSERDATA 7
+
+lua_State* luaL_newstate();
+void lua_close(lua_State* L);
+
+int lua_gettop(lua_State* L);
+void lua_settop(lua_State* L, int idx);
+void lua_pushvalue(lua_State* L, int idx);
+void lua_remove(lua_State* L, int idx);
+void lua_insert(lua_State* L, int idx);
+
+int lua_type(lua_State* L, int idx);
+int lua_isnumber(lua_State* L, int idx);
+int lua_isstring(lua_State* L, int idx);
+int lua_rawequal(lua_State* L, int idx1, int idx2);
+lua_Number lua_tonumber(lua_State* L, int idx);
+lua_Integer lua_tointeger(lua_State* L, int idx);
+int lua_toboolean(lua_State* L, int idx);
+const char* lua_tolstring(lua_State* L, int idx, size_t* len);
+void* lua_touserdata(lua_State* L, int idx);
+
+void lua_pushnil(lua_State* L);
+void lua_pushnumber(lua_State* L, lua_Number n);
+void lua_pushinteger(lua_State* L, lua_Integer n);
+void lua_pushlstring(lua_State* L, const char* s, size_t len);
+void lua_pushstring(lua_State* L, const char* s);
+const char* lua_pushfstring(lua_State* L, const char* fmt, ...);
+void lua_pushcfunction(lua_State* L, lua_CFunction fn);
+void lua_pushboolean(lua_State* L, int b);
+void lua_pushlightuserdata(lua_State* L, void* p);
+
+void lua_gettable(lua_State* L, int idx);
+void lua_getfield(lua_State* L, int idx, const char* k);
+void lua_rawget(lua_State* L, int idx);
+void lua_rawgeti(lua_State* L, int idx, int n);
+void lua_createtable(lua_State* L, int narr, int nrec);
+void* lua_newuserdata(lua_State* L, size_t size);
+int lua_getmetatable(lua_State* L, int idx);
+void lua_getfenv(lua_State* L, int idx);
+
+void lua_settable(lua_State* L, int idx);
+void lua_setfield(lua_State* L, int idx, const char* k);
+void lua_rawset(lua_State* L, int idx);
+void lua_rawseti(lua_State* L, int idx, int n);
+int lua_setmetatable(lua_State* L, int idx);
+int lua_setfenv(lua_State* L, int idx);
+
+void lua_call(lua_State* L, int nargs, int nresults);
+int lua_pcall(lua_State* L, int nargs, int nresults, int errfunc);
+int lua_error(lua_State* L);
+
+#define lua_pop(L, n) lua_settop(L, -(n)-1)
+#define lua_newtable(L) lua_createtable(L, 0, 0)
+#define lua_isfunction(L, n) (lua_type(L, (n)) == LUA_TFUNCTION)
+#define lua_istable(L, n) (lua_type(L, (n)) == LUA_TTABLE)
+#define lua_isnil(L, n) (lua_type(L, (n)) == LUA_TNIL)
+#define lua_isnone(L, n) (lua_type(L, (n)) == LUA_TNONE)
+#define lua_isnoneornil(L, n) (lua_type(L, (n)) <= 0)
+#define lua_isuserdata(L, n) (lua_type(L, (n)) == LUA_TUSERDATA || lua_type(L, (n)) == LUA_TLIGHTUSERDATA)
+#define lua_tostring(L, i) lua_tolstring(L, (i), NULL)
+
+void luaL_register(lua_State* L, const char* libname, const luaL_Reg* l);
+int luaL_newmetatable(lua_State* L, const char* tname);
+void* luaL_checkudata(lua_State* L, int narg, const char* tname);
+void luaL_checktype(lua_State* L, int narg, int t);
+lua_Number luaL_checknumber(lua_State* L, int narg);
+lua_Number luaL_optnumber(lua_State* L, int narg, lua_Number def);
+lua_Integer luaL_checkinteger(lua_State* L, int narg);
+lua_Integer luaL_optinteger(lua_State* L, int narg, lua_Integer def);
+const char* luaL_checklstring(lua_State* L, int narg, size_t* len);
+int luaL_argerror(lua_State* L, int narg, const char* extramsg);
+int luaL_typerror(lua_State* L, int narg, const char* tname);
+int luaL_error(lua_State* L, const char* fmt, ...);
+
+#define luaL_getmetatable(L, n) (lua_getfield(L, LUA_REGISTRYINDEX, (n)))
+#define luaL_checkstring(L, n) (luaL_checklstring(L, (n), NULL))
+#define luaL_argcheck(L, cond, numarg, extramsg) ((void)((cond) || luaL_argerror(L, (numarg), (extramsg))))
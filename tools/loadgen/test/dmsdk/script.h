@@ -0,0 +1,37 @@
+#pragma once
+
+#include <dmsdk/dlib/buffer.h>
+#include <dmsdk/lua.h>
+
+// 只在Lua栈检查不过时报错, luaL_error等抛出的错误跳过检查, 与真实dmsdk的longjmp一致
+struct dmStubStackCheck {
+    dmStubStackCheck(lua_State* L, int diff);
+    ~dmStubStackCheck();
+    lua_State* m_L;
+    int m_Top;
+    int m_Diff;
+    int m_Exceptions;
+};
+#define DM_LUA_STACK_CHECK(L, diff) dmStubStackCheck _dm_stack_check(L, diff);
+
+namespace dmScript {
+// 当前脚本实例, 测试里是一个普通的table. IsInstanceValid在实例不为nil时为true
+void GetInstance(lua_State* L);
+void SetInstance(lua_State* L);
+bool IsInstanceValid(lua_State* L);
+int PCall(lua_State* L, int nargs, int nresult);
+
+enum LuaBufferOwnership {
+    OWNER_C = 0,
+    OWNER_LUA = 1,
+    OWNER_RES = 2,
+};
+struct LuaHBuffer {
+    LuaHBuffer(dmBuffer::HBuffer buffer, LuaBufferOwnership owner) : m_Buffer(buffer), m_Owner(owner) {}
+    dmBuffer::HBuffer m_Buffer;
+    LuaBufferOwnership m_Owner;
+};
+void PushBuffer(lua_State* L, const LuaHBuffer& buffer);
+LuaHBuffer* ToBuffer(lua_State* L, int index);
+dmBuffer::HBuffer CheckBufferUnpack(lua_State* L, int index);
+}  // namespace dmScript
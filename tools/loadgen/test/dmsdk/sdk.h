@@ -0,0 +1,44 @@
+#pragma once
+
+// 测试用的dmsdk替身, 只有connclient扩展用到的部分, 见lua.h
+#include <cassert>
+
+#include <dmsdk/dlib/buffer.h>
+#include <dmsdk/dlib/hash.h>
+#include <dmsdk/dlib/log.h>
+#include <dmsdk/lua.h>
+#include <dmsdk/script.h>
+
+namespace dmExtension {
+enum Result {
+    RESULT_OK = 0,
+};
+enum EventID {
+    EVENT_ID_ACTIVATEAPP,
+    EVENT_ID_DEACTIVATEAPP,
+    EVENT_ID_ICONIFYAPP,
+    EVENT_ID_DEICONIFYAPP,
+};
+struct AppParams {
+};
+struct Params {
+    lua_State* m_L;
+};
+struct Event {
+    EventID m_Event;
+};
+
+// DM_DECLARE_EXTENSION生成的扩展描述, 测试按名字(symbol##_desc)直接调用各阶段
+struct Desc {
+    const char* m_Name;
+    Result (*m_AppInitialize)(AppParams* params);
+    Result (*m_AppFinalize)(AppParams* params);
+    Result (*m_Initialize)(Params* params);
+    Result (*m_Update)(Params* params);
+    void (*m_OnEvent)(Params* params, const Event* event);
+    Result (*m_Finalize)(Params* params);
+};
+}  // namespace dmExtension
+
+#define DM_DECLARE_EXTENSION(symbol, name, app_init, app_final, init, update, on_event, final) \
+    dmExtension::Desc symbol##_desc = {name, app_init, app_final, init, update, on_event, final};
@@ -0,0 +1,9 @@
+#pragma once
+
+// 测试查看stub内部状态用
+namespace dmStub {
+// 还没Destroy的dmBuffer数
+int LiveBuffers();
+// 最近一次dmScript::PCall的错误, 没有错误为空串
+const char* LastCallError();
+}  // namespace dmStub
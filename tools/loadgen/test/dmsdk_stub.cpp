@@ -0,0 +1,777 @@
+// 测试用dmsdk替身的实现: 一个没有解释器和GC的Lua栈, 加上dmScript/dmBuffer里connclient用到的部分.
+// 对象都挂在lua_State上, lua_close时一起释放; Lua错误用C++异常代替longjmp
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <dmsdk/sdk.h>
+#include <dmsdk/stub.h>
+
+namespace {
+
+struct Table;
+struct Udata;
+
+struct Value {
+    int type = LUA_TNIL;
+    bool b = false;
+    lua_Number n = 0;
+    void* p = nullptr;  // lightuserdata
+    std::shared_ptr<const std::string> s;
+    Table* t = nullptr;
+    Udata* u = nullptr;
+    lua_CFunction f = nullptr;
+};
+
+struct ValueLess {
+    bool operator()(const Value& a, const Value& b) const
+    {
+        if (a.type != b.type) return a.type < b.type;
+        switch (a.type) {
+            case LUA_TBOOLEAN: return a.b < b.b;
+            case LUA_TNUMBER: return a.n < b.n;
+            case LUA_TSTRING: return *a.s < *b.s;
+            case LUA_TLIGHTUSERDATA: return a.p < b.p;
+            case LUA_TTABLE: return a.t < b.t;
+            case LUA_TUSERDATA: return a.u < b.u;
+            case LUA_TFUNCTION: return (void*)a.f < (void*)b.f;
+            default: return false;
+        }
+    }
+};
+
+struct Table {
+    std::map<Value, Value, ValueLess> fields;
+    Table* meta = nullptr;
+};
+
+struct Udata {
+    std::unique_ptr<max_align_t[]> mem;
+    Table* meta = nullptr;
+    Table* env = nullptr;
+};
+
+struct LuaError {
+    std::string msg;
+};
+
+const char* const buffer_meta_name = "dmstub.buffer";
+
+int g_live_buffers = 0;
+std::string g_last_call_error;
+
+}  // namespace
+
+struct lua_State {
+    std::vector<Value> stack;
+    int base = 0;  // 当前C函数第一个参数在stack里的位置
+    Value registry;
+    Value globals;
+    Value instance;
+    std::vector<std::unique_ptr<Table>> tables;
+    std::vector<std::unique_ptr<Udata>> udatas;
+};
+
+struct dmBuffer::BufferImpl {
+    std::vector<uint8_t> bytes;
+};
+
+namespace {
+
+Table* NewTable(lua_State* L)
+{
+    L->tables.push_back(std::make_unique<Table>());
+    return L->tables.back().get();
+}
+
+Value TableValue(Table* t)
+{
+    Value v;
+    v.type = LUA_TTABLE;
+    v.t = t;
+    return v;
+}
+
+Value StringValue(const char* s, size_t len)
+{
+    Value v;
+    v.type = LUA_TSTRING;
+    v.s = std::make_shared<const std::string>(s, len);
+    return v;
+}
+
+Value NumberValue(lua_Number n)
+{
+    Value v;
+    v.type = LUA_TNUMBER;
+    v.n = n;
+    return v;
+}
+
+[[noreturn]] void Throw(const std::string& msg)
+{
+    throw LuaError{msg};
+}
+
+int AbsIndex(lua_State* L, int idx)
+{
+    return idx > 0 ? idx : (int)L->stack.size() - L->base + idx + 1;
+}
+
+// 不存在的位置返回none
+Value* Slot(lua_State* L, int idx)
+{
+    static Value none;
+    none = Value();
+    none.type = LUA_TNONE;
+    if (idx == LUA_REGISTRYINDEX) return &L->registry;
+    if (idx == LUA_GLOBALSINDEX) return &L->globals;
+    const int abs = AbsIndex(L, idx);
+    if (abs <= 0 || L->base + abs > (int)L->stack.size()) return &none;
+    return &L->stack[L->base + abs - 1];
+}
+
+Table* CheckTable(lua_State* L, int idx)
+{
+    Value* v = Slot(L, idx);
+    if (v->type != LUA_TTABLE) Throw("attempt to index a non-table value");
+    return v->t;
+}
+
+Value RawGet(const Table* t, const Value& k)
+{
+    auto it = t->fields.find(k);
+    return it == t->fields.end() ? Value() : it->second;
+}
+
+void RawSet(Table* t, const Value& k, const Value& v)
+{
+    if (k.type == LUA_TNIL) Throw("table index is nil");
+    if (v.type == LUA_TNIL) {
+        t->fields.erase(k);
+    } else {
+        t->fields[k] = v;
+    }
+}
+
+// 取值时支持userdata/table的__index表, 方法调用client:send(...)要用到
+Value Index(const Value& obj, const Value& k)
+{
+    const Table* meta = nullptr;
+    if (obj.type == LUA_TTABLE) {
+        Value v = RawGet(obj.t, k);
+        if (v.type != LUA_TNIL) return v;
+        meta = obj.t->meta;
+    } else if (obj.type == LUA_TUSERDATA) {
+        meta = obj.u->meta;
+    } else {
+        Throw("attempt to index a non-table value");
+    }
+    if (meta == nullptr) return Value();
+    Value index = RawGet(meta, StringValue("__index", 7));
+    if (index.type != LUA_TTABLE) return Value();
+    return Index(index, k);
+}
+
+void Push(lua_State* L, const Value& v)
+{
+    L->stack.push_back(v);
+}
+
+Value Pop(lua_State* L)
+{
+    if ((int)L->stack.size() <= L->base) Throw("stack underflow");
+    Value v = L->stack.back();
+    L->stack.pop_back();
+    return v;
+}
+
+std::string VFormat(const char* fmt, va_list ap)
+{
+    // 只支持%s %d %f %p %%, 与lua_pushfstring一致
+    std::string out;
+    for (const char* p = fmt; *p; ++p) {
+        if (*p != '%' || p[1] == 0) {
+            out += *p;
+            continue;
+        }
+        char buf[64];
+        switch (*++p) {
+            case 's': {
+                const char* s = va_arg(ap, const char*);
+                out += s ? s : "(null)";
+                break;
+            }
+            case 'd': snprintf(buf, sizeof(buf), "%d", va_arg(ap, int)); out += buf; break;
+            case 'f': snprintf(buf, sizeof(buf), "%.14g", va_arg(ap, double)); out += buf; break;
+            case 'p': snprintf(buf, sizeof(buf), "%p", va_arg(ap, void*)); out += buf; break;
+            default: out += *p; break;
+        }
+    }
+    return out;
+}
+
+const char* TypeName(int type)
+{
+    static const char* const names[] = {"nil",    "boolean", "userdata", "number",
+                                        "string", "table",   "function", "userdata"};
+    return type >= 0 && type <= LUA_TUSERDATA ? names[type] : "no value";
+}
+
+}  // namespace
+
+lua_State* luaL_newstate()
+{
+    lua_State* L = new lua_State();
+    L->registry = TableValue(NewTable(L));
+    L->globals = TableValue(NewTable(L));
+    return L;
+}
+
+void lua_close(lua_State* L)
+{
+    // 没有GC, Lua持有的buffer在这里释放
+    for (auto& u : L->udatas) {
+        if (u->meta == nullptr) continue;
+        Value name = RawGet(u->meta, StringValue("__name", 6));
+        if (name.type == LUA_TSTRING && *name.s == buffer_meta_name) {
+            auto* ud = (dmScript::LuaHBuffer*)u->mem.get();
+            if (ud->m_Owner == dmScript::OWNER_LUA) dmBuffer::Destroy(ud->m_Buffer);
+        }
+    }
+    delete L;
+}
+
+int lua_gettop(lua_State* L)
+{
+    return (int)L->stack.size() - L->base;
+}
+
+void lua_settop(lua_State* L, int idx)
+{
+    const int top = idx >= 0 ? idx : lua_gettop(L) + idx + 1;
+    if (top < 0) Throw("invalid settop");
+    L->stack.resize(L->base + top);
+}
+
+void lua_pushvalue(lua_State* L, int idx)
+{
+    Push(L, *Slot(L, idx));
+}
+
+void lua_remove(lua_State* L, int idx)
+{
+    const int abs = AbsIndex(L, idx);
+    L->stack.erase(L->stack.begin() + L->base + abs - 1);
+}
+
+void lua_insert(lua_State* L, int idx)
+{
+    const int abs = AbsIndex(L, idx);
+    Value v = Pop(L);
+    L->stack.insert(L->stack.begin() + L->base + abs - 1, v);
+}
+
+int lua_type(lua_State* L, int idx)
+{
+    return Slot(L, idx)->type;
+}
+
+int lua_isnumber(lua_State* L, int idx)
+{
+    return Slot(L, idx)->type == LUA_TNUMBER;
+}
+
+int lua_isstring(lua_State* L, int idx)
+{
+    const int type = Slot(L, idx)->type;
+    return type == LUA_TSTRING || type == LUA_TNUMBER;
+}
+
+int lua_rawequal(lua_State* L, int idx1, int idx2)
+{
+    const Value* a = Slot(L, idx1);
+    const Value* b = Slot(L, idx2);
+    if (a->type == LUA_TNONE || b->type == LUA_TNONE) return 0;
+    return !ValueLess()(*a, *b) && !ValueLess()(*b, *a);
+}
+
+lua_Number lua_tonumber(lua_State* L, int idx)
+{
+    const Value* v = Slot(L, idx);
+    return v->type == LUA_TNUMBER ? v->n : 0;
+}
+
+lua_Integer lua_tointeger(lua_State* L, int idx)
+{
+    return (lua_Integer)lua_tonumber(L, idx);
+}
+
+int lua_toboolean(lua_State* L, int idx)
+{
+    const Value* v = Slot(L, idx);
+    return !(v->type <= LUA_TNIL || (v->type == LUA_TBOOLEAN && !v->b));
+}
+
+const char* lua_tolstring(lua_State* L, int idx, size_t* len)
+{
+    Value* v = Slot(L, idx);
+    if (v->type == LUA_TNUMBER) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.14g", v->n);
+        *v = StringValue(buf, strlen(buf));
+    }
+    if (v->type != LUA_TSTRING) return nullptr;
+    if (len) *len = v->s->size();
+    return v->s->c_str();
+}
+
+void* lua_touserdata(lua_State* L, int idx)
+{
+    const Value* v = Slot(L, idx);
+    if (v->type == LUA_TUSERDATA) return v->u->mem.get();
+    if (v->type == LUA_TLIGHTUSERDATA) return v->p;
+    return nullptr;
+}
+
+void lua_pushnil(lua_State* L)
+{
+    Push(L, Value());
+}
+
+void lua_pushnumber(lua_State* L, lua_Number n)
+{
+    Push(L, NumberValue(n));
+}
+
+void lua_pushinteger(lua_State* L, lua_Integer n)
+{
+    Push(L, NumberValue((lua_Number)n));
+}
+
+void lua_pushlstring(lua_State* L, const char* s, size_t len)
+{
+    Push(L, StringValue(s, len));
+}
+
+void lua_pushstring(lua_State* L, const char* s)
+{
+    if (s == nullptr) {
+        lua_pushnil(L);
+    } else {
+        lua_pushlstring(L, s, strlen(s));
+    }
+}
+
+const char* lua_pushfstring(lua_State* L, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    const std::string s = VFormat(fmt, ap);
+    va_end(ap);
+    lua_pushlstring(L, s.data(), s.size());
+    return lua_tostring(L, -1);
+}
+
+void lua_pushcfunction(lua_State* L, lua_CFunction fn)
+{
+    Value v;
+    v.type = LUA_TFUNCTION;
+    v.f = fn;
+    Push(L, v);
+}
+
+void lua_pushboolean(lua_State* L, int b)
+{
+    Value v;
+    v.type = LUA_TBOOLEAN;
+    v.b = b != 0;
+    Push(L, v);
+}
+
+void lua_pushlightuserdata(lua_State* L, void* p)
+{
+    Value v;
+    v.type = LUA_TLIGHTUSERDATA;
+    v.p = p;
+    Push(L, v);
+}
+
+void lua_gettable(lua_State* L, int idx)
+{
+    Value obj = *Slot(L, idx);
+    Value k = Pop(L);
+    Push(L, Index(obj, k));
+}
+
+void lua_getfield(lua_State* L, int idx, const char* k)
+{
+    Value obj = *Slot(L, idx);
+    Push(L, Index(obj, StringValue(k, strlen(k))));
+}
+
+void lua_rawget(lua_State* L, int idx)
+{
+    Table* t = CheckTable(L, idx);
+    Value k = Pop(L);
+    Push(L, RawGet(t, k));
+}
+
+void lua_rawgeti(lua_State* L, int idx, int n)
+{
+    Push(L, RawGet(CheckTable(L, idx), NumberValue(n)));
+}
+
+void lua_createtable(lua_State* L, int narr, int nrec)
+{
+    Push(L, TableValue(NewTable(L)));
+}
+
+void* lua_newuserdata(lua_State* L, size_t size)
+{
+    auto u = std::make_unique<Udata>();
+    u->mem.reset(new max_align_t[(size + sizeof(max_align_t) - 1) / sizeof(max_align_t) + 1]);
+    Value v;
+    v.type = LUA_TUSERDATA;
+    v.u = u.get();
+    L->udatas.push_back(std::move(u));
+    Push(L, v);
+    return v.u->mem.get();
+}
+
+int lua_getmetatable(lua_State* L, int idx)
+{
+    const Value* v = Slot(L, idx);
+    Table* meta = v->type == LUA_TTABLE ? v->t->meta : v->type == LUA_TUSERDATA ? v->u->meta : nullptr;
+    if (meta == nullptr) return 0;
+    Push(L, TableValue(meta));
+    return 1;
+}
+
+void lua_getfenv(lua_State* L, int idx)
+{
+    const Value* v = Slot(L, idx);
+    if (v->type == LUA_TUSERDATA && v->u->env != nullptr) {
+        Push(L, TableValue(v->u->env));
+    } else {
+        lua_pushnil(L);
+    }
+}
+
+void lua_settable(lua_State* L, int idx)
+{
+    Table* t = CheckTable(L, idx);
+    Value v = Pop(L);
+    Value k = Pop(L);
+    RawSet(t, k, v);
+}
+
+void lua_setfield(lua_State* L, int idx, const char* k)
+{
+    Table* t = CheckTable(L, idx);
+    Value v = Pop(L);
+    RawSet(t, StringValue(k, strlen(k)), v);
+}
+
+void lua_rawset(lua_State* L, int idx)
+{
+    lua_settable(L, idx);
+}
+
+void lua_rawseti(lua_State* L, int idx, int n)
+{
+    Table* t = CheckTable(L, idx);
+    Value v = Pop(L);
+    RawSet(t, NumberValue(n), v);
+}
+
+int lua_setmetatable(lua_State* L, int idx)
+{
+    Value* obj = Slot(L, idx);
+    Value meta = Pop(L);
+    Table* t = meta.type == LUA_TTABLE ? meta.t : nullptr;
+    if (obj->type == LUA_TTABLE) {
+        obj->t->meta = t;
+    } else if (obj->type == LUA_TUSERDATA) {
+        obj->u->meta = t;
+    } else {
+        Throw("cannot set metatable");
+    }
+    return 1;
+}
+
+int lua_setfenv(lua_State* L, int idx)
+{
+    Value* obj = Slot(L, idx);
+    Value env = Pop(L);
+    if (obj->type != LUA_TUSERDATA || env.type != LUA_TTABLE) return 0;
+    obj->u->env = env.t;
+    return 1;
+}
+
+void lua_call(lua_State* L, int nargs, int nresults)
+{
+    const int func = (int)L->stack.size() - nargs - 1;
+    if (func < L->base || L->stack[func].type != LUA_TFUNCTION) Throw("attempt to call a non-function value");
+    const int old_base = L->base;
+    L->base = func + 1;
+    int n = 0;
+    try {
+        n = L->stack[func].f(L);
+    } catch (...) {
+        L->stack.resize(func);
+        L->base = old_base;
+        throw;
+    }
+    std::vector<Value> results(L->stack.end() - n, L->stack.end());
+    L->stack.resize(func);
+    L->base = old_base;
+    if (nresults != LUA_MULTRET) results.resize(nresults);
+    for (const Value& v : results) {
+        Push(L, v);
+    }
+}
+
+int lua_pcall(lua_State* L, int nargs, int nresults, int errfunc)
+{
+    const int func = (int)L->stack.size() - nargs - 1;
+    try {
+        lua_call(L, nargs, nresults);
+    } catch (const LuaError& e) {
+        L->stack.resize(func);
+        lua_pushlstring(L, e.msg.data(), e.msg.size());
+        return 2;
+    }
+    return 0;
+}
+
+int lua_error(lua_State* L)
+{
+    const char* msg = lua_tostring(L, -1);
+    Throw(msg ? msg : "error object is not a string");
+}
+
+void luaL_register(lua_State* L, const char* libname, const luaL_Reg* l)
+{
+    if (libname != nullptr) {
+        lua_getfield(L, LUA_GLOBALSINDEX, libname);
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, LUA_GLOBALSINDEX, libname);
+        }
+    }
+    for (; l->name != nullptr; ++l) {
+        lua_pushcfunction(L, l->func);
+        lua_setfield(L, -2, l->name);
+    }
+}
+
+int luaL_newmetatable(lua_State* L, const char* tname)
+{
+    luaL_getmetatable(L, tname);
+    if (!lua_isnil(L, -1)) return 0;
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushstring(L, tname);
+    lua_setfield(L, -2, "__name");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, tname);
+    return 1;
+}
+
+void* luaL_checkudata(lua_State* L, int narg, const char* tname)
+{
+    const Value* v = Slot(L, narg);
+    if (v->type == LUA_TUSERDATA && v->u->meta != nullptr) {
+        const Value meta = RawGet(L->registry.t, StringValue(tname, strlen(tname)));
+        if (meta.type == LUA_TTABLE && meta.t == v->u->meta) return v->u->mem.get();
+    }
+    luaL_typerror(L, narg, tname);
+    return nullptr;
+}
+
+void luaL_checktype(lua_State* L, int narg, int t)
+{
+    if (lua_type(L, narg) != t) luaL_typerror(L, narg, TypeName(t));
+}
+
+lua_Number luaL_checknumber(lua_State* L, int narg)
+{
+    if (!lua_isnumber(L, narg)) luaL_typerror(L, narg, "number");
+    return lua_tonumber(L, narg);
+}
+
+lua_Number luaL_optnumber(lua_State* L, int narg, lua_Number def)
+{
+    return lua_isnoneornil(L, narg) ? def : luaL_checknumber(L, narg);
+}
+
+lua_Integer luaL_checkinteger(lua_State* L, int narg)
+{
+    return (lua_Integer)luaL_checknumber(L, narg);
+}
+
+lua_Integer luaL_optinteger(lua_State* L, int narg, lua_Integer def)
+{
+    return lua_isnoneornil(L, narg) ? def : luaL_checkinteger(L, narg);
+}
+
+const char* luaL_checklstring(lua_State* L, int narg, size_t* len)
+{
+    const char* s = lua_tolstring(L, narg, len);
+    if (s == nullptr) luaL_typerror(L, narg, "string");
+    return s;
+}
+
+int luaL_argerror(lua_State* L, int narg, const char* extramsg)
+{
+    return luaL_error(L, "bad argument #%d (%s)", narg, extramsg);
+}
+
+int luaL_typerror(lua_State* L, int narg, const char* tname)
+{
+    const char* msg = lua_pushfstring(L, "%s expected, got %s", tname, TypeName(lua_type(L, narg)));
+    return luaL_argerror(L, narg, msg);
+}
+
+int luaL_error(lua_State* L, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    const std::string msg = VFormat(fmt, ap);
+    va_end(ap);
+    Throw(msg);
+}
+
+dmStubStackCheck::dmStubStackCheck(lua_State* L, int diff)
+    : m_L(L), m_Top(lua_gettop(L)), m_Diff(diff), m_Exceptions(std::uncaught_exceptions())
+{
+}
+
+dmStubStackCheck::~dmStubStackCheck()
+{
+    if (std::uncaught_exceptions() != m_Exceptions) return;
+    if (lua_gettop(m_L) != m_Top + m_Diff) {
+        fprintf(stderr, "lua stack check failed: expected %d, got %d\n", m_Top + m_Diff, lua_gettop(m_L));
+        std::terminate();
+    }
+}
+
+dmhash_t dmHashString64(const char* string)
+{
+    // FNV-1a
+    dmhash_t h = 14695981039346656037ull;
+    for (const char* p = string; *p; ++p) {
+        h = (h ^ (uint8_t)*p) * 1099511628211ull;
+    }
+    return h;
+}
+
+namespace dmBuffer {
+
+Result Create(uint32_t num_elements, const StreamDeclaration* streams_decl, uint8_t streams_decl_count,
+              HBuffer* out_buffer)
+{
+    if (num_elements == 0 || streams_decl_count != 1 || streams_decl[0].m_Type != VALUE_TYPE_UINT8) {
+        return RESULT_BUFFER_INVALID;
+    }
+    HBuffer buffer = new BufferImpl();
+    buffer->bytes.resize((size_t)num_elements * streams_decl[0].m_Count);
+    g_live_buffers++;
+    *out_buffer = buffer;
+    return RESULT_OK;
+}
+
+void Destroy(HBuffer buffer)
+{
+    if (buffer == nullptr) return;
+    g_live_buffers--;
+    delete buffer;
+}
+
+Result GetBytes(HBuffer buffer, void** out_bytes, uint32_t* out_size)
+{
+    if (buffer == nullptr) return RESULT_BUFFER_INVALID;
+    *out_bytes = buffer->bytes.data();
+    *out_size = (uint32_t)buffer->bytes.size();
+    return RESULT_OK;
+}
+
+}  // namespace dmBuffer
+
+namespace dmScript {
+
+void GetInstance(lua_State* L)
+{
+    Push(L, L->instance);
+}
+
+void SetInstance(lua_State* L)
+{
+    L->instance = Pop(L);
+}
+
+bool IsInstanceValid(lua_State* L)
+{
+    return L->instance.type != LUA_TNIL;
+}
+
+int PCall(lua_State* L, int nargs, int nresult)
+{
+    const int ret = lua_pcall(L, nargs, nresult, 0);
+    if (ret != 0) {
+        g_last_call_error = lua_tostring(L, -1);
+        fprintf(stderr, "PCall error: %s\n", g_last_call_error.c_str());
+        lua_pop(L, 1);
+    } else {
+        g_last_call_error.clear();
+    }
+    return ret;
+}
+
+void PushBuffer(lua_State* L, const LuaHBuffer& buffer)
+{
+    new (lua_newuserdata(L, sizeof(LuaHBuffer))) LuaHBuffer(buffer);
+    luaL_newmetatable(L, buffer_meta_name);
+    lua_setmetatable(L, -2);
+}
+
+LuaHBuffer* ToBuffer(lua_State* L, int index)
+{
+    const Value* v = Slot(L, index);
+    if (v->type != LUA_TUSERDATA || v->u->meta == nullptr) return nullptr;
+    const Value meta = RawGet(L->registry.t, StringValue(buffer_meta_name, strlen(buffer_meta_name)));
+    if (meta.type != LUA_TTABLE || meta.t != v->u->meta) return nullptr;
+    return (LuaHBuffer*)v->u->mem.get();
+}
+
+dmBuffer::HBuffer CheckBufferUnpack(lua_State* L, int index)
+{
+    LuaHBuffer* buffer = ToBuffer(L, index);
+    if (buffer == nullptr) luaL_typerror(L, index, "buffer");
+    return buffer->m_Buffer;
+}
+
+}  // namespace dmScript
+
+namespace dmStub {
+
+int LiveBuffers()
+{
+    return g_live_buffers;
+}
+
+const char* LastCallError()
+{
+    return g_last_call_error.c_str();
+}
+
+}  // namespace dmStub
@@ -0,0 +1,329 @@
+// conn_kcp_test: 不经过网络, 两个KCP直接对连, 按字节检查ikcp扩展的输出和处理:
+// SACK把乱序到达后的确认合成una加sn区间, 发送端一次清掉区间内的segment;
+// pvp_ikcp_input_ref+pvp_ikcp_recv_segment交出的单segment消息直接指向datagram, 引用计数配平;
+// pvp_ikcp_sendv分片跨过片段边界时输出与整块pvp_ikcp_send逐字节相同
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "ikcp.h"
+#include "test_util.h"
+
+// ikcp.cpp里的cmd取值
+const int cmd_push = 81;
+const int cmd_ack = 82;
+const int cmd_sack = 86;
+// 原格式segment头: conv(4) cmd(1) frg(2) wnd(2) ts(4) sn(2) una(2) len(2), 小端
+const int seg_head_size = 19;
+
+static uint16_t Read16(const char* p)
+{
+    return (uint16_t)((uint8_t)p[0] | (uint8_t)p[1] << 8);
+}
+
+struct SegView {
+    int cmd = 0;
+    int frg = 0;
+    int sn = 0;
+    int una = 0;
+    std::string payload;
+    std::string raw;  // 整个segment, 可以单独交给pvp_ikcp_input
+};
+
+// 把一个原格式datagram拆成segment
+static std::vector<SegView> SplitSegments(const std::string& dgram)
+{
+    std::vector<SegView> segs;
+    size_t pos = 0;
+    while (pos < dgram.size()) {
+        TEST_CHECK(pos + seg_head_size <= dgram.size());
+        const char* p = dgram.data() + pos;
+        SegView seg;
+        seg.cmd = (uint8_t)p[4];
+        seg.frg = Read16(p + 5);
+        seg.sn = Read16(p + 13);
+        seg.una = Read16(p + 15);
+        const size_t len = Read16(p + 17);
+        TEST_CHECK(pos + seg_head_size + len <= dgram.size());
+        seg.payload.assign(p + seg_head_size, len);
+        seg.raw.assign(p, seg_head_size + len);
+        segs.push_back(seg);
+        pos += seg_head_size + len;
+    }
+    return segs;
+}
+
+static int CollectOutput(const char* buf, int len, ikcpcb* kcp, void* user)
+{
+    ((std::vector<std::string>*)user)->push_back(std::string(buf, len));
+    return 0;
+}
+
+static ikcpcb* CreateKcp(std::vector<std::string>* out)
+{
+    ikcpcb* kcp = pvp_ikcp_create(1, out);
+    pvp_ikcp_setoutput(kcp, CollectOutput);
+    pvp_ikcp_nodelay(kcp, 1, 10, 2, 1);
+    pvp_ikcp_wndsize(kcp, 128, 128);
+    return kcp;
+}
+
+// 把from输出的datagram全部交给to
+static void Deliver(std::vector<std::string>* from, ikcpcb* to, IUINT32 now)
+{
+    for (const std::string& dgram : *from) {
+        TEST_CHECK(pvp_ikcp_input(to, dgram.data(), (long)dgram.size(), now) == 0);
+    }
+    from->clear();
+}
+
+// 收发两端互相投递直到b收齐count条消息, 收到的追加到received
+static void RunUntilReceived(ikcpcb* a, std::vector<std::string>* a_out, ikcpcb* b,
+                             std::vector<std::string>* b_out, size_t count, IUINT32* now,
+                             std::vector<std::string>* received)
+{
+    char buf[8192];
+    for (int step = 0; step < 1000 && received->size() < count; ++step) {
+        *now += 10;
+        pvp_ikcp_update(a, *now);
+        Deliver(a_out, b, *now);
+        pvp_ikcp_update(b, *now);
+        Deliver(b_out, a, *now);
+        int len;
+        while ((len = pvp_ikcp_recv(b, buf, sizeof(buf))) >= 0) {
+            received->push_back(std::string(buf, len));
+        }
+    }
+    TEST_CHECK(received->size() == count);
+}
+
+// 0-19里3, 7, 8, 15没到: 开SACK时一个segment带una=3和[4,7) [9,15) [16,20)三个区间,
+// 不开时是16个ACK. 两种情况发送端都只剩4个segment待确认, 之后补齐
+static void TestSack()
+{
+    size_t ack_bytes[2] = {};
+    for (int sack = 0; sack <= 1; ++sack) {
+        std::vector<std::string> a_out;
+        std::vector<std::string> b_out;
+        ikcpcb* a = CreateKcp(&a_out);
+        ikcpcb* b = CreateKcp(&b_out);
+        pvp_ikcp_setsack(b, sack);
+        IUINT32 now = 1000;
+        std::vector<std::string> sent;
+        for (int i = 0; i < 20; ++i) {
+            sent.push_back(std::string(10, (char)i));
+            TEST_CHECK(pvp_ikcp_send(a, sent.back().data(), 10, now) >= 0);
+        }
+        pvp_ikcp_update(a, now);
+        pvp_ikcp_update(b, now);
+        int pushed = 0;
+        for (const std::string& dgram : a_out) {
+            for (const SegView& seg : SplitSegments(dgram)) {
+                TEST_CHECK(seg.cmd == cmd_push);
+                pushed++;
+                if (seg.sn == 3 || seg.sn == 7 || seg.sn == 8 || seg.sn == 15) continue;
+                TEST_CHECK(pvp_ikcp_input(b, seg.raw.data(), (long)seg.raw.size(), now) == 0);
+            }
+        }
+        TEST_CHECK(pushed == 20);
+        a_out.clear();
+
+        pvp_ikcp_flush(b);
+        std::vector<SegView> acks;
+        for (const std::string& dgram : b_out) {
+            ack_bytes[sack] += dgram.size();
+            for (const SegView& seg : SplitSegments(dgram)) {
+                acks.push_back(seg);
+            }
+        }
+        if (sack) {
+            TEST_CHECK(acks.size() == 1 && acks[0].cmd == cmd_sack);
+            TEST_CHECK(acks[0].una == 3 && acks[0].sn == 19 && acks[0].frg == 3);
+            // 每个区间为相对una的偏移和连续sn个数
+            const int ranges[] = {1, 3, 6, 6, 13, 4};
+            TEST_CHECK(acks[0].payload.size() == sizeof(ranges) / sizeof(ranges[0]) * 2);
+            for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); ++i) {
+                TEST_CHECK(Read16(acks[0].payload.data() + i * 2) == ranges[i]);
+            }
+        } else {
+            TEST_CHECK(acks.size() == 16);
+            for (const SegView& seg : acks) {
+                TEST_CHECK(seg.cmd == cmd_ack && seg.una == 3);
+            }
+        }
+        Deliver(&b_out, a, now);
+        TEST_CHECK(a->snd_una == 3 && a->nsnd_buf == 4);
+
+        std::vector<std::string> received;
+        RunUntilReceived(a, &a_out, b, &b_out, sent.size(), &now, &received);
+        TEST_CHECK(received == sent);
+        now += 10;
+        pvp_ikcp_update(b, now);
+        Deliver(&b_out, a, now);
+        TEST_CHECK(a->nsnd_buf == 0 && a->snd_una == 20);
+        pvp_ikcp_release(a);
+        pvp_ikcp_release(b);
+    }
+    TEST_CHECK(ack_bytes[1] * 4 < ack_bytes[0]);
+}
+
+// 引用计数的datagram缓冲, 供pvp_ikcp_input_ref
+struct CountedDgram {
+    IKCPREF ref;
+    std::string data;
+    int refs = 0;
+};
+
+static void RetainDgram(IKCPREF* ref)
+{
+    ((CountedDgram*)ref)->refs++;
+}
+
+static void ReleaseDgram(IKCPREF* ref)
+{
+    ((CountedDgram*)ref)->refs--;
+}
+
+// 单segment消息用pvp_ikcp_recv_segment零拷贝取出, 多fragment的返回NULL, 由peeksize+recv拼好.
+// 取出的segment可以晚于kcp释放
+static void TestRecvSegment()
+{
+    std::vector<std::string> a_out;
+    std::vector<std::string> b_out;
+    ikcpcb* a = CreateKcp(&a_out);
+    ikcpcb* b = CreateKcp(&b_out);
+    pvp_ikcp_setmtu(a, 200);
+    IUINT32 now = 1000;
+    std::string big(1000, 0);
+    for (size_t i = 0; i < big.size(); ++i) {
+        big[i] = (char)(i * 7);
+    }
+    const std::string sent[] = {"short", big, "tail"};
+    for (const std::string& msg : sent) {
+        TEST_CHECK(pvp_ikcp_send(a, msg.data(), (int)msg.size(), now) >= 0);
+    }
+    pvp_ikcp_update(a, now);
+    pvp_ikcp_update(b, now);
+    TEST_CHECK(a_out.size() > 1);
+    std::deque<CountedDgram> dgrams;
+    for (const std::string& out : a_out) {
+        dgrams.emplace_back();
+        CountedDgram& dgram = dgrams.back();
+        dgram.ref.retain = RetainDgram;
+        dgram.ref.release = ReleaseDgram;
+        dgram.data = out;
+        TEST_CHECK(pvp_ikcp_input_ref(b, dgram.data.data(), (long)dgram.data.size(), now,
+                                      &dgram.ref) == 0);
+    }
+    int refs = 0;
+    for (const CountedDgram& dgram : dgrams) {
+        refs += dgram.refs;
+    }
+    TEST_CHECK(refs == 1 + ((int)big.size() + (int)a->mss - 1) / (int)a->mss + 1);
+
+    auto in_dgram = [&dgrams](const char* p) {
+        for (const CountedDgram& dgram : dgrams) {
+            if (p >= dgram.data.data() && p < dgram.data.data() + dgram.data.size()) return true;
+        }
+        return false;
+    };
+    TEST_CHECK(pvp_ikcp_peeksize(b) == (int)sent[0].size());
+    IKCPSEG* first = pvp_ikcp_recv_segment(b);
+    TEST_CHECK(first != nullptr && std::string(first->payload, first->len) == sent[0]);
+    TEST_CHECK(in_dgram(first->payload));
+
+    TEST_CHECK(pvp_ikcp_peeksize(b) == (int)big.size());
+    TEST_CHECK(pvp_ikcp_recv_segment(b) == nullptr);
+    std::string buf(big.size(), 0);
+    TEST_CHECK(pvp_ikcp_recv(b, &buf[0], (int)buf.size()) == (int)big.size() && buf == big);
+
+    IKCPSEG* last = pvp_ikcp_recv_segment(b);
+    TEST_CHECK(last != nullptr && std::string(last->payload, last->len) == sent[2]);
+    TEST_CHECK(pvp_ikcp_recv_segment(b) == nullptr && pvp_ikcp_peeksize(b) < 0);
+
+    pvp_ikcp_release(a);
+    pvp_ikcp_release(b);
+    TEST_CHECK(std::string(first->payload, first->len) == sent[0]);
+    pvp_ikcp_segment_free(first);
+    pvp_ikcp_segment_free(last);
+    for (const CountedDgram& dgram : dgrams) {
+        TEST_CHECK(dgram.refs == 0);
+    }
+}
+
+// 同一条消息切成若干片段(含空片段, 片段边界和分片边界错开)用sendv发, 与拼好后send的输出比较.
+// stream模式下还会先补进前一个没满的segment
+static void TestSendV()
+{
+    std::string msg(1000, 0);
+    for (size_t i = 0; i < msg.size(); ++i) {
+        msg[i] = (char)(i * 13 + 1);
+    }
+    const int cuts[][6] = {
+        {1000, 0, 0, 0, 0, 0},
+        {0, 1, 180, 0, 400, 419},
+        {7, 7, 7, 7, 7, 965},
+        {500, 499, 1, 0, 0, 0},
+    };
+    for (int stream = 0; stream <= 1; ++stream) {
+        for (const int* cut : cuts) {
+            std::vector<std::string> whole_out;
+            std::vector<std::string> vec_out;
+            ikcpcb* whole = CreateKcp(&whole_out);
+            ikcpcb* gather = CreateKcp(&vec_out);
+            std::vector<IKCPVEC> vec;
+            int offset = 0;
+            for (int i = 0; i < 6; ++i) {
+                vec.push_back(IKCPVEC{msg.data() + offset, cut[i]});
+                offset += cut[i];
+            }
+            TEST_CHECK(offset == (int)msg.size());
+            for (ikcpcb* kcp : {whole, gather}) {
+                pvp_ikcp_setmtu(kcp, 200);
+                kcp->stream = stream;
+                TEST_CHECK(pvp_ikcp_send(kcp, "head", 4, 1000) >= 0);
+            }
+            TEST_CHECK(pvp_ikcp_send(whole, msg.data(), (int)msg.size(), 1000) >= 0);
+            TEST_CHECK(pvp_ikcp_sendv(gather, vec.data(), (int)vec.size(), 1000) >= 0);
+            TEST_CHECK(whole->nsnd_que == gather->nsnd_que);
+            pvp_ikcp_update(whole, 1000);
+            pvp_ikcp_update(gather, 1000);
+            TEST_CHECK(!vec_out.empty() && vec_out == whole_out);
+
+            // 收到的与拼接后的一致
+            std::vector<std::string> b_out;
+            ikcpcb* b = CreateKcp(&b_out);
+            b->stream = stream;
+            pvp_ikcp_update(b, 1000);
+            Deliver(&vec_out, b, 1000);
+            std::string received;
+            char buf[2048];
+            int len;
+            while ((len = pvp_ikcp_recv(b, buf, sizeof(buf))) >= 0) {
+                received.append(buf, len);
+            }
+            TEST_CHECK(received == "head" + msg);
+            pvp_ikcp_release(whole);
+            pvp_ikcp_release(gather);
+            pvp_ikcp_release(b);
+        }
+    }
+    // 非法的片段
+    std::vector<std::string> out;
+    ikcpcb* kcp = CreateKcp(&out);
+    const IKCPVEC bad[] = {{"ab", 2}, {"cd", -1}};
+    TEST_CHECK(pvp_ikcp_sendv(kcp, bad, 2, 1000) < 0);
+    TEST_CHECK(pvp_ikcp_sendv(kcp, nullptr, 1, 1000) < 0);
+    TEST_CHECK(pvp_ikcp_waitsnd(kcp) == 0);
+    pvp_ikcp_release(kcp);
+}
+
+int main()
+{
+    TestSack();
+    TestRecvSegment();
+    TestSendV();
+    printf("kcp test passed\n");
+    return 0;
+}
@@ -0,0 +1,224 @@
+// conn_loopback_test: 无Defold方式的ConnClient连本进程里的回显服务端, 每个场景起一个新的回显端.
+// 在丢包, 下行bit翻转(带校验和), 紧凑头开关, 批量消息, 压缩, FEC, 单线程内联模式和协商后重连下,
+// 验证回显的字节流与发出的逐条一致且顺序不变, 连接不断开, 相应的统计计数确实发生了变化
+#include <unistd.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "conn_client.h"
+#include "echo_peer.h"
+#include "test_util.h"
+
+struct Scenario {
+    const char* name;
+    std::function<void(EchoPeerOptions*)> peer;
+    std::function<void(ConnClient*)> client;
+    std::function<void(const ConnClient&)> verify;  // 全部回显之后检查统计
+    bool relink = false;  // 回显端中途断开一次TCP, 客户端重连后继续收发
+};
+
+// 第seq条消息: 每25条一条多fragment的大消息, 其余为小消息, 内容可压缩但每条不同
+static std::string MakeMsg(int seq)
+{
+    const int len = (seq % 25 == 0) ? 1500 + seq * 7 % 2500 : 1 + seq * 13 % 120;
+    std::string msg(len, 0);
+    for (int i = 0; i < len; ++i) {
+        msg[i] = (char)(seq + i / 16);
+    }
+    return msg;
+}
+
+static void RunScenario(const Scenario& scenario, uint16_t port)
+{
+    EchoPeerOptions options;
+    options.ip = "127.0.0.1";
+    options.port = port;
+    if (scenario.peer) scenario.peer(&options);
+    EchoPeer peer;
+    TEST_CHECK(peer.Start(options) == 0);
+    volatile bool running = true;
+    std::thread peer_thread([&peer, &running]() { peer.Run(&running); });
+
+    const int msg_count = 500;
+    std::vector<std::string> sent;
+    std::vector<std::string> received;
+    int connected = 0;
+    int disconnected = 0;
+    int relinked = 0;
+    bool linked = false;  // 断开到重连成功之间不发送
+    size_t relink_seq = 0;  // 重连成功时已发出的消息数
+    HeadlessCallback connect_cb;
+    HeadlessCallback disconnect_cb;
+    HeadlessCallback relink_success_cb;
+    HeadlessCallback output_cb;
+    connect_cb.fun = [&](void*, const char*, int, int, int) { connected++, linked = true; };
+    disconnect_cb.fun = [&](void*, const char*, int, int, int) { disconnected++, linked = false; };
+    relink_success_cb.fun = [&](void*, const char*, int, int, int) {
+        relinked++, linked = true;
+        relink_seq = sent.size();
+    };
+    output_cb.fun = [&received](void*, const char* data, int data_len, int channel, int) {
+        TEST_CHECK(channel == 0);
+        received.push_back(std::string(data, data_len));
+    };
+    {
+        ConnClient client;
+        client.SetErrorLogMode();
+        client.SetConnectSuccessCB(&connect_cb);
+        client.SetDisconnectCB(&disconnect_cb);
+        client.SetRelinkSuccessCB(&relink_success_cb);
+        client.SetOutputCB(&output_cb);
+        if (scenario.client) scenario.client(&client);
+        TEST_CHECK(client.Connect("127.0.0.1", port, 3000) == 0);
+
+        // 每轮发几条, 每10条有一条用SendMsgV分3段发出
+        // 最后一条回来了就结束
+        auto done = [&]() {
+            return (int)sent.size() == msg_count && !received.empty() &&
+                   SameEcho(received.back(), sent.back());
+        };
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+        while (!done() && std::chrono::steady_clock::now() < deadline) {
+            client.Update();
+            for (int n = 0; linked && n < 5 && (int)sent.size() < msg_count; ++n) {
+                const int seq = (int)sent.size();
+                sent.push_back(MakeMsg(seq));
+                const std::string& msg = sent.back();
+                if (seq % 10 == 3 && msg.size() >= 3) {
+                    const int a = (int)msg.size() / 3;
+                    const ConnMsgVec vec[] = {{msg.data(), a},
+                                              {msg.data() + a, a},
+                                              {msg.data() + 2 * a, (int)msg.size() - 2 * a}};
+                    TEST_CHECK(client.SendMsgV(vec, 3) >= 0);
+                } else {
+                    TEST_CHECK(client.SendMsg(msg.data(), (int)msg.size()) >= 0);
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (received.size() != sent.size()) {
+            fprintf(stderr, "%s: sent %zu received %zu\n", scenario.name, sent.size(),
+                    received.size());
+        }
+        const int relinks = scenario.relink ? 1 : 0;
+        TEST_CHECK(connected == 1 && disconnected == relinks && relinked == relinks);
+        TEST_CHECK(done());
+        // 按顺序逐条比对. 网络线程感知断开到断开回调之间发的消息会被丢弃(发送时连接还在),
+        // 所以重连时允许在重连成功之前缺一段连续的消息, 其余都不能少
+        size_t j = 0;
+        size_t gap_begin = sent.size();
+        size_t gap_end = sent.size();
+        for (size_t i = 0; i < sent.size(); ++i) {
+            if (j < received.size() && SameEcho(received[j], sent[i])) {
+                j++;
+                continue;
+            }
+            if (gap_begin == sent.size()) gap_begin = gap_end = i;
+            if (gap_end != i) {
+                fprintf(stderr, "%s: msg %zu missing or differs\n", scenario.name, i);
+                exit(1);
+            }
+            gap_end = i + 1;
+        }
+        TEST_CHECK(j == received.size());
+        if (gap_begin != sent.size()) {
+            fprintf(stderr, "%s: msgs [%zu, %zu) dropped across relink at %zu\n", scenario.name,
+                    gap_begin, gap_end, relink_seq);
+            TEST_CHECK(scenario.relink && gap_end <= relink_seq);
+        }
+        if (scenario.verify) scenario.verify(client);
+        client.Close();
+    }
+    running = false;
+    peer_thread.join();
+    peer.Stop();
+    printf("%s: ok\n", scenario.name);
+}
+
+int main()
+{
+    const Scenario scenarios[] = {
+        {"udp", nullptr, nullptr, nullptr},
+        {"tcp", [](EchoPeerOptions* o) { o->enable_udp = false; }, nullptr, nullptr},
+        {"loss", [](EchoPeerOptions* o) { o->loss = 10, o->up_loss = 10; }, nullptr, nullptr},
+        // 旧的KCP包头格式
+        {"legacy_header",
+         [](EchoPeerOptions* o) {
+             o->kcp_features &= ~KCP_FEATURE_COMPACT;
+             o->loss = 5, o->up_loss = 5;
+         },
+         nullptr, nullptr},
+        // 原格式下行UDP不回显magic, 客户端只核对flow
+        {"legacy_no_udp_magic",
+         [](EchoPeerOptions* o) {
+             o->kcp_features &= ~KCP_FEATURE_COMPACT;
+             o->udp_magic = false;
+         },
+         nullptr, nullptr},
+        // 下行datagram随机翻转bit, 校验不过的丢弃后由KCP重传
+        {"corrupt_checksum", [](EchoPeerOptions* o) { o->corrupt = 10; },
+         [](ConnClient* c) { c->SetUdpChecksum(true); },
+         [](const ConnClient& c) {
+             ConnChecksumStats stats;
+             c.GetChecksumStats(&stats);
+             TEST_CHECK(stats.verified > 0 && stats.drops > 0);
+         }},
+        // 上行小消息合并, 回显端整条回传, 客户端拆开交付
+        {"batch",
+         [](EchoPeerOptions* o) {
+             o->echo_batch = true;
+             o->loss = 5;
+         },
+         [](ConnClient* c) { c->SetCoalesce(5); },
+         [](const ConnClient& c) {
+             ConnCoalesceStats stats;
+             c.GetCoalesceStats(&stats);
+             TEST_CHECK(stats.batches > 0 && stats.msgs > stats.batches);
+         }},
+        {"compress", [](EchoPeerOptions* o) { o->compress = 64; },
+         [](ConnClient* c) { c->SetCompressThreshold(64); },
+         [](const ConnClient& c) {
+             ConnCompressStats stats;
+             c.GetCompressStats(&stats);
+             TEST_CHECK(stats.send_msgs > 0 && stats.send_zip_bytes < stats.send_raw_bytes);
+             TEST_CHECK(stats.recv_msgs > 0 && stats.recv_zip_bytes < stats.recv_raw_bytes);
+         }},
+        // 内联模式下两个方向都带FEC, 下行丢包由校验分片恢复
+        {"inline_fec",
+         [](EchoPeerOptions* o) {
+             o->fec_data = 4, o->fec_parity = 1;
+             o->loss = 5;
+         },
+         [](ConnClient* c) {
+             c->SetInlineMode(true);
+             c->SetFec(4, 1);
+         },
+         [](const ConnClient& c) {
+             ConnFecStats stats;
+             c.GetFecStats(&stats);
+             TEST_CHECK(stats.send_data_shards > 0 && stats.send_parity_shards > 0);
+             TEST_CHECK(stats.recv_recovered > 0);
+         }},
+        // 紧凑格式和校验和协商之后断线重连, 重连后两边都回到原格式
+        {"relink_after_compact",
+         [](EchoPeerOptions* o) {
+             o->relink_ms = 30;
+             o->loss = 5;
+         },
+         [](ConnClient* c) {
+             c->SetUdpChecksum(true);
+             c->AddRelinkInterval(50);
+         },
+         nullptr, true},
+    };
+    const uint16_t base_port = (uint16_t)(40000 + getpid() % 20000);
+    uint16_t port = base_port;
+    for (const Scenario& scenario : scenarios) {
+        RunScenario(scenario, port++);
+    }
+    return 0;
+}
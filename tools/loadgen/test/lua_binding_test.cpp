@@ -0,0 +1,264 @@
+// conn_lua_test: 用stub dmsdk(见dmsdk/lua.h)跑connclient的Lua绑定, 连本进程里的回显服务端. 验证:
+// 回调的cli参数是连接的userdata, 在回调里能直接调用连接的方法; send_buffer发送dmBuffer;
+// set_output_buffer打开后output回调收到dmBuffer, 同样长度的消息复用同一个buffer; 非默认通道的消息
+// 带上通道号; close和__gc之后句柄失效; 所有dmBuffer最终都被释放
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dmsdk/sdk.h>
+#include <dmsdk/stub.h>
+
+#include "echo_peer.h"
+#include "test_util.h"
+
+extern dmExtension::Desc connclient_desc;
+
+struct OutputRecord {
+    bool is_buffer = false;
+    dmBuffer::HBuffer buffer = nullptr;
+    bool owned_by_c = false;
+    std::string data;
+    int channel = 0;
+    bool cli_ok = false;
+    bool self_ok = false;
+};
+
+static std::vector<OutputRecord> g_outputs;
+static int g_connected = 0;
+
+static bool IsRegistryValue(lua_State* L, int idx, const char* name)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, name);
+    const bool same = lua_rawequal(L, idx, -1) != 0;
+    lua_pop(L, 1);
+    return same;
+}
+
+// output回调: self, cli, msg[, channel]
+static int OnOutput(lua_State* L)
+{
+    OutputRecord record;
+    record.self_ok = IsRegistryValue(L, 1, "test.instance");
+    record.cli_ok = IsRegistryValue(L, 2, "test.conn");
+    if (dmScript::LuaHBuffer* buffer = dmScript::ToBuffer(L, 3)) {
+        void* bytes = nullptr;
+        uint32_t size = 0;
+        TEST_CHECK(dmBuffer::GetBytes(buffer->m_Buffer, &bytes, &size) == dmBuffer::RESULT_OK);
+        record.is_buffer = true;
+        record.buffer = buffer->m_Buffer;
+        record.owned_by_c = buffer->m_Owner == dmScript::OWNER_C;
+        record.data.assign((const char*)bytes, size);
+    } else {
+        size_t len = 0;
+        const char* msg = lua_tolstring(L, 3, &len);
+        TEST_CHECK(msg != nullptr);
+        record.data.assign(msg, len);
+    }
+    if (lua_gettop(L) >= 4) record.channel = (int)lua_tointeger(L, 4);
+    TEST_CHECK(lua_gettop(L) <= 4);
+    g_outputs.push_back(record);
+    return 0;
+}
+
+// connectsuccess回调: 用cli调用连接的方法发hello
+static int OnConnect(lua_State* L)
+{
+    TEST_CHECK(lua_gettop(L) == 2);
+    TEST_CHECK(IsRegistryValue(L, 1, "test.instance"));
+    TEST_CHECK(IsRegistryValue(L, 2, "test.conn"));
+    lua_getfield(L, 2, "send");
+    lua_pushvalue(L, 2);
+    lua_pushstring(L, "hello");
+    lua_call(L, 2, 0);
+    g_connected++;
+    return 0;
+}
+
+// 调用connclient.name, 参数已在栈顶, 返回lua_pcall的结果, 出错时错误信息留在栈顶
+static int CallModule(lua_State* L, const char* name, int nargs, int nresults)
+{
+    lua_getfield(L, LUA_GLOBALSINDEX, "connclient");
+    lua_getfield(L, -1, name);
+    lua_remove(L, -2);
+    lua_insert(L, -nargs - 1);
+    return lua_pcall(L, nargs, nresults, 0);
+}
+
+static void MustCall(lua_State* L, const char* name, int nargs, int nresults)
+{
+    if (CallModule(L, name, nargs, nresults) != 0) {
+        fprintf(stderr, "connclient.%s: %s\n", name, lua_tostring(L, -1));
+        exit(1);
+    }
+}
+
+static void PushBytes(lua_State* L, const std::string& bytes)
+{
+    dmBuffer::StreamDeclaration decl = {};
+    decl.m_Name = dmHashString64("data");
+    decl.m_Type = dmBuffer::VALUE_TYPE_UINT8;
+    decl.m_Count = 1;
+    dmBuffer::HBuffer buffer = nullptr;
+    TEST_CHECK(dmBuffer::Create((uint32_t)bytes.size(), &decl, 1, &buffer) == dmBuffer::RESULT_OK);
+    void* data = nullptr;
+    uint32_t size = 0;
+    dmBuffer::GetBytes(buffer, &data, &size);
+    memcpy(data, bytes.data(), bytes.size());
+    dmScript::PushBuffer(L, dmScript::LuaHBuffer(buffer, dmScript::OWNER_LUA));
+}
+
+// 跑扩展的Update直到收到count条消息
+static void WaitOutputs(dmExtension::Params* params, size_t count)
+{
+    const int top = lua_gettop(params->m_L);
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (g_outputs.size() < count && std::chrono::steady_clock::now() < deadline) {
+        TEST_CHECK(connclient_desc.m_Update(params) == dmExtension::RESULT_OK);
+        TEST_CHECK(lua_gettop(params->m_L) == top);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    TEST_CHECK(g_outputs.size() == count);
+    TEST_CHECK(dmStub::LastCallError()[0] == 0);
+}
+
+int main()
+{
+    EchoPeerOptions options;
+    options.ip = "127.0.0.1";
+    options.port = (uint16_t)(20000 + getpid() % 20000);
+    EchoPeer peer;
+    TEST_CHECK(peer.Start(options) == 0);
+    volatile bool running = true;
+    std::thread peer_thread([&peer, &running]() { peer.Run(&running); });
+
+    lua_State* L = luaL_newstate();
+    dmExtension::Params params;
+    params.m_L = L;
+    TEST_CHECK(connclient_desc.m_Initialize(&params) == dmExtension::RESULT_OK);
+    TEST_CHECK(lua_gettop(L) == 0);
+
+    // 脚本实例
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "test.instance");
+    dmScript::SetInstance(L);
+
+    lua_pushnumber(L, 117);
+    MustCall(L, "create", 1, 1);
+    TEST_CHECK(lua_type(L, -1) == LUA_TUSERDATA);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "test.conn");
+    const int conn = lua_gettop(L);
+
+    lua_pushvalue(L, conn);
+    lua_pushcfunction(L, OnConnect);
+    MustCall(L, "set_connectsuccess_cb", 2, 0);
+    lua_pushvalue(L, conn);
+    lua_pushcfunction(L, OnOutput);
+    MustCall(L, "set_output_cb", 2, 0);
+    lua_pushvalue(L, conn);
+    lua_pushstring(L, "127.0.0.1");
+    lua_pushnumber(L, options.port);
+    lua_pushnumber(L, 3000);
+    MustCall(L, "connect", 4, 0);
+
+    // 回调里用cli发的hello回显为字符串
+    WaitOutputs(&params, 1);
+    TEST_CHECK(g_connected == 1);
+    TEST_CHECK(!g_outputs[0].is_buffer && g_outputs[0].data == "hello" && g_outputs[0].channel == 0);
+    TEST_CHECK(g_outputs[0].cli_ok && g_outputs[0].self_ok);
+
+    // 打开buffer输出, send_buffer在默认通道和通道2各发一条
+    lua_pushvalue(L, conn);
+    lua_pushboolean(L, 1);
+    MustCall(L, "set_output_buffer", 2, 0);
+    std::string big(3000, 0);
+    for (size_t i = 0; i < big.size(); ++i) {
+        big[i] = (char)(i * 7);
+    }
+    lua_pushvalue(L, conn);
+    PushBytes(L, big);
+    MustCall(L, "send_buffer", 2, 0);
+    lua_pushvalue(L, conn);
+    PushBytes(L, "on channel 2");
+    lua_pushnumber(L, 2);
+    MustCall(L, "send_buffer", 3, 0);
+    WaitOutputs(&params, 3);
+    // 不同通道之间不保证顺序
+    const OutputRecord& r1 = g_outputs[1].channel == 0 ? g_outputs[1] : g_outputs[2];
+    const OutputRecord& r2 = g_outputs[1].channel == 0 ? g_outputs[2] : g_outputs[1];
+    TEST_CHECK(r1.is_buffer && SameEcho(r1.data, big) && r1.channel == 0 && r1.cli_ok);
+    TEST_CHECK(r2.is_buffer && r2.data == "on channel 2" && r2.channel == 2 && r2.cli_ok);
+
+    // 回调返回后buffer收回, 下一条同样长度的消息复用它, 不再新建
+    lua_pushvalue(L, conn);
+    lua_pushstring(L, "reuse 1");
+    MustCall(L, "send", 2, 0);
+    WaitOutputs(&params, 4);
+    const int live_buffers = dmStub::LiveBuffers();
+    lua_pushvalue(L, conn);
+    lua_pushstring(L, "reuse 2");
+    MustCall(L, "send", 2, 0);
+    WaitOutputs(&params, 5);
+    TEST_CHECK(g_outputs[3].is_buffer && g_outputs[3].data == "reuse 1" && g_outputs[3].owned_by_c);
+    TEST_CHECK(g_outputs[4].is_buffer && g_outputs[4].data == "reuse 2");
+    TEST_CHECK(g_outputs[4].buffer == g_outputs[3].buffer);
+    TEST_CHECK(dmStub::LiveBuffers() == live_buffers);
+
+    // 关掉后又是字符串, 通道号照样带上. 留着复用的buffer随之释放
+    lua_pushvalue(L, conn);
+    lua_pushboolean(L, 0);
+    MustCall(L, "set_output_buffer", 2, 0);
+    TEST_CHECK(dmStub::LiveBuffers() < live_buffers);
+    lua_pushvalue(L, conn);
+    lua_pushnumber(L, 3);
+    lua_pushstring(L, "abc");
+    MustCall(L, "send_channel", 3, 0);
+    WaitOutputs(&params, 6);
+    TEST_CHECK(!g_outputs[5].is_buffer && g_outputs[5].data == "abc" && g_outputs[5].channel == 3);
+
+    // send_buffer只接受buffer
+    lua_pushvalue(L, conn);
+    lua_pushstring(L, "not a buffer");
+    TEST_CHECK(CallModule(L, "send_buffer", 2, 0) != 0);
+    lua_pop(L, 1);
+
+    // close后句柄失效
+    lua_pushvalue(L, conn);
+    MustCall(L, "close", 1, 0);
+    lua_pushvalue(L, conn);
+    lua_pushstring(L, "after close");
+    TEST_CHECK(CallModule(L, "send", 2, 0) != 0);
+    TEST_CHECK(strstr(lua_tostring(L, -1), "Invalid connection") != nullptr);
+    lua_pop(L, 1);
+
+    // 没有close的连接由__gc关闭
+    lua_pushnumber(L, 117);
+    MustCall(L, "create", 1, 1);
+    const int conn2 = lua_gettop(L);
+    TEST_CHECK(lua_getmetatable(L, conn2) == 1);
+    lua_getfield(L, -1, "__gc");
+    lua_remove(L, -2);
+    lua_pushvalue(L, conn2);
+    lua_call(L, 1, 0);
+    lua_pushvalue(L, conn2);
+    lua_pushstring(L, "after gc");
+    TEST_CHECK(CallModule(L, "send", 2, 0) != 0);
+    lua_pop(L, 1);
+    TEST_CHECK(connclient_desc.m_Update(&params) == dmExtension::RESULT_OK);
+
+    TEST_CHECK(connclient_desc.m_Finalize(&params) == dmExtension::RESULT_OK);
+    lua_close(L);
+    TEST_CHECK(dmStub::LiveBuffers() == 0);
+
+    running = false;
+    peer_thread.join();
+    peer.Stop();
+    printf("lua binding test passed\n");
+    return 0;
+}
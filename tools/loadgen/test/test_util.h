@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "load_msg.h"
+
+// 检查失败时打印位置并以非0退出, 由ctest判定失败
+#define TEST_CHECK(cond)                                                              \
+    do {                                                                              \
+        if (!(cond)) {                                                                \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                                  \
+        }                                                                             \
+    } while (0)
+
+// 回显端会改写不短于LoadMsgHead的消息里的peer_us, 比较时跳过
+inline bool SameEcho(const std::string& echo, const std::string& sent)
+{
+    if (echo.size() != sent.size()) return false;
+    if (sent.size() < sizeof(LoadMsgHead)) return echo == sent;
+    const size_t peer_us = offsetof(LoadMsgHead, peer_us);
+    return echo.compare(0, peer_us, sent, 0, peer_us) == 0 &&
+           echo.compare(sizeof(LoadMsgHead), std::string::npos, sent, sizeof(LoadMsgHead)) == 0;
+}